@@ -0,0 +1,204 @@
+/**
+ * Lookup storm against a single DHT node
+ *
+ * Keeps a window of lookups for random hashes in flight and counts those
+ * resolved by the REPLY messages coming back, from the node itself or from
+ * whichever node the lookup was forwarded to. A reply resolves every
+ * outstanding hash in its range. With `batch` above 1, the lookups are sent
+ * as LOOKUP_BATCH datagrams of that many hashes.
+ *
+ * Usage: dht_flood <ip> <port> [seconds] [window] [batch]
+ */
+
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dht.h"
+
+#define BATCH 64
+#define MAX_WINDOW 65536
+
+// Hashes looked up and not resolved yet
+static uint16_t outstanding[MAX_WINDOW];
+static long in_flight = 0;
+
+// Room for combined replies
+static unsigned char datagrams[BATCH][DHT_DATAGRAM_MAX];
+
+/**
+ * Drop the outstanding hashes within (`pred_id`, `id`], returning how many
+ */
+static long resolve(uint16_t pred_id, uint16_t id) {
+    long resolved = 0;
+    for (long i = in_flight; i-- > 0;) {
+        uint16_t hash = outstanding[i];
+        if (pred_id == id ||
+            (uint16_t)(hash - pred_id - 1) < (uint16_t)(id - pred_id)) {
+            outstanding[i] = outstanding[--in_flight];
+            resolved++;
+        }
+    }
+    return resolved;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <ip> <port> [seconds] [window] [batch]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    double duration = argc > 3 ? atof(argv[3]) : 5;
+    long window = argc > 4 ? atol(argv[4]) : 256;
+    long per_datagram = argc > 5 ? atol(argv[5]) : 1;
+    if (window < 1 || window > MAX_WINDOW || per_datagram < 1 ||
+        per_datagram > DHT_LOOKUP_BATCH_MAX) {
+        fprintf(stderr, "Invalid window or batch\n");
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_in target = {
+        .sin_family = AF_INET,
+        .sin_port = htons(atoi(argv[2])),
+    };
+    if (inet_pton(AF_INET, argv[1], &target.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IP '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // Connecting a scratch socket picks the local address replies have to be
+    // sent to. The real one stays unconnected, as they also arrive from
+    // other nodes.
+    struct sockaddr_in self;
+    socklen_t self_len = sizeof(self);
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe == -1 ||
+        connect(probe, (struct sockaddr *)&target, sizeof(target)) == -1 ||
+        getsockname(probe, (struct sockaddr *)&self, &self_len) == -1) {
+        perror("connect");
+        return EXIT_FAILURE;
+    }
+    close(probe);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    self.sin_port = 0;
+    self_len = sizeof(self);
+    if (sock == -1 || bind(sock, (struct sockaddr *)&self, sizeof(self)) == -1 ||
+        getsockname(sock, (struct sockaddr *)&self, &self_len) == -1) {
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+
+    static struct dht_lookup_batch lookups[BATCH];
+    struct iovec send_iovecs[BATCH];
+    struct mmsghdr send_headers[BATCH];
+    struct iovec receive_iovecs[BATCH];
+    struct mmsghdr receive_headers[BATCH];
+
+    for (int i = 0; i < BATCH; i++) {
+        send_iovecs[i] = (struct iovec){&lookups[i], sizeof(lookups[i])};
+        send_headers[i] = (struct mmsghdr){.msg_hdr = {
+            .msg_name = &target,
+            .msg_namelen = sizeof(target),
+            .msg_iov = &send_iovecs[i],
+            .msg_iovlen = 1,
+        }};
+        receive_iovecs[i] = (struct iovec){datagrams[i], sizeof(datagrams[i])};
+        receive_headers[i] = (struct mmsghdr){.msg_hdr = {
+            .msg_iov = &receive_iovecs[i],
+            .msg_iovlen = 1,
+        }};
+    }
+
+    unsigned long sent = 0, datagrams_sent = 0, received = 0, replies = 0,
+                  lost = 0;
+    double start = now(), last_progress = start;
+
+    while (now() - start < duration) {
+        long batch = (window - in_flight) / per_datagram;
+        if (batch > BATCH) batch = BATCH;
+        for (long i = 0; i < batch; i++) {
+            lookups[i].header = (struct dht_message){
+                .type = per_datagram > 1 ? MESSAGE_TYPE_LOOKUP_BATCH
+                                         : MESSAGE_TYPE_LOOKUP,
+                .hash = htons(per_datagram > 1 ? per_datagram : 0),
+                .node_id = htons(0),
+                .node_ip = self.sin_addr.s_addr,
+                .node_port = self.sin_port,
+            };
+            for (long j = 0; j < per_datagram; j++) {
+                uint16_t hash = rand() & 0xffff;
+                if (per_datagram > 1) {
+                    lookups[i].hashes[j] = htons(hash);
+                } else {
+                    lookups[i].header.hash = htons(hash);
+                }
+            }
+            send_iovecs[i].iov_len =
+                sizeof(struct dht_message) +
+                (per_datagram > 1 ? per_datagram * sizeof(uint16_t) : 0);
+        }
+        if (batch > 0) {
+            int result = sendmmsg(sock, send_headers, batch, 0);
+            for (int i = 0; i < result; i++) {
+                for (long j = 0; j < per_datagram; j++) {
+                    outstanding[in_flight++] =
+                        ntohs(per_datagram > 1 ? lookups[i].hashes[j]
+                                               : lookups[i].header.hash);
+                }
+            }
+            if (result > 0) {
+                sent += result * per_datagram;
+                datagrams_sent += result;
+            }
+        }
+
+        struct pollfd pfd = {.fd = sock, .events = POLLIN};
+        if (poll(&pfd, 1, 10) > 0) {
+            int result = recvmmsg(sock, receive_headers, BATCH, MSG_DONTWAIT, NULL);
+            for (int i = 0; i < result; i++) {
+                // Several replies may arrive together
+                size_t length = receive_headers[i].msg_len;
+                if (length % sizeof(struct dht_message) != 0) continue;
+                const struct dht_message *reply = (const void *)datagrams[i];
+                for (size_t j = 0; j < length / sizeof(*reply); j++) {
+                    if (reply[j].type != MESSAGE_TYPE_REPLY) continue;
+                    replies++;
+                    received += resolve(ntohs(reply[j].hash),
+                                        ntohs(reply[j].node_id));
+                }
+                last_progress = now();
+            }
+        }
+
+        // Assume whatever is still outstanding after a pause was dropped
+        if (in_flight > 0 && now() - last_progress > 0.1) {
+            lost += in_flight;
+            in_flight = 0;
+            last_progress = now();
+        }
+    }
+
+    double elapsed = now() - start;
+    printf("sent %lu lookups in %lu datagrams, %lu resolved by %lu replies, "
+           "%lu lost in %.2f s\n",
+           sent, datagrams_sent, received, replies, lost, elapsed);
+    printf("%.0f lookups/s, %.0f resolved/s\n", sent / elapsed,
+           received / elapsed);
+    return EXIT_SUCCESS;
+}
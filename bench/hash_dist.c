@@ -0,0 +1,236 @@
+/**
+ * How evenly a corpus of URIs spreads over the ring
+ *
+ * Hashes every line of the corpus, one URI each, with the functions
+ * `--key-hash` offers and reports how many distinct hashes they produce, how
+ * unevenly the keys fill 256 equal slices of the hash space, and which share
+ * of the keys each node of a ring would store next to the share of the hash
+ * space it is responsible for.
+ *
+ * The ring defaults to `nodes` nodes spaced like bench/ring.c does, or takes
+ * the first IDs of its nodes from `-i`. With `-v`, every node holds `ids`
+ * IDs derived like the webserver derives them with `--vnodes`.
+ *
+ * Usage: hash_dist [-f checksum|wyhash] [-n nodes] [-i id,...] [-v ids]
+ *                  [corpus]
+ *
+ * For example:
+ *     seq 0 99999 | sed 's|^|/bench/|' | hash_dist -n 4
+ */
+
+#define _GNU_SOURCE // getline
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define HASHES 65536
+#define SLICES 256
+#define MAX_NODES 1024
+#define MAX_IDS (MAX_NODES * 64)
+
+struct ring_id {
+    uint16_t id;
+    uint16_t node;
+};
+
+static const struct {
+    const char *name;
+    enum key_hash_function function;
+} functions[] = {
+    {"checksum", KEY_HASH_CHECKSUM},
+    {"wyhash", KEY_HASH_WYHASH},
+};
+
+// Keys per hash, for every function
+static uint32_t keys[sizeof(functions) / sizeof(*functions)][HASHES];
+
+// Node responsible for every hash
+static uint16_t owner[HASHES];
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [-f checksum|wyhash] [-n nodes] [-i id,...] [-v ids] "
+            "[corpus]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+static int compare_ids(const void *a, const void *b) {
+    const struct ring_id *x = a, *y = b;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+/**
+ * Fill `owner` for nodes with the given first IDs, each holding `vnodes` IDs.
+ * Returns the number of IDs placed; one taken by an earlier node is left to
+ * that node, as the ring would refuse the later join.
+ */
+static size_t place(const uint16_t *first_ids, size_t node_count,
+                    unsigned vnodes) {
+    static struct ring_id ids[MAX_IDS];
+    static bool taken[HASHES];
+    size_t count = 0;
+    for (size_t node = 0; node < node_count; node++) {
+        for (unsigned index = 0; index < vnodes; index++) {
+            uint16_t id = virtual_id(first_ids[node], index);
+            if (taken[id]) continue;
+            taken[id] = true;
+            ids[count++] = (struct ring_id){id, (uint16_t)node};
+        }
+    }
+    qsort(ids, count, sizeof(*ids), compare_ids);
+
+    // A hash belongs to the first ID at or after it, wrapping around
+    size_t next = 0;
+    for (uint32_t hash = 0; hash < HASHES; hash++) {
+        while (next < count && ids[next].id < hash) next++;
+        owner[hash] = ids[next < count ? next : 0].node;
+    }
+    return count;
+}
+
+static void report(const char *name, const uint32_t *counts, size_t total,
+                   size_t node_count) {
+    size_t distinct = 0;
+    uint32_t largest = 0;
+    uint64_t slices[SLICES] = {0};
+    uint64_t node_keys[MAX_NODES] = {0};
+    uint32_t node_hashes[MAX_NODES] = {0};
+    for (uint32_t hash = 0; hash < HASHES; hash++) {
+        if (counts[hash]) distinct++;
+        if (counts[hash] > largest) largest = counts[hash];
+        slices[hash / (HASHES / SLICES)] += counts[hash];
+        node_keys[owner[hash]] += counts[hash];
+        node_hashes[owner[hash]] += 1;
+    }
+
+    double mean = (double)total / SLICES;
+    uint64_t fullest = 0;
+    double variance = 0;
+    for (size_t i = 0; i < SLICES; i++) {
+        if (slices[i] > fullest) fullest = slices[i];
+        variance += (slices[i] - mean) * (slices[i] - mean);
+    }
+    variance /= SLICES;
+
+    printf("%s: %zu keys, %zu distinct hashes, at most %u keys per hash\n",
+           name, total, distinct, largest);
+    printf("  %d slices of the hash space: fullest %.2fx the mean, "
+           "coefficient of variation %.2f\n",
+           SLICES, fullest / mean, sqrt(variance) / mean);
+
+    printf("  %-6s %12s %12s\n", "node", "hash share", "key share");
+    double most = 0;
+    for (size_t node = 0; node < node_count; node++) {
+        double share = (double)node_keys[node] / total;
+        if (share > most) most = share;
+        printf("  %-6zu %11.2f%% %11.2f%%\n", node,
+               100.0 * node_hashes[node] / HASHES, 100.0 * share);
+    }
+    printf("  busiest node stores %.2fx its fair share of the keys\n\n",
+           most * node_count);
+}
+
+int main(int argc, char *argv[]) {
+    size_t node_count = 4;
+    unsigned vnodes = 1;
+    uint16_t first_ids[MAX_NODES];
+    bool explicit_ids = false;
+    int only = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:n:i:v:")) != -1) {
+        switch (opt) {
+            case 'f':
+                for (size_t i = 0; i < sizeof(functions) / sizeof(*functions);
+                     i++) {
+                    if (strcmp(optarg, functions[i].name) == 0) only = (int)i;
+                }
+                if (only == -1) usage(argv[0]);
+                break;
+            case 'n':
+                node_count = strtoul(optarg, NULL, 10);
+                if (node_count == 0 || node_count > MAX_NODES) usage(argv[0]);
+                break;
+            case 'i': {
+                explicit_ids = true;
+                node_count = 0;
+                char *cursor = optarg;
+                while (*cursor) {
+                    char *end;
+                    unsigned long id = strtoul(cursor, &end, 0);
+                    if (end == cursor || id >= HASHES ||
+                        node_count == MAX_NODES) {
+                        usage(argv[0]);
+                    }
+                    if (*end && *end != ',') usage(argv[0]);
+                    first_ids[node_count++] = (uint16_t)id;
+                    cursor = *end ? end + 1 : end;
+                }
+                if (node_count == 0) usage(argv[0]);
+                break;
+            }
+            case 'v':
+                vnodes = strtoul(optarg, NULL, 10);
+                if (vnodes == 0 || vnodes > MAX_IDS / MAX_NODES) usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind > 1) usage(argv[0]);
+
+    if (!explicit_ids) {
+        for (size_t i = 0; i < node_count; i++) {
+            first_ids[i] = (uint16_t)((i + 1) * 65536ul / node_count);
+        }
+    }
+
+    FILE *corpus = stdin;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        corpus = fopen(argv[optind], "r");
+        if (!corpus) {
+            perror(argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t total = 0;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, corpus)) != -1) {
+        while (length > 0 &&
+               (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            length--;
+        }
+        if (length == 0) continue;
+        for (size_t i = 0; i < sizeof(functions) / sizeof(*functions); i++) {
+            key_hash_select(functions[i].function);
+            keys[i][ring_hash((unsigned char *)line, length)] += 1;
+        }
+        total++;
+    }
+    free(line);
+    if (corpus != stdin) fclose(corpus);
+    if (total == 0) {
+        fprintf(stderr, "Empty corpus\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t ids = place(first_ids, node_count, vnodes);
+    printf("%zu nodes with %zu IDs\n\n", node_count, ids);
+    for (size_t i = 0; i < sizeof(functions) / sizeof(*functions); i++) {
+        if (only == -1 || only == (int)i) {
+            report(functions[i].name, keys[i], total, node_count);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/**
+ * Microbenchmark of the HTTP request parser
+ *
+ * Parses typical requests in one piece, and once more as they would arrive
+ * in small segments, reporting nanoseconds per request. The time needed to
+ * restore the request bytes the parser overwrites is measured separately
+ * and subtracted.
+ *
+ * Usage: http_parse [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http.h"
+
+static const char *requests[] = {
+    "GET /static/foo HTTP/1.1\r\nHost: localhost:4711\r\n\r\n",
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:4711\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n\r\n",
+    "PUT /dynamic/key HTTP/1.1\r\n"
+    "Host: localhost:4711\r\n"
+    "content-length: 32\r\n"
+    "Content-Type: application/octet-stream\r\n\r\n"
+    "0123456789abcdef0123456789abcdef",
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Nanoseconds per request, handing the parser `segment` bytes more at a time
+ */
+static double measure(const char *text, size_t segment, long iterations,
+                      bool parse) {
+    static char buffer[HTTP_MAX_SIZE];
+    size_t length = strlen(text);
+    struct http_parser parser;
+    struct request request;
+    http_parser_init(&parser);
+
+    double start = now();
+    for (long i = 0; i < iterations; i++) {
+        memcpy(buffer, text, length);
+        if (!parse) continue;
+        for (size_t n = segment < length ? segment : length;;
+             n = n + segment < length ? n + segment : length) {
+            ssize_t parsed = parse_request(&parser, buffer, n, &request);
+            if (parsed == -1) {
+                fprintf(stderr, "Parse error\n");
+                exit(EXIT_FAILURE);
+            }
+            if (parsed > 0) break;
+        }
+    }
+    // Keep the copies from being optimized away
+    __asm__ volatile("" : : "r"(buffer) : "memory");
+    return (now() - start) * 1e9 / iterations;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+    size_t segments[] = {HTTP_MAX_SIZE, 64, 16, 1};
+
+    printf("%-8s %-8s %10s\n", "request", "segment", "ns/request");
+    for (size_t r = 0; r < sizeof(requests) / sizeof(*requests); r++) {
+        for (size_t s = 0; s < sizeof(segments) / sizeof(*segments); s++) {
+            long n = segments[s] == 1 ? iterations / 10 : iterations;
+            double copy = measure(requests[r], segments[s], n, false);
+            double total = measure(requests[r], segments[s], n, true);
+            char label[32];
+            snprintf(label, sizeof(label), "%zu B", strlen(requests[r]));
+            if (segments[s] == HTTP_MAX_SIZE) {
+                printf("%-8s %-8s %10.1f\n", label, "whole", total - copy);
+            } else {
+                printf("%-8s %-8zu %10.1f\n", label, segments[s], total - copy);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+/**
+ * Pipelining throughput of a single connection
+ *
+ * Sends `depth` GET requests back to back, waits for all responses and
+ * repeats, reporting requests per second and how many reads it took to
+ * receive each batch of responses.
+ *
+ * Usage: http_pipeline <ip> <port> [seconds] [depth] [uri]
+ */
+
+#define _GNU_SOURCE // memmem
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECEIVE_SIZE (1 << 16)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Consume complete responses from `buffer[0..*length)`, moving the rest to
+ * the front. Returns the number of responses consumed.
+ */
+static long consume_responses(char *buffer, size_t *length) {
+    long responses = 0;
+    char *pos = buffer;
+    char *end = buffer + *length;
+
+    while (true) {
+        char *head_end = memmem(pos, end - pos, "\r\n\r\n", 4);
+        if (!head_end) break;
+
+        size_t content_length = 0;
+        char *header = memmem(pos, head_end - pos, "Content-Length:", 15);
+        if (header) content_length = strtoul(header + 15, NULL, 10);
+
+        char *next = head_end + 4 + content_length;
+        if (next > end) break;
+        pos = next;
+        responses += 1;
+    }
+
+    *length = end - pos;
+    memmove(buffer, pos, *length);
+    return responses;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <ip> <port> [seconds] [depth] [uri]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    double duration = argc > 3 ? atof(argv[3]) : 5;
+    long depth = argc > 4 ? atol(argv[4]) : 50;
+    const char *uri = argc > 5 ? argv[5] : "/static/foo";
+
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(atoi(argv[2]))};
+    if (inet_pton(AF_INET, argv[1], &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) ==
+                          -1) {
+        perror("connect");
+        return EXIT_FAILURE;
+    }
+    const int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    char request[512];
+    int request_length =
+        snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\n\r\n", uri);
+    char *batch = malloc(request_length * depth);
+    char *buffer = malloc(RECEIVE_SIZE);
+    if (!batch || !buffer) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for (long i = 0; i < depth; i++) {
+        memcpy(batch + i * request_length, request, request_length);
+    }
+
+    long requests = 0;
+    long reads = 0;
+    size_t buffered = 0;
+    double start = now();
+    double elapsed;
+    while ((elapsed = now() - start) < duration) {
+        if (send(sock, batch, request_length * depth, MSG_NOSIGNAL) == -1) {
+            perror("send");
+            return EXIT_FAILURE;
+        }
+        for (long answered = 0; answered < depth;) {
+            ssize_t n = recv(sock, buffer + buffered, RECEIVE_SIZE - buffered, 0);
+            if (n <= 0) {
+                fprintf(stderr, "Connection closed by server\n");
+                return EXIT_FAILURE;
+            }
+            reads += 1;
+            buffered += n;
+            answered += consume_responses(buffer, &buffered);
+        }
+        requests += depth;
+    }
+
+    printf("%ld requests in %.2f s, depth %ld\n", requests, elapsed, depth);
+    printf("%.0f requests/s, %.2f reads per batch\n", requests / elapsed,
+           (double)reads * depth / requests);
+    close(sock);
+    return EXIT_SUCCESS;
+}
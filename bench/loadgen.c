@@ -0,0 +1,598 @@
+/**
+ * HTTP load generator for a ring of nodes
+ *
+ * Every thread keeps one keep-alive connection to an entry node and sends
+ * `depth` pipelined requests at a time, for keys drawn uniformly or from a
+ * Zipf distribution. Redirects are followed over keep-alive connections to
+ * the nodes they point to, pipelined per node. A request's latency runs
+ * from sending its batch until its final response arrived. The nodes'
+ * metrics before and after the run tell how many system calls they needed
+ * per request.
+ *
+ * Usage: loadgen [-t seconds] [-c connections] [-d depth] [-k keys]
+ *                [-z exponent] [-w write_fraction] [-s value_size] [-p]
+ *                <ip:port>...
+ */
+
+#define _GNU_SOURCE // memmem
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_NODES 256
+#define MAX_DEPTH 1024
+#define MAX_HOPS 4
+#define RECEIVE_SIZE (1 << 16)
+
+struct node {
+    char address[32];
+    struct sockaddr_in addr;
+};
+
+struct connection {
+    int sock;
+    char buffer[RECEIVE_SIZE];
+    size_t length;
+};
+
+struct pending {
+    size_t key;
+    bool put;
+    int status;
+    int hops;
+    size_t node;
+};
+
+struct worker {
+    pthread_t thread;
+    size_t index;
+    uint64_t random;
+    struct connection *connections[MAX_NODES];
+
+    // Results
+    uint32_t *latencies;
+    size_t latency_count, latency_capacity;
+    uint64_t redirected, unavailable, redirects, errors;
+};
+
+// Nodes given on the command line come first, the entry nodes. Those
+// redirected to are added, e.g. ones that joined the ring meanwhile.
+static struct node nodes[MAX_NODES];
+static size_t node_count = 0;
+static size_t entry_count = 0;
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double duration = 10;
+static size_t connection_count = 4;
+static size_t depth = 16;
+static size_t key_count = 10000;
+static double zipf_exponent = 0;
+static double write_fraction = 0;
+static size_t value_size = 64;
+static bool preload = false;
+
+static double *zipf_cdf;
+static char *value;
+static double deadline;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+static double uniform(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t draw_key(struct worker *worker) {
+    if (!zipf_cdf) return next_random(&worker->random) % key_count;
+
+    double target = uniform(&worker->random);
+    size_t low = 0, high = key_count - 1;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (zipf_cdf[middle] < target) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void zipf_setup(void) {
+    zipf_cdf = malloc(key_count * sizeof(*zipf_cdf));
+    if (!zipf_cdf) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    double sum = 0;
+    for (size_t i = 0; i < key_count; i++) {
+        sum += 1 / pow(i + 1, zipf_exponent);
+        zipf_cdf[i] = sum;
+    }
+    for (size_t i = 0; i < key_count; i++) zipf_cdf[i] /= sum;
+}
+
+static bool parse_node(const char *address, struct node *node) {
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon - address >= INET_ADDRSTRLEN) return false;
+
+    char ip[INET_ADDRSTRLEN];
+    memcpy(ip, address, colon - address);
+    ip[colon - address] = '\0';
+    node->addr = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_port = htons(atoi(colon + 1)),
+    };
+    snprintf(node->address, sizeof(node->address), "%s", address);
+    return inet_pton(AF_INET, ip, &node->addr.sin_addr) == 1;
+}
+
+static size_t node_index(const char *address, size_t length) {
+    size_t index = SIZE_MAX;
+    pthread_mutex_lock(&nodes_lock);
+    for (size_t i = 0; i < node_count && index == SIZE_MAX; i++) {
+        if (strlen(nodes[i].address) == length &&
+            memcmp(nodes[i].address, address, length) == 0) {
+            index = i;
+        }
+    }
+    char copy[sizeof(nodes[0].address)];
+    if (index == SIZE_MAX && node_count < MAX_NODES && length < sizeof(copy)) {
+        memcpy(copy, address, length);
+        copy[length] = '\0';
+        if (parse_node(copy, &nodes[node_count])) index = node_count++;
+    }
+    pthread_mutex_unlock(&nodes_lock);
+    return index;
+}
+
+static struct connection *connection_get(struct worker *worker, size_t node) {
+    struct connection *conn = worker->connections[node];
+    if (conn) return conn;
+
+    conn = malloc(sizeof(*conn));
+    if (!conn) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    conn->length = 0;
+    conn->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->sock == -1 ||
+        connect(conn->sock, (struct sockaddr *)&nodes[node].addr,
+                sizeof(nodes[node].addr)) == -1) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    const int enable = 1;
+    setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    worker->connections[node] = conn;
+    return conn;
+}
+
+static void connection_drop(struct worker *worker, size_t node) {
+    struct connection *conn = worker->connections[node];
+    if (!conn) return;
+    close(conn->sock);
+    free(conn);
+    worker->connections[node] = NULL;
+}
+
+static bool send_all(int sock, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(sock, data, length, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * Read the next response on `conn`. Returns its status code, or -1 if the
+ * connection failed. A redirect's target node is stored in `location`.
+ */
+static int read_response(struct connection *conn, size_t *location) {
+    char *head_end;
+    while (!(head_end = memmem(conn->buffer, conn->length, "\r\n\r\n", 4))) {
+        if (conn->length == RECEIVE_SIZE) return -1;
+        ssize_t n = recv(conn->sock, conn->buffer + conn->length,
+                         RECEIVE_SIZE - conn->length, 0);
+        if (n <= 0) return -1;
+        conn->length += n;
+    }
+    size_t head_length = head_end + 4 - conn->buffer;
+    *head_end = '\0'; // the headers are searched as a string
+
+    int status = 0;
+    if (sscanf(conn->buffer, "HTTP/1.%*d %d", &status) != 1) return -1;
+
+    size_t content_length = 0;
+    for (char *line = strstr(conn->buffer, "\r\n"); line;
+         line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            content_length = strtoul(line + 17, NULL, 10);
+        } else if (strncasecmp(line + 2, "Location:", 9) == 0) {
+            // http://<ip>:<port>/<uri>
+            char *host = strstr(line + 11, "//");
+            char *path = host ? strchr(host + 2, '/') : NULL;
+            *location = path ? node_index(host + 2, path - host - 2) : SIZE_MAX;
+        }
+    }
+
+    // Skip the payload, which may be larger than the buffer
+    size_t consumed = head_length + content_length;
+    if (consumed <= conn->length) {
+        conn->length -= consumed;
+        memmove(conn->buffer, conn->buffer + consumed, conn->length);
+    } else {
+        size_t remaining = consumed - conn->length;
+        conn->length = 0;
+        while (remaining > 0) {
+            size_t chunk = remaining < RECEIVE_SIZE ? remaining : RECEIVE_SIZE;
+            ssize_t n = recv(conn->sock, conn->buffer, chunk, 0);
+            if (n <= 0) return -1;
+            remaining -= n;
+        }
+    }
+    return status;
+}
+
+static size_t format_request(char *buffer, size_t size,
+                             const struct pending *request) {
+    if (request->put) {
+        return snprintf(buffer, size,
+                        "PUT /bench/%zu HTTP/1.1\r\nContent-Length: %zu\r\n\r\n",
+                        request->key, value_size);
+    }
+    return snprintf(buffer, size, "GET /bench/%zu HTTP/1.1\r\n\r\n",
+                    request->key);
+}
+
+static void record(struct worker *worker, uint32_t latency) {
+    if (worker->latency_count == worker->latency_capacity) {
+        worker->latency_capacity = worker->latency_capacity * 2 + 1024;
+        worker->latencies = realloc(worker->latencies,
+                                    worker->latency_capacity * sizeof(uint32_t));
+        if (!worker->latencies) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    worker->latencies[worker->latency_count++] = latency;
+}
+
+/**
+ * Send the requests of `batch` that are redirected to `node`, pipelined, and
+ * read their responses. Final responses are recorded if `measure` is set,
+ * timed from `start`. Returns false if the connection failed.
+ */
+static bool exchange(struct worker *worker, size_t node, struct pending *batch,
+                     size_t count, bool measure, double start) {
+    struct connection *conn = connection_get(worker, node);
+
+    static __thread char *output = NULL;
+    static __thread size_t output_capacity = 0;
+    size_t needed = count * (128 + value_size);
+    if (needed > output_capacity) {
+        free(output);
+        output = malloc(needed);
+        if (!output) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        output_capacity = needed;
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (batch[i].status != 303 || batch[i].node != node) continue;
+        length += format_request(output + length, 128, &batch[i]);
+        if (batch[i].put) {
+            memcpy(output + length, value, value_size);
+            length += value_size;
+        }
+    }
+    if (!send_all(conn->sock, output, length)) return false;
+
+    for (size_t i = 0; i < count; i++) {
+        if (batch[i].status != 303 || batch[i].node != node) continue;
+        size_t location = SIZE_MAX;
+        int status = read_response(conn, &location);
+        if (status == -1) return false;
+
+        batch[i].status = status;
+        if (status == 303) {
+            batch[i].hops += 1;
+            batch[i].node = location;
+            if (measure) worker->redirects += 1;
+            if (location == SIZE_MAX || batch[i].hops > MAX_HOPS) {
+                batch[i].status = -1; // unknown node or a redirect loop
+            }
+        }
+        if (measure && batch[i].status != 303) {
+            record(worker, (now() - start) * 1e6);
+            if (batch[i].hops > 0) worker->redirected += 1;
+            if (batch[i].status == 503) worker->unavailable += 1;
+            if (batch[i].status == -1) worker->errors += 1;
+        }
+    }
+    return true;
+}
+
+/**
+ * Run one batch to completion, following redirects. Returns false if a
+ * connection failed.
+ */
+static bool run_batch(struct worker *worker, struct pending *batch,
+                      size_t count, bool measure) {
+    size_t entry = worker->index % entry_count;
+    for (size_t i = 0; i < count; i++) {
+        // Marked as redirected to the entry node, so the first round goes there
+        batch[i].status = 303;
+        batch[i].hops = 0;
+        batch[i].node = entry;
+    }
+
+    double start = now();
+    while (true) {
+        size_t target = SIZE_MAX;
+        for (size_t i = 0; i < count && target == SIZE_MAX; i++) {
+            if (batch[i].status == 303) target = batch[i].node;
+        }
+        if (target == SIZE_MAX) break;
+
+        if (!exchange(worker, target, batch, count, measure, start)) {
+            connection_drop(worker, target);
+            worker->errors += 1;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *worker = arg;
+    struct pending batch[MAX_DEPTH];
+
+    if (preload) {
+        // Every key is written once, spread over the workers
+        size_t count = 0;
+        for (size_t key = worker->index; key < key_count;
+             key += connection_count) {
+            batch[count++] = (struct pending){.key = key, .put = true};
+            if (count == depth || key + connection_count >= key_count) {
+                run_batch(worker, batch, count, false);
+                count = 0;
+            }
+        }
+    }
+
+    while (now() < deadline) {
+        for (size_t i = 0; i < depth; i++) {
+            batch[i].key = draw_key(worker);
+            batch[i].put = uniform(&worker->random) < write_fraction;
+        }
+        run_batch(worker, batch, depth, true);
+    }
+    return NULL;
+}
+
+/**
+ * Sum up `io_syscalls_total` and `http_requests_total` over the metrics of
+ * all nodes. Returns false if a node's metrics are unavailable.
+ */
+static bool scrape(uint64_t *syscalls, uint64_t *requests) {
+    *syscalls = *requests = 0;
+    for (size_t node = 0; node < node_count; node++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        const char request[] =
+            "GET /_metrics HTTP/1.1\r\nConnection: close\r\n\r\n";
+        if (sock == -1 ||
+            connect(sock, (struct sockaddr *)&nodes[node].addr,
+                    sizeof(nodes[node].addr)) == -1 ||
+            !send_all(sock, request, sizeof(request) - 1)) {
+            if (sock != -1) close(sock);
+            return false;
+        }
+
+        // Read until the node closes the connection
+        size_t length = 0, capacity = RECEIVE_SIZE;
+        char *text = malloc(capacity + 1);
+        ssize_t n;
+        while (text && (n = recv(sock, text + length, capacity - length, 0)) > 0) {
+            length += n;
+            if (length == capacity) {
+                capacity *= 2;
+                char *larger = realloc(text, capacity + 1);
+                if (!larger) free(text);
+                text = larger;
+            }
+        }
+        close(sock);
+        if (!text) return false;
+        text[length] = '\0';
+
+        for (char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n")) {
+            char *value = strrchr(line, ' ');
+            if (!value) continue;
+            if (strncmp(line, "io_syscalls_total ", 18) == 0) {
+                *syscalls += strtoull(value + 1, NULL, 10);
+            } else if (strncmp(line, "http_requests_total{", 20) == 0) {
+                *requests += strtoull(value + 1, NULL, 10);
+            }
+        }
+        free(text);
+    }
+    return true;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, size_t count,
+                           double fraction) {
+    if (count == 0) return 0;
+    size_t rank = (size_t)(fraction * count);
+    return sorted[rank < count ? rank : count - 1];
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [-t seconds] [-c connections] [-d depth] [-k keys]\n"
+            "       [-z exponent] [-w write_fraction] [-s value_size] [-p]\n"
+            "       <ip:port>...\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:d:k:z:w:s:p")) != -1) {
+        switch (opt) {
+            case 't':
+                duration = atof(optarg);
+                break;
+            case 'c':
+                connection_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                depth = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                key_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'z':
+                zipf_exponent = atof(optarg);
+                break;
+            case 'w':
+                write_fraction = atof(optarg);
+                break;
+            case 's':
+                value_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                preload = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc || connection_count == 0 || depth == 0 ||
+        depth > MAX_DEPTH || key_count == 0) {
+        usage(argv[0]);
+    }
+    for (int i = optind; i < argc; i++) {
+        if (node_count == MAX_NODES || !parse_node(argv[i], &nodes[node_count])) {
+            fprintf(stderr, "Invalid node %s, expected ip:port\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        node_count += 1;
+    }
+    entry_count = node_count;
+
+    if (zipf_exponent > 0) zipf_setup();
+    value = malloc(value_size + 1);
+    if (!value) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    memset(value, 'x', value_size);
+
+    struct worker *workers = calloc(connection_count, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    uint64_t syscalls_before, requests_before;
+    bool scraped = scrape(&syscalls_before, &requests_before);
+
+    double start = now();
+    deadline = start + duration;
+    for (size_t i = 0; i < connection_count; i++) {
+        workers[i].index = i;
+        workers[i].random = 0x9E3779B97F4A7C15ull * (i + 1);
+        if (pthread_create(&workers[i].thread, NULL, worker_main,
+                           &workers[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    size_t total = 0;
+    uint64_t redirected = 0, unavailable = 0, redirects = 0, errors = 0;
+    for (size_t i = 0; i < connection_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].latency_count;
+        redirected += workers[i].redirected;
+        unavailable += workers[i].unavailable;
+        redirects += workers[i].redirects;
+        errors += workers[i].errors;
+    }
+    double elapsed = now() - start;
+
+    uint64_t syscalls_after, requests_after;
+    scraped = scraped && scrape(&syscalls_after, &requests_after) &&
+              requests_after > requests_before;
+
+    uint32_t *latencies = malloc((total + 1) * sizeof(*latencies));
+    if (!latencies) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < connection_count; i++) {
+        memcpy(latencies + offset, workers[i].latencies,
+               workers[i].latency_count * sizeof(*latencies));
+        offset += workers[i].latency_count;
+    }
+    qsort(latencies, total, sizeof(*latencies), compare_latency);
+
+    double requests = total ? total : 1;
+    printf("nodes %zu, connections %zu, depth %zu, keys %zu (%s), writes %.0f%%\n",
+           node_count, connection_count, depth, key_count,
+           zipf_cdf ? "zipf" : "uniform", write_fraction * 100);
+    printf("requests %zu in %.2f s: %.0f req/s\n", total, elapsed,
+           total / elapsed);
+    printf("latency us: p50 %u p99 %u p999 %u max %u\n",
+           percentile(latencies, total, 0.5), percentile(latencies, total, 0.99),
+           percentile(latencies, total, 0.999),
+           total ? latencies[total - 1] : 0);
+    printf("redirect ratio %.4f (%.2f redirects per request)\n",
+           redirected / requests, redirects / requests);
+    printf("503 ratio %.4f\n", unavailable / requests);
+    printf("errors %" PRIu64 "\n", errors);
+    if (scraped) {
+        // Redirects and the nodes' DHT traffic included
+        printf("node syscalls per request %.3f\n",
+               (double)(syscalls_after - syscalls_before) /
+                   (requests_after - requests_before));
+    }
+
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/**
+ * Microbenchmark and check of `pseudo_hash()`
+ *
+ * First compares it with the previous, allocating implementation for every
+ * length up to a few KiB and several alignments, and with hashes computed by
+ * `hash()` in test/dht.py. Then reports nanoseconds per call of both, and of
+ * `wyhash16()` for comparison, for URI lengths from 8 B to 8 KiB. Exits with
+ * failure on any mismatch. With `--check`, as run by ctest, only compares.
+ *
+ * Usage: pseudo_hash [--check | iterations]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+
+#define MAX_LENGTH 8192
+
+/**
+ * The implementation `pseudo_hash()` replaced, as it was
+ */
+static uint16_t reference_hash(const unsigned char *buffer, size_t buf_len) {
+    uint32_t hash = 0;
+    size_t pad_length = buf_len % 2 ? buf_len + 1 : buf_len;
+    uint8_t *int_buffer = calloc(pad_length, sizeof *buffer);
+    memcpy(int_buffer, buffer, buf_len);
+
+    for (size_t i = 0; i < pad_length; i += 2) {
+        hash += int_buffer[i] << 8 | int_buffer[i + 1];
+    }
+
+    hash = (hash & 0xFFFF) + (hash >> 16);
+
+    free(int_buffer);
+
+    return (uint16_t)~hash;
+}
+
+/**
+ * `prefix` followed by `fill` bytes up to `length`, and its hash according
+ * to test/dht.py
+ */
+static const struct {
+    const char *prefix;
+    unsigned char fill;
+    size_t length;
+    uint16_t hash;
+} known[] = {
+    {"", 0, 0, 0xffff},
+    {"/", 0, 1, 0xd0ff},
+    {"/a", 0, 2, 0xd09e},
+    {"/static/foo", 0, 11, 0xaf22},
+    {"/static/bar", 0, 11, 0xb030},
+    {"/static/baz", 0, 11, 0xa830},
+    {"/dynamic/key", 0, 12, 0xf777},
+    {"/index.html", 0, 11, 0xede3},
+    {"/\xff\xfe\xfd", 0, 4, 0xd102},
+    {"/", 'x', 101, 0x4978},
+    {"/", 0xff, 8192, 0xd000},
+    {"/", 'x', 131073, 0x5887},
+    // The sum wraps around in 32 bits
+    {"/", 0xff, 200000, 0xd002},
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check(void) {
+    int mismatches = 0;
+
+    for (size_t k = 0; k < sizeof(known) / sizeof(*known); k++) {
+        unsigned char *uri = malloc(known[k].length + 1);
+        size_t prefix = strlen(known[k].prefix);
+        memcpy(uri, known[k].prefix, prefix);
+        memset(uri + prefix, known[k].fill, known[k].length - prefix);
+        uint16_t hash = pseudo_hash(uri, known[k].length);
+        if (hash != known[k].hash) {
+            fprintf(stderr, "%zu bytes of \"%s\": 0x%04x, expected 0x%04x\n",
+                    known[k].length, known[k].prefix, hash, known[k].hash);
+            mismatches++;
+        }
+        free(uri);
+    }
+
+    // Random bytes, so that every byte value and carry pattern shows up
+    static unsigned char data[MAX_LENGTH + 64];
+    srand(1);
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = rand();
+    for (size_t offset = 0; offset < 64; offset += 7) {
+        for (size_t length = 0; length <= MAX_LENGTH; length++) {
+            uint16_t hash = pseudo_hash(data + offset, length);
+            uint16_t expected = reference_hash(data + offset, length);
+            if (hash != expected) {
+                fprintf(stderr, "%zu bytes at offset %zu: 0x%04x, expected "
+                                "0x%04x\n",
+                        length, offset, hash, expected);
+                if (++mismatches > 10) return mismatches;
+            }
+        }
+    }
+    return mismatches;
+}
+
+/**
+ * Nanoseconds per call of `hash` on `length` bytes
+ */
+static double measure(uint16_t (*hash)(const unsigned char *, size_t),
+                      const unsigned char *data, size_t length,
+                      long iterations) {
+    volatile uint16_t sink = 0;
+    double start = now();
+    for (long i = 0; i < iterations; i++) sink += hash(data, length);
+    (void)sink;
+    return (now() - start) * 1e9 / iterations;
+}
+
+int main(int argc, char **argv) {
+    bool check_only = argc > 1 && strcmp(argv[1], "--check") == 0;
+    long iterations = argc > 1 && !check_only ? atol(argv[1]) : 2000000;
+
+    int mismatches = check();
+    if (mismatches) {
+        fprintf(stderr, "%d mismatches\n", mismatches);
+        return EXIT_FAILURE;
+    }
+    printf("identical to the previous implementation and test/dht.py\n");
+    if (check_only) return EXIT_SUCCESS;
+    printf("\n");
+
+    static unsigned char uri[MAX_LENGTH];
+    memset(uri, 'a', sizeof(uri));
+    uri[0] = '/';
+
+    printf("%-8s %12s %12s %8s %12s\n", "length", "previous ns", "ns", "GB/s",
+           "wyhash ns");
+    for (size_t length = 8; length <= MAX_LENGTH; length *= 2) {
+        // Fewer rounds for long URIs, about the same bytes in total
+        long n = iterations / (length / 64 + 1);
+        double previous = measure(reference_hash, uri, length, n);
+        double current = measure(pseudo_hash, uri, length, n);
+        double wyhash = measure(wyhash16, uri, length, n);
+        printf("%-8zu %12.1f %12.1f %8.2f %12.1f\n", length, previous, current,
+               length / current, wyhash);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,293 @@
+/**
+ * Start a ring of webserver nodes on localhost
+ *
+ * Node `i` listens on `base_port + i` with an ID spaced evenly around the
+ * ring and learns its neighbours from the PRED_* and SUCC_* environment
+ * variables, as in aufgabe2.md. With `-f`, every node also gets all others
+ * as FINGERS. Once all nodes accept connections, `command` is run with the
+ * node addresses appended, e.g. a load generator, and the ring is torn down
+ * when it exits. Without a command, the ring runs until interrupted.
+ *
+ * With `-j`, as many more nodes join the running ring through node 0 one
+ * second after the command started, each halfway before one of the first
+ * nodes, on the ports after theirs. The ring then stabilizes, which it
+ * otherwise does not.
+ *
+ * Usage: ring [-n nodes] [-p base_port] [-f] [-j joining] [-a node_option]...
+ *             <webserver> [-- command...]
+ */
+
+#define _GNU_SOURCE // setenv
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_NODES 256
+#define MAX_NODE_OPTIONS 32
+#define STARTUP_TIMEOUT_MS 5000
+#define JOIN_DELAY_S 1
+
+static const char *ip = "127.0.0.1";
+static pid_t nodes[MAX_NODES];
+static size_t node_count = 0;
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_signal(int signal) {
+    (void)signal;
+    interrupted = 1;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [-n nodes] [-p base_port] [-f] [-j joining] "
+            "[-a node_option]... <webserver> [-- command...]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+static uint16_t node_id(size_t index, size_t count) {
+    return (uint16_t)((index + 1) * 65536ul / count);
+}
+
+static void set_number(const char *name, unsigned long value) {
+    char text[16];
+    snprintf(text, sizeof(text), "%lu", value);
+    setenv(name, text, 1);
+}
+
+static bool accepts(uint16_t port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    bool connected =
+        sock != -1 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (sock != -1) close(sock);
+    return connected;
+}
+
+/**
+ * Wait until node `index` accepts connections on `port`. Returns false if it
+ * exited or did not start in time.
+ */
+static bool wait_listening(size_t index, unsigned port) {
+    const struct timespec poll_interval = {.tv_nsec = 10 * 1000000};
+    int waited = 0;
+    while (!accepts(port)) {
+        if (interrupted || waited >= STARTUP_TIMEOUT_MS ||
+            waitpid(nodes[index], NULL, WNOHANG) == nodes[index]) {
+            fprintf(stderr, "Node %zu did not start on port %u\n", index, port);
+            return false;
+        }
+        nanosleep(&poll_interval, NULL);
+        waited += 10;
+    }
+    return true;
+}
+
+/**
+ * Start `joining` nodes that join the ring of `count` through node 0, the
+ * `i`th halfway between node `i` and its predecessor
+ */
+static void join_nodes(const char *webserver, char **node_argv,
+                       size_t node_options, size_t count, size_t joining,
+                       unsigned base_port) {
+    char anchor_port[8];
+    snprintf(anchor_port, sizeof(anchor_port), "%u", base_port);
+
+    for (size_t i = 0; i < joining; i++) {
+        char port[12], id[12];
+        snprintf(port, sizeof(port), "%zu", base_port + count + i);
+        snprintf(id, sizeof(id), "%u",
+                 (uint16_t)(node_id(i, count) - 32768u / count));
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            return;
+        }
+        if (pid == 0) {
+            node_argv[0] = (char *)webserver;
+            node_argv[1 + node_options] = (char *)ip;
+            node_argv[2 + node_options] = port;
+            node_argv[3 + node_options] = id;
+            node_argv[4 + node_options] = (char *)ip;
+            node_argv[5 + node_options] = anchor_port;
+            node_argv[6 + node_options] = NULL;
+            execv(webserver, node_argv);
+            perror("execv");
+            _exit(EXIT_FAILURE);
+        }
+        nodes[node_count++] = pid;
+    }
+
+    // Also makes sure they run the webserver before they may be stopped
+    for (size_t i = 0; i < joining; i++) {
+        wait_listening(count + i, base_port + count + i);
+    }
+}
+
+static void stop_nodes(void) {
+    for (size_t i = 0; i < node_count; i++) kill(nodes[i], SIGTERM);
+    for (size_t i = 0; i < node_count; i++) waitpid(nodes[i], NULL, 0);
+    node_count = 0;
+}
+
+int main(int argc, char **argv) {
+    size_t count = 4;
+    unsigned base_port = 4000;
+    bool fingers = false;
+    size_t joining = 0;
+    char *node_argv[MAX_NODE_OPTIONS + 7];
+    size_t node_options = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "+n:p:fj:a:")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                if (count == 0 || count > MAX_NODES) usage(argv[0]);
+                break;
+            case 'p':
+                base_port = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                fingers = true;
+                break;
+            case 'j':
+                joining = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                if (node_options == MAX_NODE_OPTIONS) usage(argv[0]);
+                node_argv[1 + node_options++] = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc || joining > count || count + joining > MAX_NODES ||
+        base_port + count + joining > 65536) {
+        usage(argv[0]);
+    }
+    const char *webserver = argv[optind++];
+    if (optind < argc && strcmp(argv[optind], "--") == 0) optind++;
+    char **command = argv + optind;
+    size_t command_length = argc - optind;
+
+    char finger_list[MAX_NODES * 32] = "";
+    size_t finger_length = 0;
+    for (size_t i = 0; fingers && i < count; i++) {
+        finger_length += snprintf(finger_list + finger_length,
+                                  sizeof(finger_list) - finger_length,
+                                  "%s%u@%s:%zu", i ? "," : "",
+                                  node_id(i, count), ip, base_port + i);
+    }
+
+    struct sigaction action = {.sa_handler = on_signal};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        size_t pred = (i + count - 1) % count;
+        size_t succ = (i + 1) % count;
+        char port[12], id[12];
+        snprintf(port, sizeof(port), "%zu", base_port + i);
+        snprintf(id, sizeof(id), "%u", node_id(i, count));
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            stop_nodes();
+            return EXIT_FAILURE;
+        }
+        if (pid == 0) {
+            if (count > 1) {
+                set_number("PRED_ID", node_id(pred, count));
+                setenv("PRED_IP", ip, 1);
+                set_number("PRED_PORT", base_port + pred);
+                set_number("SUCC_ID", node_id(succ, count));
+                setenv("SUCC_IP", ip, 1);
+                set_number("SUCC_PORT", base_port + succ);
+            }
+            if (fingers) setenv("FINGERS", finger_list, 1);
+            if (!joining) setenv("NO_STABILIZE", "1", 1);
+
+            node_argv[0] = (char *)webserver;
+            node_argv[1 + node_options] = (char *)ip;
+            node_argv[2 + node_options] = port;
+            node_argv[3 + node_options] = id;
+            node_argv[4 + node_options] = NULL;
+            execv(webserver, node_argv);
+            perror("execv");
+            _exit(EXIT_FAILURE);
+        }
+        nodes[node_count++] = pid;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!wait_listening(i, base_port + i)) {
+            stop_nodes();
+            return EXIT_FAILURE;
+        }
+    }
+    fprintf(stderr, "Ring of %zu nodes on %s:%u-%zu\n", count, ip, base_port,
+            base_port + count - 1);
+
+    int status = EXIT_SUCCESS;
+    if (command_length == 0) {
+        while (!interrupted) pause();
+    } else {
+        char **child_argv = calloc(command_length + count + 1, sizeof(char *));
+        char (*addresses)[32] = calloc(count, sizeof(*addresses));
+        if (!child_argv || !addresses) {
+            perror("calloc");
+            stop_nodes();
+            return EXIT_FAILURE;
+        }
+        memcpy(child_argv, command, command_length * sizeof(char *));
+        for (size_t i = 0; i < count; i++) {
+            snprintf(addresses[i], sizeof(addresses[i]), "%s:%zu", ip,
+                     base_port + i);
+            child_argv[command_length + i] = addresses[i];
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            execvp(child_argv[0], child_argv);
+            perror("execvp");
+            _exit(EXIT_FAILURE);
+        }
+
+        if (joining && pid != -1) {
+            sleep(JOIN_DELAY_S);
+            join_nodes(webserver, node_argv, node_options, count, joining,
+                       base_port);
+            fprintf(stderr, "%zu nodes joining on %s:%zu-%zu\n", joining, ip,
+                    base_port + count, base_port + count + joining - 1);
+        }
+        int child_status = 0;
+        while (pid != -1 && waitpid(pid, &child_status, 0) == -1 &&
+               errno == EINTR) {
+            if (interrupted) kill(pid, SIGINT);
+        }
+        if (pid == -1 || !WIFEXITED(child_status) ||
+            WEXITSTATUS(child_status) != 0) {
+            status = EXIT_FAILURE;
+        }
+        free(child_argv);
+        free(addresses);
+    }
+
+    stop_nodes();
+    return status;
+}
@@ -0,0 +1,180 @@
+/**
+ * PUT/GET/DELETE churn against the store
+ *
+ * Worker threads overwrite, read and delete random keys with values of
+ * mixed sizes, then everything is deleted again. Reports throughput,
+ * resident memory relative to the bytes stored, and calls to the system
+ * allocator. Built twice: `store_churn` uses the slab allocator,
+ * `store_churn_malloc` plain malloc().
+ *
+ * Usage: store_churn [seconds] [threads] [keys]
+ */
+
+#define _GNU_SOURCE // malloc_trim
+
+#include <inttypes.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "data.h"
+#include "slab.h"
+
+#define MAX_VALUE (16 * 1024)
+
+// Referenced by the store, unused here
+struct store resources;
+
+static double duration = 5;
+static size_t key_count = 200000;
+static volatile int stop = 0;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+/**
+ * Key `index`, every other one too long to be stored inline
+ */
+static void format_key(char *key, size_t size, size_t index) {
+    if (index % 2) {
+        snprintf(key, size, "/churn/a/rather/long/path/%08zx", index);
+    } else {
+        snprintf(key, size, "/churn/%08zx", index);
+    }
+}
+
+/**
+ * Mostly small values, some up to a few KiB, a few beyond the slab classes
+ */
+static size_t value_length(uint64_t *random) {
+    uint64_t r = next_random(random);
+    unsigned kind = r % 100;
+    r >>= 8;
+    if (kind < 70) return 16 + r % 240;
+    if (kind < 95) return 256 + r % 3840;
+    return 4096 + r % (MAX_VALUE - 4096);
+}
+
+static size_t resident_bytes(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    size_t pages = 0, resident = 0;
+    if (statm) {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) resident = 0;
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void *worker(void *arg) {
+    uint64_t *operations = arg;
+    uint64_t random = 0x9E3779B97F4A7C15ull ^ (uintptr_t)arg;
+    static const char payload[MAX_VALUE];
+    char key[64];
+
+    while (!stop) {
+        for (int i = 0; i < 1024; i++) {
+            format_key(key, sizeof(key), next_random(&random) % key_count);
+            unsigned kind = next_random(&random) % 10;
+            if (kind < 6) {
+                set(&resources, key, payload, value_length(&random));
+            } else if (kind < 8) {
+                size_t length;
+                const char *value = get(&resources, key, &length);
+                if (value) release(value);
+            } else {
+                remove_tuple(&resources, key);
+            }
+        }
+        *operations += 1024;
+    }
+    return NULL;
+}
+
+static void report(const char *phase) {
+    struct store_stats store;
+    struct slab_stats slab;
+    store_stats(&resources, &store);
+    slab_stats(&slab);
+    size_t resident = resident_bytes();
+
+    printf("%s: %zu keys, %.1f MiB stored, %.1f MiB resident (%.2fx)\n", phase,
+           store.keys, store.value_bytes / 1048576.0, resident / 1048576.0,
+           store.value_bytes ? (double)resident / store.value_bytes : 0);
+    printf("  slab pages %zu (+%zu pooled), objects %zu, large objects %zu\n",
+           slab.pages, slab.pool_pages, slab.objects, slab.large_objects);
+    printf("  system allocations %" PRIu64 ", frees %" PRIu64 "\n",
+           slab.system_allocations, slab.system_frees);
+}
+
+int main(int argc, char **argv) {
+    duration = argc > 1 ? atof(argv[1]) : duration;
+    size_t thread_count = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+    key_count = argc > 3 ? strtoul(argv[3], NULL, 10) : key_count;
+    if (thread_count == 0 || key_count == 0) {
+        fprintf(stderr, "Usage: %s [seconds] [threads] [keys]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+#ifdef SLAB_MALLOC
+    printf("allocator: malloc\n");
+#else
+    printf("allocator: slab\n");
+#endif
+    store_init(&resources);
+
+    pthread_t *threads = calloc(thread_count, sizeof(*threads));
+    uint64_t *operations = calloc(thread_count, 64); // a cache line each
+    if (!threads || !operations) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    double start = now();
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i], NULL, worker, &operations[i * 8]);
+    }
+    struct timespec interval = {.tv_sec = (time_t)duration,
+                                .tv_nsec = (duration - (time_t)duration) * 1e9};
+    nanosleep(&interval, NULL);
+    stop = 1;
+    uint64_t total = 0;
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+        total += operations[i * 8];
+    }
+    double elapsed = now() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%" PRIu64 " operations in %.2f s: %.0f ops/s, peak resident %.1f MiB\n",
+           total, elapsed, total / elapsed, usage.ru_maxrss / 1024.0);
+    report("after churn");
+
+    char key[64];
+    for (size_t i = 0; i < key_count; i++) {
+        format_key(key, sizeof(key), i);
+        remove_tuple(&resources, key);
+    }
+    slab_trim();
+    malloc_trim(0);
+    report("after deleting all");
+
+    free(threads);
+    free(operations);
+    return EXIT_SUCCESS;
+}
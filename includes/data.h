@@ -1,42 +1,206 @@
 #pragma once
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "util.h"
 
+#define STORE_SHARDS 16
+#define TUPLE_INLINE_KEY 32
+
+// Bytes preceding every value, see `value_wrap()`
+#define VALUE_HEADER_SIZE 16
+
 /**
- * A simple key-value entry
+ * A key-value entry, one slot of a shard's hash table
  *
- * Provides a simple, inefficient, key-value when combined with `get()`,
- * `set()`, and `remove_tuple()`.
+ * `hash` caches the 64 bit hash of the key and is zero for empty slots. Keys
+ * shorter than `TUPLE_INLINE_KEY` are stored in the slot itself, longer ones
+ * are allocated separately. `value` points into a reference-counted
+ * allocation, see `get()`. Both come from the slab allocator, see `slab.h`.
+ * The layout fills exactly one cache line.
  */
 struct tuple {
-    string key;
+    uint64_t hash;
     char *value;
     size_t value_length;
+    uint32_t key_length;
+    union {
+        char inline_key[TUPLE_INLINE_KEY];
+        char *key;
+    };
+};
+
+/**
+ * One lock stripe of the store
+ *
+ * An open-addressing hash table with linear probing, holding the keys whose
+ * hash selects this shard. `capacity` is a power of two, the table grows
+ * once three quarters of it are used. `value_bytes` sums up the length of
+ * the values stored.
+ */
+struct store_shard {
+    pthread_rwlock_t lock;
+    struct tuple *tuples;
+    size_t capacity;
+    size_t count;
+    size_t value_bytes;
+};
+
+enum store_operation {
+    STORE_PUT,
+    STORE_DELETE,
+};
+
+/**
+ * Outcome of storing a value
+ *
+ * `STORE_CREATED`: the key did not exist
+ * `STORE_UPDATED`: the value of an existing key was replaced
+ * `STORE_KEPT`: the key existed, `set_if_absent()` left it alone
+ * `STORE_FAILED`: out of memory, nothing was stored
+ */
+enum store_result {
+    STORE_CREATED,
+    STORE_UPDATED,
+    STORE_KEPT,
+    STORE_FAILED,
 };
 
 /**
- * Get the value matching the key in an array of tuples
+ * Called for every change of a store, under the lock of the key's shard, so
+ * changes to a key are seen in the order they were applied. `value` is
+ * NULL for deletions.
+ */
+typedef void (*store_journal)(enum store_operation operation, const char *key,
+                              size_t key_length, const char *value,
+                              size_t value_length);
+
+/**
+ * A key-value store that is safe to share between worker threads
+ *
+ * Provides a key-value store with constant-time lookups when combined with
+ * `get()`, `set()`, and `remove_tuple()`. Keys are spread over `STORE_SHARDS`
+ * independently locked shards, so operations on different keys rarely
+ * contend. `journal`, if set, sees every change, e.g. to log it.
+ */
+struct store {
+    struct store_shard shards[STORE_SHARDS];
+    store_journal journal;
+};
+
+/**
+ * Occupancy of a store, summed over its shards
+ *
+ * `keys`: number of keys stored
+ * `slots`: number of hash table slots allocated for them
+ * `value_bytes`: total length of the values
+ */
+struct store_stats {
+    size_t keys;
+    size_t slots;
+    size_t value_bytes;
+};
+
+/**
+ * Initialize an empty store
+ */
+void store_init(struct store *store);
+
+void store_stats(struct store *store, struct store_stats *stats);
+
+/**
+ * Call `visit` for every key-value pair
+ *
+ * Each shard's entries are collected under its lock, but visited after it
+ * was released, so a slow `visit` does not hold up writers. Changes made
+ * meanwhile may or may not be seen.
+ */
+void store_for_each(struct store *store,
+                    void (*visit)(void *context, const char *key,
+                                  size_t key_length, const char *value,
+                                  size_t value_length),
+                    void *context);
+
+/**
+ * Get the value matching the key
  *
  * Returns a pointer to the begin of the value, stores its length in
- * `value_length`.
+ * `value_length`. The value stays valid, even if it is overwritten or deleted
+ * concurrently, until it is handed back with `release()`.
+ */
+const char *get(struct store *store, const string key, size_t *value_length);
+
+/**
+ * Drop a reference obtained from `get()` or `value_alloc()`
+ */
+void release(const char *value);
+
+/**
+ * Take another reference to a value held already, to be dropped with
+ * `release()` as well
+ */
+void value_retain(const char *value);
+
+/**
+ * Allocate a value of `length` bytes to be filled in and handed to
+ * `set_value()`
+ *
+ * Returns NULL if out of memory.
+ */
+char *value_alloc(size_t length);
+
+/**
+ * Turn memory that outlives the store, e.g. a mapped file, into a value for
+ * `set_value()` without copying
+ *
+ * `memory` holds `VALUE_HEADER_SIZE` bytes for bookkeeping, followed by the
+ * value. Returns a pointer to the value. It is never freed.
+ */
+char *value_wrap(char *memory);
+
+/**
+ * Set the value for the key, copying `value`
+ *
+ * An old value that no reader holds is overwritten in place if the new one
+ * has the same size class. Returns `STORE_UPDATED` if a value was
+ * overwritten, `STORE_CREATED` if it was created.
  */
-const char *get(const string key, struct tuple *tuples, size_t n_tuples,
-                size_t *value_length);
+enum store_result set(struct store *store, const string key,
+                      const char *value, size_t value_length);
 
 /**
- * Set the value for the key in an array of tuples
+ * Set the value for the key, copying `value`, unless it exists already
  *
- * Returns true if a value was overwritten, false if it was created.
+ * Returns `STORE_CREATED` if the value was stored, `STORE_KEPT` if not.
  */
-bool set(const string key, char *value, size_t value_length,
-         struct tuple *tuples, size_t n_tuples);
+enum store_result set_if_absent(struct store *store, const string key,
+                                const char *value, size_t value_length);
 
 /**
- * Deletes the key in the array of tuples.
+ * Set the value for the key, taking over a reference from `value_alloc()`
+ *
+ * The reference is dropped if storing fails. Returns `STORE_UPDATED` if a
+ * value was overwritten, `STORE_CREATED` if it was created.
+ */
+enum store_result set_value(struct store *store, const string key,
+                            char *value, size_t value_length);
+
+/**
+ * Deletes the key.
  *
  * Returns true if it existed.
  */
-bool remove_tuple(const string key, struct tuple *tuples, size_t n_tuples);
+bool remove_tuple(struct store *store, const string key);
+
+/**
+ * Delete the key only if its value is still `value`, a reference obtained
+ * from `get()`: not overwritten since, which always stores a new value while
+ * a reference is held.
+ *
+ * Returns true if it was deleted.
+ */
+bool remove_if_value(struct store *store, const string key,
+                     const char *value);
@@ -1,15 +1,54 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <netinet/in.h>
 
 #define MESSAGE_TYPE_LOOKUP 0
 #define MESSAGE_TYPE_REPLY 1
+#define MESSAGE_TYPE_STABILIZE 2
+#define MESSAGE_TYPE_NOTIFY 3
+#define MESSAGE_TYPE_JOIN 4
+#define MESSAGE_TYPE_LOOKUP_BATCH 5
 
 #define MESSAGE_FORMAT_SIZE 12
 
+#define DHT_FINGERS 16
 
+// Most IDs a node can hold in the ring, see `struct dht_vnode`
+#define DHT_MAX_VNODES 64
+
+// Largest DHT datagram: the UDP payload of a 1500 byte Ethernet frame
+#define DHT_DATAGRAM_MAX 1472
+
+// Most hashes of a `struct dht_lookup_batch`, and most REPLY messages in a
+// combined reply
+#define DHT_LOOKUP_BATCH_MAX ((DHT_DATAGRAM_MAX - 11) / 2)
+#define DHT_REPLY_BATCH_MAX (DHT_DATAGRAM_MAX / 11)
+
+
+/**
+ * A DHT message, 11 bytes on the wire
+ *
+ * `LOOKUP`: who is responsible for `hash`? Answer to `node`.
+ * `REPLY`: `node` is responsible for (`hash`, `node_id`].
+ * `STABILIZE`: `node`, which believes to be the predecessor of the recipient,
+ *              asks for the recipient's predecessor. The node admitting a
+ *              joining one also sends it on behalf of the predecessor.
+ * `NOTIFY`: `node` is the sender's predecessor, the recipient's successor if
+ *           it lies between the two. In answer to a join, `node` is the
+ *           sender, the joining node's successor.
+ * `JOIN`: `node` wants to join; routed like a lookup of its ID to the node
+ *         responsible for it, which makes it its predecessor.
+ *
+ * `LOOKUP_BATCH`: several lookups for `node` at once, see
+ *                 `struct dht_lookup_batch`.
+ *
+ * As a node may hold several IDs, `hash` is the ID of the recipient for
+ * `STABILIZE` and `NOTIFY`. The answers to a `LOOKUP_BATCH` are sent as one
+ * datagram of several `REPLY` messages back to back.
+ */
 struct dht_message {
     uint8_t type;
     uint16_t hash;
@@ -19,25 +58,131 @@ struct dht_message {
 } __attribute__((packed));
 
 
+/**
+ * The lookups of as many hashes as fit into a datagram, for one node
+ *
+ * The header is that of a `LOOKUP`, with the number of hashes in place of
+ * the hash; the hashes follow it, in network byte order. The datagram ends
+ * after the last one. Each node answers those it or a successor is
+ * responsible for and forwards the rest, batched again by next hop.
+ */
+struct dht_lookup_batch {
+    struct dht_message header;
+    uint16_t hashes[DHT_LOOKUP_BATCH_MAX];
+} __attribute__((packed));
+
+
+/**
+ * Entry `i` of the finger table: the node responsible for `self_id + 2^i`
+ */
+struct dht_finger {
+    uint16_t start;
+    bool known;
+    uint16_t id;
+    struct sockaddr_in addr;
+};
+
+
+/**
+ * A neighbour in the ring, its address also formatted for redirects
+ *
+ * `known`: whether the address is, the ID always is
+ */
+struct dht_node {
+    uint16_t id;
+    bool known;
+    struct sockaddr_in addr;
+    char ip[INET_ADDRSTRLEN];
+    char port[6];
+};
+
+
+/**
+ * One of the IDs a node holds in the ring, each with its own neighbours and
+ * range (`pred.id`, `id`]
+ *
+ * `joined`: whether it was admitted to the ring yet
+ * `has_pred`: whether the predecessor is known. The node admitting the ID
+ *             introduces it along with the answer to the join, otherwise
+ *             it is not known until the predecessor stabilizes. Without
+ *             one, the ID is responsible for nothing.
+ * `succ`: without a successor the node is alone, with itself as the
+ *         predecessor it is responsible for the whole ring
+ */
+struct dht_vnode {
+    uint16_t id;
+    bool joined;
+    bool has_pred;
+    struct dht_node pred;
+    struct dht_node succ;
+};
+
+
+/**
+ * `self_id`: the ID given on the command line, the first of `vnodes`
+ * `vnodes`: the IDs of this node, all served from the same sockets and
+ *           store. The ring changes with joins and stabilization while other
+ *           workers route requests; use `dht_route()` to read it.
+ * `anchor`: the node IDs join the ring through, one at a time
+ * `stabilize`: periodic stabilization and fixing of the fingers, disabled by
+ *              NO_STABILIZE for a node with a single ID
+ * `fingers`: shared by all IDs, starting from `self_id`
+ */
 struct dht_state {
     uint16_t self_id;
     const char *self_ip;
     uint16_t self_port;
+    struct sockaddr_in self_addr;
+
+    struct dht_vnode vnodes[DHT_MAX_VNODES];
+    size_t vnode_count;
+
+    struct sockaddr_in anchor;
+
+    bool stabilize;
+    struct dht_finger fingers[DHT_FINGERS];
+};
+
+
+/**
+ * `ids_joined`: IDs admitted to the ring so far
+ * `hashes`: how many of the 65536 hashes the node is responsible for, its
+ *           expected share of the keys
+ */
+struct dht_stats {
+    uint64_t ids;
+    uint64_t ids_joined;
+    uint64_t hashes;
+};
 
-    uint16_t pred_id;
-    const char *pred_ip;
-    const char *pred_port;
 
-    uint16_t succ_id;
-    const char *succ_ip;
-    const char *succ_port;
+/**
+ * Who is responsible for a hash, as far as a node knows on its own
+ *
+ * `DHT_ROUTE_SELF`: one of its IDs
+ * `DHT_ROUTE_SUCCESSOR`: the successor of one of its IDs
+ * `DHT_ROUTE_UNKNOWN`: neither, it takes a lookup
+ * `DHT_ROUTE_JOINING`: none of its IDs joined the ring yet
+ */
+enum dht_route {
+    DHT_ROUTE_SELF,
+    DHT_ROUTE_SUCCESSOR,
+    DHT_ROUTE_UNKNOWN,
+    DHT_ROUTE_JOINING,
 };
 
 
 /**
  * Initialize DHT state from command line arguments and environment variables
+ *
+ * With an anchor node after the ID, `<id> <anchor ip> <anchor port>`, the
+ * node joins the ring through it instead. Of `vnodes` IDs, the first is the
+ * given one and the others are derived from it. A node on its own arranges
+ * them in a ring; otherwise they join through the anchor, or through the
+ * first ID when it was placed by PRED_ID and SUCC_ID.
  */
-void init_dht_state(struct dht_state *dht, int argc, char **argv);
+void init_dht_state(struct dht_state *dht, int argc, char **argv,
+                    unsigned vnodes);
 
 /**
  * Print DHT server information to stderr
@@ -50,14 +195,113 @@ void print_dht_info(const struct dht_state *dht);
 bool is_responsible(uint16_t hash, uint16_t self_id, uint16_t pred_id);
 
 /**
- * Send a lookup message to the successor node
+ * Find who is responsible for `hash` among the IDs of this node and their
+ * successors. For `DHT_ROUTE_SELF` and `DHT_ROUTE_SUCCESSOR`, `node` is set to
+ * it and `pred_id` to its predecessor.
+ */
+enum dht_route dht_route(const struct dht_state *dht, uint16_t hash,
+                         struct dht_node *node, uint16_t *pred_id);
+
+/**
+ * Whether the ID `id` of this node is responsible for `hash`, also while it
+ * is joining. Until its predecessor is known, e.g. right after it was
+ * admitted, it may be responsible for any.
+ */
+bool dht_owns(const struct dht_state *dht, uint16_t id, uint16_t hash);
+
+/**
+ * The predecessor of the ID `id` of this node. Returns false if it is not
+ * known, not even by its ID.
+ */
+bool dht_predecessor(const struct dht_state *dht, uint16_t id,
+                     struct dht_node *pred);
+
+/**
+ * Whether `addr` is that of another node next to one of the IDs of this
+ * node in the ring, its predecessor or successor
+ */
+bool dht_is_neighbour(const struct dht_state *dht,
+                      const struct sockaddr_in *addr);
+
+/**
+ * Narrow the range (`pred_id`, `id`] another node claims to the part after the
+ * last ID of this node within it, joined or not: a claim over one of them is
+ * outdated. Returns the new start, `id` if nothing is left.
+ */
+uint16_t dht_clip_range(const struct dht_state *dht, uint16_t pred_id,
+                        uint16_t id);
+
+/**
+ * Set `addr` to the next hop for a lookup of `hash`: the known node of another
+ * process closest to, but not after it, out of the fingers and successors.
+ * Returns false if no other node is known.
+ */
+bool dht_next_hop(const struct dht_state *dht, uint16_t hash,
+                  struct sockaddr_in *addr);
+
+/**
+ * Learn from a reply that the given node is responsible for (`pred_id`, `id`]
+ *
+ * Updates all fingers whose start lies within that range.
+ */
+void dht_learn_node(struct dht_state *dht, uint16_t pred_id, uint16_t id,
+                    const struct sockaddr_in *addr);
+
+/**
+ * Refresh the finger table: look up all unknown fingers and one known one,
+ * round robin. Fingers that an ID of this node or its successor is
+ * responsible for are resolved locally.
+ */
+void dht_fix_fingers(int udp_socket, struct dht_state *dht);
+
+/**
+ * Ask the anchor node to admit the next ID that has not joined yet, if any
+ */
+void dht_join(int udp_socket, const struct dht_state *dht);
+
+/**
+ * Ask the successor of every ID for its predecessor, which becomes the
+ * successor if it joined in between, see `dht_handle_notify()`
+ */
+void dht_stabilize(int udp_socket, const struct dht_state *dht);
+
+/**
+ * Admit the joining node as the predecessor of the ID responsible for its ID,
+ * and tell the previous predecessor about it; forward the join otherwise
+ */
+void dht_handle_join(int udp_socket, struct dht_state *dht,
+                     const struct dht_message *msg);
+
+/**
+ * Adopt the sender as the predecessor of the addressed ID if it lies between
+ * the current one and the ID, then answer with a notify about the predecessor
+ */
+void dht_handle_stabilize(int udp_socket, struct dht_state *dht,
+                          const struct dht_message *msg);
+
+/**
+ * Finish joining of the addressed ID, or adopt the notified node as its
+ * successor if it lies between the ID and the current one
+ */
+void dht_handle_notify(int udp_socket, struct dht_state *dht,
+                       const struct dht_message *msg);
+
+/**
+ * Send a lookup message towards the node responsible for `hash`
  */
 void send_dht_lookup(int udp_socket, const struct dht_state *dht, uint16_t hash);
 
 /**
- * Send a reply message to the successor node
+ * Send reply messages about the `count` `responsible` nodes, whose
+ * predecessors are at the same index of `predecessor_ids`, to the requesting
+ * node, all in one datagram
  */
-void send_dht_reply(int udp_socket, const struct dht_state *dht, uint16_t responsible_node_id, const char * responsible_node_ip, uint16_t responsible_node_port, uint16_t hash);
+void send_dht_reply(int udp_socket, const struct dht_node *responsible,
+                    const char *requesting_node_ip,
+                    uint16_t requesting_node_port,
+                    const uint16_t *predecessor_ids, size_t count);
+
+void dht_stats(const struct dht_state *dht, struct dht_stats *stats);
 
 /**
  * Convert host and port to sockaddr_in structure
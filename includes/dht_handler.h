@@ -3,10 +3,39 @@
 
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "dht.h"
 
+struct event_loop;
+
+/**
+ * Outcome of a DHT lookup, delivered to every loop waiting for `hash`
+ *
+ * `found` is false if the lookup timed out.
+ */
+struct dht_resolution {
+    uint16_t hash;
+    bool found;
+    char ip[INET_ADDRSTRLEN];
+    uint16_t port;
+};
+
+/**
+ * Handle a datagram of `length` bytes from `sender`, starting with `msg`
+ *
+ * Datagrams of other sizes than their type has are dropped. Several REPLY
+ * messages may follow each other, as sent in answer to a LOOKUP_BATCH.
+ */
 void handle_dht_message(int udp_socket, const struct dht_message *msg,
-                       const struct sockaddr_in *sender, struct dht_state *dht);
-bool get_last_dht_reply(uint16_t *id, const char **ip, uint16_t *port);
+                        size_t length, const struct sockaddr_in *sender,
+                        struct dht_state *dht);
+
+// Resolve `hash` on behalf of `loop`. Concurrent lookups of the same hash
+// share a single LOOKUP message. The loop that sends it retransmits it with
+// exponential backoff and expires it, driven by a timer on its wheel.
+void dht_lookup_start(struct event_loop *loop, uint16_t hash);
+
+// Periodic upkeep of the DHT state, driven by the first event loop
+void dht_maintenance(struct event_loop *loop);
 
-#endif // DHT_HANDLER_H 
\ No newline at end of file
+#endif // DHT_HANDLER_H
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dht.h"
+
+// Messages per recvmmsg/sendmmsg call. Building with -DDHT_IO_BATCH=1
+// degrades to one syscall per message, for comparison.
+#ifndef DHT_IO_BATCH
+#define DHT_IO_BATCH 64
+#endif
+
+// Batches drained from the socket per wakeup, so a lookup storm cannot
+// starve the HTTP connections
+#define DHT_IO_RECEIVE_ROUNDS 4
+
+// Most hashes sent in one LOOKUP_BATCH datagram, with --lookup-batch. Building
+// with -DDHT_LOOKUP_BATCH=1 sends a LOOKUP per hash regardless.
+#ifndef DHT_LOOKUP_BATCH
+#define DHT_LOOKUP_BATCH DHT_LOOKUP_BATCH_MAX
+#endif
+
+/**
+ * Counters of the DHT socket traffic, summed over all workers
+ *
+ * `messages_*`: datagrams, each holding one message or a batch
+ * `lookup_batches_sent`: LOOKUP_BATCH datagrams, carrying `lookups_batched`
+ *                        hashes together
+ */
+struct dht_io_stats {
+    uint64_t messages_received;
+    uint64_t messages_sent;
+    uint64_t receive_calls;
+    uint64_t send_calls;
+    uint64_t lookup_batches_sent;
+    uint64_t lookups_batched;
+};
+
+/**
+ * Queue a message to `addr`
+ *
+ * Messages are queued per thread and sent by `dht_flush()`, or as soon as the
+ * queue is full or a different socket is used. With --lookup-batch, a LOOKUP
+ * joins one queued for the same node and requester, the two becoming a
+ * LOOKUP_BATCH.
+ */
+void dht_send(int udp_socket, const struct dht_message *msg,
+              const struct sockaddr_in *addr);
+
+/**
+ * Queue a datagram of `length` bytes, at most `DHT_DATAGRAM_MAX`, to `addr`
+ * like `dht_send()`
+ */
+void dht_send_datagram(int udp_socket, const void *data, size_t length,
+                       const struct sockaddr_in *addr);
+
+/**
+ * Send all queued messages of this thread
+ */
+void dht_flush(void);
+
+/**
+ * Receive pending messages in batches and pass them to `handle_dht_message()`
+ */
+void dht_receive(int udp_socket, struct dht_state *dht);
+
+/**
+ * Pass a datagram of `length` bytes from `sender`, received by other means,
+ * to `handle_dht_message()` if it is a DHT message
+ */
+void dht_received(int udp_socket, const void *data, size_t length,
+                  const struct sockaddr_in *sender, struct dht_state *dht);
+
+void dht_io_stats(struct dht_io_stats *stats);
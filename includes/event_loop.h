@@ -0,0 +1,152 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "timer.h"
+
+#define EVENT_LOOP_MAX 64
+#define EVENT_LOOP_MAX_EVENTS 256
+#define EVENT_LOOP_ACCEPT_BATCH 64
+#define EVENT_LOOP_ACCEPT_PAUSE_MS 100
+#define EVENT_LOOP_MAINTENANCE_INTERVAL_MS 1000
+
+struct connection_state;
+struct dht_resolution;
+struct event_loop_uring;
+
+/**
+ * How a loop waits for and performs I/O
+ *
+ * `EVENT_LOOP_EPOLL`: readiness notifications, then a system call per
+ *                     accept, receive and send
+ * `EVENT_LOOP_IO_URING`: multishot accepts and receives into provided
+ *                        buffers, and sends submitted together with the wait
+ *                        for completions. Needs Linux 6.0 and a build with
+ *                        `WITH_IO_URING`; loops fall back to epoll otherwise.
+ */
+enum event_loop_backend {
+    EVENT_LOOP_EPOLL,
+    EVENT_LOOP_IO_URING,
+};
+
+/**
+ * An epoll- or io_uring-based reactor
+ *
+ * Serves the TCP listener, the DHT socket and every client connection of the
+ * node. With epoll, client sockets are edge-triggered and drained on each
+ * wakeup, the listener is level-triggered so that a bounded accept loop per
+ * wakeup cannot lose pending connections.
+ *
+ * `id`: index of the loop, used to address it from other threads
+ * `wake_fd`: eventfd signalled when `mailbox` receives DHT resolutions, or
+ *            when the write-ahead log synced changes `syncing` waits for
+ * `unposted`: hashes whose resolution did not fit into `mailbox` for lack of
+ *             memory, one bit each; their requests are answered with 503
+ * `timers`: the timeouts of the loop's connections and DHT lookups, they
+ *           determine how long the loop may sleep
+ * `maintenance`: timer driving `dht_maintenance()`, only on the first loop
+ * `accept_pause`: timer resuming accepts, after they failed for lack of file
+ *                 descriptors or memory
+ * `parked`: connections waiting for a DHT lookup to resolve
+ * `syncing`: connections whose responses wait for their changes to be durable
+ * `uring`: state of the io_uring backend, NULL while the loop uses epoll
+ */
+struct event_loop {
+    int epoll_fd;
+    int server_socket;
+    int udp_socket;
+    enum event_loop_backend backend;
+    struct event_loop_uring *uring;
+
+    unsigned id;
+    int wake_fd;
+    pthread_mutex_t mailbox_lock;
+    struct dht_resolution *mailbox;
+    size_t mailbox_length;
+    size_t mailbox_capacity;
+    bool any_unposted;
+    uint64_t unposted[(UINT16_MAX + 1) / 64];
+
+    struct connection_state *parked;
+    struct connection_state *syncing;
+
+    struct timer_wheel timers;
+    struct timer maintenance;
+    struct timer accept_pause;
+};
+
+/**
+ * Create the epoll instance and register the listening and DHT sockets.
+ * With `EVENT_LOOP_IO_URING`, the ring is set up by `event_loop_run()`, on
+ * the thread that uses it.
+ *
+ * At most `EVENT_LOOP_MAX` loops may be created.
+ */
+void event_loop_init(struct event_loop *loop, int server_socket,
+                     int udp_socket, enum event_loop_backend backend);
+
+/**
+ * Register `fd` with the given epoll `events`, passing `ptr` back on wakeup.
+ * With io_uring, `EPOLLIN` and `EPOLLOUT` are watched by a multishot poll,
+ * always edge-triggered.
+ *
+ * Returns -1 on failure.
+ */
+int event_loop_watch(struct event_loop *loop, int fd, uint32_t events,
+                     void *ptr);
+
+/**
+ * Report that accepting a connection failed with `error`. Out of file
+ * descriptors or memory, the loop stops accepting for
+ * `EVENT_LOOP_ACCEPT_PAUSE_MS`: the pending connections would wake it again
+ * right away, until some connection is closed.
+ */
+void event_loop_accept_failed(struct event_loop *loop, int error);
+
+/**
+ * Stop watching `fd`, registered with `ptr`, before it is closed
+ */
+void event_loop_unwatch(struct event_loop *loop, int fd, void *ptr);
+
+/**
+ * With io_uring: receive on the socket of `state` until cancelled, the data
+ * is passed to `connection_received()`
+ */
+void event_loop_receive(struct event_loop *loop, struct connection_state *state);
+
+/**
+ * With io_uring: send `message` on the socket of `state`, the result is
+ * passed to `connection_sent()`. Submitted with the next wait.
+ */
+void event_loop_send(struct event_loop *loop, struct connection_state *state,
+                     const struct msghdr *message);
+
+/**
+ * With io_uring: cancel the receive or send in flight for `state`, whose
+ * completion still arrives
+ */
+void event_loop_cancel_receive(struct event_loop *loop,
+                               struct connection_state *state);
+void event_loop_cancel_send(struct event_loop *loop,
+                            struct connection_state *state);
+
+/**
+ * Hand a DHT resolution to the loop with the given id, from any thread.
+ * Without memory to queue it, the requests waiting for it are answered as if
+ * the lookup had failed.
+ */
+void event_loop_post(unsigned id, const struct dht_resolution *resolution);
+
+/**
+ * Wake up the loop with index `id`, e.g. from the write-ahead log's thread
+ */
+void event_loop_wake(unsigned id);
+
+/**
+ * Dispatch readiness events or completions to their handlers, forever.
+ */
+void event_loop_run(struct event_loop *loop);
@@ -1,12 +1,18 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include "metrics.h"
+#include "output_queue.h"
+#include "timer.h"
 #include "util.h"
 
 #define HTTP_MAX_SIZE 8192
 #define HTTP_MAX_HEADERS 40
+#define HTTP_MAX_PAYLOAD (1ul << 30)
 
 /**
  * Simple string tuple representing a HTTP header
@@ -23,37 +29,181 @@ struct request {
     string method;
     string uri;
     struct header headers[HTTP_MAX_HEADERS];
+    size_t header_count;
     char *payload;
     ssize_t payload_length;
 };
 
+/**
+ * Position of a string within the request being parsed
+ */
+struct http_span {
+    uint32_t start;
+    uint32_t length;
+};
+
+enum http_parser_state {
+    HTTP_PARSE_REQUEST_LINE,
+    HTTP_PARSE_HEADERS,
+    HTTP_PARSE_PAYLOAD,
+};
+
+/**
+ * Progress of parsing the request at the start of a connection's buffer
+ *
+ * Every byte is scanned once, no matter in how many pieces the request
+ * arrives. Offsets are relative to the start of the request, so they stay
+ * valid when the unprocessed data is moved to the front of the buffer.
+ *
+ * `scanned`: bytes of the request already looked at
+ * `line_start`: start of the line being scanned
+ * `colon`: first ':' of the current header line, zero if none was seen yet
+ * `head_length`: length of request line and headers, once complete
+ * `content_length`: value of the Content-Length header, zero if missing
+ */
+struct http_parser {
+    enum http_parser_state state;
+    size_t scanned;
+    size_t line_start;
+    size_t colon;
+    struct http_span method;
+    struct http_span uri;
+    struct http_span keys[HTTP_MAX_HEADERS];
+    struct http_span values[HTTP_MAX_HEADERS];
+    size_t header_count;
+    size_t head_length;
+    size_t content_length;
+};
+
+struct event_loop;
+struct proxy_request;
+struct proxy_upstream;
+
 /**
  * The state of an ongoing HTTP connection
  *
  * `sock`: the socket connected to the client
  * `buffer`: buffer for the raw received data
  * `end`: end of unprocessed data in `buffer`
- * `current_request`: current, complete request, not yet answered to. Reuses
- *                    memory of `buffer`.
+ * `parser`: parsing progress of the request at the start of `buffer`
+ * `body`: payload of `body_request` while it is received. Once its header is
+ *         parsed, a request's payload goes straight into this allocation
+ *         from `value_alloc()`, sized from its Content-Length. The header
+ *         stays at the start of `buffer` until the request is answered.
+ * `body_received`: number of payload bytes in `body`
+ * `loop`: the event loop serving this connection
+ * `output`: response data the socket did not take yet. No further requests
+ *           are read while it is pending.
+ * `closing`: whether the connection is closed once `output` is sent
+ * `parked`: whether a request waits for a DHT lookup of `parked_hash`. It
+ *           is answered with a redirect to `parked_uri` once the lookup
+ *           resolves; later requests are only processed afterwards.
+ * `parked_request`: the parked request kept in proxy mode, forwarded to
+ *                   the responsible node once the lookup resolves
+ * `close_after_parked`: whether the parked or proxied request asked to close
+ *                       the connection
+ * `prev_parked`, `next_parked`: links in the loop's list of parked connections
+ * `parked_method`, `parked_since`: for the metrics of the parked or proxied
+ *                                  request, once it is answered
+ * `proxied`: whether a request was forwarded on `upstream`, in `proxy_slot`
+ *            of its queue, and its response has not completely arrived.
+ *            Later requests are only processed afterwards.
+ * `syncing`: whether the corked `output` acknowledges changes that are not
+ *            durable yet, up to log position `sync_position`. It is sent
+ *            once the write-ahead log synced them.
+ * `prev_syncing`, `next_syncing`: links in the loop's list of syncing
+ *                                 connections
+ * `timer`: closes the connection once it was idle or a request took too long
+ *          to arrive, on the loop's timer wheel
+ * `request_started`: when the first bytes of the partial request header in
+ *                    `buffer` arrived, zero if there is none
+ *
+ * With the io_uring backend, data arrives without being asked for:
+ * `inbox`: received data the connection was not ready to read yet, the
+ *          socket buffer's counterpart
+ * `receiving`: whether a multishot receive is armed, `receive_paused` whether
+ *              it is being cancelled because `inbox` is full
+ * `received_end`, `receive_error`: how receiving ended, for when the data
+ *                                  before is read
+ * `closed`: closed already, but memory the kernel uses for a receive or send
+ *           in flight is only freed once it completed
  */
 struct connection_state {
     int sock;
     char buffer[HTTP_MAX_SIZE];
     char *end;
-    struct request current_request;
+    struct http_parser parser;
+    char *body;
+    size_t body_received;
+    struct request body_request;
+    struct event_loop *loop;
+    struct output_queue output;
+    bool closing;
+
+    bool parked;
+    uint16_t parked_hash;
+    char *parked_uri;
+    struct proxy_request *parked_request;
+    bool close_after_parked;
+    struct connection_state *prev_parked;
+    struct connection_state *next_parked;
+    enum metrics_method parked_method;
+    uint64_t parked_since;
+
+    bool proxied;
+    struct proxy_upstream *upstream;
+    size_t proxy_slot;
+
+    bool syncing;
+    uint64_t sync_position;
+    struct connection_state *prev_syncing;
+    struct connection_state *next_syncing;
+
+    struct timer timer;
+    uint64_t request_started;
+
+    char *inbox;
+    size_t inbox_length;
+    size_t inbox_capacity;
+    bool receiving;
+    bool receive_paused;
+    bool received_end;
+    int receive_error;
+    bool closed;
+
+    // Bytes counted in the connection buffer gauge, and the most ever held
+    size_t reported_bytes;
+    size_t peak_bytes;
 };
 
+void http_parser_init(struct http_parser *parser);
+
 /**
  * Parse HTTP request into the given structure.
  *
- * When a full request is read, `request` is populated with its corresponding
- * values, utilizing the existing memory in `buffer`, and the number of bytes
- * read is returned. Otherwise, `buffer` remains unchanged, and zero is
- * returned.
+ * Continues where `parser` left off with the same request, only scanning
+ * the bytes beyond those seen before. When a full request is read,
+ * `request` is populated with its corresponding values, utilizing the
+ * existing memory in `buffer`, the number of bytes read is returned and
+ * `parser` is ready for the next request. Otherwise, `buffer` remains
+ * unchanged, and zero is returned. Malformed requests yield -1.
+ */
+ssize_t parse_request(struct http_parser *parser, char *buffer, size_t n,
+                      struct request *request);
+
+/**
+ * Populate `request` from a header that is complete while its payload is
+ * not, see `parse_request()`.
+ *
+ * Returns the number of header bytes, or zero if the header is incomplete.
+ * `request->payload` is left unset and `parser` is ready for the next
+ * request.
  */
-ssize_t parse_request(char *buffer, size_t n, struct request *request);
+ssize_t parse_request_head(struct http_parser *parser, char *buffer,
+                           struct request *request);
 
 /**
- * Get value of header in request if set, or NULL.
+ * Get value of header in request if set, or NULL. Header names are matched
+ * case-insensitively.
  */
 string get_header(const struct request *request, const string name);
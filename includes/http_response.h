@@ -4,17 +4,36 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "data.h"
+#include "http.h"
 
-#define MAX_RESOURCES 100
+extern struct store resources;
 
-extern struct tuple resources[MAX_RESOURCES];
+void send_http_response(struct connection_state *conn, const char *response,
+                        size_t length);
+void send_redirect(struct connection_state *conn, const char *ip,
+                   const char *port, const char *uri);
+void send_service_unavailable(struct connection_state *conn);
 
-void send_http_response(int conn, const char *response, size_t length);
-void send_redirect(int conn, const char *ip, const char *port, const char *uri);
-void send_service_unavailable(int conn);
-void handle_get_request(int conn, const char *uri, size_t *offset, char *reply);
-void handle_put_request(int conn, const char *uri, const char *payload,
-                       size_t payload_length, size_t *offset, char *reply);
-void handle_delete_request(int conn, const char *uri, size_t *offset, char *reply);
+/**
+ * Answer a request from the local store. Return the status code sent.
+ */
+int handle_get_request(struct connection_state *conn, const char *uri);
+int handle_put_request(struct connection_state *conn, const char *uri,
+                       const char *payload, size_t payload_length);
+int handle_delete_request(struct connection_state *conn, const char *uri);
+
+/**
+ * Store a batch of keys moved here from another node, see
+ * `migrate_receive()`, if that is a neighbour in the ring. Returns the
+ * status code sent.
+ */
+int handle_migration(struct connection_state *conn,
+                     const struct request *request);
+
+/**
+ * Answer with this node's metrics, see `metrics_render()`. Returns the status
+ * code sent.
+ */
+int send_metrics(struct connection_state *conn);
 
 #endif // HTTP_RESPONSE_H 
\ No newline at end of file
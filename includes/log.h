@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum log_level {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF,
+};
+
+// Messages below this level are compiled out, e.g. with
+// -DLOG_COMPILE_LEVEL=LOG_LEVEL_INFO
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Lines held by the ring buffer, a power of two, and their maximum length.
+// Longer lines are truncated.
+#define LOG_RING_SLOTS 4096
+#define LOG_LINE_MAX 240
+
+// How long the writer thread sleeps once the ring buffer is drained
+#define LOG_DRAIN_INTERVAL_MS 10
+
+/**
+ * Runtime level, messages below it are skipped before their arguments are
+ * formatted
+ */
+extern enum log_level log_level;
+
+#define log_at(level, ...)                                                \
+    do {                                                                  \
+        if ((level) >= LOG_COMPILE_LEVEL && (level) >= log_level) {       \
+            log_write(__VA_ARGS__);                                       \
+        }                                                                 \
+    } while (0)
+
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/**
+ * Start the thread writing queued lines to stderr
+ *
+ * Lines queued before are kept. Everything still queued is written on
+ * `exit()`.
+ */
+void log_init(enum log_level level);
+
+/**
+ * Set the text every line starts with, e.g. the node's address
+ *
+ * Formatted once here instead of on every call. Should be set before
+ * workers start logging.
+ */
+void log_set_prefix(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+/**
+ * Parse a level name like "debug" or "warn". Returns false if unknown.
+ */
+bool log_parse_level(const char *name, enum log_level *level);
+
+/**
+ * Queue a line, use the leveled macros above instead
+ *
+ * Never blocks: formatting happens in the caller, writing in the log thread.
+ * If the ring buffer is full the line is dropped and counted.
+ */
+void log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * Write all queued lines now
+ */
+void log_flush(void);
+
+/**
+ * Number of lines dropped because the ring buffer was full
+ */
+uint64_t log_dropped(void);
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reserved path answered by every node, before any DHT routing
+#define METRICS_PATH "/_metrics"
+
+// Log-linear histogram buckets: 2^METRICS_SUB_BUCKET_BITS buckets per power
+// of two, i.e. a relative error below 1/8
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_HISTOGRAM_BUCKETS 512
+
+enum metrics_method {
+    METRICS_GET,
+    METRICS_PUT,
+    METRICS_DELETE,
+    METRICS_OTHER_METHOD,
+    METRICS_METHODS,
+};
+
+/**
+ * How a request was answered, each with its own latency histogram
+ *
+ * `METRICS_LOCAL`: served from the local store, or rejected locally
+ * `METRICS_REDIRECT`: 303 to the responsible node
+ * `METRICS_UNAVAILABLE`: 503, no DHT reply arrived in time
+ */
+enum metrics_path {
+    METRICS_LOCAL,
+    METRICS_REDIRECT,
+    METRICS_UNAVAILABLE,
+    METRICS_PATHS,
+};
+
+/**
+ * Events counted since the start
+ *
+ * `METRICS_DHT_LOOKUPS_DROPPED`: lookups neither sent nor forwarded, as no
+ *                                other node was known to send them to
+ * `METRICS_IO_SYSCALLS`: system calls made to wait for, accept, receive and
+ *                        send data, for comparing the I/O backends
+ */
+enum metrics_counter {
+    METRICS_CONNECTIONS_ACCEPTED,
+    METRICS_CONNECTIONS_TIMED_OUT,
+    METRICS_DHT_LOOKUPS_STARTED,
+    METRICS_DHT_LOOKUPS_SENT,
+    METRICS_DHT_LOOKUPS_RETRANSMITTED,
+    METRICS_DHT_LOOKUPS_EXPIRED,
+    METRICS_DHT_LOOKUPS_FORWARDED,
+    METRICS_DHT_LOOKUPS_DROPPED,
+    METRICS_DHT_LOOKUPS_ANSWERED,
+    METRICS_DHT_REPLIES_RECEIVED,
+    METRICS_IO_SYSCALLS,
+    METRICS_COUNTERS,
+};
+
+/**
+ * Values that go up and down
+ *
+ * `METRICS_CONNECTIONS_OPEN`: client connections currently open
+ * `METRICS_CONNECTION_BYTES`: bytes held for them: buffered requests,
+ *                             payloads being received, responses not sent
+ */
+enum metrics_gauge {
+    METRICS_CONNECTIONS_OPEN,
+    METRICS_CONNECTION_BYTES,
+    METRICS_GAUGES,
+};
+
+enum metrics_method metrics_method(const char *method);
+
+/**
+ * Current time for latency measurements, in microseconds
+ */
+uint64_t metrics_now(void);
+
+/**
+ * Count a request answered with `status`, which took since `start`, a time
+ * from `metrics_now()`.
+ */
+void metrics_request(enum metrics_method method, int status, uint64_t start);
+
+void metrics_count(enum metrics_counter counter);
+
+void metrics_gauge_add(enum metrics_gauge gauge, int64_t delta);
+
+/**
+ * Record the most bytes a connection held at once, when it is closed
+ */
+void metrics_connection_peak(size_t bytes);
+
+/**
+ * Render all metrics in the Prometheus text format
+ *
+ * Returns a buffer to be freed by the caller, or NULL if out of memory.
+ */
+char *metrics_render(size_t *length);
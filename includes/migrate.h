@@ -0,0 +1,95 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data.h"
+#include "dht.h"
+
+// Path that batches of migrated keys are PUT to. Only requests with the
+// headers below are batches, others are for a key of that name.
+#define MIGRATE_PATH "/_migrate"
+
+// HTTP port of the sending node, which has to be a neighbour in the ring
+#define MIGRATE_FROM_HEADER "Migrate-From"
+
+// Range (pred_id, id] the keys are moved from, as two numbers. A node
+// refusing keys outside its range answers with its own, and the address of
+// its predecessor, which they go to instead.
+#define MIGRATE_RANGE_HEADER "Migrate-Range"
+#define MIGRATE_PREDECESSOR_HEADER "Migrate-Predecessor"
+
+// Target size of a batch; a single larger value makes a larger one
+#define MIGRATE_BATCH_SIZE (256 * 1024)
+
+// Failures of `migrate_receive()`
+#define MIGRATE_MALFORMED (-1)
+#define MIGRATE_NO_MEMORY (-2)
+#define MIGRATE_FOREIGN (-3)
+
+/**
+ * Progress of the migrations of this node
+ *
+ * `ranges_pending`: ranges queued or being moved
+ */
+struct migrate_stats {
+    uint64_t keys_sent;
+    uint64_t bytes_sent;
+    uint64_t keys_received;
+    uint64_t batches_received;
+    uint64_t ranges_pending;
+};
+
+/**
+ * Start the thread that moves keys to other nodes out of `store`, sending at
+ * most `rate_mb_s` megabytes per second, or as fast as possible if zero.
+ * Batches are sent from the IP of `self`, and name its port.
+ */
+void migrate_init(struct store *store, const struct sockaddr_in *self,
+                  unsigned rate_mb_s);
+
+/**
+ * Move the keys whose hashes lie in (`pred_id`, `id`] to the node at `addr`,
+ * which became responsible for them
+ *
+ * Returns right away. Ranges are moved one after the other, each over one
+ * connection to the node's HTTP port, as a series of binary batches PUT to
+ * `MIGRATE_PATH`, and an empty one once all are moved. Keys are deleted
+ * here once the batch holding them was acknowledged, unless they were
+ * written meanwhile.
+ */
+void migrate_range(uint16_t pred_id, uint16_t id, const struct sockaddr_in *addr);
+
+/**
+ * Expect the keys of (`pred_id`, `id`] to be moved here
+ *
+ * Until the last batch of the range arrived, keys of it deleted with
+ * `migrate_delete()` leave a tombstone, so that a batch sent before does not
+ * bring them back. The first batch of a range expects the rest of it, too.
+ */
+void migrate_expect(uint16_t pred_id, uint16_t id);
+
+/**
+ * Delete the key from `store` like `remove_tuple()`, leaving a tombstone
+ * while keys of its range are expected
+ */
+bool migrate_delete(struct store *store, const string key);
+
+/**
+ * Store the keys of a batch of (`pred_id`, `id`] received from another node
+ * in `store`, keeping those written or deleted here meanwhile
+ *
+ * A batch is a sequence of records: the key and value lengths as 32 bit
+ * big-endian numbers, followed by the key and the value. An empty batch ends
+ * the range. Returns the number of keys in the batch, `MIGRATE_MALFORMED` if
+ * it is malformed, `MIGRATE_FOREIGN` if it holds keys the ID `id` of this
+ * node in `dht` is not responsible for, or `MIGRATE_NO_MEMORY` if some could
+ * not be stored.
+ */
+long migrate_receive(struct store *store, const struct dht_state *dht,
+                     uint16_t pred_id, uint16_t id, const char *batch,
+                     size_t length);
+
+void migrate_stats(struct migrate_stats *stats);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "event_loop.h"
+#include "log.h"
+#include "util.h"
+
+/**
+ * Command line options of the node
+ *
+ * `workers`: number of threads, each owning its own listener and event loop
+ * `backend`: how the event loops do I/O
+ * `lookup_timeout_ms`: how long a request waits for a DHT lookup before it is
+ *                      answered with 503
+ * `route_ttl_s`: how long a node learned from a DHT reply is trusted to be
+ *                responsible for its range
+ * `log_level`: least severe messages that are logged
+ * `data_dir`: where the store is persisted, NULL to keep it in memory only
+ * `snapshot_interval_s`: how often a snapshot of the store is written, zero
+ *                        to only keep the log
+ * `proxy`: whether requests for other nodes' keys are forwarded to them
+ *          rather than redirected
+ * `idle_timeout_s`: how long a connection may go without a request before it
+ *                   is closed, zero for no limit
+ * `header_timeout_s`: how long a client may take to send a request header, or
+ *                     to send more of a payload, before it is answered with
+ *                     408 and the connection closed; zero for no limit
+ * `migration_rate_mb_s`: how fast keys are moved to a node that took over
+ *                        part of this node's range, zero for no limit
+ * `vnodes`: how many IDs the node holds in the ring, to even out the share
+ *           of the keys each node is responsible for
+ * `key_hash`: how keys are placed in the ring, the same on all nodes
+ * `lookup_batch`: whether lookups to the same node are sent together as a
+ *                 LOOKUP_BATCH, which only nodes of this version understand
+ */
+struct options {
+    unsigned workers;
+    enum event_loop_backend backend;
+    unsigned lookup_timeout_ms;
+    unsigned route_ttl_s;
+    enum log_level log_level;
+    const char *data_dir;
+    unsigned snapshot_interval_s;
+    bool proxy;
+    unsigned idle_timeout_s;
+    unsigned header_timeout_s;
+    unsigned migration_rate_mb_s;
+    unsigned vnodes;
+    enum key_hash_function key_hash;
+    bool lookup_batch;
+};
+
+/**
+ * Parse the options in `argv`, exiting with a usage message on errors.
+ *
+ * Options may appear anywhere on the command line. Afterwards the positional
+ * arguments are moved to the end of `argv`; the index of the first one is
+ * returned.
+ */
+int parse_options(struct options *options, int argc, char **argv);
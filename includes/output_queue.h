@@ -0,0 +1,147 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Bytes of a queued part that are copied into its segment rather than the heap
+#define OUTPUT_INLINE_SIZE 112
+
+// Segments handed to one `writev()`-style call
+#define OUTPUT_IOV_MAX 128
+
+/**
+ * Who owns the memory of an `output_part`
+ *
+ * `OUTPUT_BORROWED`: only valid during the call, copied if it cannot be sent
+ *                    right away
+ * `OUTPUT_STATIC`: outlives the connection, e.g. string literals
+ * `OUTPUT_VALUE`: a reference obtained from `get()`, handed over to the queue
+ *                 and released once sent
+ * `OUTPUT_INLINE`, `OUTPUT_HEAP`: copies of borrowed parts, internal to the
+ *                                 queue
+ */
+enum output_ownership {
+    OUTPUT_BORROWED,
+    OUTPUT_STATIC,
+    OUTPUT_VALUE,
+    OUTPUT_INLINE,
+    OUTPUT_HEAP,
+};
+
+/**
+ * A piece of a response, sent back to back with the other parts
+ */
+struct output_part {
+    const char *data;
+    size_t length;
+    enum output_ownership ownership;
+};
+
+/**
+ * A queued part that has not been sent completely
+ *
+ * `data` is unused for `OUTPUT_INLINE` segments, which keep their bytes in
+ * `inline_data`.
+ */
+struct output_segment {
+    enum output_ownership ownership;
+    const char *data;
+    size_t length;
+    char inline_data[OUTPUT_INLINE_SIZE];
+};
+
+/**
+ * Data of a connection waiting for its socket to become writable
+ *
+ * `segments[head..tail)` are pending in order, `sent` bytes of the first one
+ * already went out. `pending_bytes` sums up everything not yet sent. A queue
+ * that `failed` lost data and its connection has to be closed. While
+ * `corked`, data is only queued, to be sent together once uncorked.
+ *
+ * With `submit` set, the queue never writes itself. Pending data is handed to
+ * `submit` as `message` instead, e.g. to be sent asynchronously, and the
+ * queue is `in_flight` until `output_queue_complete()` reports the result.
+ * Until then, `message` and the data it points to stay where they are;
+ * segments moved meanwhile leave their old array `retired`.
+ */
+struct output_queue {
+    struct output_segment *segments;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    size_t sent;
+    size_t pending_bytes;
+    bool failed;
+    bool corked;
+
+    void (*submit)(struct output_queue *queue, const struct msghdr *message);
+    bool in_flight;
+    struct msghdr message;
+    struct iovec *iov;
+    struct output_segment *retired;
+};
+
+void output_queue_init(struct output_queue *queue);
+
+/**
+ * Hand pending data to `submit` rather than writing it, see
+ * `struct output_queue`
+ */
+void output_queue_init_submitted(struct output_queue *queue,
+                                 void (*submit)(struct output_queue *queue,
+                                                const struct msghdr *message));
+
+/**
+ * Whether data is waiting for the socket to become writable
+ */
+bool output_queue_pending(const struct output_queue *queue);
+
+/**
+ * Send `parts` to `sock` with a single gathering write
+ *
+ * Whatever the socket does not take right away is queued behind earlier data
+ * and sent by `output_queue_flush()`. Borrowed parts are only copied in that
+ * case.
+ */
+void output_queue_send(struct output_queue *queue, int sock,
+                       const struct output_part *parts, size_t count);
+
+/**
+ * Write queued data until the socket would block
+ *
+ * Returns 1 once the queue is empty, 0 if data is left and -1 if the queue
+ * failed. A submitting queue returns 0 while data is pending, having
+ * submitted it unless it is in flight already.
+ */
+int output_queue_flush(struct output_queue *queue, int sock);
+
+/**
+ * Account for the submitted message, of which `written` bytes were sent, or
+ * which failed with the negative error number `written`. What is left is
+ * submitted again, unless the queue is corked.
+ *
+ * Returns like `output_queue_flush()`.
+ */
+int output_queue_complete(struct output_queue *queue, ssize_t written);
+
+/**
+ * Hold back data sent from now on, e.g. the responses to a batch of
+ * pipelined requests
+ */
+void output_queue_cork(struct output_queue *queue);
+
+/**
+ * Send what was held back since `output_queue_cork()`, with as few writes as
+ * possible
+ *
+ * Returns the result of `output_queue_flush()`.
+ */
+int output_queue_uncork(struct output_queue *queue, int sock);
+
+/**
+ * Drop everything queued, releasing the references held. Not while a
+ * message is in flight.
+ */
+void output_queue_clear(struct output_queue *queue);
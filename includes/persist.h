@@ -0,0 +1,17 @@
+#pragma once
+
+#include "data.h"
+
+/**
+ * Make `store` durable in `directory`
+ *
+ * Restores the latest snapshot and replays the log written since, then logs
+ * every change to a new log segment. Unless `snapshot_interval_s` is zero, a
+ * background thread writes a new snapshot at that interval if anything
+ * changed, and deletes the log segments it covers.
+ *
+ * A worker that changed the store has to wait for the change to be durable
+ * before it acknowledges it, see `wal_sync()` and `wal_notify()`.
+ */
+void persist_open(struct store *store, const char *directory,
+                  unsigned snapshot_interval_s);
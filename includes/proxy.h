@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "http.h"
+
+// Pooled connections to other nodes, per event loop
+#define PROXY_MAX_UPSTREAMS 16
+
+// Requests in flight on one pooled connection
+#define PROXY_MAX_PIPELINE 256
+
+// Marks forwarded requests, which are never forwarded again
+#define PROXY_VIA "1.1 rn"
+
+struct proxy_upstream;
+
+/**
+ * Whether `request` is forwarded rather than redirected
+ *
+ * That is the case in proxy mode, unless another node forwarded the request
+ * already: a request takes at most one hop, also while the nodes disagree
+ * about the ring.
+ */
+bool proxy_wanted(const struct request *request);
+
+/**
+ * A request kept to be forwarded: until the responsible node is known, and
+ * until its response starts arriving, to be sent again on a new connection
+ * if the pooled one was closed meanwhile. `payload` is a value reference,
+ * NULL if there is no payload.
+ */
+struct proxy_request {
+    char *method;
+    char *uri;
+    const char *payload;
+    size_t payload_length;
+};
+
+/**
+ * Keep `request` of `client` to be forwarded. Method and URI are copied; a
+ * payload streamed into `client->body` is referenced rather than copied, a
+ * buffered one is bounded by the buffer size. Returns NULL if out of memory.
+ */
+struct proxy_request *proxy_copy_request(const struct connection_state *client,
+                                         const struct request *request);
+
+/**
+ * Drop a request kept with `proxy_copy_request()`
+ */
+void proxy_free_request(struct proxy_request *request);
+
+/**
+ * Forward `request` from `client` to the node at `ip`:`port`, taking it over
+ *
+ * Every event loop keeps one connection per node, on which the requests are
+ * pipelined; those forwarded during an iteration are sent together by
+ * `proxy_flush()`. The response is streamed back to `client`, which then
+ * continues with `connection_proxied()`. A request whose response did not
+ * start yet when the connection is lost is sent once more on a new one.
+ *
+ * Returns false if no connection is available, the request is to be
+ * redirected then and stays with the caller.
+ */
+bool proxy_forward(struct connection_state *client,
+                   struct proxy_request *request, const char *ip,
+                   uint16_t port);
+
+/**
+ * Forget the request `client` waits for, e.g. because the client went away.
+ * Its response is dropped.
+ */
+void proxy_detach(struct connection_state *client);
+
+/**
+ * Send the requests forwarded by this thread since the last call
+ */
+void proxy_flush(void);
+
+/**
+ * The pooled connection an epoll event with `source` is for, or NULL if it
+ * is not one of this thread's
+ */
+struct proxy_upstream *proxy_upstream_of(void *source);
+
+/**
+ * Complete the connection to `upstream`, send what is queued for it and
+ * stream the responses received back to the clients
+ */
+void proxy_handle(struct proxy_upstream *upstream);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ROUTE_CACHE_CAPACITY 1024
+
+/**
+ * A node responsible for the hashes in (`pred_id`, `id`]
+ */
+struct route {
+    uint16_t pred_id;
+    uint16_t id;
+    char ip[INET_ADDRSTRLEN];
+    uint16_t port;
+    uint64_t expires_at;
+};
+
+/**
+ * Remember that the given node is responsible for (`pred_id`, `id`]
+ *
+ * Cached ranges overlapping the new one are outdated and dropped. The entry
+ * expires after the configured route TTL.
+ */
+void route_cache_insert(uint16_t pred_id, uint16_t id, const char *ip,
+                        uint16_t port);
+
+/**
+ * Find the cached node responsible for `hash`
+ *
+ * Returns whether a live entry was found and copied to `route`.
+ */
+bool route_cache_lookup(uint16_t hash, struct route *route);
+
+/**
+ * Forget the cached ranges overlapping (`pred_id`, `id`], after the ring
+ * changed there
+ */
+void route_cache_forget(uint16_t pred_id, uint16_t id);
+
+/**
+ * Number of lookups answered from the cache, and of those that were not
+ */
+void route_cache_stats(uint64_t *hits, uint64_t *misses);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Objects are carved out of pages of this size, aligned to it so an object's
+// page is found by masking its address
+#define SLAB_PAGE_SIZE (64 * 1024)
+
+// Pages are mapped this many at a time. Up to SLAB_POOL_PAGES empty pages
+// are kept for reuse, further ones are unmapped.
+#define SLAB_BATCH_PAGES 16
+#define SLAB_POOL_PAGES 64
+
+// Larger objects are allocated with malloc()
+#define SLAB_MAX_OBJECT 8192
+
+// Size classes: steps of 16 bytes up to 128, then four classes per power of
+// two up to SLAB_MAX_OBJECT
+#define SLAB_CLASSES 32
+
+/**
+ * Allocation statistics
+ *
+ * `pages`: slab pages holding objects
+ * `pool_pages`: empty pages kept for reuse
+ * `objects`: objects allocated from slab pages
+ * `object_bytes`: their total size, rounded up to their size class
+ * `large_objects`, `large_bytes`: objects allocated with malloc()
+ * `system_allocations`, `system_frees`: calls to the system allocator, for
+ *                                       batches of pages, single pages and
+ *                                       large objects
+ */
+struct slab_stats {
+    size_t pages;
+    size_t pool_pages;
+    size_t objects;
+    size_t object_bytes;
+    size_t large_objects;
+    size_t large_bytes;
+    uint64_t system_allocations;
+    uint64_t system_frees;
+};
+
+/**
+ * Allocate `size` bytes, aligned to 16. Returns NULL if out of memory.
+ *
+ * Safe to call from any thread. Objects of the same size class share pages,
+ * a page is reused or handed back to the system once all its objects are
+ * freed.
+ */
+void *slab_alloc(size_t size);
+
+/**
+ * Free an object from `slab_alloc()`, `size` being the size it was
+ * allocated with, or any other size of the same class
+ */
+void slab_free(void *object, size_t size);
+
+/**
+ * Usable size of an allocation of `size` bytes: its size class
+ */
+size_t slab_capacity(size_t size);
+
+/**
+ * Hand all pooled empty pages back to the system
+ */
+void slab_trim(void);
+
+void slab_stats(struct slab_stats *stats);
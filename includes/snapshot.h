@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data.h"
+
+#define SNAPSHOT_FILE "snapshot"
+
+/**
+ * Write all of `store` to `directory`/SNAPSHOT_FILE, replacing the previous
+ * snapshot atomically
+ *
+ * `segment` is the first log segment whose records may be missing from the
+ * snapshot; recovery replays it and all later ones. Returns the number of
+ * keys written.
+ */
+size_t snapshot_write(struct store *store, const char *directory,
+                      uint64_t segment);
+
+/**
+ * Load the snapshot in `directory` into `store`
+ *
+ * The file is mapped and its values are used in place, so only the index
+ * and the keys are read up front. Returns false if there is no valid
+ * snapshot. Otherwise, the number of keys and the first segment to replay
+ * are stored in `keys` and `segment`.
+ */
+bool snapshot_load(struct store *store, const char *directory, size_t *keys,
+                   uint64_t *segment);
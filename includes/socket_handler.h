@@ -2,22 +2,34 @@
 #define SOCKET_HANDLER_H
 
 #include <netinet/in.h>
-#include <poll.h>
 #include <stdbool.h>
+#include "dht_handler.h"
+#include "event_loop.h"
 #include "http.h"
 
-int setup_socket_common(int sock);
-int setup_server_socket(struct sockaddr_in addr);
-int setup_udp_socket(struct sockaddr_in addr);
-void connection_setup(struct connection_state *state, int sock);
+int setup_socket_common(int sock, bool reuse_port);
+int setup_server_socket(struct sockaddr_in addr, bool reuse_port);
+int setup_udp_socket(struct sockaddr_in addr, bool reuse_port);
+void connection_setup(struct connection_state *state, int sock,
+                      struct event_loop *loop);
+void connection_close(struct connection_state *state);
+void connection_finish(struct connection_state *state);
+void connection_park(struct connection_state *state, uint16_t hash,
+                     const struct request *request);
+void connection_resume_all(struct event_loop *loop,
+                           const struct dht_resolution *resolution);
+void connection_release_synced(struct event_loop *loop);
+void connection_proxied(struct connection_state *state, int status);
 char *buffer_discard(char *buffer, size_t discard, size_t keep);
-void handle_server_socket(int server_socket, struct pollfd *sockets,
-                         struct connection_state *state);
-void handle_client_socket(struct connection_state *state,
-                         struct pollfd *sockets, int udp_socket);
-bool handle_connection(struct connection_state *state, int udp_socket);
-bool handle_incoming_data(struct connection_state *state, int udp_socket);
-size_t process_packet(int conn, char *buffer, size_t n, int udp_socket);
-void send_reply(int conn, struct request *request, int udp_socket);
+void connection_open(struct event_loop *loop, int sock);
+void connection_received(struct connection_state *state, const char *data,
+                         int result, bool more);
+void connection_sent(struct connection_state *state, int result);
+void handle_server_socket(struct event_loop *loop);
+void handle_client_socket(struct event_loop *loop,
+                          struct connection_state *state);
+bool handle_incoming_data(struct connection_state *state);
+ssize_t process_packet(struct connection_state *state, char *buffer, size_t n);
+void send_reply(struct connection_state *state, struct request *request);
 
 #endif // SOCKET_HANDLER_H 
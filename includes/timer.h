@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Slots per level are 1 << TIMER_WHEEL_BITS, each level's slots span as much
+// time as all of the level below
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/**
+ * A timer, usually embedded in the object it is for
+ *
+ * `callback` runs once the time reaches `expires`, in milliseconds on the
+ * monotonic clock. `next` and `prev` link it into a slot of the wheel while
+ * armed, `next` is NULL otherwise.
+ */
+struct timer {
+    struct timer *next;
+    struct timer *prev;
+    uint64_t expires;
+    void (*callback)(struct timer *timer);
+};
+
+/**
+ * A hierarchical timer wheel with a resolution of one millisecond
+ *
+ * Level 0 has a slot for each of the next 64 ms, level 1 one for each of the
+ * next 64 blocks of 64 ms, and so on; timers further out than the top level
+ * reaches are cycled through it. When the time reaches a slot of a higher
+ * level, its timers are spread over the levels below. Arming and cancelling
+ * are constant time, and so is finding the next slot that needs attention,
+ * thanks to a bit set of the occupied slots per level.
+ *
+ * A wheel is not synchronized, it belongs to one thread.
+ *
+ * `now`: time up to which expired timers have run
+ * `slots`: list heads, circular through the heads themselves
+ */
+struct timer_wheel {
+    uint64_t now;
+    size_t count;
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+
+/**
+ * Initialize `timer` to run `callback`, not armed
+ */
+void timer_init(struct timer *timer, void (*callback)(struct timer *timer));
+
+/**
+ * Run `timer` at time `expires`, replacing its previous expiry if armed
+ *
+ * A time that has passed already is run on the next advance.
+ */
+void timer_arm(struct timer_wheel *wheel, struct timer *timer,
+               uint64_t expires);
+
+/**
+ * Disarm `timer`, if it is armed
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+static inline bool timer_armed(const struct timer *timer) {
+    return timer->next != NULL;
+}
+
+/**
+ * Run the callbacks of all timers that expired by `now`
+ *
+ * Callbacks may arm and cancel timers, including their own.
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now);
+
+/**
+ * Milliseconds from `now` until the wheel needs to be advanced again, for
+ * `epoll_wait()`: -1 if no timer is armed
+ */
+int timer_wheel_timeout(const struct timer_wheel *wheel, uint64_t now);
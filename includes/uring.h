@@ -0,0 +1,159 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * The part of io_uring the event loop uses, on the raw system calls
+ *
+ * Submissions are prepared with `uring_sqe()` and the `uring_prep_*()`
+ * helpers and only handed to the kernel by `uring_wait()`, so everything an
+ * event loop iteration queues goes out with one system call. A ring is not
+ * synchronized, it belongs to the thread that created it.
+ *
+ * `sq_local_tail`: end of the prepared entries, published to the kernel on
+ *                  submission
+ */
+struct uring {
+    int fd;
+    unsigned features;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/**
+ * A ring of equally sized buffers the kernel picks from for multishot
+ * receives, identified by `group` in submissions and by a buffer ID in
+ * completions
+ *
+ * Buffers are lent to the kernel until handed back with
+ * `uring_buffer_return()`.
+ */
+struct uring_buffers {
+    struct io_uring_buf_ring *ring;
+    size_t ring_size;
+    char *memory;
+    size_t size;
+    unsigned count;
+    uint16_t group;
+    uint16_t tail;
+};
+
+/**
+ * Create a ring with `entries` submission slots. Returns -1 and sets `errno`
+ * if the kernel does not offer what the event loop needs, e.g. because
+ * io_uring is disabled.
+ */
+int uring_init(struct uring *ring, unsigned entries);
+
+void uring_destroy(struct uring *ring);
+
+/**
+ * A cleared submission entry, submitting the prepared ones first if the
+ * queue is full
+ */
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+
+/**
+ * Submit what was prepared and wait until a completion is available or
+ * `timeout_ms` passed, -1 waits without limit. Returns -1 with `errno` set
+ * on errors other than timeouts and interruptions.
+ */
+int uring_wait(struct uring *ring, int timeout_ms);
+
+/**
+ * The oldest completion not yet consumed, or NULL
+ */
+static inline struct io_uring_cqe *uring_peek(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/**
+ * Consume the completion returned by `uring_peek()`
+ */
+static inline void uring_advance(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Register `count` buffers of `size` bytes as buffer group `group`. `count`
+ * must be a power of two. Returns -1 and sets `errno` on failure.
+ */
+int uring_buffers_init(struct uring *ring, struct uring_buffers *buffers,
+                       uint16_t group, unsigned count, size_t size);
+
+static inline char *uring_buffer(const struct uring_buffers *buffers,
+                                 uint16_t id) {
+    return buffers->memory + (size_t)id * buffers->size;
+}
+
+/**
+ * Lend buffer `id` to the kernel again
+ */
+void uring_buffer_return(struct uring_buffers *buffers, uint16_t id);
+
+/**
+ * Accept connections on `fd` until cancelled, one completion each
+ */
+void uring_prep_accept_multishot(struct uring *ring, int fd,
+                                 uint64_t user_data);
+
+/**
+ * Receive on `fd` until cancelled, the end of the stream or an error, into
+ * buffers of `buffers`
+ */
+void uring_prep_recv_multishot(struct uring *ring, int fd,
+                               const struct uring_buffers *buffers,
+                               uint64_t user_data);
+
+/**
+ * Receive datagrams on `fd` until cancelled, into buffers of `buffers`. Each
+ * buffer starts with a `struct io_uring_recvmsg_out`, followed by the
+ * sender's address as far as `header` reserves room for it.
+ */
+void uring_prep_recvmsg_multishot(struct uring *ring, int fd,
+                                  struct msghdr *header,
+                                  const struct uring_buffers *buffers,
+                                  uint64_t user_data);
+
+/**
+ * Send `message` on `fd`. It has to stay valid until the submission.
+ */
+void uring_prep_sendmsg(struct uring *ring, int fd,
+                        const struct msghdr *message, uint64_t user_data);
+
+/**
+ * Report `poll_mask` events of `fd` until cancelled, once per change like an
+ * edge-triggered epoll registration
+ */
+void uring_prep_poll_multishot(struct uring *ring, int fd, unsigned poll_mask,
+                               uint64_t user_data);
+
+/**
+ * Cancel the request submitted with `target`; the cancellation completes
+ * with `user_data`
+ */
+void uring_prep_cancel(struct uring *ring, uint64_t target,
+                       uint64_t user_data);
@@ -1,14 +1,14 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 typedef char *string; // differentiate null-terminated C-string from bytes
 
-/**
- * Analog to `strstr()`, for non-C-string haystacks.
- */
-char *memstr(char *haystack, size_t n, string needle);
+// The structure of type `type` that has `pointer` as its `member`
+#define container_of(pointer, type, member) \
+    ((type *)((char *)(pointer) - offsetof(type, member)))
 
 /**
  * Safe version of `strtoul()`
@@ -26,3 +26,49 @@ uint16_t safe_strtoul(const char *restrict nptr, char **restrict endptr,
  * @return the 16 bit hash
  */
 uint16_t pseudo_hash(const unsigned char *buffer, size_t buf_len);
+
+/**
+ * wyhash (final version 4, zero seed) of the buffer, folded to 16 bits
+ *
+ * Unlike the checksum, every input bit affects every output bit: reordered
+ * or byte-swapped keys do not collide, and similar ones do not cluster.
+ */
+uint16_t wyhash16(const unsigned char *buffer, size_t buf_len);
+
+/**
+ * Functions keys can be hashed with to place them in the ring. All nodes of
+ * a ring have to use the same; `pseudo_hash()` is what the protocol
+ * specifies.
+ */
+enum key_hash_function {
+    KEY_HASH_CHECKSUM,
+    KEY_HASH_WYHASH,
+};
+
+/**
+ * Select the function of `ring_hash()`, before any key is hashed
+ */
+void key_hash_select(enum key_hash_function function);
+
+/**
+ * Hash of a key for its place in the ring, with the selected function,
+ * `pseudo_hash()` unless chosen otherwise
+ */
+uint16_t ring_hash(const unsigned char *buffer, size_t buf_len);
+
+/**
+ * ID number `index` of a node whose first ID is `first_id`, spread over the
+ * ring by an integer hash so that the IDs of all nodes interleave
+ */
+uint16_t virtual_id(uint16_t first_id, uint32_t index);
+
+/**
+ * Milliseconds on the monotonic clock
+ */
+uint64_t monotonic_ms(void);
+
+/**
+ * CRC-32C (Castagnoli) of `length` bytes, continuing from `crc`, which is
+ * zero for the first chunk
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
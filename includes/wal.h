@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data.h"
+
+// Initial size of the buffer records are appended to, it grows as needed
+#define WAL_BUFFER_SIZE (1 << 20)
+
+/**
+ * Start logging to segment number `segment` in `directory`
+ *
+ * A background thread writes out the records appended meanwhile and syncs
+ * them to disk in one go, so concurrent writers share the cost of an
+ * `fdatasync()` (group commit).
+ */
+void wal_open(const char *directory, uint64_t segment);
+
+/**
+ * Append a change to the log, a `store_journal`
+ *
+ * Returns right away. The record is durable once `wal_sync()` returns.
+ */
+void wal_append(enum store_operation operation, const char *key,
+                size_t key_length, const char *value, size_t value_length);
+
+/**
+ * Wait until all records appended by the calling thread are on disk
+ *
+ * Returns immediately if there are none, e.g. if the log is not open.
+ */
+void wal_sync(void);
+
+/**
+ * Log position after the last record appended by the calling thread
+ *
+ * Comparing it before and after handling a request tells whether the
+ * request changed the store.
+ */
+uint64_t wal_position(void);
+
+/**
+ * Whether the log is on disk up to `position`
+ */
+bool wal_durable(uint64_t position);
+
+/**
+ * Have the log thread call `wake(waiter)` once it synced up to `position`
+ *
+ * Lets an event loop keep serving while its acknowledgements wait for the
+ * disk, instead of blocking in `wal_sync()`. `waiter` is below 64, and all
+ * callers pass the same `wake`. Returns false without registering if
+ * `position` is durable already.
+ */
+bool wal_notify(uint64_t position, void (*wake)(unsigned waiter),
+                unsigned waiter);
+
+/**
+ * Continue logging into the next segment
+ *
+ * Returns its number once the switch is done. Records appended before the
+ * call are in older segments.
+ */
+uint64_t wal_rotate(void);
+
+/**
+ * Bytes appended since the log was opened
+ */
+uint64_t wal_appended(void);
+
+/**
+ * Apply the records of a segment to `store`
+ *
+ * Stops at the first incomplete or corrupt record, i.e. one that was being
+ * written when the node stopped and never acknowledged. Returns the number
+ * of records applied, or -1 if the file cannot be read.
+ */
+long wal_replay(const char *path, struct store *store);
+
+/**
+ * Format the path of segment number `segment` in `directory`
+ */
+void wal_segment_path(char *path, size_t size, const char *directory,
+                      uint64_t segment);
+
+/**
+ * Parse a segment's file name. Returns false if it is no segment.
+ */
+bool wal_segment_number(const char *name, uint64_t *segment);
@@ -6,8 +6,9 @@ hash_f = ProtoField.uint16("rn_protocol.hash", "hash", base.HEX)
 id_f = ProtoField.uint16("rn_protocol.id", "id", base.HEX)
 ip_f = ProtoField.ipv4("rn_protocol.ip", "ip")
 port_f = ProtoField.uint16("rn_protocol.port", "port", base.DEC)
+count_f = ProtoField.uint16("rn_protocol.count", "count", base.DEC)
 
-rn_protocol.fields = {flags_f, hash_f, id_f, ip_f, port_f}
+rn_protocol.fields = {flags_f, hash_f, id_f, ip_f, port_f, count_f}
 
 op_names = {
     [0] = "Lookup",
@@ -15,29 +16,72 @@ op_names = {
     [2] = "Stabilize",
     [3] = "Notify",
     [4] = "Join",
+    [5] = "Lookup Batch",
 }
 
+-- Size of a datagram holding a valid message of its type, or nil
+function expected_length(buffer)
+    local length = buffer:len()
+    if length < 11 then
+        return nil
+    end
+    local op = buffer(0, 1):uint()
+    if op == 5 then
+        local count = buffer(1, 2):uint()
+        if count > 0 and length == 11 + 2 * count then
+            return length
+        end
+        return nil
+    end
+    -- Replies to a lookup batch are combined into one datagram
+    if op == 1 and length % 11 == 0 then
+        for offset = 11, length - 11, 11 do
+            if buffer(offset, 1):uint() ~= 1 then
+                return nil
+            end
+        end
+        return length
+    end
+    if length == 11 and op_names[op] ~= nil then
+        return length
+    end
+    return nil
+end
+
 function info_text(buffer, pinfo)
     local name = op_names[buffer(0, 1):uint()]
     local desc = ""
     if name == "Lookup" then
         desc = string.format(" %x for %x@%s:%u", buffer(1, 2):uint(), buffer(3, 2):uint(), buffer(5, 4):uint(), buffer(9, 2):uint())
     elseif name == "Reply" then
+        if buffer:len() > 11 then
+            desc = string.format(" x%u", math.floor(buffer:len() / 11))
+        end
     elseif name == "Stabilize" then
         desc = string.format(" from 0x%02x@%s:%u", buffer(3, 2):uint(), buffer(5, 4):ipv4(), buffer(9, 2):uint())
     elseif name == "Notify" then
         desc = string.format(" of 0x%02x@%s:%u", buffer(3, 2):uint(), buffer(5, 4):ipv4(), buffer(9, 2):uint())
     elseif name == "Join" then
         desc = string.format(" from 0x%02x@%s:%u", buffer(3, 2):uint(), buffer(5, 4):ipv4(), buffer(9, 2):uint())
+    elseif name == "Lookup Batch" then
+        desc = string.format(" of %u for %x@%s:%u", buffer(1, 2):uint(), buffer(3, 2):uint(), buffer(5, 4):ipv4(), buffer(9, 2):uint())
     end
     local suffix = string.format(" (%s:%u → %s:%u)", pinfo.src, pinfo.src_port, pinfo.dst, pinfo.dst_port)
     return name .. desc .. suffix
 end
 
+function add_message(tree, buffer)
+    tree:add(flags_f, buffer(0, 1)):append_text(" (" .. op_names[buffer(0, 1):uint()] .. ")")
+    tree:add(hash_f, buffer(1, 2))
+    tree:add(id_f, buffer(3, 2))
+    tree:add(ip_f, buffer(5, 4))
+    tree:add(port_f, buffer(9, 2))
+end
+
 function rn_protocol.dissector(buffer, pinfo, tree)
-    length = buffer:len()
+    length = expected_length(buffer)
 
-    if length ~= 11 then
+    if length == nil then
         return 0
     end
 
@@ -45,13 +89,24 @@ function rn_protocol.dissector(buffer, pinfo, tree)
     pinfo.cols.protocol = rn_protocol.name
     pinfo.cols.info = info_text(buffer, pinfo) -- string.format("%s: (%s:%u → %s:%u)", op_names[buffer(0, 1):uint()],  pinfo.src, pinfo.src_port, pinfo.dst, pinfo.dst_port)
 
-    subtree:add(flags_f, buffer(0, 1)):append_text(" (" .. op_names[buffer(0, 1):uint()] .. ")")
-    subtree:add(hash_f, buffer(1, 2))
-    subtree:add(id_f, buffer(3, 2))
-    subtree:add(ip_f, buffer(5, 4))
-    subtree:add(port_f, buffer(9, 2))
+    if buffer(0, 1):uint() == 5 then
+        subtree:add(flags_f, buffer(0, 1)):append_text(" (Lookup Batch)")
+        subtree:add(count_f, buffer(1, 2))
+        subtree:add(id_f, buffer(3, 2))
+        subtree:add(ip_f, buffer(5, 4))
+        subtree:add(port_f, buffer(9, 2))
+        for offset = 11, length - 2, 2 do
+            subtree:add(hash_f, buffer(offset, 2))
+        end
+    elseif length > 11 then
+        for offset = 0, length - 11, 11 do
+            add_message(subtree:add(rn_protocol, buffer(offset, 11), "Reply"), buffer(offset, 11))
+        end
+    else
+        add_message(subtree, buffer)
+    end
 
-    return 11
+    return length
 end
 
 rn_protocol:register_heuristic("udp", rn_protocol.dissector)
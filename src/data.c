@@ -1,67 +1,406 @@
 #include "data.h"
 
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
-struct tuple *find(string key, struct tuple *tuples, size_t n_tuples) {
-    for (size_t i = 0; i < n_tuples; i += 1) {
-        // compare keys with 'strcmp'
-        if (tuples[i].key && strcmp(key, tuples[i].key) == 0) {
-            return &(tuples[i]);
+#include "slab.h"
+
+/**
+ * Reference-counted value storage
+ *
+ * The store itself holds one reference, every reader returned from `get()`
+ * another. The memory is freed when the last one is dropped. `capacity` is
+ * the usable size of the slab object, at least the value's length.
+ */
+struct value {
+    atomic_size_t refs;
+    size_t capacity;
+    char data[];
+};
+
+_Static_assert(sizeof(struct value) == VALUE_HEADER_SIZE,
+               "VALUE_HEADER_SIZE does not match struct value");
+
+// `capacity` of values from `value_wrap()`
+#define VALUE_WRAPPED SIZE_MAX
+
+static struct value *value_of(const char *data) {
+    return (struct value *)(data - offsetof(struct value, data));
+}
+
+char *value_alloc(size_t length) {
+    struct value *value = slab_alloc(sizeof(*value) + length);
+    if (!value) return NULL;
+    atomic_init(&value->refs, 1);
+    value->capacity = slab_capacity(sizeof(*value) + length) - sizeof(*value);
+    return value->data;
+}
+
+char *value_wrap(char *memory) {
+    struct value *value = (struct value *)memory;
+    // Left alone if already set, so that a mapped page stays clean
+    if (atomic_load_explicit(&value->refs, memory_order_relaxed) != 1) {
+        atomic_init(&value->refs, 1);
+    }
+    if (value->capacity != VALUE_WRAPPED) value->capacity = VALUE_WRAPPED;
+    return value->data;
+}
+
+void release(const char *data) {
+    struct value *value = value_of(data);
+    if (atomic_fetch_sub_explicit(&value->refs, 1, memory_order_acq_rel) == 1 &&
+        value->capacity != VALUE_WRAPPED) {
+        slab_free(value, sizeof(*value) + value->capacity);
+    }
+}
+
+void value_retain(const char *data) {
+    atomic_fetch_add_explicit(&value_of(data)->refs, 1, memory_order_relaxed);
+}
+
+/**
+ * Whether a value of `length` bytes can replace `data` in place: no reader
+ * holds it, and it needs the same size class
+ */
+static bool fits(const char *data, size_t length) {
+    struct value *value = value_of(data);
+    return atomic_load_explicit(&value->refs, memory_order_acquire) == 1 &&
+           slab_capacity(sizeof(*value) + length) - sizeof(*value) ==
+               value->capacity;
+}
+
+#define SHARD_INITIAL_CAPACITY 16
+
+static uint64_t key_hash(const char *key, size_t key_length) {
+    // FNV-1a, followed by the MurmurHash3 finalizer to mix the low bits used
+    // for slot selection
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < key_length; i += 1) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb3f99ebe1a53ull;
+    hash ^= hash >> 33;
+    return hash ? hash : 1; // zero marks empty slots
+}
+
+static const char *tuple_key(const struct tuple *tuple) {
+    return tuple->key_length < TUPLE_INLINE_KEY ? tuple->inline_key
+                                                : tuple->key;
+}
+
+static struct store_shard *shard_of(struct store *store, uint64_t hash) {
+    // The low bits select the slot within the shard
+    return &store->shards[(hash >> 56) % STORE_SHARDS];
+}
+
+/**
+ * Find the slot of `key` in `shard`, or the empty slot ending its probe
+ * sequence if it is missing.
+ */
+static struct tuple *find(struct store_shard *shard, uint64_t hash,
+                          const char *key, size_t key_length) {
+    size_t mask = shard->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct tuple *tuple = &shard->tuples[i];
+        // compare the cached hash before the key itself
+        if (tuple->hash == 0 ||
+            (tuple->hash == hash && tuple->key_length == key_length &&
+             memcmp(tuple_key(tuple), key, key_length) == 0)) {
+            return tuple;
         }
     }
-    return NULL;
 }
 
-const char *get(const string key, struct tuple *tuples, size_t n_tuples,
-                size_t *value_length) {
-    struct tuple *tuple = find(key, tuples, n_tuples);
-    if (tuple) {
+static bool grow(struct store_shard *shard) {
+    size_t capacity = shard->capacity * 2;
+    struct tuple *tuples = calloc(capacity, sizeof(*tuples));
+    if (!tuples) return false;
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < shard->capacity; i += 1) {
+        struct tuple *tuple = &shard->tuples[i];
+        if (tuple->hash == 0) continue;
+        size_t j = tuple->hash & mask;
+        while (tuples[j].hash != 0) j = (j + 1) & mask;
+        tuples[j] = *tuple;
+    }
+
+    free(shard->tuples);
+    shard->tuples = tuples;
+    shard->capacity = capacity;
+    return true;
+}
+
+/**
+ * Empty `tuple`, shifting back later entries of its probe sequence so that
+ * lookups never need tombstones.
+ */
+static void erase(struct store_shard *shard, struct tuple *tuple) {
+    size_t mask = shard->capacity - 1;
+    size_t i = tuple - shard->tuples;
+    for (size_t j = (i + 1) & mask; shard->tuples[j].hash != 0;
+         j = (j + 1) & mask) {
+        size_t home = shard->tuples[j].hash & mask;
+        // Entries whose home slot lies in (i, j] have to stay
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            shard->tuples[i] = shard->tuples[j];
+            i = j;
+        }
+    }
+    memset(&shard->tuples[i], 0, sizeof(shard->tuples[i]));
+    shard->count -= 1;
+}
+
+void store_init(struct store *store) {
+    for (size_t i = 0; i < STORE_SHARDS; i += 1) {
+        struct store_shard *shard = &store->shards[i];
+        pthread_rwlock_init(&shard->lock, NULL);
+        shard->tuples = calloc(SHARD_INITIAL_CAPACITY, sizeof(struct tuple));
+        if (!shard->tuples) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        shard->capacity = SHARD_INITIAL_CAPACITY;
+        shard->count = 0;
+        shard->value_bytes = 0;
+    }
+    store->journal = NULL;
+}
+
+void store_stats(struct store *store, struct store_stats *stats) {
+    *stats = (struct store_stats){0};
+    for (size_t i = 0; i < STORE_SHARDS; i += 1) {
+        struct store_shard *shard = &store->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        stats->keys += shard->count;
+        stats->slots += shard->capacity;
+        stats->value_bytes += shard->value_bytes;
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+/**
+ * An entry collected by `store_for_each()`, holding a reference to its value
+ */
+struct visit_entry {
+    char *key;
+    size_t key_length;
+    const char *value;
+    size_t value_length;
+};
+
+void store_for_each(struct store *store,
+                    void (*visit)(void *context, const char *key,
+                                  size_t key_length, const char *value,
+                                  size_t value_length),
+                    void *context) {
+    for (size_t i = 0; i < STORE_SHARDS; i += 1) {
+        struct store_shard *shard = &store->shards[i];
+        struct visit_entry *entries = NULL;
+        size_t count = 0;
+
+        pthread_rwlock_rdlock(&shard->lock);
+        if (shard->count > 0 &&
+            !(entries = malloc(shard->count * sizeof(*entries)))) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < shard->capacity; j += 1) {
+            struct tuple *tuple = &shard->tuples[j];
+            if (tuple->hash == 0) continue;
+            char *key = malloc(tuple->key_length + 1);
+            if (!key) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(key, tuple_key(tuple), tuple->key_length + 1);
+            atomic_fetch_add_explicit(&value_of(tuple->value)->refs, 1,
+                                      memory_order_relaxed);
+            entries[count++] = (struct visit_entry){
+                key, tuple->key_length, tuple->value, tuple->value_length};
+        }
+        pthread_rwlock_unlock(&shard->lock);
+
+        for (size_t j = 0; j < count; j += 1) {
+            visit(context, entries[j].key, entries[j].key_length,
+                  entries[j].value, entries[j].value_length);
+            free(entries[j].key);
+            release(entries[j].value);
+        }
+        free(entries);
+    }
+}
+
+const char *get(struct store *store, const string key, size_t *value_length) {
+    size_t key_length = strlen(key);
+    uint64_t hash = key_hash(key, key_length);
+    struct store_shard *shard = shard_of(store, hash);
+    const char *value = NULL;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    struct tuple *tuple = find(shard, hash, key, key_length);
+    if (tuple->hash) {
+        atomic_fetch_add_explicit(&value_of(tuple->value)->refs, 1,
+                                  memory_order_relaxed);
         *value_length = tuple->value_length;
-        return tuple->value;
-    } else {
-        return NULL;
+        value = tuple->value;
     }
+    pthread_rwlock_unlock(&shard->lock);
+
+    return value;
 }
 
-bool set(const string key, char *value, size_t value_length,
-         struct tuple *tuples, size_t n_tuples) {
+/**
+ * Store `value` for the key, or only if it is absent unless `replace`
+ */
+static enum store_result insert(struct store *store, const string key,
+                                size_t key_length, uint64_t hash, char *value,
+                                size_t value_length, bool replace) {
+    char *long_key = NULL;
+    if (key_length >= TUPLE_INLINE_KEY) {
+        if (!(long_key = slab_alloc(key_length + 1))) {
+            release(value);
+            return STORE_FAILED;
+        }
+        memcpy(long_key, key, key_length + 1);
+    }
+
+    struct store_shard *shard = shard_of(store, hash);
+    char *old_value = NULL;
+    enum store_result result = STORE_CREATED;
+
+    pthread_rwlock_wrlock(&shard->lock);
     // check if tuple already exists
-    struct tuple *tuple = find(key, tuples, n_tuples);
+    struct tuple *tuple = find(shard, hash, key, key_length);
 
-    if (tuple) { // overwrite existing value
-        free(tuple->value);
-        tuple->value = (char *)malloc(value_length * sizeof(char));
-        strcpy(tuple->value, value);
-        tuple->value_length = value_length;
-        return true;
+    if (tuple->hash && !replace) { // keep existing value
+        old_value = value;
+        tuple = NULL;
+        result = STORE_KEPT;
+    } else if (tuple->hash) { // overwrite existing value
+        old_value = tuple->value;
+        shard->value_bytes -= tuple->value_length;
+        result = STORE_UPDATED;
+    } else if ((shard->count + 1) * 4 > shard->capacity * 3 && !grow(shard)) {
+        // the table cannot grow, the value is dropped
+        old_value = value;
+        tuple = NULL;
+        result = STORE_FAILED;
     } else { // add tuple
-        for (size_t i = 0; i < n_tuples; i += 1) {
-            if (tuples[i].key == NULL) {
-                tuples[i].key =
-                    (char *)malloc((strlen(key) + 1) * sizeof(char));
-                strcpy(tuples[i].key, key);
-                tuples[i].value = (char *)malloc(value_length * sizeof(char));
-                memcpy(tuples[i].value, value, value_length);
-                tuples[i].value_length = value_length;
-                return false;
-            }
+        tuple = find(shard, hash, key, key_length);
+        tuple->hash = hash;
+        tuple->key_length = key_length;
+        if (long_key) {
+            tuple->key = long_key;
+            long_key = NULL;
+        } else {
+            memcpy(tuple->inline_key, key, key_length + 1);
+        }
+        shard->count += 1;
+    }
+    if (tuple) {
+        tuple->value = value;
+        tuple->value_length = value_length;
+        shard->value_bytes += value_length;
+        if (store->journal) {
+            store->journal(STORE_PUT, key, key_length, value, value_length);
         }
     }
-    return false; // fail silently if no space for a new tuple is available
+    pthread_rwlock_unlock(&shard->lock);
+
+    slab_free(long_key, key_length + 1);
+    if (old_value) release(old_value);
+    return result;
+}
+
+enum store_result set(struct store *store, const string key,
+                      const char *value, size_t value_length) {
+    size_t key_length = strlen(key);
+    uint64_t hash = key_hash(key, key_length);
+    struct store_shard *shard = shard_of(store, hash);
+
+    // Overwrite in place if possible, sparing an allocation and a free
+    pthread_rwlock_wrlock(&shard->lock);
+    struct tuple *tuple = find(shard, hash, key, key_length);
+    bool in_place = tuple->hash && fits(tuple->value, value_length);
+    if (in_place) {
+        memcpy(tuple->value, value, value_length);
+        shard->value_bytes += value_length - tuple->value_length;
+        tuple->value_length = value_length;
+        if (store->journal) {
+            store->journal(STORE_PUT, key, key_length, value, value_length);
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (in_place) return STORE_UPDATED;
+
+    char *copy = value_alloc(value_length);
+    if (!copy) return STORE_FAILED;
+    memcpy(copy, value, value_length);
+    return insert(store, key, key_length, hash, copy, value_length, true);
+}
+
+enum store_result set_if_absent(struct store *store, const string key,
+                                const char *value, size_t value_length) {
+    char *copy = value_alloc(value_length);
+    if (!copy) return STORE_FAILED;
+    memcpy(copy, value, value_length);
+    size_t key_length = strlen(key);
+    return insert(store, key, key_length, key_hash(key, key_length), copy,
+                  value_length, false);
+}
+
+enum store_result set_value(struct store *store, const string key,
+                            char *value, size_t value_length) {
+    size_t key_length = strlen(key);
+    return insert(store, key, key_length, key_hash(key, key_length), value,
+                  value_length, true);
 }
 
 // MODIFIED delete -> remove_tuple
-bool remove_tuple (const string key, struct tuple *tuples, size_t n_tuples) {
-    struct tuple *tuple = find(key, tuples, n_tuples);
+/**
+ * Delete the key if its value is `value`, or in any case if that is NULL.
+ * Returns true if it was deleted.
+ */
+static bool remove_matching(struct store *store, const string key,
+                            const char *value) {
+    size_t key_length = strlen(key);
+    uint64_t hash = key_hash(key, key_length);
+    struct store_shard *shard = shard_of(store, hash);
+    char *old_key = NULL;
+    char *old_value = NULL;
 
-    if (tuple) {
-        free(tuple->key);
-        tuple->key = NULL;
-        free(tuple->value);
-        tuple->value = NULL;
-        tuple->value_length = 0;
-        return true;
-    } else {
-        return false;
+    pthread_rwlock_wrlock(&shard->lock);
+    struct tuple *tuple = find(shard, hash, key, key_length);
+
+    if (tuple->hash && (!value || tuple->value == value)) {
+        old_key = key_length >= TUPLE_INLINE_KEY ? tuple->key : NULL;
+        old_value = tuple->value;
+        shard->value_bytes -= tuple->value_length;
+        erase(shard, tuple);
+        if (store->journal) {
+            store->journal(STORE_DELETE, key, key_length, NULL, 0);
+        }
     }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (!old_value) return false;
+    slab_free(old_key, key_length + 1);
+    release(old_value);
+    return true;
+}
+
+bool remove_tuple(struct store *store, const string key) {
+    return remove_matching(store, key, NULL);
+}
+
+bool remove_if_value(struct store *store, const string key,
+                     const char *value) {
+    return remove_matching(store, key, value);
 }
@@ -2,11 +2,19 @@
 
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "dht_io.h"
+#include "log.h"
+#include "metrics.h"
+#include "migrate.h"
+#include "route_cache.h"
+#include "util.h"
+
 bool is_responsible(uint16_t hash, uint16_t self_id, uint16_t pred_id) {
     // Normal case:
     // ex. pred_id=100, self_id=200
@@ -20,9 +28,250 @@ bool is_responsible(uint16_t hash, uint16_t self_id, uint16_t pred_id) {
     return (hash > pred_id) || (hash <= self_id);
 }
 
+// Neighbours change with joins and stabilization, fingers are learned from
+// replies; both as messages arrive at any worker
+static pthread_rwlock_t ring_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void set_node(struct dht_node *node, uint16_t id,
+                     const struct sockaddr_in *addr) {
+    node->id = id;
+    node->known = true;
+    node->addr = *addr;
+    inet_ntop(AF_INET, &addr->sin_addr, node->ip, sizeof(node->ip));
+    snprintf(node->port, sizeof(node->port), "%u", ntohs(addr->sin_port));
+}
+
+static void node_from_message(struct dht_node *node,
+                              const struct dht_message *msg) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = msg->node_port,
+        .sin_addr.s_addr = msg->node_ip,
+    };
+    set_node(node, ntohs(msg->node_id), &addr);
+}
+
+static bool same_address(const struct sockaddr_in *a,
+                         const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+           a->sin_port == b->sin_port;
+}
+
+static bool is_local(const struct dht_state *dht,
+                     const struct sockaddr_in *addr) {
+    return addr->sin_port == 0 || same_address(addr, &dht->self_addr);
+}
+
+static void self_node(const struct dht_state *dht, uint16_t id,
+                      struct dht_node *node) {
+    set_node(node, id, &dht->self_addr);
+}
+
+/**
+ * The joined ID of this node responsible for `hash`, or NULL
+ */
+static const struct dht_vnode *responsible_vnode(const struct dht_state *dht,
+                                                 uint16_t hash) {
+    for (size_t i = 0; i < dht->vnode_count; i++) {
+        const struct dht_vnode *vnode = &dht->vnodes[i];
+        if (vnode->joined && vnode->has_pred &&
+            is_responsible(hash, vnode->id, vnode->pred.id)) {
+            return vnode;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The ID of this node `id`, or NULL
+ */
+static struct dht_vnode *find_vnode(struct dht_state *dht, uint16_t id) {
+    for (size_t i = 0; i < dht->vnode_count; i++) {
+        if (dht->vnodes[i].id == id) return &dht->vnodes[i];
+    }
+    return NULL;
+}
+
+/**
+ * `dht_route()` with `ring_lock` held
+ */
+static enum dht_route route(const struct dht_state *dht, uint16_t hash,
+                            struct dht_node *node, uint16_t *pred_id) {
+    bool joined = false;
+    for (size_t i = 0; i < dht->vnode_count; i++) {
+        const struct dht_vnode *vnode = &dht->vnodes[i];
+        if (!vnode->joined) continue;
+        joined = true;
+        // Another ID of this node as the successor is found as such
+        if (vnode->succ.known && !is_local(dht, &vnode->succ.addr) &&
+            is_responsible(hash, vnode->succ.id, vnode->id)) {
+            *node = vnode->succ;
+            *pred_id = vnode->id;
+            return DHT_ROUTE_SUCCESSOR;
+        }
+        if (vnode->has_pred && is_responsible(hash, vnode->id, vnode->pred.id)) {
+            self_node(dht, vnode->id, node);
+            *pred_id = vnode->pred.id;
+            return DHT_ROUTE_SELF;
+        }
+    }
+    return joined ? DHT_ROUTE_UNKNOWN : DHT_ROUTE_JOINING;
+}
+
+enum dht_route dht_route(const struct dht_state *dht, uint16_t hash,
+                         struct dht_node *node, uint16_t *pred_id) {
+    pthread_rwlock_rdlock(&ring_lock);
+    enum dht_route result = route(dht, hash, node, pred_id);
+    pthread_rwlock_unlock(&ring_lock);
+    return result;
+}
+
+bool dht_owns(const struct dht_state *dht, uint16_t id, uint16_t hash) {
+    pthread_rwlock_rdlock(&ring_lock);
+    const struct dht_vnode *vnode = find_vnode((struct dht_state *)dht, id);
+    bool owned = vnode && (!vnode->has_pred ||
+                           is_responsible(hash, vnode->id, vnode->pred.id));
+    pthread_rwlock_unlock(&ring_lock);
+    return owned;
+}
+
+bool dht_predecessor(const struct dht_state *dht, uint16_t id,
+                     struct dht_node *pred) {
+    pthread_rwlock_rdlock(&ring_lock);
+    const struct dht_vnode *vnode = find_vnode((struct dht_state *)dht, id);
+    bool known = vnode && vnode->has_pred;
+    if (known) *pred = vnode->pred;
+    pthread_rwlock_unlock(&ring_lock);
+    return known;
+}
+
+bool dht_is_neighbour(const struct dht_state *dht,
+                      const struct sockaddr_in *addr) {
+    bool found = false;
+    pthread_rwlock_rdlock(&ring_lock);
+    for (size_t i = 0; i < dht->vnode_count && !found; i++) {
+        const struct dht_vnode *vnode = &dht->vnodes[i];
+        found = (vnode->has_pred && vnode->pred.known &&
+                 same_address(&vnode->pred.addr, addr)) ||
+                (vnode->succ.known && same_address(&vnode->succ.addr, addr));
+    }
+    pthread_rwlock_unlock(&ring_lock);
+    return found && !is_local(dht, addr);
+}
+
+uint16_t dht_clip_range(const struct dht_state *dht, uint16_t pred_id,
+                        uint16_t id) {
+    // IDs never change, no need for the lock
+    for (size_t i = 0; i < dht->vnode_count; i++) {
+        uint16_t own = dht->vnodes[i].id;
+        if (is_responsible(own, id, pred_id)) pred_id = own;
+    }
+    return pred_id;
+}
+
+bool dht_next_hop(const struct dht_state *dht, uint16_t hash,
+                  struct sockaddr_in *addr) {
+    // Distances are measured counterclockwise from the hash. Other IDs of
+    // this node are left out: their successors are always closer, as none of
+    // them is responsible.
+    uint16_t best = UINT16_MAX;
+    bool found = false;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    for (size_t i = 0; i < dht->vnode_count; i++) {
+        const struct dht_node *succ = &dht->vnodes[i].succ;
+        uint16_t distance = hash - succ->id;
+        if (dht->vnodes[i].joined && succ->known &&
+            !is_local(dht, &succ->addr) && (!found || distance < best)) {
+            best = distance;
+            *addr = succ->addr;
+            found = true;
+        }
+    }
+    for (size_t i = 0; i < DHT_FINGERS; i++) {
+        const struct dht_finger *finger = &dht->fingers[i];
+        uint16_t distance = hash - finger->id;
+        if (finger->known && !is_local(dht, &finger->addr) &&
+            (!found || distance < best)) {
+            best = distance;
+            *addr = finger->addr;
+            found = true;
+        }
+    }
+    pthread_rwlock_unlock(&ring_lock);
+
+    return found;
+}
+
+static void set_finger(struct dht_finger *finger, uint16_t id,
+                       const struct sockaddr_in *addr) {
+    finger->known = true;
+    finger->id = id;
+    finger->addr = *addr;
+}
+
+/**
+ * `dht_learn_node()` with `ring_lock` held
+ */
+static void learn_node(struct dht_state *dht, uint16_t pred_id, uint16_t id,
+                       const struct sockaddr_in *addr) {
+    for (size_t i = 0; i < DHT_FINGERS; i++) {
+        if (is_responsible(dht->fingers[i].start, id, pred_id)) {
+            set_finger(&dht->fingers[i], id, addr);
+        }
+    }
+}
+
+void dht_learn_node(struct dht_state *dht, uint16_t pred_id, uint16_t id,
+                    const struct sockaddr_in *addr) {
+    pthread_rwlock_wrlock(&ring_lock);
+    learn_node(dht, pred_id, id, addr);
+    pthread_rwlock_unlock(&ring_lock);
+}
+
+void dht_fix_fingers(int udp_socket, struct dht_state *dht) {
+    static size_t next_refresh = 0;
+    uint16_t lookups[DHT_FINGERS];
+    size_t lookup_count = 0;
+
+    pthread_rwlock_wrlock(&ring_lock);
+    for (size_t i = 0; i < DHT_FINGERS; i++) {
+        struct dht_finger *finger = &dht->fingers[i];
+        struct dht_node node;
+        uint16_t pred_id;
+        switch (route(dht, finger->start, &node, &pred_id)) {
+            case DHT_ROUTE_SELF:
+                set_finger(finger, node.id, &(struct sockaddr_in){0});
+                break;
+            case DHT_ROUTE_SUCCESSOR:
+                set_finger(finger, node.id, &node.addr);
+                break;
+            case DHT_ROUTE_UNKNOWN:
+                if (!finger->known || i == next_refresh) {
+                    lookups[lookup_count++] = finger->start;
+                }
+                break;
+            case DHT_ROUTE_JOINING:
+                break;
+        }
+    }
+    next_refresh = (next_refresh + 1) % DHT_FINGERS;
+    pthread_rwlock_unlock(&ring_lock);
+
+    // The replies are picked up by `dht_learn_node()`
+    for (size_t i = 0; i < lookup_count; i++) {
+        send_dht_lookup(udp_socket, dht, lookups[i]);
+    }
+}
+
 // AUFGABE 1.3
 void send_dht_lookup(int udp_socket, const struct dht_state *dht, uint16_t hash) {
-    struct sockaddr_in addr = derive_sockaddr(dht->succ_ip, dht->succ_port);
+    struct sockaddr_in addr;
+    if (!dht_next_hop(dht, hash, &addr)) {
+        log_debug("No node to send the lookup for hash 0x%04x to\n", hash);
+        metrics_count(METRICS_DHT_LOOKUPS_DROPPED);
+        return;
+    }
     struct dht_message msg = {
         .type = MESSAGE_TYPE_LOOKUP,
         .hash = htons(hash),
@@ -31,52 +280,329 @@ void send_dht_lookup(int udp_socket, const struct dht_state *dht, uint16_t hash)
         .node_port = htons(dht->self_port)
     };
 
-    fprintf(stderr, "(%s:%d) Sending DHT lookup for hash 0x%04x to successor: %s:%s\n",
-            dht->self_ip, dht->self_port, hash, dht->succ_ip, dht->succ_port);
+    char next_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, next_ip, sizeof(next_ip));
+    log_debug("Sending DHT lookup for hash 0x%04x to %s:%d\n", hash, next_ip,
+              ntohs(addr.sin_port));
 
-    if (sendto(udp_socket, &msg, sizeof(msg), 0, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-        perror("sendto");
-    }
-} 
+    dht_send(udp_socket, &msg, &addr);
+    metrics_count(METRICS_DHT_LOOKUPS_SENT);
+}
 
 // AUFGABE 1.4
 //  Message type 1 ( reply )
 // hash id ist die ID des Vorgängers der verantwortlichen Node
 // Node Id, IP und Port, Beschreibung der verantwortlichen Node
 // wir haben hier die verantwortliche Node als parameter, da vielleicht der nachfolgende knoten der verantwortliche ist
-void send_dht_reply(int udp_socket, const struct dht_state *dht, 
-                    uint16_t responsible_node_id, 
-                    const char *requesting_node_ip, 
-                    uint16_t requesting_node_port, 
-                    uint16_t predecessor_id) {
+void send_dht_reply(int udp_socket, const struct dht_node *responsible,
+                    const char *requesting_node_ip,
+                    uint16_t requesting_node_port,
+                    const uint16_t *predecessor_ids, size_t count) {
     // Send to the node that made the lookup request
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(requesting_node_port);
     addr.sin_addr.s_addr = inet_addr(requesting_node_ip);
 
-    // If we're sending a reply about our successor being responsible,
-    // use the successor's IP and port
-    const char *resp_ip = (responsible_node_id == dht->succ_id) ? dht->succ_ip : dht->self_ip;
-    const char *resp_port = (responsible_node_id == dht->succ_id) ? dht->succ_port : NULL;
-    uint16_t resp_port_num = resp_port ? atoi(resp_port) : dht->self_port;
+    struct dht_message msgs[DHT_REPLY_BATCH_MAX];
+    if (count > DHT_REPLY_BATCH_MAX) count = DHT_REPLY_BATCH_MAX;
+    for (size_t i = 0; i < count; i++) {
+        msgs[i] = (struct dht_message){
+            .type = MESSAGE_TYPE_REPLY,
+            .hash = htons(predecessor_ids[i]),  // ID of the predecessor of the responsible node
+            .node_id = htons(responsible[i].id),  // ID of the responsible node
+            .node_ip = responsible[i].addr.sin_addr.s_addr,  // IP of the responsible node
+            .node_port = responsible[i].addr.sin_port  // Port of the responsible node
+        };
+
+        log_debug("Sending DHT reply to %s:%d: responsible=%04x, predecessor=%04x\n",
+                  requesting_node_ip, requesting_node_port, responsible[i].id,
+                  predecessor_ids[i]);
+    }
 
+    dht_send_datagram(udp_socket, msgs, count * sizeof(*msgs), &addr);
+}
+
+/**
+ * Send a message of `type` about the node `id` at `node_ip`:`node_port`, both
+ * in network byte order, to `to`
+ */
+static void send_about(int udp_socket, uint8_t type, uint16_t hash,
+                       uint16_t id, uint32_t node_ip, uint16_t node_port,
+                       const struct sockaddr_in *to) {
     struct dht_message msg = {
-        .type = MESSAGE_TYPE_REPLY,
-        .hash = htons(predecessor_id),  // ID of the predecessor of the responsible node
-        .node_id = htons(responsible_node_id),  // ID of the responsible node
-        .node_ip = inet_addr(resp_ip),  // IP of the responsible node
-        .node_port = htons(resp_port_num)  // Port of the responsible node
+        .type = type,
+        .hash = htons(hash),
+        .node_id = htons(id),
+        .node_ip = node_ip,
+        .node_port = node_port,
     };
+    dht_send(udp_socket, &msg, to);
+}
 
-    fprintf(stderr, "(%s:%d) Sending DHT reply to %s:%d: responsible=%04x, predecessor=%04x\n",
-            dht->self_ip, dht->self_port, requesting_node_ip, requesting_node_port, 
-            responsible_node_id, predecessor_id);
+/**
+ * Send a message of `type` about this node's ID `id`
+ */
+static void send_about_self(int udp_socket, const struct dht_state *dht,
+                            uint8_t type, uint16_t hash, uint16_t id,
+                            const struct sockaddr_in *to) {
+    send_about(udp_socket, type, hash, id, dht->self_addr.sin_addr.s_addr,
+               dht->self_addr.sin_port, to);
+}
+
+static void send_about_node(int udp_socket, uint8_t type, uint16_t hash,
+                            const struct dht_node *node,
+                            const struct sockaddr_in *to) {
+    send_about(udp_socket, type, hash, node->id, node->addr.sin_addr.s_addr,
+               node->addr.sin_port, to);
+}
 
-    if (sendto(udp_socket, &msg, sizeof(msg), 0, 
-               (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-        perror("sendto");
+void dht_join(int udp_socket, const struct dht_state *dht) {
+    // One at a time, once the previous one was stabilized: a node drops
+    // joins while one of its IDs has no predecessor
+    int joining = -1;
+    bool unsettled = false;
+    pthread_rwlock_rdlock(&ring_lock);
+    for (size_t i = 0; i < dht->vnode_count; i++) {
+        const struct dht_vnode *vnode = &dht->vnodes[i];
+        unsettled |= vnode->joined && !vnode->has_pred;
+        if (!vnode->joined && joining == -1) joining = vnode->id;
     }
+    pthread_rwlock_unlock(&ring_lock);
+    if (joining == -1 || unsettled) return;
+
+    char anchor_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &dht->anchor.sin_addr, anchor_ip, sizeof(anchor_ip));
+    log_debug("Asking %s:%d to admit 0x%04x to the ring\n", anchor_ip,
+              ntohs(dht->anchor.sin_port), joining);
+    send_about_self(udp_socket, dht, MESSAGE_TYPE_JOIN, joining, joining,
+                    &dht->anchor);
+}
+
+void dht_stabilize(int udp_socket, const struct dht_state *dht) {
+    struct dht_vnode vnodes[DHT_MAX_VNODES];
+    pthread_rwlock_rdlock(&ring_lock);
+    size_t count = dht->vnode_count;
+    memcpy(vnodes, dht->vnodes, count * sizeof(*vnodes));
+    pthread_rwlock_unlock(&ring_lock);
+
+    for (size_t i = 0; i < count; i++) {
+        if (!vnodes[i].joined || !vnodes[i].succ.known) continue;
+        send_about_self(udp_socket, dht, MESSAGE_TYPE_STABILIZE,
+                        vnodes[i].succ.id, vnodes[i].id, &vnodes[i].succ.addr);
+    }
+}
+
+void dht_handle_join(int udp_socket, struct dht_state *dht,
+                     const struct dht_message *msg) {
+    struct dht_node node;
+    node_from_message(&node, msg);
+    bool local = is_local(dht, &node.addr);
+
+    pthread_rwlock_wrlock(&ring_lock);
+    struct dht_vnode *vnode = find_vnode(dht, node.id);
+    if (vnode && (!local || vnode->joined)) {
+        pthread_rwlock_unlock(&ring_lock);
+        log_warn("Node %s:%s cannot join with this node's ID 0x%04x\n",
+                 node.ip, node.port, node.id);
+        return;
+    }
+    // Answered again if the joining node asks again
+    bool repeated = false;
+    for (size_t i = 0; i < dht->vnode_count && !repeated; i++) {
+        vnode = &dht->vnodes[i];
+        repeated = vnode->joined && vnode->has_pred && vnode->pred.known &&
+                   vnode->pred.id == node.id &&
+                   same_address(&vnode->pred.addr, &node.addr);
+    }
+    if (!repeated) vnode = (struct dht_vnode *)responsible_vnode(dht, node.id);
+    bool admitted = !repeated && vnode;
+    // An ID without a predecessor may be the one responsible without knowing
+    bool unsettled = false;
+    for (size_t i = 0; i < dht->vnode_count; i++) {
+        unsettled |= dht->vnodes[i].joined && !dht->vnodes[i].has_pred;
+    }
+    struct dht_node succ;
+    uint16_t succ_pred_id;
+    bool to_succ = route(dht, node.id, &succ, &succ_pred_id) ==
+                   DHT_ROUTE_SUCCESSOR;
+    struct dht_node old_pred = {0};
+    if (admitted) {
+        old_pred = vnode->pred;
+        vnode->pred = node;
+        if (!vnode->succ.known) vnode->succ = node; // alone so far
+        learn_node(dht, old_pred.id, node.id, &node.addr);
+    }
+    uint16_t id = vnode ? vnode->id : 0;
+    pthread_rwlock_unlock(&ring_lock);
+
+    if (!admitted && !repeated) {
+        // Dropped rather than passed around while none of the IDs joined
+        // yet, or one may be responsible; the joining node asks again
+        struct sockaddr_in next_hop = succ.addr;
+        if (unsettled && !to_succ) return;
+        if (!to_succ && !dht_next_hop(dht, node.id, &next_hop)) return;
+        log_debug("Forwarding join of 0x%04x\n", node.id);
+        dht_send(udp_socket, msg, &next_hop);
+        return;
+    }
+
+    if (admitted) {
+        log_info("Node 0x%04x at %s:%s joined as predecessor of 0x%04x\n",
+                 node.id, node.ip, node.port, id);
+        // Another ID of this node keeps the keys in the same store
+        if (!local) {
+            // Other nodes' routes to this one for the range are outdated
+            route_cache_insert(old_pred.id, node.id, node.ip,
+                               ntohs(node.addr.sin_port));
+            migrate_range(old_pred.id, node.id, &node.addr);
+        }
+    }
+    // The joining node is introduced to its predecessor on the predecessor's
+    // behalf before the answer, so that it has one as soon as it joined
+    bool introduce = admitted && old_pred.known && old_pred.id != id;
+    if (introduce) {
+        send_about_node(udp_socket, MESSAGE_TYPE_STABILIZE, node.id, &old_pred,
+                        &node.addr);
+    }
+    send_about_self(udp_socket, dht, MESSAGE_TYPE_NOTIFY, node.id, id,
+                    &node.addr);
+    if (introduce) {
+        send_about_node(udp_socket, MESSAGE_TYPE_NOTIFY, old_pred.id, &node,
+                        &old_pred.addr);
+    }
+}
+
+/**
+ * The ID of this node a stabilize or notify message is addressed to
+ *
+ * Its `hash` names it; a node with a single ID accepts any.
+ */
+static struct dht_vnode *addressed_vnode(struct dht_state *dht,
+                                         const struct dht_message *msg) {
+    if (dht->vnode_count == 1) return &dht->vnodes[0];
+    return find_vnode(dht, ntohs(msg->hash));
+}
+
+void dht_handle_stabilize(int udp_socket, struct dht_state *dht,
+                          const struct dht_message *msg) {
+    struct dht_node node;
+    node_from_message(&node, msg);
+
+    pthread_rwlock_wrlock(&ring_lock);
+    struct dht_vnode *vnode = addressed_vnode(dht, msg);
+    if (!vnode || node.id == vnode->id) {
+        pthread_rwlock_unlock(&ring_lock);
+        return;
+    }
+    if (!vnode->joined) {
+        // The introduction just before the answer to the join
+        vnode->pred = node;
+        vnode->has_pred = true;
+        pthread_rwlock_unlock(&ring_lock);
+        return;
+    }
+    bool adopted = false;
+    bool had_pred = vnode->has_pred;
+    uint16_t old_pred_id = vnode->pred.id;
+    if (had_pred && vnode->pred.id == node.id) {
+        vnode->pred = node; // its address may not have been known
+    } else if (!had_pred ||
+               is_responsible(node.id, vnode->id, vnode->pred.id)) {
+        if (had_pred) learn_node(dht, vnode->pred.id, node.id, &node.addr);
+        vnode->pred = node;
+        vnode->has_pred = true;
+        adopted = true;
+    }
+    if (!vnode->succ.known) vnode->succ = node; // alone so far
+    uint16_t id = vnode->id;
+    struct dht_node pred = vnode->pred;
+    pthread_rwlock_unlock(&ring_lock);
+
+    if (adopted) {
+        log_info("New predecessor of 0x%04x: 0x%04x at %s:%s\n", id, node.id,
+                 node.ip, node.port);
+        // Keys stay in the store if it is another ID of this node
+        if (had_pred && !is_local(dht, &node.addr)) {
+            // Cached routes over the range it took over are outdated
+            route_cache_insert(old_pred_id, node.id, node.ip,
+                               ntohs(node.addr.sin_port));
+            migrate_range(old_pred_id, node.id, &node.addr);
+        }
+        if (!had_pred) dht_join(udp_socket, dht); // the next ID, if any
+    }
+    // A predecessor only known by its ID stabilizes soon, and is then told
+    if (pred.known) {
+        send_about_node(udp_socket, MESSAGE_TYPE_NOTIFY, node.id, &pred,
+                        &node.addr);
+    }
+}
+
+void dht_handle_notify(int udp_socket, struct dht_state *dht,
+                       const struct dht_message *msg) {
+    struct dht_node node;
+    node_from_message(&node, msg);
+
+    pthread_rwlock_wrlock(&ring_lock);
+    struct dht_vnode *vnode = addressed_vnode(dht, msg);
+    if (!vnode) {
+        pthread_rwlock_unlock(&ring_lock);
+        return;
+    }
+    uint16_t id = vnode->id;
+    if (!vnode->joined) {
+        // Admitted by `node`, usually introduced to the predecessor already;
+        // otherwise it stabilizes soon. The keys of the range are expected
+        // before it is served, so none deleted here meanwhile come back.
+        if (vnode->has_pred && !is_local(dht, &node.addr)) {
+            migrate_expect(vnode->pred.id, vnode->id);
+        }
+        vnode->joined = true;
+        vnode->succ = node;
+        bool settled = vnode->has_pred;
+        uint16_t pred_id = vnode->pred.id;
+        pthread_rwlock_unlock(&ring_lock);
+        log_info("Joined the ring as 0x%04x before 0x%04x\n", id, node.id);
+        // The range is served here now, whoever cached routes named for it
+        if (settled) route_cache_forget(pred_id, id);
+        if (settled) dht_join(udp_socket, dht); // the next ID, if any
+        return;
+    }
+    bool adopted = node.id != id && node.id != vnode->succ.id &&
+                   is_responsible(node.id, vnode->succ.id, id);
+    if (adopted) {
+        learn_node(dht, id, node.id, &node.addr);
+        vnode->succ = node;
+    }
+    pthread_rwlock_unlock(&ring_lock);
+
+    if (adopted) {
+        log_info("New successor of 0x%04x: 0x%04x at %s:%s\n", id, node.id,
+                 node.ip, node.port);
+        // It took over the start of the previous successor's range, which
+        // drops a cached route to that
+        if (!is_local(dht, &node.addr)) {
+            route_cache_insert(id, node.id, node.ip, ntohs(node.addr.sin_port));
+        }
+        // Let it know about its new predecessor right away
+        send_about_self(udp_socket, dht, MESSAGE_TYPE_STABILIZE, node.id, id,
+                        &node.addr);
+    }
+}
+
+void dht_stats(const struct dht_state *dht, struct dht_stats *stats) {
+    *stats = (struct dht_stats){.ids = dht->vnode_count};
+    pthread_rwlock_rdlock(&ring_lock);
+    for (size_t i = 0; i < dht->vnode_count; i++) {
+        const struct dht_vnode *vnode = &dht->vnodes[i];
+        if (!vnode->joined) continue;
+        stats->ids_joined += 1;
+        if (!vnode->has_pred) continue;
+        // With itself as the predecessor, the whole ring
+        uint16_t size = vnode->id - vnode->pred.id;
+        stats->hashes += size ? size : 1u << 16;
+    }
+    pthread_rwlock_unlock(&ring_lock);
 }
 
 struct sockaddr_in derive_sockaddr(const char *host, const char *port) {
@@ -96,30 +622,166 @@ struct sockaddr_in derive_sockaddr(const char *host, const char *port) {
     return result;
 }
 
-void init_dht_state(struct dht_state *dht, int argc, char **argv) {
-    dht->self_id = (argc > 3) ? strtoul(argv[3], NULL, 10) : 0;
+/**
+ * Seed the finger table from a list of known nodes, formatted as
+ * `id@ip:port,id@ip:port,...`. Each finger points to the first listed node
+ * at or after its start, unless this node or its successor is closer.
+ */
+static void parse_fingers(struct dht_state *dht, const char *list) {
+    char *copy = strdup(list);
+    char *saveptr = NULL;
 
-    const char *pred_id_str = getenv("PRED_ID");
-    dht->pred_id = pred_id_str ? strtoul(pred_id_str, NULL, 10) : dht->self_id;
+    for (char *node = strtok_r(copy, ",", &saveptr); node;
+         node = strtok_r(NULL, ",", &saveptr)) {
+        char *at = strchr(node, '@');
+        char *colon = at ? strrchr(at, ':') : NULL;
+        if (!colon) {
+            fprintf(stderr, "Invalid finger '%s', expected id@ip:port\n", node);
+            exit(EXIT_FAILURE);
+        }
+        *at = *colon = '\0';
+        uint16_t id = strtoul(node, NULL, 10);
+        struct sockaddr_in addr = derive_sockaddr(at + 1, colon + 1);
 
-    // dht->pred_ip = getenv("PRED_IP");
-    // dht->pred_port = getenv("PRED_PORT");
+        const struct dht_node *succ = &dht->vnodes[0].succ;
+        for (size_t i = 0; i < DHT_FINGERS; i++) {
+            struct dht_finger *finger = &dht->fingers[i];
+            uint16_t distance = id - finger->start;
+            uint16_t self_distance = dht->self_id - finger->start;
+            uint16_t succ_distance = succ->id - finger->start;
+            if (distance < self_distance &&
+                (!succ->known || distance < succ_distance) &&
+                (!finger->known ||
+                 distance < (uint16_t)(finger->id - finger->start))) {
+                set_finger(finger, id, &addr);
+            }
+        }
+    }
 
-    const char *succ_id_str = getenv("SUCC_ID");
-    dht->succ_ip = getenv("SUCC_IP");
-    dht->succ_port = getenv("SUCC_PORT");
-    dht->succ_id = succ_id_str ? strtoul(succ_id_str, NULL, 10) : dht->self_id;
+    free(copy);
+}
+
+/**
+ * Make the IDs of a node on its own each other's neighbours
+ */
+static void link_vnodes(struct dht_state *dht) {
+    for (size_t i = 0; i < dht->vnode_count; i++) {
+        struct dht_vnode *vnode = &dht->vnodes[i];
+        // The closest other ID on either side
+        const struct dht_vnode *pred = NULL, *succ = NULL;
+        for (size_t j = 0; j < dht->vnode_count; j++) {
+            const struct dht_vnode *other = &dht->vnodes[j];
+            if (other == vnode) continue;
+            if (!pred || (uint16_t)(vnode->id - other->id) <
+                             (uint16_t)(vnode->id - pred->id)) {
+                pred = other;
+            }
+            if (!succ || (uint16_t)(other->id - vnode->id) <
+                             (uint16_t)(succ->id - vnode->id)) {
+                succ = other;
+            }
+        }
+        self_node(dht, pred->id, &vnode->pred);
+        self_node(dht, succ->id, &vnode->succ);
+    }
+}
 
+void init_dht_state(struct dht_state *dht, int argc, char **argv,
+                    unsigned vnodes) {
+    dht->self_id = (argc > 3) ? strtoul(argv[3], NULL, 10) : 0;
     dht->self_ip = argv[1];
     dht->self_port = atoi(argv[2]);
+    dht->self_addr = (struct sockaddr_in){
+        .sin_family = AF_INET,
+        .sin_port = htons(dht->self_port),
+        .sin_addr.s_addr = inet_addr(dht->self_ip),
+    };
+
+    // Derived IDs that collide with an earlier one are skipped
+    for (uint32_t index = 0; dht->vnode_count < vnodes; index++) {
+        uint16_t id = virtual_id(dht->self_id, index);
+        if (find_vnode(dht, id)) continue;
+        dht->vnodes[dht->vnode_count++] = (struct dht_vnode){
+            .id = id,
+            .pred.id = id,
+            .succ.id = id,
+        };
+    }
+    struct dht_vnode *first = &dht->vnodes[0];
+
+    const char *pred_id_str = getenv("PRED_ID");
+    const char *pred_ip = getenv("PRED_IP");
+    const char *pred_port = getenv("PRED_PORT");
+    if (pred_id_str) first->pred.id = strtoul(pred_id_str, NULL, 10);
+    if (pred_id_str && pred_ip && pred_port) {
+        struct sockaddr_in addr = derive_sockaddr(pred_ip, pred_port);
+        set_node(&first->pred, first->pred.id, &addr);
+    }
+
+    const char *succ_id_str = getenv("SUCC_ID");
+    const char *succ_ip = getenv("SUCC_IP");
+    const char *succ_port = getenv("SUCC_PORT");
+    if (succ_id_str) first->succ.id = strtoul(succ_id_str, NULL, 10);
+    if (succ_ip && succ_port) {
+        struct sockaddr_in addr = derive_sockaddr(succ_ip, succ_port);
+        set_node(&first->succ, first->succ.id, &addr);
+    }
+
+    if (argc > 5) {
+        dht->anchor = derive_sockaddr(argv[4], argv[5]);
+    } else {
+        first->joined = first->has_pred = true;
+        if (pred_id_str || succ_id_str) {
+            // Placed in a ring: the others join it through the first ID
+            dht->anchor = dht->self_addr;
+        } else if (dht->vnode_count > 1) {
+            for (size_t i = 0; i < dht->vnode_count; i++) {
+                dht->vnodes[i].joined = dht->vnodes[i].has_pred = true;
+            }
+            link_vnodes(dht);
+        }
+    }
+
+    // IDs joining on their own have to be stabilized into place
+    dht->stabilize = getenv("NO_STABILIZE") == NULL || dht->vnode_count > 1;
+
+    for (size_t i = 0; i < DHT_FINGERS; i++) {
+        dht->fingers[i] = (struct dht_finger){
+            .start = dht->self_id + (1u << i),
+        };
+    }
+    const char *fingers = getenv("FINGERS");
+    if (fingers) {
+        parse_fingers(dht, fingers);
+    }
 }
 
 void print_dht_info(const struct dht_state *dht) {
-    fprintf(stderr, "Server starting with:\n");
-    fprintf(stderr, "Self ID: 0x%04x, IP: %s, Port: %d\n",
-            dht->self_id, dht->self_ip, dht->self_port);
-    fprintf(stderr, "Pred ID: 0x%04x\n", dht->pred_id);
-    fprintf(stderr, "Succ ID: 0x%04x, IP: %s, Port: %s\n",
-            dht->succ_id, dht->succ_ip, dht->succ_port);
+    log_info("Server starting with:\n");
+    log_info("Self ID: 0x%04x, IP: %s, Port: %d\n", dht->self_id,
+             dht->self_ip, dht->self_port);
+    bool joining = false;
+    for (size_t i = 0; i < dht->vnode_count; i++) {
+        const struct dht_vnode *vnode = &dht->vnodes[i];
+        joining |= !vnode->joined;
+        if (i > 0) log_info("Virtual ID: 0x%04x\n", vnode->id);
+        if (!vnode->joined) continue;
+        log_info("Pred ID: 0x%04x\n", vnode->pred.id);
+        log_info("Succ ID: 0x%04x, IP: %s, Port: %s\n", vnode->succ.id,
+                 vnode->succ.known ? vnode->succ.ip : "(null)",
+                 vnode->succ.known ? vnode->succ.port : "(null)");
+    }
+    if (joining) {
+        char anchor_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &dht->anchor.sin_addr, anchor_ip, sizeof(anchor_ip));
+        log_info("Joining through %s:%d\n", anchor_ip,
+                 ntohs(dht->anchor.sin_port));
+    }
+    for (size_t i = 0; i < DHT_FINGERS; i++) {
+        const struct dht_finger *finger = &dht->fingers[i];
+        if (finger->known) {
+            log_info("Finger %zu: 0x%04x -> 0x%04x\n", i, finger->start,
+                     finger->id);
+        }
+    }
 }
-
@@ -1,18 +1,154 @@
 #include <arpa/inet.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "dht.h"
 #include "dht_handler.h"
+#include "dht_io.h"
+#include "event_loop.h"
+#include "log.h"
+#include "metrics.h"
+#include "options.h"
+#include "route_cache.h"
+#include "util.h"
 
-static struct {
-    bool received;
-    uint16_t responsible_id;
-    const char *responsible_ip;
-    uint16_t responsible_port;
-} last_dht_reply = {0};
+#define DHT_LOOKUP_INITIAL_RTO_MS 10
+
+extern struct dht_state dht;
+extern struct options options;
+
+/**
+ * An in-flight lookup, indexed by the hash it resolves
+ *
+ * `waiters`: bit set of the ids of the event loops with parked requests
+ * `position`: index of the hash in `pending_hashes`
+ */
+struct dht_pending {
+    uint64_t waiters;
+    uint64_t deadline;
+    uint64_t retransmit_at;
+    uint32_t rto;
+    uint16_t position;
+    bool active;
+    uint32_t generation;
+};
+
+/**
+ * Retransmission and expiry of a lookup, on the wheel of the loop that sent
+ * it. Other threads resolve lookups, so the timer is never cancelled; it
+ * finds out when it runs that the lookup it is for, identified by
+ * `generation`, is gone.
+ */
+struct dht_lookup_timer {
+    struct timer timer;
+    struct event_loop *loop;
+    uint16_t hash;
+    uint32_t generation;
+};
+
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dht_pending pending[1 << 16];
+static uint16_t pending_hashes[1 << 16]; // dense list of active hashes
+static size_t pending_count = 0;
+
+static void pending_remove(uint16_t hash) {
+    struct dht_pending *entry = &pending[hash];
+    uint16_t last = pending_hashes[--pending_count];
+    pending_hashes[entry->position] = last;
+    pending[last].position = entry->position;
+    entry->active = false;
+}
+
+static void pending_notify(uint64_t waiters,
+                           const struct dht_resolution *resolution) {
+    for (unsigned id = 0; waiters; id++, waiters >>= 1) {
+        if (waiters & 1) event_loop_post(id, resolution);
+    }
+}
+
+// A node answers a batch with a reply about each of its IDs and their
+// successors it is responsible for at most, in one datagram
+_Static_assert(2 * DHT_MAX_VNODES <= DHT_REPLY_BATCH_MAX,
+               "replies to a lookup batch do not fit into a datagram");
+
+/**
+ * Answer the hashes of `batch` that an ID of this node or a successor is
+ * responsible for with one combined reply, and forward the lookups of the
+ * others, which `dht_send()` batches again by next hop
+ */
+static void handle_lookup_batch(int udp_socket,
+                                const struct dht_lookup_batch *batch,
+                                size_t count, const char *requester_ip,
+                                uint16_t requester_port,
+                                struct dht_state *dht) {
+    struct dht_node responsible[DHT_REPLY_BATCH_MAX];
+    uint16_t pred_ids[DHT_REPLY_BATCH_MAX];
+    size_t replies = 0, answered = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        uint16_t hash = ntohs(batch->hashes[i]);
+        struct dht_node node;
+        uint16_t pred_id;
+        enum dht_route route = dht_route(dht, hash, &node, &pred_id);
+
+        if (route == DHT_ROUTE_SELF || route == DHT_ROUTE_SUCCESSOR) {
+            // One reply covers the whole range of the responsible node
+            size_t j = 0;
+            while (j < replies && responsible[j].id != node.id) j++;
+            if (j == replies) {
+                responsible[replies] = node;
+                pred_ids[replies++] = pred_id;
+            }
+            answered += 1;
+            metrics_count(METRICS_DHT_LOOKUPS_ANSWERED);
+        } else {
+            struct dht_message lookup = batch->header;
+            lookup.type = MESSAGE_TYPE_LOOKUP;
+            lookup.hash = batch->hashes[i];
+            struct sockaddr_in next_hop;
+            if (!dht_next_hop(dht, hash, &next_hop)) {
+                metrics_count(METRICS_DHT_LOOKUPS_DROPPED);
+                continue;
+            }
+            dht_send(udp_socket, &lookup, &next_hop);
+            metrics_count(METRICS_DHT_LOOKUPS_FORWARDED);
+        }
+    }
+
+    log_debug("Answering %zu of %zu batched lookups from %s:%d with %zu "
+              "replies\n",
+              answered, count, requester_ip, requester_port, replies);
+    if (replies > 0) {
+        send_dht_reply(udp_socket, responsible, requester_ip, requester_port,
+                       pred_ids, replies);
+    }
+}
+
+void handle_dht_message(int udp_socket, const struct dht_message *msg,
+                        size_t length, const struct sockaddr_in *sender,
+                        struct dht_state *dht) {
+    if (msg->type == MESSAGE_TYPE_REPLY && length > sizeof(*msg) &&
+        length % sizeof(*msg) == 0) {
+        // A combined reply
+        for (size_t i = 0; i < length / sizeof(*msg); i++) {
+            if (msg[i].type == MESSAGE_TYPE_REPLY) {
+                handle_dht_message(udp_socket, &msg[i], sizeof(*msg), sender,
+                                   dht);
+            }
+        }
+        return;
+    }
+    if (msg->type == MESSAGE_TYPE_LOOKUP_BATCH) {
+        size_t count = ntohs(msg->hash);
+        if (count == 0 || count > DHT_LOOKUP_BATCH_MAX ||
+            length != sizeof(*msg) + count * sizeof(uint16_t)) {
+            return;
+        }
+    } else if (length != sizeof(*msg)) {
+        return;
+    }
 
-void handle_dht_message(int udp_socket, const struct dht_message *msg, 
-                       const struct sockaddr_in *sender, struct dht_state *dht) {
     uint16_t hash = ntohs(msg->hash);
     uint16_t node_id = ntohs(msg->node_id);
     uint16_t sender_port = ntohs(sender->sin_port);
@@ -25,54 +161,184 @@ void handle_dht_message(int udp_socket, const struct dht_message *msg,
     uint16_t requester_port = ntohs(msg->node_port);
 
     if (msg->type == MESSAGE_TYPE_LOOKUP) {
-        fprintf(stderr, "(%s:%d) Received lookup for hash 0x%04x from %s:%d\n", 
-                dht->self_ip, dht->self_port, hash, sender_ip, sender_port);
-        
-        // Check if our successor is responsible for the hash
-        if (is_responsible(hash, dht->succ_id, dht->self_id)) {
-            fprintf(stderr, "(%s:%d) Our successor is responsible for hash 0x%04x\n", 
-                    dht->self_ip, dht->self_port, hash);
-            send_dht_reply(udp_socket, dht, dht->succ_id, requester_ip, requester_port, dht->self_id);
-        }
-        // Check if we are responsible for the hash
-        else if (is_responsible(hash, dht->self_id, dht->pred_id)) {
-            fprintf(stderr, "(%s:%d) We are responsible for hash 0x%04x\n", 
-                    dht->self_ip, dht->self_port, hash);
-            send_dht_reply(udp_socket, dht, dht->self_id, requester_ip, requester_port, dht->pred_id);
+        log_debug("Received lookup for hash 0x%04x from %s:%d\n", hash,
+                  sender_ip, sender_port);
+
+        struct dht_node node;
+        uint16_t pred_id;
+        enum dht_route route = dht_route(dht, hash, &node, &pred_id);
+
+        // Check if we or our successor are responsible for the hash
+        if (route == DHT_ROUTE_SELF || route == DHT_ROUTE_SUCCESSOR) {
+            log_debug("%s responsible for hash 0x%04x\n",
+                      route == DHT_ROUTE_SELF ? "We are" : "Our successor is",
+                      hash);
+            send_dht_reply(udp_socket, &node, requester_ip, requester_port,
+                           &pred_id, 1);
+            metrics_count(METRICS_DHT_LOOKUPS_ANSWERED);
         }
         // Neither we nor our successor is responsible
         else {
-            fprintf(stderr, "(%s:%d) Forwarding lookup for hash 0x%04x to successor: %s:%s\n", 
-                    dht->self_ip, dht->self_port, hash, dht->succ_ip, dht->succ_port);
-            struct sockaddr_in succ_addr;
-            succ_addr.sin_family = AF_INET;
-            succ_addr.sin_port = htons(atoi(dht->succ_port));
-            succ_addr.sin_addr.s_addr = inet_addr(dht->succ_ip);
-            
-            if (sendto(udp_socket, msg, sizeof(*msg), 0, 
-                      (struct sockaddr *)&succ_addr, sizeof(succ_addr)) == -1) {
-                perror("sendto");
+            struct sockaddr_in next_hop;
+            if (!dht_next_hop(dht, hash, &next_hop)) {
+                log_debug("No node to forward the lookup for hash 0x%04x to\n",
+                          hash);
+                metrics_count(METRICS_DHT_LOOKUPS_DROPPED);
+                return;
             }
+            char next_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &next_hop.sin_addr, next_ip, sizeof(next_ip));
+            log_debug("Forwarding lookup for hash 0x%04x to %s:%d\n", hash,
+                      next_ip, ntohs(next_hop.sin_port));
+
+            dht_send(udp_socket, msg, &next_hop);
+            metrics_count(METRICS_DHT_LOOKUPS_FORWARDED);
         }
     } else if (msg->type == MESSAGE_TYPE_REPLY) {
-        fprintf(stderr, "(%s:%d) Received DHT reply from %s:%d: responsible=%04x, predecessor=%04x\n",
-                dht->self_ip, dht->self_port, sender_ip, sender_port, node_id, hash);
-        last_dht_reply.received = true;
-        last_dht_reply.responsible_id = node_id;
-        last_dht_reply.responsible_ip = inet_ntoa(*(struct in_addr *)&msg->node_ip);
-        last_dht_reply.responsible_port = ntohs(msg->node_port);
+        log_debug("Received DHT reply from %s:%d: responsible=%04x, "
+                  "predecessor=%04x\n",
+                  sender_ip, sender_port, node_id, hash);
+        metrics_count(METRICS_DHT_REPLIES_RECEIVED);
+        // Lookups the reply no longer covers are retransmitted
+        hash = dht_clip_range(dht, hash, node_id);
+        if (hash == node_id) return;
+        route_cache_insert(hash, node_id, requester_ip, requester_port);
+
+        struct sockaddr_in node_addr = {
+            .sin_family = AF_INET,
+            .sin_port = msg->node_port,
+            .sin_addr.s_addr = msg->node_ip,
+        };
+        dht_learn_node(dht, hash, node_id, &node_addr);
+
+        // The reply covers the whole range (predecessor, responsible], so it
+        // resolves every pending lookup within it.
+        struct dht_resolution resolution = {
+            .found = true,
+            .port = requester_port,
+        };
+        memcpy(resolution.ip, requester_ip, INET_ADDRSTRLEN);
+
+        pthread_mutex_lock(&pending_lock);
+        for (size_t i = pending_count; i-- > 0;) {
+            uint16_t pending_hash = pending_hashes[i];
+            if (is_responsible(pending_hash, node_id, hash)) {
+                resolution.hash = pending_hash;
+                pending_notify(pending[pending_hash].waiters, &resolution);
+                pending_remove(pending_hash);
+            }
+        }
+        pthread_mutex_unlock(&pending_lock);
+    } else if (msg->type == MESSAGE_TYPE_STABILIZE) {
+        log_debug("Received stabilize from 0x%04x at %s:%d\n", node_id,
+                  requester_ip, requester_port);
+        dht_handle_stabilize(udp_socket, dht, msg);
+    } else if (msg->type == MESSAGE_TYPE_NOTIFY) {
+        log_debug("Received notify of 0x%04x at %s:%d\n", node_id,
+                  requester_ip, requester_port);
+        dht_handle_notify(udp_socket, dht, msg);
+    } else if (msg->type == MESSAGE_TYPE_JOIN) {
+        log_debug("Received join from 0x%04x at %s:%d\n", node_id,
+                  requester_ip, requester_port);
+        dht_handle_join(udp_socket, dht, msg);
+    } else if (msg->type == MESSAGE_TYPE_LOOKUP_BATCH) {
+        log_debug("Received %u batched lookups from %s:%d\n", hash, sender_ip,
+                  sender_port);
+        handle_lookup_batch(udp_socket, (const struct dht_lookup_batch *)msg,
+                            hash, requester_ip, requester_port, dht);
     }
 }
 
-bool get_last_dht_reply(uint16_t *id, const char **ip, uint16_t *port) {
-    if (!last_dht_reply.received) {
-        return false;
+static void lookup_expired(struct timer *timer) {
+    struct dht_lookup_timer *lookup =
+        container_of(timer, struct dht_lookup_timer, timer);
+    uint64_t now = lookup->loop->timers.now;
+    struct dht_pending *entry = &pending[lookup->hash];
+
+    pthread_mutex_lock(&pending_lock);
+    if (!entry->active || entry->generation != lookup->generation) {
+        // Resolved meanwhile, or started over by another loop
+        pthread_mutex_unlock(&pending_lock);
+        free(lookup);
+        return;
     }
-    
-    *id = last_dht_reply.responsible_id;
-    *ip = last_dht_reply.responsible_ip;
-    *port = last_dht_reply.responsible_port;
-    
-    last_dht_reply.received = false;  // Clear the reply
-    return true;
-} 
+    if (entry->deadline <= now) {
+        struct dht_resolution resolution = {.hash = lookup->hash, .found = false};
+        pending_notify(entry->waiters, &resolution);
+        pending_remove(lookup->hash);
+        pthread_mutex_unlock(&pending_lock);
+        metrics_count(METRICS_DHT_LOOKUPS_EXPIRED);
+        free(lookup);
+        return;
+    }
+    if (entry->retransmit_at <= now) {
+        send_dht_lookup(lookup->loop->udp_socket, &dht, lookup->hash);
+        metrics_count(METRICS_DHT_LOOKUPS_RETRANSMITTED);
+        entry->rto *= 2; // exponential backoff
+        entry->retransmit_at = now + entry->rto;
+    }
+    uint64_t next = entry->retransmit_at < entry->deadline ? entry->retransmit_at
+                                                           : entry->deadline;
+    pthread_mutex_unlock(&pending_lock);
+    timer_arm(&lookup->loop->timers, timer, next);
+}
+
+void dht_lookup_start(struct event_loop *loop, uint16_t hash) {
+    uint64_t now = monotonic_ms();
+    struct dht_pending *entry = &pending[hash];
+    bool send = false;
+
+    // Allocated up front, not to fail with the lookup registered already
+    struct dht_lookup_timer *lookup = malloc(sizeof(*lookup));
+    if (!lookup) {
+        perror("malloc");
+        struct dht_resolution resolution = {.hash = hash, .found = false};
+        event_loop_post(loop->id, &resolution);
+        return;
+    }
+
+    pthread_mutex_lock(&pending_lock);
+    if (!entry->active) {
+        entry->active = true;
+        entry->position = pending_count;
+        pending_hashes[pending_count++] = hash;
+        entry->waiters = 0;
+        send = true;
+    } else if (entry->deadline <= now) {
+        send = true; // expired, its timer has not run yet: start over
+    }
+    uint64_t next = 0;
+    if (send) {
+        entry->deadline = now + options.lookup_timeout_ms;
+        entry->rto = DHT_LOOKUP_INITIAL_RTO_MS;
+        entry->retransmit_at = now + entry->rto;
+        entry->generation += 1;
+        *lookup = (struct dht_lookup_timer){
+            .loop = loop,
+            .hash = hash,
+            .generation = entry->generation,
+        };
+        next = entry->retransmit_at < entry->deadline ? entry->retransmit_at
+                                                      : entry->deadline;
+    }
+    entry->waiters |= UINT64_C(1) << loop->id;
+    pthread_mutex_unlock(&pending_lock);
+
+    if (!send) {
+        free(lookup);
+        return;
+    }
+    timer_init(&lookup->timer, lookup_expired);
+    timer_arm(&loop->timers, &lookup->timer, next);
+    send_dht_lookup(loop->udp_socket, &dht, hash);
+    metrics_count(METRICS_DHT_LOOKUPS_STARTED);
+}
+
+void dht_maintenance(struct event_loop *loop) {
+    // Until all IDs are admitted, whether or not stabilization is disabled
+    dht_join(loop->udp_socket, &dht);
+    if (dht.stabilize) {
+        dht_stabilize(loop->udp_socket, &dht);
+        dht_fix_fingers(loop->udp_socket, &dht);
+    }
+}
@@ -0,0 +1,239 @@
+/**
+ * Batched I/O on the DHT socket: incoming messages are drained with
+ * `recvmmsg()`, or arrive as completions of a multishot receive with
+ * io_uring; outgoing ones are queued and sent with one `sendmmsg()` per event
+ * loop iteration. With --lookup-batch, lookups queued for the same node
+ * meanwhile leave as one LOOKUP_BATCH datagram. Nodes that predate it drop
+ * those, so batching is only for rings running this version throughout.
+ */
+
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+
+#include "dht_io.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "dht_handler.h"
+#include "metrics.h"
+#include "options.h"
+
+extern struct options options;
+
+// Room for any datagram, a full LOOKUP_BATCH being the largest
+union dht_datagram {
+    struct dht_message message;
+    struct dht_lookup_batch batch;
+    unsigned char bytes[DHT_DATAGRAM_MAX];
+};
+
+// Every event loop runs on its own thread, so each one has its own queue
+static __thread struct {
+    int udp_socket;
+    unsigned count;
+    union dht_datagram datagrams[DHT_IO_BATCH];
+    size_t lengths[DHT_IO_BATCH];
+    struct sockaddr_in addrs[DHT_IO_BATCH];
+} outbox = {.udp_socket = -1};
+
+// Receive buffers of the epoll loops, too large for their stacks
+static __thread union dht_datagram inbox[DHT_IO_BATCH];
+
+static atomic_uint_fast64_t messages_received = 0;
+static atomic_uint_fast64_t messages_sent = 0;
+static atomic_uint_fast64_t receive_calls = 0;
+static atomic_uint_fast64_t send_calls = 0;
+static atomic_uint_fast64_t lookup_batches_sent = 0;
+static atomic_uint_fast64_t lookups_batched = 0;
+
+static bool same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/**
+ * Add the hash of `lookup` to a lookup queued for the same node and
+ * requester, turning it into a batch. Returns false if there is none with
+ * room left.
+ */
+static bool batch_lookup(const struct dht_message *lookup,
+                         const struct sockaddr_in *addr) {
+    for (unsigned i = 0; i < outbox.count; i++) {
+        union dht_datagram *datagram = &outbox.datagrams[i];
+        struct dht_message *header = &datagram->message;
+        if (!same_addr(&outbox.addrs[i], addr) ||
+            header->node_id != lookup->node_id ||
+            header->node_ip != lookup->node_ip ||
+            header->node_port != lookup->node_port) {
+            continue;
+        }
+
+        size_t count;
+        if (header->type == MESSAGE_TYPE_LOOKUP) {
+            datagram->batch.hashes[0] = header->hash;
+            header->type = MESSAGE_TYPE_LOOKUP_BATCH;
+            count = 1;
+        } else if (header->type == MESSAGE_TYPE_LOOKUP_BATCH) {
+            count = ntohs(header->hash);
+            if (count == DHT_LOOKUP_BATCH) continue;
+        } else {
+            continue;
+        }
+        datagram->batch.hashes[count++] = lookup->hash;
+        header->hash = htons(count);
+        outbox.lengths[i] = sizeof(*header) + count * sizeof(uint16_t);
+        return true;
+    }
+    return false;
+}
+
+void dht_send(int udp_socket, const struct dht_message *msg,
+              const struct sockaddr_in *addr) {
+    if (DHT_LOOKUP_BATCH > 1 && options.lookup_batch &&
+        msg->type == MESSAGE_TYPE_LOOKUP && outbox.udp_socket == udp_socket &&
+        batch_lookup(msg, addr)) {
+        return;
+    }
+    dht_send_datagram(udp_socket, msg, sizeof(*msg), addr);
+}
+
+void dht_send_datagram(int udp_socket, const void *data, size_t length,
+                       const struct sockaddr_in *addr) {
+    if (outbox.count == DHT_IO_BATCH ||
+        (outbox.count > 0 && outbox.udp_socket != udp_socket)) {
+        dht_flush();
+    }
+
+    outbox.udp_socket = udp_socket;
+    memcpy(&outbox.datagrams[outbox.count], data, length);
+    outbox.lengths[outbox.count] = length;
+    outbox.addrs[outbox.count] = *addr;
+    outbox.count += 1;
+}
+
+void dht_flush(void) {
+    struct mmsghdr headers[DHT_IO_BATCH];
+    struct iovec iovecs[DHT_IO_BATCH];
+    uint64_t batches = 0, batched = 0;
+
+    for (unsigned i = 0; i < outbox.count; i++) {
+        const struct dht_message *header = &outbox.datagrams[i].message;
+        if (header->type == MESSAGE_TYPE_LOOKUP_BATCH) {
+            batches += 1;
+            batched += ntohs(header->hash);
+        }
+        iovecs[i] = (struct iovec){
+            .iov_base = &outbox.datagrams[i],
+            .iov_len = outbox.lengths[i],
+        };
+        headers[i] = (struct mmsghdr){
+            .msg_hdr = {
+                .msg_name = &outbox.addrs[i],
+                .msg_namelen = sizeof(outbox.addrs[i]),
+                .msg_iov = &iovecs[i],
+                .msg_iovlen = 1,
+            },
+        };
+    }
+
+    unsigned sent = 0;
+    while (sent < outbox.count) {
+        int result = sendmmsg(outbox.udp_socket, headers + sent,
+                              outbox.count - sent, 0);
+        atomic_fetch_add_explicit(&send_calls, 1, memory_order_relaxed);
+        metrics_count(METRICS_IO_SYSCALLS);
+        if (result == -1) {
+            if (errno == EINTR) continue;
+            // Like any datagram, the rest is lost; lookups are retransmitted
+            perror("sendmmsg");
+            break;
+        }
+        sent += result;
+    }
+    atomic_fetch_add_explicit(&messages_sent, sent, memory_order_relaxed);
+    if (batches) {
+        atomic_fetch_add_explicit(&lookup_batches_sent, batches,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&lookups_batched, batched,
+                                  memory_order_relaxed);
+    }
+
+    outbox.count = 0;
+}
+
+void dht_receive(int udp_socket, struct dht_state *dht) {
+    struct sockaddr_in senders[DHT_IO_BATCH];
+    struct mmsghdr headers[DHT_IO_BATCH];
+    struct iovec iovecs[DHT_IO_BATCH];
+
+    for (int round = 0; round < DHT_IO_RECEIVE_ROUNDS; round++) {
+        for (unsigned i = 0; i < DHT_IO_BATCH; i++) {
+            iovecs[i] = (struct iovec){
+                .iov_base = &inbox[i],
+                .iov_len = sizeof(inbox[i]),
+            };
+            headers[i] = (struct mmsghdr){
+                .msg_hdr = {
+                    .msg_name = &senders[i],
+                    .msg_namelen = sizeof(senders[i]),
+                    .msg_iov = &iovecs[i],
+                    .msg_iovlen = 1,
+                },
+            };
+        }
+
+        int received =
+            recvmmsg(udp_socket, headers, DHT_IO_BATCH, MSG_DONTWAIT, NULL);
+        atomic_fetch_add_explicit(&receive_calls, 1, memory_order_relaxed);
+        metrics_count(METRICS_IO_SYSCALLS);
+        if (received <= 0) {
+            if (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR) {
+                perror("recvmmsg");
+            }
+            return;
+        }
+        atomic_fetch_add_explicit(&messages_received, received,
+                                  memory_order_relaxed);
+
+        for (int i = 0; i < received; i++) {
+            if (headers[i].msg_len >= sizeof(struct dht_message) &&
+                !(headers[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+                handle_dht_message(udp_socket, &inbox[i].message,
+                                   headers[i].msg_len, &senders[i], dht);
+            }
+        }
+        if (received < DHT_IO_BATCH) return; // drained
+    }
+}
+
+void dht_received(int udp_socket, const void *data, size_t length,
+                  const struct sockaddr_in *sender, struct dht_state *dht) {
+    atomic_fetch_add_explicit(&messages_received, 1, memory_order_relaxed);
+    if (length < sizeof(struct dht_message) || length > DHT_DATAGRAM_MAX) {
+        return;
+    }
+
+    // Copied, the buffer need not be aligned
+    union dht_datagram datagram;
+    memcpy(&datagram, data, length);
+    handle_dht_message(udp_socket, &datagram.message, length, sender, dht);
+}
+
+void dht_io_stats(struct dht_io_stats *stats) {
+    stats->messages_received =
+        atomic_load_explicit(&messages_received, memory_order_relaxed);
+    stats->messages_sent =
+        atomic_load_explicit(&messages_sent, memory_order_relaxed);
+    stats->receive_calls =
+        atomic_load_explicit(&receive_calls, memory_order_relaxed);
+    stats->send_calls = atomic_load_explicit(&send_calls, memory_order_relaxed);
+    stats->lookup_batches_sent =
+        atomic_load_explicit(&lookup_batches_sent, memory_order_relaxed);
+    stats->lookups_batched =
+        atomic_load_explicit(&lookups_batched, memory_order_relaxed);
+}
@@ -0,0 +1,575 @@
+#include "event_loop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "dht.h"
+#include "dht_handler.h"
+#include "dht_io.h"
+#include "log.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "socket_handler.h"
+#include "util.h"
+
+#ifdef WITH_IO_URING
+#include "http.h"
+#include "uring.h"
+#endif
+
+extern struct dht_state dht;
+
+static struct event_loop *registry[EVENT_LOOP_MAX];
+static unsigned registered = 0;
+
+static void arm_accept(struct event_loop *loop);
+
+static void accept_resumed(struct timer *timer) {
+    struct event_loop *loop =
+        container_of(timer, struct event_loop, accept_pause);
+    if (loop->uring) {
+        arm_accept(loop);
+    } else if (event_loop_watch(loop, loop->server_socket, EPOLLIN,
+                                &loop->server_socket) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void maintenance_expired(struct timer *timer) {
+    struct event_loop *loop = container_of(timer, struct event_loop, maintenance);
+    dht_maintenance(loop);
+    timer_arm(&loop->timers, timer,
+              loop->timers.now + EVENT_LOOP_MAINTENANCE_INTERVAL_MS);
+}
+
+void event_loop_init(struct event_loop *loop, int server_socket,
+                     int udp_socket, enum event_loop_backend backend) {
+    if (registered == EVENT_LOOP_MAX) {
+        fprintf(stderr, "Too many event loops\n");
+        exit(EXIT_FAILURE);
+    }
+
+    *loop = (struct event_loop){
+        .server_socket = server_socket,
+        .udp_socket = udp_socket,
+        .backend = backend,
+        .id = registered,
+    };
+    pthread_mutex_init(&loop->mailbox_lock, NULL);
+    registry[registered++] = loop;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd == -1) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    // The listener, DHT socket and wakeup fd are told apart from client
+    // connections by the address of their field in `loop`.
+    if (event_loop_watch(loop, server_socket, EPOLLIN, &loop->server_socket) ==
+            -1 ||
+        event_loop_watch(loop, udp_socket, EPOLLIN, &loop->udp_socket) == -1 ||
+        event_loop_watch(loop, loop->wake_fd, EPOLLIN, &loop->wake_fd) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t now = monotonic_ms();
+    timer_wheel_init(&loop->timers, now);
+    timer_init(&loop->maintenance, maintenance_expired);
+    timer_init(&loop->accept_pause, accept_resumed);
+    if (loop->id == 0) {
+        // First expiry right away, e.g. to fill the finger table
+        timer_arm(&loop->timers, &loop->maintenance, now);
+    }
+}
+
+static int uring_watch(struct event_loop *loop, int fd, uint32_t events,
+                       void *ptr);
+static void uring_unwatch(struct event_loop *loop, void *ptr);
+
+int event_loop_watch(struct event_loop *loop, int fd, uint32_t events,
+                     void *ptr) {
+    if (loop->uring) return uring_watch(loop, fd, events, ptr);
+    struct epoll_event event = {.events = events, .data.ptr = ptr};
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void event_loop_unwatch(struct event_loop *loop, int fd, void *ptr) {
+    if (loop->uring) {
+        uring_unwatch(loop, ptr);
+    } else {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+void event_loop_accept_failed(struct event_loop *loop, int error) {
+    if (error != EMFILE && error != ENFILE && error != ENOBUFS &&
+        error != ENOMEM) {
+        fprintf(stderr, "accept: %s\n", strerror(error));
+        return;
+    }
+    if (timer_armed(&loop->accept_pause)) return;
+
+    log_warn("accept: %s, pausing for %d ms\n", strerror(error),
+             EVENT_LOOP_ACCEPT_PAUSE_MS);
+    if (!loop->uring) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->server_socket, NULL);
+    }
+    timer_arm(&loop->timers, &loop->accept_pause,
+              monotonic_ms() + EVENT_LOOP_ACCEPT_PAUSE_MS);
+}
+
+void event_loop_post(unsigned id, const struct dht_resolution *resolution) {
+    struct event_loop *loop = registry[id];
+
+    pthread_mutex_lock(&loop->mailbox_lock);
+    if (loop->mailbox_length == loop->mailbox_capacity) {
+        size_t capacity = loop->mailbox_capacity ? loop->mailbox_capacity * 2 : 16;
+        struct dht_resolution *mailbox =
+            realloc(loop->mailbox, capacity * sizeof(*mailbox));
+        if (!mailbox) {
+            // Their lookup is done, nothing else would answer the requests
+            perror("realloc");
+            loop->unposted[resolution->hash / 64] |=
+                UINT64_C(1) << (resolution->hash % 64);
+            loop->any_unposted = true;
+            pthread_mutex_unlock(&loop->mailbox_lock);
+            event_loop_wake(id);
+            return;
+        }
+        loop->mailbox = mailbox;
+        loop->mailbox_capacity = capacity;
+    }
+    loop->mailbox[loop->mailbox_length++] = *resolution;
+    pthread_mutex_unlock(&loop->mailbox_lock);
+    event_loop_wake(id);
+}
+
+void event_loop_wake(unsigned id) {
+    uint64_t one = 1;
+    metrics_count(METRICS_IO_SYSCALLS);
+    if (write(registry[id]->wake_fd, &one, sizeof(one)) == -1 &&
+        errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+static void handle_wakeup(struct event_loop *loop) {
+    uint64_t count;
+    metrics_count(METRICS_IO_SYSCALLS);
+    if (read(loop->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+
+    pthread_mutex_lock(&loop->mailbox_lock);
+    size_t length = loop->mailbox_length;
+    struct dht_resolution *resolutions = loop->mailbox;
+    loop->mailbox = NULL;
+    loop->mailbox_length = loop->mailbox_capacity = 0;
+    bool any_unposted = loop->any_unposted;
+    loop->any_unposted = false;
+    pthread_mutex_unlock(&loop->mailbox_lock);
+
+    for (size_t i = 0; i < length; i++) {
+        connection_resume_all(loop, &resolutions[i]);
+    }
+    free(resolutions);
+
+    for (size_t word = 0; any_unposted && word < (UINT16_MAX + 1) / 64;
+         word++) {
+        pthread_mutex_lock(&loop->mailbox_lock);
+        uint64_t hashes = loop->unposted[word];
+        loop->unposted[word] = 0;
+        pthread_mutex_unlock(&loop->mailbox_lock);
+        for (unsigned bit = 0; hashes; bit++, hashes >>= 1) {
+            if (!(hashes & 1)) continue;
+            struct dht_resolution failed = {.hash = word * 64 + bit};
+            connection_resume_all(loop, &failed);
+        }
+    }
+
+    if (loop->syncing) connection_release_synced(loop);
+}
+
+/**
+ * Pass a readiness event for `source`, one of the pointers registered with
+ * `event_loop_watch()`, to its handler
+ */
+static void dispatch(struct event_loop *loop, void *source) {
+    struct proxy_upstream *upstream;
+    if (source == &loop->server_socket) {
+        handle_server_socket(loop);
+    } else if (source == &loop->udp_socket) {
+        dht_receive(loop->udp_socket, &dht);
+    } else if (source == &loop->wake_fd) {
+        handle_wakeup(loop);
+    } else if ((upstream = proxy_upstream_of(source))) {
+        proxy_handle(upstream);
+    } else {
+        handle_client_socket(loop, source);
+    }
+}
+
+static void run_epoll(struct event_loop *loop) {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    while (true) {
+        // Everything the last iteration queued for the DHT and for other nodes
+        // goes out at once
+        dht_flush();
+        proxy_flush();
+
+        // Sleeps until the next timer is due, at the latest
+        int timeout = timer_wheel_timeout(&loop->timers, monotonic_ms());
+        int ready =
+            epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+        metrics_count(METRICS_IO_SYSCALLS);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < ready; i++) dispatch(loop, events[i].data.ptr);
+
+        // Only now, connections closed by their timeouts must not have
+        // events left in this batch
+        timer_wheel_advance(&loop->timers, monotonic_ms());
+    }
+}
+
+#ifdef WITH_IO_URING
+
+// Submission slots per ring, completions get four times as many
+#define URING_ENTRIES 1024
+
+// Provided buffers for the HTTP connections, and for the DHT socket, which
+// also hold the sender's address next to up to `DHT_DATAGRAM_MAX` bytes
+#define URING_STREAM_BUFFERS 256
+#define URING_STREAM_BUFFER_SIZE 4096
+#define URING_DATAGRAM_BUFFERS 256
+#define URING_DATAGRAM_BUFFER_SIZE 2048
+
+// The wakeup fd and the proxy's pooled connections are polled
+#define URING_MAX_POLLS (PROXY_MAX_UPSTREAMS + 1)
+
+/**
+ * What a completion is for, in the low bits of its user data, the rest being
+ * a pointer to the object concerned. Cancellations have no user data.
+ */
+enum uring_tag {
+    TAG_NONE,
+    TAG_ACCEPT,   // the loop
+    TAG_RECEIVE,  // a connection
+    TAG_SEND,     // a connection
+    TAG_DATAGRAM, // the loop
+    TAG_POLL,     // a `struct uring_poll`
+};
+#define TAG_MASK UINT64_C(7)
+
+struct uring_poll {
+    bool used;
+    int fd;
+    uint32_t events;
+    void *source;
+};
+
+/**
+ * `streams`, `datagrams`: buffer groups of the connections and DHT socket
+ * `datagram_header`: how much room the DHT receive reserves for addresses
+ */
+struct event_loop_uring {
+    struct uring ring;
+    struct uring_buffers streams;
+    struct uring_buffers datagrams;
+    struct msghdr datagram_header;
+    struct uring_poll polls[URING_MAX_POLLS];
+};
+
+static uint64_t tagged(void *pointer, enum uring_tag tag) {
+    return (uint64_t)(uintptr_t)pointer | tag;
+}
+
+static void arm_accept(struct event_loop *loop) {
+    uring_prep_accept_multishot(&loop->uring->ring, loop->server_socket,
+                                tagged(loop, TAG_ACCEPT));
+}
+
+static void arm_datagrams(struct event_loop *loop) {
+    struct event_loop_uring *uring = loop->uring;
+    uring_prep_recvmsg_multishot(&uring->ring, loop->udp_socket,
+                                 &uring->datagram_header, &uring->datagrams,
+                                 tagged(loop, TAG_DATAGRAM));
+}
+
+static void arm_poll(struct event_loop *loop, struct uring_poll *poll) {
+    uring_prep_poll_multishot(&loop->uring->ring, poll->fd, poll->events,
+                              tagged(poll, TAG_POLL));
+}
+
+static int uring_watch(struct event_loop *loop, int fd, uint32_t events,
+                       void *ptr) {
+    for (size_t i = 0; i < URING_MAX_POLLS; i++) {
+        struct uring_poll *poll = &loop->uring->polls[i];
+        if (poll->used) continue;
+        *poll = (struct uring_poll){
+            .used = true,
+            .fd = fd,
+            // Same bits for poll
+            .events = events & (EPOLLIN | EPOLLOUT),
+            .source = ptr,
+        };
+        arm_poll(loop, poll);
+        return 0;
+    }
+    errno = ENOSPC;
+    return -1;
+}
+
+static void uring_unwatch(struct event_loop *loop, void *ptr) {
+    for (size_t i = 0; i < URING_MAX_POLLS; i++) {
+        struct uring_poll *poll = &loop->uring->polls[i];
+        if (!poll->used || poll->source != ptr) continue;
+        uring_prep_cancel(&loop->uring->ring, tagged(poll, TAG_POLL), 0);
+        poll->used = false;
+    }
+}
+
+void event_loop_receive(struct event_loop *loop,
+                        struct connection_state *state) {
+    uring_prep_recv_multishot(&loop->uring->ring, state->sock,
+                              &loop->uring->streams,
+                              tagged(state, TAG_RECEIVE));
+}
+
+void event_loop_send(struct event_loop *loop, struct connection_state *state,
+                     const struct msghdr *message) {
+    uring_prep_sendmsg(&loop->uring->ring, state->sock, message,
+                       tagged(state, TAG_SEND));
+}
+
+void event_loop_cancel_receive(struct event_loop *loop,
+                               struct connection_state *state) {
+    uring_prep_cancel(&loop->uring->ring, tagged(state, TAG_RECEIVE), 0);
+}
+
+void event_loop_cancel_send(struct event_loop *loop,
+                            struct connection_state *state) {
+    uring_prep_cancel(&loop->uring->ring, tagged(state, TAG_SEND), 0);
+}
+
+/**
+ * Set up the ring of `loop` and start accepting and receiving with it.
+ * Returns false if the kernel does not support what it needs.
+ */
+static bool uring_setup(struct event_loop *loop) {
+    struct event_loop_uring *uring = calloc(1, sizeof(*uring));
+    if (!uring) {
+        perror("calloc");
+        return false;
+    }
+    if (uring_init(&uring->ring, URING_ENTRIES) == -1) {
+        log_warn("io_uring unavailable (%s), using epoll\n", strerror(errno));
+        free(uring);
+        return false;
+    }
+    if (uring_buffers_init(&uring->ring, &uring->streams, 0,
+                           URING_STREAM_BUFFERS,
+                           URING_STREAM_BUFFER_SIZE) == -1 ||
+        uring_buffers_init(&uring->ring, &uring->datagrams, 1,
+                           URING_DATAGRAM_BUFFERS,
+                           URING_DATAGRAM_BUFFER_SIZE) == -1) {
+        log_warn("io_uring buffer rings unavailable (%s), using epoll\n",
+                 strerror(errno));
+        uring_destroy(&uring->ring); // also drops the registered buffers
+        free(uring->streams.memory);
+        free(uring->datagrams.memory);
+        free(uring);
+        return false;
+    }
+    uring->datagram_header =
+        (struct msghdr){.msg_namelen = sizeof(struct sockaddr_in)};
+
+    loop->uring = uring;
+    arm_accept(loop);
+    arm_datagrams(loop);
+    if (event_loop_watch(loop, loop->wake_fd, EPOLLIN, &loop->wake_fd) == -1) {
+        perror("io_uring");
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+/**
+ * Pass the datagram in `buffer`, as laid out by a multishot `recvmsg`, to
+ * the DHT
+ */
+static void receive_datagram(struct event_loop *loop, const char *buffer,
+                             int length) {
+    const struct msghdr *header = &loop->uring->datagram_header;
+    const struct io_uring_recvmsg_out *out = (const void *)buffer;
+    if (length < (int)sizeof(*out) || (out->flags & MSG_TRUNC) ||
+        out->namelen > header->msg_namelen) {
+        return;
+    }
+    struct sockaddr_in sender;
+    memcpy(&sender, buffer + sizeof(*out), sizeof(sender));
+    const char *payload =
+        buffer + sizeof(*out) + header->msg_namelen + header->msg_controllen;
+    dht_received(loop->udp_socket, payload, out->payloadlen, &sender, &dht);
+}
+
+static void complete(struct event_loop *loop, const struct io_uring_cqe *cqe) {
+    struct event_loop_uring *uring = loop->uring;
+    void *pointer = (void *)(uintptr_t)(cqe->user_data & ~TAG_MASK);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    char *buffer = NULL;
+    uint16_t buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    switch (cqe->user_data & TAG_MASK) {
+        case TAG_ACCEPT:
+            if (cqe->res >= 0) {
+                connection_open(loop, cqe->res);
+            } else if (cqe->res != -ECANCELED) {
+                event_loop_accept_failed(loop, -cqe->res);
+            }
+            // Or once the pause after a failure is over
+            if (!more && !timer_armed(&loop->accept_pause)) arm_accept(loop);
+            break;
+        case TAG_RECEIVE:
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                buffer = uring_buffer(&uring->streams, buffer_id);
+            }
+            connection_received(pointer, buffer, cqe->res, more);
+            if (buffer) uring_buffer_return(&uring->streams, buffer_id);
+            break;
+        case TAG_SEND:
+            connection_sent(pointer, cqe->res);
+            break;
+        case TAG_DATAGRAM:
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                buffer = uring_buffer(&uring->datagrams, buffer_id);
+                receive_datagram(loop, buffer, cqe->res);
+                uring_buffer_return(&uring->datagrams, buffer_id);
+            }
+            if (!more) arm_datagrams(loop);
+            break;
+        case TAG_POLL: {
+            struct uring_poll *poll = pointer;
+            // Completions may still arrive after `event_loop_unwatch()`
+            if (cqe->res == -ECANCELED || !poll->used) break;
+            if (!more) arm_poll(loop, poll);
+            if (cqe->res > 0) dispatch(loop, poll->source);
+            break;
+        }
+        default:
+            break; // cancellations
+    }
+}
+
+static void run_uring(struct event_loop *loop) {
+    struct uring *ring = &loop->uring->ring;
+
+    while (true) {
+        // Everything the last iteration queued for the DHT and for other nodes
+        // goes out at once, the sends to clients with the wait below
+        dht_flush();
+        proxy_flush();
+
+        int timeout = timer_wheel_timeout(&loop->timers, monotonic_ms());
+        if (uring_wait(ring, timeout) == -1) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(ring))) {
+            // Handlers may submit, which may need the completion queue space
+            struct io_uring_cqe copy = *cqe;
+            uring_advance(ring);
+            complete(loop, &copy);
+        }
+
+        timer_wheel_advance(&loop->timers, monotonic_ms());
+    }
+}
+
+#else
+
+// Without io_uring support `loop->uring` is always NULL, nothing below is
+// reached
+static bool uring_setup(struct event_loop *loop) {
+    (void)loop;
+    log_warn("Built without io_uring support, using epoll\n");
+    return false;
+}
+
+static void run_uring(struct event_loop *loop) { (void)loop; }
+
+static int uring_watch(struct event_loop *loop, int fd, uint32_t events,
+                       void *ptr) {
+    (void)loop;
+    (void)fd;
+    (void)events;
+    (void)ptr;
+    errno = ENOSYS;
+    return -1;
+}
+
+static void uring_unwatch(struct event_loop *loop, void *ptr) {
+    (void)loop;
+    (void)ptr;
+}
+
+static void arm_accept(struct event_loop *loop) {
+    (void)loop;
+}
+
+void event_loop_receive(struct event_loop *loop,
+                        struct connection_state *state) {
+    (void)loop;
+    (void)state;
+}
+
+void event_loop_send(struct event_loop *loop, struct connection_state *state,
+                     const struct msghdr *message) {
+    (void)loop;
+    (void)state;
+    (void)message;
+}
+
+void event_loop_cancel_receive(struct event_loop *loop,
+                               struct connection_state *state) {
+    (void)loop;
+    (void)state;
+}
+
+void event_loop_cancel_send(struct event_loop *loop,
+                            struct connection_state *state) {
+    (void)loop;
+    (void)state;
+}
+
+#endif
+
+void event_loop_run(struct event_loop *loop) {
+    if (loop->backend == EVENT_LOOP_IO_URING && uring_setup(loop)) {
+        run_uring(loop);
+    } else {
+        run_epoll(loop);
+    }
+}
@@ -1,167 +1,239 @@
 /**
  * This file provides functions to parse and extract information from an HTTP
  * request, such as the request line, headers, and payload.
+ *
+ * The parser is incremental: it scans each received byte once, looking for
+ * line ends and header colons 16 or 32 bytes at a time with SSE2 or AVX2.
  */
 
 #include "http.h"
 
-#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_WIDTH 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_WIDTH 16
+#else
+#define SCAN_WIDTH 1
+#endif
 
 /**
- * Non null-terminated string
+ * Bit mask of the positions of '\n' and ':' among the `SCAN_WIDTH` bytes at
+ * `p`, least significant bit first
  */
-struct non_string {
-    char *start;
-    size_t n;
-};
+static inline uint32_t scan_block(const char *p) {
+#if defined(__AVX2__)
+    __m256i block = _mm256_loadu_si256((const __m256i *)p);
+    __m256i matches =
+        _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(block, _mm256_set1_epi8(':')));
+    return (uint32_t)_mm256_movemask_epi8(matches);
+#elif defined(__SSE2__)
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    __m128i matches =
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(block, _mm_set1_epi8(':')));
+    return (uint32_t)_mm_movemask_epi8(matches);
+#else
+    return *p == '\n' || *p == ':';
+#endif
+}
+
+static bool is_space(char c) { return c == ' ' || c == '\t'; }
 
 /**
- * Parse the request line of an HTTP request
+ * Parse the request line in `buffer[start..end)`
  *
  * Returns whether a valid request line (excluding line separator) is parsed.
- * On valid request lines, `method` and `uri` are populated with the
- * corresponding values, reusing `buffer`'s memory.
+ * On valid request lines, the positions of method and uri are stored in
+ * `parser`.
  */
-static bool parse_request_line(char *buffer, size_t n,
-                               struct non_string *method,
-                               struct non_string *uri) {
-    const char *end = buffer + n;
-    char *pos = buffer;
-
-    method->start = buffer;
-    if ((pos = memchr(buffer, ' ', end - buffer)) == NULL) {
-        return false;
-    }
-    method->n = pos - buffer;
-    buffer = pos + 1;
+static bool parse_request_line(struct http_parser *parser, const char *buffer,
+                               size_t start, size_t end) {
+    const char *method_end = memchr(buffer + start, ' ', end - start);
+    if (!method_end) return false;
+    const char *uri = method_end + 1;
+    const char *uri_end = memchr(uri, ' ', buffer + end - uri);
+    if (!uri_end) return false;
+
+    parser->method = (struct http_span){start, method_end - (buffer + start)};
+    parser->uri = (struct http_span){uri - buffer, uri_end - uri};
+    return true;
+}
 
-    uri->start = buffer;
-    if ((pos = memchr(buffer, ' ', end - buffer)) == NULL) {
+/**
+ * Record the header in `buffer[start..end)`, whose name ends at
+ * `parser->colon`. Surrounding whitespace is stripped from the value.
+ */
+static bool parse_header(struct http_parser *parser, const char *buffer,
+                         size_t start, size_t end) {
+    if (!parser->colon || parser->header_count == HTTP_MAX_HEADERS) {
         return false;
     }
-    uri->n = pos - buffer;
-    buffer = pos + 1;
 
+    size_t value = parser->colon + 1;
+    while (value < end && is_space(buffer[value])) value += 1;
+    while (end > value && is_space(buffer[end - 1])) end -= 1;
+
+    size_t i = parser->header_count++;
+    parser->keys[i] = (struct http_span){start, parser->colon - start};
+    parser->values[i] = (struct http_span){value, end - value};
+
+    // Only Content-Length is needed before the request is complete
+    if (parser->keys[i].length == strlen("Content-Length") &&
+        strncasecmp(buffer + start, "Content-Length", strlen("Content-Length")) ==
+            0) {
+        parser->content_length = strtoul(buffer + value, NULL, 10);
+    }
     return true;
 }
 
 /**
- * Parse HTTP header
- *
- * Returns whether a valid header (excluding line separator) is parsed. On
- * a valid header, `key` and `value` are populated with the corresponding
- * values, reusing `buffer`'s memory.
+ * Handle the line ending with the '\n' at `lf`. Returns false on malformed
+ * lines.
  */
-static bool parse_header(char *buffer, size_t n, struct non_string *key,
-                         struct non_string *value) {
-    char *field_name_end = memchr(buffer, ':', n);
-    if (!field_name_end) {
+static bool end_line(struct http_parser *parser, const char *buffer,
+                     size_t lf) {
+    // Lines end with CRLF, a bare LF is not accepted
+    if (lf == parser->line_start || buffer[lf - 1] != '\r') return false;
+    size_t end = lf - 1;
+
+    if (parser->state == HTTP_PARSE_REQUEST_LINE) {
+        if (!parse_request_line(parser, buffer, parser->line_start, end)) {
+            return false;
+        }
+        parser->state = HTTP_PARSE_HEADERS;
+    } else if (end == parser->line_start) { // empty line ends the header
+        parser->state = HTTP_PARSE_PAYLOAD;
+        parser->head_length = lf + 1;
+    } else if (!parse_header(parser, buffer, parser->line_start, end)) {
         return false;
     }
 
-    *key = (struct non_string){.start = buffer, .n = field_name_end - buffer};
-    *value = (struct non_string){.start = field_name_end + 1,
-                                 .n = (buffer + n) - (field_name_end + 1)};
-
+    parser->line_start = lf + 1;
+    parser->colon = 0;
     return true;
 }
 
-ssize_t parse_request(char *buffer, size_t n, struct request *request) {
-    char *line_separator = "\r\n";
-
-    const char *end = buffer + n;
-    char *pos = buffer;
-    char *line_end;
-
-    // Parse the request line
-    if (!(line_end = memstr(pos, end - pos, line_separator))) {
-        return 0; // Request line not received yet
-    }
-    struct non_string method = {0};
-    struct non_string uri = {0};
-    if (!parse_request_line(pos, line_end - pos, &method, &uri)) {
-        return -1; // Error parsing request line
+/**
+ * Handle a '\n' or ':' found at `i`. Returns false on malformed lines.
+ */
+static bool scan_event(struct http_parser *parser, const char *buffer,
+                       size_t i) {
+    if (buffer[i] == '\n') return end_line(parser, buffer, i);
+    // Only the first colon of a header line separates name and value
+    if (parser->state == HTTP_PARSE_HEADERS && !parser->colon) {
+        parser->colon = i;
     }
+    return true;
+}
 
-    pos = line_end + strlen(line_separator); // Skip line separator
-
-    // Parse headers
-    struct {
-        struct non_string key;
-        struct non_string value;
-    } headers[HTTP_MAX_HEADERS] = {0};
-    size_t header_count = 0;
-
-    while ((line_end = memstr(pos, end - pos, line_separator)) != pos) {
-        if (header_count > HTTP_MAX_HEADERS) {
-            fprintf(stderr, "Exceeded max header count.\n");
-            exit(EXIT_FAILURE);
-        }
-        if (!line_end) {
-            return 0; // Header not fully received
-        }
-        if (!parse_header(pos, line_end - pos, &(headers[header_count].key),
-                          &(headers[header_count].value))) {
-            return -1; // Error parsing header
+/**
+ * Scan `buffer[parser->scanned..n)` until the header is complete
+ */
+static bool scan(struct http_parser *parser, const char *buffer, size_t n) {
+    size_t i = parser->scanned;
+
+    for (; i + SCAN_WIDTH <= n && parser->state != HTTP_PARSE_PAYLOAD;
+         i += SCAN_WIDTH) {
+        uint32_t mask = scan_block(buffer + i);
+        while (mask) {
+            size_t event = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (!scan_event(parser, buffer, event)) return false;
+            if (parser->state == HTTP_PARSE_PAYLOAD) {
+                // The payload may contain anything, it is not scanned
+                parser->scanned = parser->head_length;
+                return true;
+            }
         }
-        pos = line_end + strlen(line_separator); // Skip line separator
-        header_count += 1;
     }
 
-    pos = line_end + strlen(line_separator); // Skip empty line
-
-    // Parse payload length from headers
-    for (size_t i = 0; i < header_count; i += 1) {
-        if (strncmp(headers[i].key.start, "Content-Length", headers[i].key.n) ==
-            0) {
-            request->payload_length = strtoul(headers[i].value.start, NULL, 10);
-            break;
-        }
-    }
-    if (request->payload_length < 0) {
-        if (request->method &&
-            strncmp(request->method, "PUT", strlen("PUT")) == 0) {
-            return -1; // Content-Length non-optional on PUT-requests
+    for (; i < n && parser->state != HTTP_PARSE_PAYLOAD; i += 1) {
+        if ((buffer[i] == '\n' || buffer[i] == ':') &&
+            !scan_event(parser, buffer, i)) {
+            return false;
         }
-        request->payload_length = 0;
-    }
-    request->payload = pos;
-    if (pos + request->payload_length > end) {
-        return 0; // Payload not yet received completely, try again.
     }
 
-    // Request is valid: Bytes will be discarded after sending the reply,
-    // so we can reuse `buffer` here to avoid dynamic memory allocation.
-    // All relevant strings are followed by at least one byte, so we can
-    // overwrite these with null-characters, yielding proper strings.
+    parser->scanned = parser->state == HTTP_PARSE_PAYLOAD ? parser->head_length
+                                                          : i;
+    return true;
+}
 
-    method.start[method.n] = '\0';
-    request->method = method.start;
+static char *terminate(char *buffer, struct http_span span) {
+    // Every span is followed by at least one separator byte, which is
+    // overwritten to yield a proper string
+    buffer[span.start + span.length] = '\0';
+    return buffer + span.start;
+}
 
-    uri.start[uri.n] = '\0';
-    request->uri = uri.start;
+/**
+ * Fill `request` from the parsed header. The request's bytes will be
+ * discarded after sending the reply, so `buffer` is reused for its strings
+ * to avoid dynamic memory allocation.
+ */
+static void populate(const struct http_parser *parser, char *buffer,
+                     struct request *request) {
+    request->method = terminate(buffer, parser->method);
+    request->uri = terminate(buffer, parser->uri);
+    for (size_t i = 0; i < parser->header_count; i += 1) {
+        request->headers[i].key = terminate(buffer, parser->keys[i]);
+        request->headers[i].value = terminate(buffer, parser->values[i]);
+    }
+    request->header_count = parser->header_count;
+    request->payload_length = parser->content_length;
+}
 
-    for (size_t i = 0; i < header_count; i += 1) {
-        headers[i].key.start[headers[i].key.n] = '\0';
-        request->headers[i].key = headers[i].key.start;
+void http_parser_init(struct http_parser *parser) {
+    parser->state = HTTP_PARSE_REQUEST_LINE;
+    parser->scanned = 0;
+    parser->line_start = 0;
+    parser->colon = 0;
+    parser->header_count = 0;
+    parser->head_length = 0;
+    parser->content_length = 0;
+}
 
-        headers[i].value.start[headers[i].value.n] = '\0';
-        request->headers[i].value = headers[i].value.start;
+ssize_t parse_request(struct http_parser *parser, char *buffer, size_t n,
+                      struct request *request) {
+    if (parser->state != HTTP_PARSE_PAYLOAD && !scan(parser, buffer, n)) {
+        http_parser_init(parser);
+        return -1;
+    }
+    if (parser->state != HTTP_PARSE_PAYLOAD ||
+        n - parser->head_length < parser->content_length) {
+        return 0; // Not received completely yet, try again.
     }
 
-    return (pos + request->payload_length) - buffer; // Parsed until `pos`
+    size_t length = parser->head_length + parser->content_length;
+    populate(parser, buffer, request);
+    request->payload = buffer + parser->head_length;
+    http_parser_init(parser);
+    return length;
+}
+
+ssize_t parse_request_head(struct http_parser *parser, char *buffer,
+                           struct request *request) {
+    if (parser->state != HTTP_PARSE_PAYLOAD) return 0;
+
+    size_t length = parser->head_length;
+    populate(parser, buffer, request);
+    http_parser_init(parser);
+    return length;
 }
 
 string get_header(const struct request *request, const string name) {
-    for (size_t i = 0; i < HTTP_MAX_HEADERS; i += 1) {
-        if (request->headers[i].key &&
-            strcmp(request->headers[i].key, name) == 0) {
+    for (size_t i = 0; i < request->header_count; i += 1) {
+        if (strcasecmp(request->headers[i].key, name) == 0) {
             return request->headers[i].value;
         }
     }
     return NULL; // Header not found
 }
-
@@ -1,22 +1,28 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "http.h"
 #include "data.h"
 #include "http_response.h"
+#include "log.h"
+#include "metrics.h"
+#include "migrate.h"
 #include "dht.h"
 
 extern struct dht_state dht;
 
-void send_http_response(int conn, const char *response, size_t length) {
-    if (send(conn, response, length, 0) == -1) {
-        perror("send");
-        close(conn);
-    }
+void send_http_response(struct connection_state *conn, const char *response,
+                        size_t length) {
+    // Queued if the socket is full, the event loop sends the rest once it
+    // becomes writable
+    struct output_part part = {response, length, OUTPUT_BORROWED};
+    output_queue_send(&conn->output, conn->sock, &part, 1);
 }
 
-void send_redirect(int conn, const char *ip, const char *port, const char *uri) {
+void send_redirect(struct connection_state *conn, const char *ip,
+                   const char *port, const char *uri) {
     char buffer[HTTP_MAX_SIZE];
     int len = snprintf(buffer, sizeof(buffer),
                       "HTTP/1.1 303 See Other\r\n"
@@ -26,8 +32,8 @@ void send_redirect(int conn, const char *ip, const char *port, const char *uri)
     send_http_response(conn, buffer, len);
 }
 
-void send_service_unavailable(int conn) {
-    fprintf(stderr, "(%s:%d) Sending 503 Service Unavailable\n", dht.self_ip, dht.self_port);
+void send_service_unavailable(struct connection_state *conn) {
+    log_debug("Sending 503 Service Unavailable\n");
     const char *response =
         "HTTP/1.1 503 Service Unavailable\r\n"
         "Retry-After: 1\r\n"
@@ -35,52 +41,203 @@ void send_service_unavailable(int conn) {
     send_http_response(conn, response, strlen(response));
 }
 
-void handle_get_request(int conn, const char *uri, size_t *offset, char *reply) {
+#define OK_PREFIX "HTTP/1.1 200 OK\r\nContent-Length: "
+#define OK_HEADER_MAX (sizeof(OK_PREFIX) - 1 + 20 + 4)
+
+/**
+ * Format the header of a 200 response from its constant prefix
+ *
+ * `header` needs room for `OK_HEADER_MAX` bytes. Returns the header length.
+ */
+static size_t format_ok_header(char *header, size_t content_length) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + content_length % 10;
+        content_length /= 10;
+    } while (content_length);
+
+    char *pos = header;
+    memcpy(pos, OK_PREFIX, sizeof(OK_PREFIX) - 1);
+    pos += sizeof(OK_PREFIX) - 1;
+    while (n) *pos++ = digits[--n];
+    memcpy(pos, "\r\n\r\n", 4);
+    return pos + 4 - header;
+}
+
+int handle_get_request(struct connection_state *conn, const char *uri) {
     size_t resource_length;
-    const char *resource = get(uri, resources, MAX_RESOURCES, &resource_length);
+    const char *resource = get(&resources, (string)uri, &resource_length);
 
     if (resource) {
-        fprintf(stderr, "(%s:%d) Found resource %s with length %lu\n", dht.self_ip, dht.self_port, uri, resource_length);
-        size_t payload_offset =
-            sprintf(reply, "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n",
-                    resource_length);
-        memcpy(reply + payload_offset, resource, resource_length);
-        *offset = payload_offset + resource_length;
+        log_debug("Found resource %s with length %lu\n", uri, resource_length);
+        // The value is sent straight from the store, the queue drops our
+        // reference once it is out
+        char header[OK_HEADER_MAX];
+        struct output_part parts[] = {
+            {header, format_ok_header(header, resource_length), OUTPUT_BORROWED},
+            {resource, resource_length, OUTPUT_VALUE},
+        };
+        output_queue_send(&conn->output, conn->sock, parts, 2);
+        return 200;
     } else {
-        fprintf(stderr, "(%s:%d) Resource %s not found\n", dht.self_ip, dht.self_port, uri);
+        log_debug("Resource %s not found\n", uri);
         const char *not_found =
             "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-        strcpy(reply, not_found);
-        *offset = strlen(not_found);
+        send_http_response(conn, not_found, strlen(not_found));
+        return 404;
     }
 }
 
-void handle_put_request(int conn, const char *uri, const char *payload,
-                       size_t payload_length, size_t *offset, char *reply) {
-    fprintf(stderr, "(%s:%d) PUT request for URI: %s, payload length: %zu\n", dht.self_ip, dht.self_port, uri,
-            payload_length);
-    fprintf(stderr, "(%s:%d) Payload content: %.*s\n", dht.self_ip, dht.self_port, (int)payload_length, payload);
+int handle_put_request(struct connection_state *conn, const char *uri,
+                       const char *payload, size_t payload_length) {
+    log_debug("PUT request for URI: %s, payload length: %zu\n", uri,
+              payload_length);
+    log_debug("Payload content: %.*s\n",
+              (int)(payload_length < 64 ? payload_length : 64), payload);
 
-    bool updated =
-        set(uri, (char *)payload, payload_length, resources, MAX_RESOURCES);
+    enum store_result result;
+    if (conn->body && payload == conn->body) {
+        // A streamed payload already is a value, the store takes it over
+        result = set_value(&resources, (string)uri, conn->body, payload_length);
+        conn->body = NULL;
+    } else {
+        result = set(&resources, (string)uri, payload, payload_length);
+    }
     const char *response;
-    if (updated) {
+    int status;
+    if (result == STORE_FAILED) {
+        log_warn("Out of memory storing %s\n", uri);
+        response =
+            "HTTP/1.1 507 Insufficient Storage\r\nContent-Length: 0\r\n\r\n";
+        status = 507;
+    } else if (result == STORE_UPDATED) {
         response = "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n";
+        status = 204;
     } else {
         response = "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
+        status = 201;
     }
-    strcpy(reply, response);
-    *offset = strlen(response);
+    send_http_response(conn, response, strlen(response));
 
-    fprintf(stderr, "(%s:%d) PUT request completed. Updated: %d\n", dht.self_ip, dht.self_port, updated);
+    log_debug("PUT request completed. Status: %d\n", status);
+    return status;
 }
 
-void handle_delete_request(int conn, const char *uri, size_t *offset, char *reply) {
-    fprintf(stderr, "(%s:%d) DELETE request for URI: %s\n", dht.self_ip, dht.self_port, uri);
-    bool deleted = remove_tuple(uri, resources, MAX_RESOURCES);
+int handle_delete_request(struct connection_state *conn, const char *uri) {
+    log_debug("DELETE request for URI: %s\n", uri);
+    bool deleted = migrate_delete(&resources, (string)uri);
     const char *response = deleted ? "HTTP/1.1 204 No Content\r\n\r\n"
-                                 : "HTTP/1.1 404 Not Found\r\n\r\n";
-    strcpy(reply, response);
-    *offset = strlen(response);
-    fprintf(stderr, "(%s:%d) DELETE request completed. Deleted: %d\n", dht.self_ip, dht.self_port, deleted);
-} 
+                                 : "HTTP/1.1 404 Not Found\r\n"
+                                   "Content-Length: 0\r\n\r\n";
+    send_http_response(conn, response, strlen(response));
+    log_debug("DELETE request completed. Deleted: %d\n", deleted);
+    return deleted ? 204 : 404;
+}
+
+/**
+ * Whether the batch `request` on `conn` comes from a neighbour in the ring:
+ * from its IP, naming its port
+ */
+static bool from_neighbour(struct connection_state *conn,
+                           const struct request *request) {
+    struct sockaddr_in peer;
+    socklen_t peer_length = sizeof(peer);
+    char *end;
+    unsigned long port =
+        strtoul(get_header(request, MIGRATE_FROM_HEADER), &end, 10);
+    if (*end || port == 0 || port > UINT16_MAX ||
+        getpeername(conn->sock, (struct sockaddr *)&peer, &peer_length) == -1 ||
+        peer.sin_family != AF_INET) {
+        return false;
+    }
+    peer.sin_port = htons(port);
+    return dht_is_neighbour(&dht, &peer);
+}
+
+int handle_migration(struct connection_state *conn,
+                     const struct request *request) {
+    if (!from_neighbour(conn, request)) {
+        log_warn("Refused migrated keys from a node that is no neighbour\n");
+        const char *forbidden =
+            "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n";
+        send_http_response(conn, forbidden, strlen(forbidden));
+        return 403;
+    }
+    const char *range = get_header(request, MIGRATE_RANGE_HEADER);
+    char *end;
+    unsigned long pred_id = range ? strtoul(range, &end, 0) : 0;
+    unsigned long id = range ? strtoul(end, &end, 0) : 0;
+    long keys = !range || *end || pred_id > UINT16_MAX || id > UINT16_MAX
+                    ? MIGRATE_MALFORMED
+                    : migrate_receive(&resources, &dht, pred_id, id,
+                                      request->payload,
+                                      request->payload_length);
+    if (keys == MIGRATE_NO_MEMORY) {
+        // The sender keeps the keys and tries again
+        log_warn("Out of memory storing a batch of migrated keys\n");
+        const char *no_storage =
+            "HTTP/1.1 507 Insufficient Storage\r\nContent-Length: 0\r\n\r\n";
+        send_http_response(conn, no_storage, strlen(no_storage));
+        return 507;
+    }
+    if (keys == MIGRATE_FOREIGN) {
+        // Another node joined in between, the sender learns where the keys
+        // before the range of this node go
+        log_debug("Refused migrated keys this node is not responsible for\n");
+        struct dht_node pred;
+        char conflict[256];
+        int length = snprintf(conflict, sizeof(conflict),
+                              "HTTP/1.1 409 Conflict\r\n");
+        if (dht_predecessor(&dht, id, &pred)) {
+            length += snprintf(conflict + length, sizeof(conflict) - length,
+                               MIGRATE_RANGE_HEADER ": 0x%04x 0x%04lx\r\n",
+                               pred.id, id);
+            if (pred.known) {
+                length += snprintf(conflict + length, sizeof(conflict) - length,
+                                   MIGRATE_PREDECESSOR_HEADER ": %s:%s\r\n",
+                                   pred.ip, pred.port);
+            }
+        }
+        snprintf(conflict + length, sizeof(conflict) - length,
+                 "Content-Length: 0\r\n\r\n");
+        send_http_response(conn, conflict, strlen(conflict));
+        return 409;
+    }
+    if (keys < 0) {
+        log_warn("Received a malformed batch of migrated keys\n");
+        const char *bad_request =
+            "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        send_http_response(conn, bad_request, strlen(bad_request));
+        return 400;
+    }
+    log_debug("Stored a batch of %ld migrated keys\n", keys);
+    const char *response = "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n";
+    send_http_response(conn, response, strlen(response));
+    return 204;
+}
+
+int send_metrics(struct connection_state *conn) {
+    size_t length;
+    char *text = metrics_render(&length);
+    if (!text) {
+        const char *error =
+            "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+        send_http_response(conn, error, strlen(error));
+        return 500;
+    }
+
+    char header[128];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.1 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\n\r\n",
+                                 length);
+    struct output_part parts[] = {
+        {header, header_length, OUTPUT_BORROWED},
+        {text, length, OUTPUT_BORROWED},
+    };
+    output_queue_send(&conn->output, conn->sock, parts, 2);
+    free(text);
+    return 200;
+} 
\ No newline at end of file
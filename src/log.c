@@ -0,0 +1,180 @@
+/**
+ * Asynchronous logging: lines are formatted by the calling thread into a
+ * lock-free ring buffer, a bounded multi-producer queue with one sequence
+ * number per slot. A background thread drains it and writes the lines to
+ * stderr in batches.
+ */
+
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+enum log_level log_level = LOG_LEVEL_INFO;
+
+/**
+ * A slot of the ring buffer
+ *
+ * The slot's sequence number equals the position a producer may claim the
+ * slot for, and that position plus one once the line is complete and may be
+ * consumed. Slot `i` starts at sequence `i`; `sequence` is stored relative
+ * to that, so the zero-initialized ring is ready for use.
+ */
+struct log_slot {
+    atomic_size_t sequence;
+    uint16_t length;
+    char text[LOG_LINE_MAX];
+};
+
+static struct log_slot ring[LOG_RING_SLOTS];
+static atomic_size_t enqueue_position = 0;
+static atomic_uint_fast64_t dropped = 0;
+
+// Only one thread drains at a time, the writer thread or `log_flush()`
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t dequeue_position = 0;
+
+static char prefix[64];
+static size_t prefix_length = 0;
+
+static size_t load_sequence(struct log_slot *slot) {
+    return atomic_load_explicit(&slot->sequence, memory_order_acquire) +
+           (slot - ring);
+}
+
+static void store_sequence(struct log_slot *slot, size_t sequence) {
+    atomic_store_explicit(&slot->sequence, sequence - (slot - ring),
+                          memory_order_release);
+}
+
+void log_set_prefix(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&drain_lock);
+    int length = vsnprintf(prefix, sizeof(prefix), format, args);
+    if (length < 0) length = 0;
+    if ((size_t)length >= sizeof(prefix)) length = sizeof(prefix) - 1;
+    prefix_length = length;
+    pthread_mutex_unlock(&drain_lock);
+    va_end(args);
+}
+
+bool log_parse_level(const char *name, enum log_level *level) {
+    static const char *names[] = {"debug", "info", "warn", "error", "off"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names); i++) {
+        if (strcasecmp(name, names[i]) == 0) {
+            *level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void log_write(const char *format, ...) {
+    struct log_slot *slot;
+    size_t position = atomic_load_explicit(&enqueue_position, memory_order_relaxed);
+    while (true) {
+        slot = &ring[position & (LOG_RING_SLOTS - 1)];
+        size_t sequence = load_sequence(slot);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &enqueue_position, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // Full: drop rather than stall a request on the log
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            position =
+                atomic_load_explicit(&enqueue_position, memory_order_relaxed);
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    if (length < 0) length = 0;
+    if ((size_t)length >= sizeof(slot->text)) length = sizeof(slot->text) - 1;
+    slot->length = length;
+
+    store_sequence(slot, position + 1);
+}
+
+/**
+ * Write out all complete lines, batched into few writes. Returns the number
+ * of lines written.
+ */
+static size_t drain(void) {
+    char batch[1 << 16];
+    size_t batch_length = 0;
+    size_t lines = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    while (true) {
+        struct log_slot *slot = &ring[dequeue_position & (LOG_RING_SLOTS - 1)];
+        if (load_sequence(slot) != dequeue_position + 1) break; // empty or incomplete
+
+        if (batch_length + prefix_length + slot->length + 1 > sizeof(batch)) {
+            if (write(STDERR_FILENO, batch, batch_length) == -1) break;
+            batch_length = 0;
+        }
+        memcpy(batch + batch_length, prefix, prefix_length);
+        batch_length += prefix_length;
+        memcpy(batch + batch_length, slot->text, slot->length);
+        batch_length += slot->length;
+        if (slot->length == 0 || slot->text[slot->length - 1] != '\n') {
+            batch[batch_length++] = '\n';
+        }
+
+        store_sequence(slot, dequeue_position + LOG_RING_SLOTS);
+        dequeue_position += 1;
+        lines += 1;
+    }
+    if (batch_length > 0 && write(STDERR_FILENO, batch, batch_length) == -1) {
+        // Nowhere left to report this
+    }
+    pthread_mutex_unlock(&drain_lock);
+
+    return lines;
+}
+
+void log_flush(void) { drain(); }
+
+static void *writer(void *arg) {
+    (void)arg;
+    const struct timespec interval = {
+        .tv_nsec = LOG_DRAIN_INTERVAL_MS * 1000000,
+    };
+    while (true) {
+        if (drain() == 0) nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+void log_init(enum log_level level) {
+    log_level = level;
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, writer, NULL);
+    if (error) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(error));
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    atexit(log_flush);
+}
+
+uint64_t log_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
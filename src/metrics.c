@@ -0,0 +1,387 @@
+/**
+ * In-process metrics registry
+ *
+ * Every thread updates its own shard, so recording is a plain add on a
+ * cache line no other thread writes. The shards are only summed up when the
+ * metrics are rendered.
+ */
+
+#define _GNU_SOURCE // open_memstream
+
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "data.h"
+#include "dht.h"
+#include "dht_io.h"
+#include "log.h"
+#include "migrate.h"
+#include "route_cache.h"
+#include "slab.h"
+
+extern struct dht_state dht;
+extern struct store resources;
+
+// Status codes counted separately, any other one is counted as "other"
+static const int statuses[] = {200, 201, 204, 303, 400, 403, 404, 409,
+                               413, 431, 500, 501, 502, 503, 507};
+#define STATUSES (sizeof(statuses) / sizeof(*statuses) + 1)
+
+static const char *method_names[] = {"GET", "PUT", "DELETE", "other"};
+static const char *path_names[] = {"local", "redirect", "unavailable"};
+static const char *counter_names[] = {
+    "connections_accepted_total",
+    "connections_timed_out_total",
+    "dht_lookups_started_total",
+    "dht_lookups_sent_total",
+    "dht_lookups_retransmitted_total",
+    "dht_lookups_expired_total",
+    "dht_lookups_forwarded_total",
+    "dht_lookups_dropped_total",
+    "dht_lookups_answered_total",
+    "dht_replies_received_total",
+    "io_syscalls_total",
+};
+static const char *gauge_names[] = {
+    "connections_open",
+    "connection_buffer_bytes",
+};
+
+/**
+ * A log-linear histogram, in the manner of HdrHistogram
+ */
+struct histogram {
+    atomic_uint_fast64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+};
+
+struct metrics_shard {
+    atomic_uint_fast64_t requests[METRICS_METHODS][STATUSES];
+    struct histogram latency[METRICS_PATHS];
+    struct histogram connection_peak;
+    atomic_uint_fast64_t counters[METRICS_COUNTERS];
+    atomic_int_fast64_t gauges[METRICS_GAUGES];
+    struct metrics_shard *next;
+};
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard *shards = NULL;
+static __thread struct metrics_shard *local = NULL;
+
+static struct metrics_shard *shard(void) {
+    if (!local) {
+        // Threads live as long as the process, so are their shards
+        local = calloc(1, sizeof(*local));
+        if (!local) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_lock(&shards_lock);
+        local->next = shards;
+        shards = local;
+        pthread_mutex_unlock(&shards_lock);
+    }
+    return local;
+}
+
+// Only the owning thread writes a shard: no read-modify-write needed
+static inline void add(atomic_uint_fast64_t *value, uint64_t delta) {
+    atomic_store_explicit(
+        value, atomic_load_explicit(value, memory_order_relaxed) + delta,
+        memory_order_relaxed);
+}
+
+static inline uint64_t load(atomic_uint_fast64_t *value) {
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+static size_t bucket_of(uint64_t value) {
+    const uint64_t sub_buckets = 1 << METRICS_SUB_BUCKET_BITS;
+    if (value < sub_buckets) return value;
+
+    unsigned shift = 63 - __builtin_clzll(value) - METRICS_SUB_BUCKET_BITS;
+    size_t index = (shift + 1) * sub_buckets +
+                   ((value >> shift) & (sub_buckets - 1));
+    return index < METRICS_HISTOGRAM_BUCKETS ? index
+                                             : METRICS_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * Highest value counted in bucket `index`
+ */
+static uint64_t bucket_limit(size_t index) {
+    const uint64_t sub_buckets = 1 << METRICS_SUB_BUCKET_BITS;
+    if (index < sub_buckets) return index;
+
+    unsigned shift = index / sub_buckets - 1;
+    return ((sub_buckets + index % sub_buckets + 1) << shift) - 1;
+}
+
+static void record(struct histogram *histogram, uint64_t value) {
+    add(&histogram->buckets[bucket_of(value)], 1);
+    add(&histogram->count, 1);
+    add(&histogram->sum, value);
+    if (value > load(&histogram->max)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+enum metrics_method metrics_method(const char *method) {
+    for (size_t i = 0; i < METRICS_OTHER_METHOD; i++) {
+        if (strcmp(method, method_names[i]) == 0) return i;
+    }
+    return METRICS_OTHER_METHOD;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void metrics_request(enum metrics_method method, int status, uint64_t start) {
+    struct metrics_shard *metrics = shard();
+
+    size_t status_index = 0;
+    while (status_index < STATUSES - 1 && statuses[status_index] != status) {
+        status_index += 1;
+    }
+    add(&metrics->requests[method][status_index], 1);
+
+    enum metrics_path path = status == 303   ? METRICS_REDIRECT
+                             : status == 503 ? METRICS_UNAVAILABLE
+                                             : METRICS_LOCAL;
+    uint64_t now = metrics_now();
+    record(&metrics->latency[path], now > start ? now - start : 0);
+}
+
+void metrics_count(enum metrics_counter counter) {
+    add(&shard()->counters[counter], 1);
+}
+
+void metrics_gauge_add(enum metrics_gauge gauge, int64_t delta) {
+    atomic_int_fast64_t *value = &shard()->gauges[gauge];
+    atomic_store_explicit(
+        value, atomic_load_explicit(value, memory_order_relaxed) + delta,
+        memory_order_relaxed);
+}
+
+void metrics_connection_peak(size_t bytes) {
+    record(&shard()->connection_peak, bytes);
+}
+
+/**
+ * Sum of `histogram` over all shards, `offset` being its position within a
+ * shard
+ */
+static void merge(struct histogram *total, size_t offset) {
+    memset(total, 0, sizeof(*total));
+    for (struct metrics_shard *s = shards; s; s = s->next) {
+        struct histogram *h = (struct histogram *)((char *)s + offset);
+        for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+            add(&total->buckets[i], load(&h->buckets[i]));
+        }
+        add(&total->count, load(&h->count));
+        add(&total->sum, load(&h->sum));
+        if (load(&h->max) > load(&total->max)) {
+            atomic_store(&total->max, load(&h->max));
+        }
+    }
+}
+
+static uint64_t percentile(struct histogram *histogram, double fraction) {
+    uint64_t count = load(&histogram->count);
+    if (count == 0) return 0;
+
+    uint64_t rank = (uint64_t)(fraction * count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        seen += load(&histogram->buckets[i]);
+        if (seen >= rank) {
+            uint64_t limit = bucket_limit(i);
+            uint64_t max = load(&histogram->max);
+            return limit < max ? limit : max;
+        }
+    }
+    return load(&histogram->max);
+}
+
+static void render_histogram(FILE *out, const char *name, const char *labels,
+                             struct histogram *histogram) {
+    static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+    static const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+
+    const char *separator = *labels ? "," : "";
+    for (size_t i = 0; i < sizeof(fractions) / sizeof(*fractions); i++) {
+        fprintf(out, "%s{%s%squantile=\"%s\"} %" PRIu64 "\n", name, labels, separator,
+                quantiles[i], percentile(histogram, fractions[i]));
+    }
+    fprintf(out, "%s{%s%squantile=\"1\"} %" PRIu64 "\n", name, labels, separator,
+            load(&histogram->max));
+    fprintf(out, "%s_sum{%s} %" PRIu64 "\n", name, labels, load(&histogram->sum));
+    fprintf(out, "%s_count{%s} %" PRIu64 "\n", name, labels, load(&histogram->count));
+}
+
+char *metrics_render(size_t *length) {
+    char *text = NULL;
+    FILE *out = open_memstream(&text, length);
+    if (!out) return NULL;
+
+    // Merged histograms are too large for the stack
+    struct histogram *total = malloc(sizeof(*total));
+    if (!total) {
+        fclose(out);
+        free(text);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shards_lock);
+
+    fprintf(out, "# TYPE http_requests_total counter\n");
+    for (size_t m = 0; m < METRICS_METHODS; m++) {
+        for (size_t i = 0; i < STATUSES; i++) {
+            uint64_t count = 0;
+            for (struct metrics_shard *s = shards; s; s = s->next) {
+                count += load(&s->requests[m][i]);
+            }
+            if (count == 0) continue;
+            char status[8] = "other";
+            if (i < STATUSES - 1) snprintf(status, sizeof(status), "%d", statuses[i]);
+            fprintf(out, "http_requests_total{method=\"%s\",status=\"%s\"} %" PRIu64 "\n",
+                    method_names[m], status, count);
+        }
+    }
+
+    fprintf(out, "# TYPE http_request_duration_us summary\n");
+    for (size_t p = 0; p < METRICS_PATHS; p++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "path=\"%s\"", path_names[p]);
+        merge(total, offsetof(struct metrics_shard, latency) +
+                         p * sizeof(struct histogram));
+        render_histogram(out, "http_request_duration_us", labels, total);
+    }
+
+    for (size_t c = 0; c < METRICS_COUNTERS; c++) {
+        uint64_t count = 0;
+        for (struct metrics_shard *s = shards; s; s = s->next) {
+            count += load(&s->counters[c]);
+        }
+        fprintf(out, "# TYPE %s counter\n%s %" PRIu64 "\n", counter_names[c],
+                counter_names[c], count);
+    }
+
+    for (size_t g = 0; g < METRICS_GAUGES; g++) {
+        int64_t value = 0;
+        for (struct metrics_shard *s = shards; s; s = s->next) {
+            value += atomic_load_explicit(&s->gauges[g], memory_order_relaxed);
+        }
+        fprintf(out, "# TYPE %s gauge\n%s %" PRId64 "\n", gauge_names[g],
+                gauge_names[g], value);
+    }
+
+    fprintf(out, "# TYPE connection_buffer_peak_bytes summary\n");
+    merge(total, offsetof(struct metrics_shard, connection_peak));
+    render_histogram(out, "connection_buffer_peak_bytes", "", total);
+
+    pthread_mutex_unlock(&shards_lock);
+    free(total);
+
+    struct dht_io_stats io;
+    dht_io_stats(&io);
+    fprintf(out,
+            "# TYPE dht_messages_received_total counter\n"
+            "dht_messages_received_total %" PRIu64 "\n"
+            "# TYPE dht_messages_sent_total counter\n"
+            "dht_messages_sent_total %" PRIu64 "\n"
+            "# TYPE dht_receive_calls_total counter\n"
+            "dht_receive_calls_total %" PRIu64 "\n"
+            "# TYPE dht_send_calls_total counter\n"
+            "dht_send_calls_total %" PRIu64 "\n"
+            "# TYPE dht_lookup_batches_sent_total counter\n"
+            "dht_lookup_batches_sent_total %" PRIu64 "\n"
+            "# TYPE dht_lookups_batched_total counter\n"
+            "dht_lookups_batched_total %" PRIu64 "\n",
+            io.messages_received, io.messages_sent, io.receive_calls,
+            io.send_calls, io.lookup_batches_sent, io.lookups_batched);
+
+    struct dht_stats ring;
+    dht_stats(&dht, &ring);
+    fprintf(out,
+            "# TYPE dht_ids gauge\n"
+            "dht_ids %" PRIu64 "\n"
+            "# TYPE dht_ids_joined gauge\n"
+            "dht_ids_joined %" PRIu64 "\n"
+            "# TYPE dht_responsible_hashes gauge\n"
+            "dht_responsible_hashes %" PRIu64 "\n",
+            ring.ids, ring.ids_joined, ring.hashes);
+
+    uint64_t hits, misses;
+    route_cache_stats(&hits, &misses);
+    fprintf(out,
+            "# TYPE route_cache_hits_total counter\n"
+            "route_cache_hits_total %" PRIu64 "\n"
+            "# TYPE route_cache_misses_total counter\n"
+            "route_cache_misses_total %" PRIu64 "\n",
+            hits, misses);
+
+    struct migrate_stats migration;
+    migrate_stats(&migration);
+    fprintf(out,
+            "# TYPE migration_keys_sent_total counter\n"
+            "migration_keys_sent_total %" PRIu64 "\n"
+            "# TYPE migration_bytes_sent_total counter\n"
+            "migration_bytes_sent_total %" PRIu64 "\n"
+            "# TYPE migration_keys_received_total counter\n"
+            "migration_keys_received_total %" PRIu64 "\n"
+            "# TYPE migration_batches_received_total counter\n"
+            "migration_batches_received_total %" PRIu64 "\n"
+            "# TYPE migration_ranges_pending gauge\n"
+            "migration_ranges_pending %" PRIu64 "\n",
+            migration.keys_sent, migration.bytes_sent, migration.keys_received,
+            migration.batches_received, migration.ranges_pending);
+
+    struct store_stats store;
+    store_stats(&resources, &store);
+    fprintf(out,
+            "# TYPE store_keys gauge\nstore_keys %zu\n"
+            "# TYPE store_slots gauge\nstore_slots %zu\n"
+            "# TYPE store_value_bytes gauge\nstore_value_bytes %zu\n",
+            store.keys, store.slots, store.value_bytes);
+
+    struct slab_stats slab;
+    slab_stats(&slab);
+    fprintf(out,
+            "# TYPE slab_pages gauge\nslab_pages %zu\n"
+            "# TYPE slab_pool_pages gauge\nslab_pool_pages %zu\n"
+            "# TYPE slab_objects gauge\nslab_objects %zu\n"
+            "# TYPE slab_object_bytes gauge\nslab_object_bytes %zu\n"
+            "# TYPE slab_large_objects gauge\nslab_large_objects %zu\n"
+            "# TYPE slab_large_bytes gauge\nslab_large_bytes %zu\n"
+            "# TYPE slab_system_allocations_total counter\n"
+            "slab_system_allocations_total %" PRIu64 "\n"
+            "# TYPE slab_system_frees_total counter\n"
+            "slab_system_frees_total %" PRIu64 "\n",
+            slab.pages, slab.pool_pages, slab.objects, slab.object_bytes, slab.large_objects,
+            slab.large_bytes, slab.system_allocations, slab.system_frees);
+
+    fprintf(out, "# TYPE log_lines_dropped_total counter\n"
+                 "log_lines_dropped_total %" PRIu64 "\n",
+            log_dropped());
+
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
@@ -0,0 +1,652 @@
+/**
+ * Moving key ranges between nodes when the ring changes
+ *
+ * One background thread works through the queued ranges. For each, it
+ * collects the keys in the range, then streams them to the new owner over a
+ * single keep-alive connection, in batches PUT to `MIGRATE_PATH`, at a
+ * limited rate so the foreground requests of both nodes are not crowded
+ * out. A batch's keys are only deleted here once the new owner acknowledged
+ * it, i.e. once it stored them durably if it persists its store, and only
+ * if they still have the value sent. Only a neighbour in the ring is sent
+ * keys, and only those of its own range: keys before it, because another
+ * node joined in between, are moved to its predecessor next.
+ *
+ * The new owner serves the range meanwhile. Keys it deletes before their
+ * batch arrives leave a tombstone until the range is complete, so that the
+ * batch does not bring them back.
+ */
+
+#include "migrate.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dht.h"
+#include "log.h"
+#include "util.h"
+
+#define MIGRATE_ATTEMPTS 5
+#define MIGRATE_RETRY_DELAY_S 1
+#define MIGRATE_TIMEOUT_S 10
+#define MIGRATE_PROGRESS_INTERVAL_MS 1000
+#define MIGRATE_RECORD_HEADER 8
+#define MIGRATE_HEADER_ROOM 192
+#define MIGRATE_RESPONSE_SIZE 1024
+
+// Ranges expected at once, and how long one is expected without a batch
+#define MIGRATE_MAX_INCOMING 64
+#define MIGRATE_INCOMING_TIMEOUT_S 600
+
+struct range {
+    uint16_t pred_id;
+    uint16_t id;
+    struct sockaddr_in addr;
+    struct range *next;
+};
+
+static struct store *store;
+static struct sockaddr_in self;
+static unsigned rate_mb_s;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+static struct range *queue_head = NULL;
+static struct range *queue_tail = NULL;
+
+static atomic_uint_fast64_t keys_sent = 0;
+static atomic_uint_fast64_t bytes_sent = 0;
+static atomic_uint_fast64_t keys_received = 0;
+static atomic_uint_fast64_t batches_received = 0;
+static atomic_uint_fast64_t ranges_pending = 0;
+
+/**
+ * A range whose keys are being moved here, since `touched_at` the last time
+ * a batch of it arrived
+ */
+struct incoming {
+    uint16_t pred_id;
+    uint16_t id;
+    uint64_t touched_at;
+};
+
+// Expected ranges and the keys of them deleted meanwhile. `expecting` tells
+// without the lock whether there are any.
+static pthread_mutex_t incoming_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct incoming incoming[MIGRATE_MAX_INCOMING];
+static size_t incoming_count = 0;
+static atomic_bool expecting = false;
+static struct store tombstones;
+
+/**
+ * Keys found in a range, to be sent, or all keys if `range` is NULL
+ */
+struct key_list {
+    struct range *range;
+    char **keys;
+    size_t count;
+    size_t capacity;
+};
+
+static void collect(void *context, const char *key, size_t key_length,
+                    const char *value, size_t value_length) {
+    (void)value;
+    (void)value_length;
+    struct key_list *list = context;
+    uint16_t hash = ring_hash((const unsigned char *)key, key_length);
+    if (list->range &&
+        !is_responsible(hash, list->range->id, list->range->pred_id)) {
+        return;
+    }
+
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        char **grown = realloc(list->keys, capacity * sizeof(*grown));
+        if (!grown) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        list->keys = grown;
+        list->capacity = capacity;
+    }
+    char *copy = strdup(key);
+    if (!copy) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    list->keys[list->count++] = copy;
+}
+
+static void put_u32(char *out, uint32_t value) {
+    uint32_t big_endian = htonl(value);
+    memcpy(out, &big_endian, sizeof(big_endian));
+}
+
+static uint32_t get_u32(const char *in) {
+    uint32_t big_endian;
+    memcpy(&big_endian, in, sizeof(big_endian));
+    return ntohl(big_endian);
+}
+
+static bool send_all(int sock, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(sock, data, length, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+/**
+ * Read the response to a batch, which has no body, into `response`. Returns
+ * its status code, or -1 if the connection failed.
+ */
+static int read_response(int sock, char response[MIGRATE_RESPONSE_SIZE]) {
+    size_t length = 0;
+    while (length < MIGRATE_RESPONSE_SIZE - 1) {
+        ssize_t received = recv(sock, response + length,
+                                MIGRATE_RESPONSE_SIZE - 1 - length, 0);
+        if (received == -1 && errno == EINTR) continue;
+        if (received <= 0) return -1;
+        length += received;
+        response[length] = '\0';
+        if (strstr(response, "\r\n\r\n")) {
+            int status;
+            return sscanf(response, "HTTP/1.1 %d", &status) == 1 ? status : -1;
+        }
+    }
+    return -1;
+}
+
+static int connect_to(const struct sockaddr_in *addr) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) return -1;
+    // From the address the other node knows this one by, if it is one
+    struct sockaddr_in local = {.sin_family = AF_INET, .sin_addr = self.sin_addr};
+    if (self.sin_addr.s_addr != htonl(INADDR_ANY) &&
+        self.sin_addr.s_addr != htonl(INADDR_NONE) &&
+        bind(sock, (const struct sockaddr *)&local, sizeof(local)) == -1) {
+        close(sock);
+        return -1;
+    }
+    struct timeval timeout = {.tv_sec = MIGRATE_TIMEOUT_S};
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Sleep as long as needed to keep `bytes` sent since `start` below the rate
+ */
+static void throttle(uint64_t start, uint64_t bytes) {
+    if (rate_mb_s == 0) return;
+    uint64_t due = start + bytes / (rate_mb_s * 1000ull);
+    uint64_t now = monotonic_ms();
+    if (due <= now) return;
+    struct timespec delay = {
+        .tv_sec = (due - now) / 1000,
+        .tv_nsec = (long)((due - now) % 1000) * 1000000,
+    };
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR) {}
+}
+
+/**
+ * Send `length - MIGRATE_HEADER_ROOM` bytes of records from `batch` on, after
+ * the request header written in front of them. Returns the status code of
+ * the response read into `response`, or -1 if the connection failed.
+ */
+static int send_batch(int sock, const struct range *range, char *batch,
+                      size_t length, char response[MIGRATE_RESPONSE_SIZE]) {
+    char header[MIGRATE_HEADER_ROOM];
+    int header_length = snprintf(header, sizeof(header),
+                                 "PUT " MIGRATE_PATH " HTTP/1.1\r\n"
+                                 MIGRATE_FROM_HEADER ": %u\r\n"
+                                 MIGRATE_RANGE_HEADER ": 0x%04x 0x%04x\r\n"
+                                 "Content-Length: %zu\r\n\r\n",
+                                 ntohs(self.sin_port), range->pred_id,
+                                 range->id, length - MIGRATE_HEADER_ROOM);
+    char *request = batch + MIGRATE_HEADER_ROOM - header_length;
+    memcpy(request, header, header_length);
+    size_t request_length = length - MIGRATE_HEADER_ROOM + header_length;
+    if (!send_all(sock, request, request_length)) return -1;
+    atomic_fetch_add_explicit(&bytes_sent, request_length,
+                              memory_order_relaxed);
+    return read_response(sock, response);
+}
+
+/**
+ * The value of the header `name` in `response`, up to the end of its line,
+ * or NULL
+ */
+static const char *response_header(const char *response, const char *name) {
+    size_t name_length = strlen(name);
+    for (const char *line = strstr(response, "\r\n"); line && line[2] != '\r';
+         line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, name_length) == 0 &&
+            line[2 + name_length] == ':') {
+            return line + 2 + name_length + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Narrow `range` to the part the other node is responsible for, as named in
+ * its `response` refusing the keys before. These go to its predecessor
+ * instead, queued after this range. Returns false if the response names no
+ * narrower range.
+ */
+static bool narrow(struct range *range, const char *response) {
+    const char *own = response_header(response, MIGRATE_RANGE_HEADER);
+    char *end;
+    unsigned long pred_id = own ? strtoul(own, &end, 0) : 0;
+    unsigned long id = own ? strtoul(end, &end, 0) : 0;
+    if (!own || id != range->id || pred_id > UINT16_MAX ||
+        pred_id == range->id || pred_id == range->pred_id ||
+        !is_responsible(pred_id, range->id, range->pred_id)) {
+        return false;
+    }
+
+    const char *pred = response_header(response, MIGRATE_PREDECESSOR_HEADER);
+    char ip[INET_ADDRSTRLEN] = "";
+    unsigned port = 0;
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    if (pred && sscanf(pred, " %15[0-9.]:%u", ip, &port) == 2 &&
+        port > 0 && port <= UINT16_MAX &&
+        inet_pton(AF_INET, ip, &addr.sin_addr) == 1) {
+        addr.sin_port = htons(port);
+        migrate_range(range->pred_id, pred_id, &addr);
+    } else {
+        log_warn("Keys of (0x%04x, 0x%04lx] stay here, no node takes them\n",
+                 range->pred_id, pred_id);
+    }
+    range->pred_id = pred_id;
+    return true;
+}
+
+/**
+ * Send the keys of `list` from `*next` on, in batches, deleting those
+ * acknowledged, then the empty batch that ends the range. Returns false if
+ * the connection failed; `*next` then is the first key still here.
+ */
+static bool send_keys(int sock, const struct key_list *list, size_t *next,
+                      const char *node) {
+    struct range *range = list->range;
+    char response[MIGRATE_RESPONSE_SIZE];
+    uint64_t start = monotonic_ms(), last_progress = start;
+    uint64_t bytes_before =
+        atomic_load_explicit(&bytes_sent, memory_order_relaxed);
+    char *batch = NULL;
+    size_t capacity = 0;
+    // The values sent, held until acknowledged to tell if they changed
+    const char **values = NULL;
+    size_t values_capacity = 0;
+    int status = 0;
+
+    while (*next < list->count) {
+        // The request header is written in front once the length is known
+        size_t length = MIGRATE_HEADER_ROOM;
+        size_t end = *next;
+        for (; end < list->count &&
+               length - MIGRATE_HEADER_ROOM < MIGRATE_BATCH_SIZE;
+             end++) {
+            if (end - *next == values_capacity) {
+                values_capacity = values_capacity ? values_capacity * 2 : 1024;
+                const char **grown =
+                    realloc(values, values_capacity * sizeof(*grown));
+                if (!grown) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+                values = grown;
+            }
+            values[end - *next] = NULL;
+            size_t key_length = strlen(list->keys[end]);
+            uint16_t hash =
+                ring_hash((const unsigned char *)list->keys[end], key_length);
+            if (!is_responsible(hash, range->id, range->pred_id)) continue;
+            size_t value_length;
+            const char *value = get(store, list->keys[end], &value_length);
+            values[end - *next] = value;
+            if (!value) continue; // deleted meanwhile
+            size_t needed = length + MIGRATE_RECORD_HEADER + key_length + value_length;
+            if (needed > capacity) {
+                capacity = needed > 2 * capacity ? needed : 2 * capacity;
+                char *grown = realloc(batch, capacity);
+                if (!grown) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+                batch = grown;
+            }
+            put_u32(batch + length, key_length);
+            put_u32(batch + length + 4, value_length);
+            length += MIGRATE_RECORD_HEADER;
+            memcpy(batch + length, list->keys[end], key_length);
+            length += key_length;
+            memcpy(batch + length, value, value_length);
+            length += value_length;
+        }
+
+        status = length == MIGRATE_HEADER_ROOM // all deleted meanwhile
+                     ? 204
+                     : send_batch(sock, range, batch, length, response);
+        for (size_t i = *next; i < end; i++) {
+            const char *value = values[i - *next];
+            if (!value) continue;
+            // A key written meanwhile stays, the new owner has its own
+            if (status / 100 == 2) remove_if_value(store, list->keys[i], value);
+            release(value);
+        }
+        if (status == 409 && narrow(range, response)) continue;
+        if (status / 100 != 2) break;
+
+        atomic_fetch_add_explicit(&keys_sent, end - *next, memory_order_relaxed);
+        *next = end;
+
+        uint64_t now = monotonic_ms();
+        if (now - last_progress >= MIGRATE_PROGRESS_INTERVAL_MS) {
+            uint64_t sent =
+                atomic_load_explicit(&bytes_sent, memory_order_relaxed) -
+                bytes_before;
+            log_info("Moving (0x%04x, 0x%04x] to %s: %zu of %zu keys, "
+                     "%.1f MB/s\n",
+                     range->pred_id, range->id, node, *next, list->count,
+                     sent / 1000.0 / (now - start));
+            last_progress = now;
+        }
+        throttle(start, atomic_load_explicit(&bytes_sent, memory_order_relaxed) -
+                            bytes_before);
+    }
+    free(values);
+
+    if (*next == list->count) {
+        char end_of_range[MIGRATE_HEADER_ROOM];
+        status = send_batch(sock, range, end_of_range, sizeof(end_of_range),
+                            response);
+    }
+    free(batch);
+    if (status != -1 && status / 100 != 2) {
+        log_warn("%s refused migrated keys with status %d\n", node, status);
+    }
+    return status / 100 == 2;
+}
+
+static void move_range(struct range *range) {
+    char node[INET_ADDRSTRLEN + 8];
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &range->addr.sin_addr, ip, sizeof(ip));
+    snprintf(node, sizeof(node), "%s:%d", ip, ntohs(range->addr.sin_port));
+
+    uint64_t start = monotonic_ms();
+    struct key_list list = {.range = range};
+    store_for_each(store, collect, &list);
+    uint64_t bytes_before = atomic_load_explicit(&bytes_sent, memory_order_relaxed);
+
+    // Also without keys, the new owner learns that the range is complete
+    size_t next = 0;
+    for (int attempt = 1;; attempt++) {
+        int sock = connect_to(&range->addr);
+        bool done = sock != -1 && send_keys(sock, &list, &next, node);
+        if (sock != -1) close(sock);
+        if (done) break;
+        if (attempt == MIGRATE_ATTEMPTS) {
+            log_warn("Giving up moving (0x%04x, 0x%04x] to %s, %zu keys stay "
+                     "here\n",
+                     range->pred_id, range->id, node, list.count - next);
+            break;
+        }
+        // The other node may not have settled in the ring yet
+        log_warn("Moving keys to %s failed, retrying\n", node);
+        sleep(MIGRATE_RETRY_DELAY_S << (attempt - 1));
+    }
+
+    if (list.count > 0) {
+        uint64_t elapsed = monotonic_ms() - start;
+        uint64_t bytes =
+            atomic_load_explicit(&bytes_sent, memory_order_relaxed) - bytes_before;
+        log_info("Moved %zu keys (%.1f MB) of (0x%04x, 0x%04x] to %s in "
+                 "%" PRIu64 " ms, %.1f MB/s\n",
+                 next, bytes / 1e6, range->pred_id, range->id, node, elapsed,
+                 elapsed ? bytes / 1000.0 / elapsed : 0.0);
+    }
+    for (size_t i = 0; i < list.count; i++) free(list.keys[i]);
+    free(list.keys);
+}
+
+static void *migrate_thread(void *arg) {
+    (void)arg;
+    while (true) {
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_head) pthread_cond_wait(&queue_changed, &queue_lock);
+        struct range *range = queue_head;
+        queue_head = range->next;
+        if (!queue_head) queue_tail = NULL;
+        pthread_mutex_unlock(&queue_lock);
+
+        move_range(range);
+        free(range);
+        atomic_fetch_sub_explicit(&ranges_pending, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+void migrate_init(struct store *migrated, const struct sockaddr_in *addr,
+                  unsigned rate) {
+    store = migrated;
+    self = *addr;
+    rate_mb_s = rate;
+    store_init(&tombstones);
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, migrate_thread, NULL);
+    if (error) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(error));
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+void migrate_range(uint16_t pred_id, uint16_t id, const struct sockaddr_in *addr) {
+    struct range *range = malloc(sizeof(*range));
+    if (!range) {
+        perror("malloc");
+        return; // the keys stay here
+    }
+    *range = (struct range){.pred_id = pred_id, .id = id, .addr = *addr};
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) {
+        queue_tail->next = range;
+    } else {
+        queue_head = range;
+    }
+    queue_tail = range;
+    atomic_fetch_add_explicit(&ranges_pending, 1, memory_order_relaxed);
+    pthread_cond_signal(&queue_changed);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Whether keys of `hash` are expected, with `incoming_lock` held
+ */
+static bool incoming_covers(uint16_t hash) {
+    for (size_t i = 0; i < incoming_count; i++) {
+        if (is_responsible(hash, incoming[i].id, incoming[i].pred_id)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Drop the expected range `index` and the tombstones no other one covers,
+ * with `incoming_lock` held
+ */
+static void incoming_drop(size_t index) {
+    incoming[index] = incoming[--incoming_count];
+    atomic_store_explicit(&expecting, incoming_count > 0, memory_order_release);
+
+    struct key_list list = {0};
+    store_for_each(&tombstones, collect, &list);
+    for (size_t i = 0; i < list.count; i++) {
+        uint16_t hash = ring_hash((const unsigned char *)list.keys[i],
+                                  strlen(list.keys[i]));
+        if (!incoming_covers(hash)) remove_tuple(&tombstones, list.keys[i]);
+        free(list.keys[i]);
+    }
+    free(list.keys);
+}
+
+/**
+ * Expect (`pred_id`, `id`], or note that a batch of it arrived, with
+ * `incoming_lock` held. Ranges whose batches stopped arriving, e.g. because
+ * the sender gave up, are no longer expected.
+ */
+static void incoming_touch(uint16_t pred_id, uint16_t id) {
+    uint64_t now = monotonic_ms();
+    for (size_t i = 0; i < incoming_count;) {
+        if (now - incoming[i].touched_at > MIGRATE_INCOMING_TIMEOUT_S * 1000ull) {
+            incoming_drop(i);
+        } else {
+            i++;
+        }
+    }
+
+    size_t index = 0;
+    while (index < incoming_count && (incoming[index].pred_id != pred_id ||
+                                      incoming[index].id != id)) {
+        index++;
+    }
+    if (index == MIGRATE_MAX_INCOMING) {
+        log_warn("Expecting too many ranges, tombstones may be lost\n");
+        incoming_drop(0);
+        index = incoming_count;
+    }
+    if (index == incoming_count) {
+        incoming_count += 1;
+        atomic_store_explicit(&expecting, true, memory_order_release);
+    }
+    incoming[index] = (struct incoming){pred_id, id, now};
+}
+
+void migrate_expect(uint16_t pred_id, uint16_t id) {
+    pthread_mutex_lock(&incoming_lock);
+    incoming_touch(pred_id, id);
+    pthread_mutex_unlock(&incoming_lock);
+}
+
+bool migrate_delete(struct store *target, const string key) {
+    if (!atomic_load_explicit(&expecting, memory_order_acquire)) {
+        return remove_tuple(target, key);
+    }
+    // Together with the tombstone, not to race with a batch
+    pthread_mutex_lock(&incoming_lock);
+    bool deleted = remove_tuple(target, key);
+    uint16_t hash = ring_hash((const unsigned char *)key, strlen(key));
+    if (incoming_covers(hash)) set(&tombstones, key, "", 0);
+    pthread_mutex_unlock(&incoming_lock);
+    return deleted;
+}
+
+long migrate_receive(struct store *target, const struct dht_state *dht,
+                     uint16_t pred_id, uint16_t id, const char *batch,
+                     size_t length) {
+    // Validated as a whole first, not to store half of a malformed batch
+    long count = 0;
+    for (size_t offset = 0; offset < length; count++) {
+        if (length - offset < MIGRATE_RECORD_HEADER) return MIGRATE_MALFORMED;
+        uint64_t key_length = get_u32(batch + offset);
+        uint64_t value_length = get_u32(batch + offset + 4);
+        offset += MIGRATE_RECORD_HEADER;
+        if (key_length == 0 || key_length + value_length > length - offset ||
+            memchr(batch + offset, '\0', key_length)) {
+            return MIGRATE_MALFORMED;
+        }
+        uint16_t hash =
+            ring_hash((const unsigned char *)batch + offset, key_length);
+        if (!is_responsible(hash, id, pred_id) || !dht_owns(dht, id, hash)) {
+            return MIGRATE_FOREIGN;
+        }
+        offset += key_length + value_length;
+    }
+
+    pthread_mutex_lock(&incoming_lock);
+    if (length == 0) {
+        // The last batch of the range
+        for (size_t i = 0; i < incoming_count; i++) {
+            if (incoming[i].pred_id == pred_id && incoming[i].id == id) {
+                incoming_drop(i);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&incoming_lock);
+        return 0;
+    }
+    incoming_touch(pred_id, id);
+
+    char *key = NULL;
+    size_t key_capacity = 0;
+    bool stored = true;
+    for (size_t offset = 0; offset < length && stored;) {
+        size_t key_length = get_u32(batch + offset);
+        size_t value_length = get_u32(batch + offset + 4);
+        offset += MIGRATE_RECORD_HEADER;
+        if (key_length + 1 > key_capacity) {
+            key_capacity = key_length + 1;
+            char *grown = realloc(key, key_capacity);
+            if (!grown) {
+                stored = false;
+                break;
+            }
+            key = grown;
+        }
+        memcpy(key, batch + offset, key_length);
+        key[key_length] = '\0';
+        size_t tombstone_length;
+        const char *tombstone = get(&tombstones, key, &tombstone_length);
+        if (tombstone) {
+            release(tombstone); // deleted here since
+        } else {
+            stored = set_if_absent(target, key, batch + offset + key_length,
+                                   value_length) != STORE_FAILED;
+        }
+        offset += key_length + value_length;
+    }
+    pthread_mutex_unlock(&incoming_lock);
+    free(key);
+    if (!stored) return MIGRATE_NO_MEMORY;
+
+    atomic_fetch_add_explicit(&keys_received, count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&batches_received, 1, memory_order_relaxed);
+    return count;
+}
+
+void migrate_stats(struct migrate_stats *stats) {
+    stats->keys_sent = atomic_load_explicit(&keys_sent, memory_order_relaxed);
+    stats->bytes_sent = atomic_load_explicit(&bytes_sent, memory_order_relaxed);
+    stats->keys_received =
+        atomic_load_explicit(&keys_received, memory_order_relaxed);
+    stats->batches_received =
+        atomic_load_explicit(&batches_received, memory_order_relaxed);
+    stats->ranges_pending =
+        atomic_load_explicit(&ranges_pending, memory_order_relaxed);
+}
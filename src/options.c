@@ -0,0 +1,147 @@
+#include "options.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dht.h"
+#include "event_loop.h"
+#include "util.h"
+
+#define DEFAULT_LOOKUP_TIMEOUT_MS 50
+#define DEFAULT_ROUTE_TTL_S 60
+#define DEFAULT_SNAPSHOT_INTERVAL_S 60
+#define DEFAULT_IDLE_TIMEOUT_S 60
+#define DEFAULT_HEADER_TIMEOUT_S 10
+#define DEFAULT_MIGRATION_RATE_MB_S 64
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [--workers N] [--backend epoll|io_uring]\n"
+            "       [--lookup-timeout MS] [--route-ttl S]\n"
+            "       [--log-level debug|info|warn|error|off]\n"
+            "       [--data-dir DIR] [--snapshot-interval S] [--proxy]\n"
+            "       [--idle-timeout S] [--header-timeout S]\n"
+            "       [--migration-rate MB/S] [--vnodes N]\n"
+            "       [--key-hash checksum|wyhash] [--lookup-batch]\n"
+            "       <ip> <port> [id [anchor-ip anchor-port]]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int parse_options(struct options *options, int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"backend", required_argument, NULL, 'b'},
+        {"lookup-timeout", required_argument, NULL, 't'},
+        {"route-ttl", required_argument, NULL, 'r'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"data-dir", required_argument, NULL, 'd'},
+        {"snapshot-interval", required_argument, NULL, 's'},
+        {"proxy", no_argument, NULL, 'p'},
+        {"idle-timeout", required_argument, NULL, 'i'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"migration-rate", required_argument, NULL, 'm'},
+        {"vnodes", required_argument, NULL, 'v'},
+        {"key-hash", required_argument, NULL, 'k'},
+        {"lookup-batch", no_argument, NULL, 'B'},
+        {0},
+    };
+
+    *options = (struct options){
+        .workers = 1,
+        .lookup_timeout_ms = DEFAULT_LOOKUP_TIMEOUT_MS,
+        .route_ttl_s = DEFAULT_ROUTE_TTL_S,
+        .log_level = LOG_LEVEL_INFO,
+        .snapshot_interval_s = DEFAULT_SNAPSHOT_INTERVAL_S,
+        .idle_timeout_s = DEFAULT_IDLE_TIMEOUT_S,
+        .header_timeout_s = DEFAULT_HEADER_TIMEOUT_S,
+        .migration_rate_mb_s = DEFAULT_MIGRATION_RATE_MB_S,
+        .vnodes = 1,
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:b:t:r:l:d:s:pi:H:m:v:k:B", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'w':
+                options->workers =
+                    safe_strtoul(optarg, NULL, 10, "Invalid worker count");
+                if (options->workers < 1 || options->workers > EVENT_LOOP_MAX) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'b':
+                if (strcmp(optarg, "epoll") == 0) {
+                    options->backend = EVENT_LOOP_EPOLL;
+                } else if (strcmp(optarg, "io_uring") == 0) {
+#ifndef WITH_IO_URING
+                    fprintf(stderr, "Built without io_uring support\n");
+                    exit(EXIT_FAILURE);
+#endif
+                    options->backend = EVENT_LOOP_IO_URING;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                options->lookup_timeout_ms =
+                    safe_strtoul(optarg, NULL, 10, "Invalid lookup timeout");
+                break;
+            case 'r':
+                options->route_ttl_s =
+                    safe_strtoul(optarg, NULL, 10, "Invalid route TTL");
+                break;
+            case 'l':
+                if (!log_parse_level(optarg, &options->log_level)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'd':
+                options->data_dir = optarg;
+                break;
+            case 's':
+                options->snapshot_interval_s =
+                    safe_strtoul(optarg, NULL, 10, "Invalid snapshot interval");
+                break;
+            case 'p':
+                options->proxy = true;
+                break;
+            case 'i':
+                options->idle_timeout_s =
+                    safe_strtoul(optarg, NULL, 10, "Invalid idle timeout");
+                break;
+            case 'H':
+                options->header_timeout_s =
+                    safe_strtoul(optarg, NULL, 10, "Invalid header timeout");
+                break;
+            case 'm':
+                options->migration_rate_mb_s =
+                    safe_strtoul(optarg, NULL, 10, "Invalid migration rate");
+                break;
+            case 'v':
+                options->vnodes =
+                    safe_strtoul(optarg, NULL, 10, "Invalid number of IDs");
+                if (options->vnodes == 0 || options->vnodes > DHT_MAX_VNODES) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'k':
+                if (strcmp(optarg, "checksum") == 0) {
+                    options->key_hash = KEY_HASH_CHECKSUM;
+                } else if (strcmp(optarg, "wyhash") == 0) {
+                    options->key_hash = KEY_HASH_WYHASH;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'B':
+                options->lookup_batch = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    return optind;
+}
@@ -0,0 +1,330 @@
+/**
+ * Per-connection output: responses are handed over as lists of parts and
+ * sent with one gathering write each. Only what the socket does not take
+ * right away is queued, so stored values are never copied.
+ */
+
+#include "output_queue.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "data.h"
+#include "metrics.h"
+
+static const char *segment_data(const struct output_segment *segment) {
+    return segment->ownership == OUTPUT_INLINE ? segment->inline_data
+                                               : segment->data;
+}
+
+static void segment_free(struct output_segment *segment) {
+    if (segment->ownership == OUTPUT_VALUE) {
+        release(segment->data);
+    } else if (segment->ownership == OUTPUT_HEAP) {
+        free((char *)segment->data);
+    }
+}
+
+/**
+ * Write `iov` without blocking. MSG_NOSIGNAL: a client that went away must
+ * not take the node down with SIGPIPE.
+ *
+ * Returns the number of bytes written, which is zero if the socket is full,
+ * or -1 on errors.
+ */
+static ssize_t write_vector(int sock, struct iovec *iov, size_t count) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+    while (true) {
+        ssize_t written = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        metrics_count(METRICS_IO_SYSCALLS);
+        if (written >= 0) return written;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno != EPIPE && errno != ECONNRESET) perror("sendmsg");
+        return -1;
+    }
+}
+
+static void fail(struct output_queue *queue) {
+    // A message in flight still points into the segments
+    if (!queue->in_flight) output_queue_clear(queue);
+    queue->failed = true;
+}
+
+/**
+ * Make room for at least one more segment
+ */
+static bool reserve(struct output_queue *queue) {
+    if (queue->tail < queue->capacity) return true;
+
+    // Reuse the space of segments that were sent already, unless a message
+    // in flight points into the segments
+    if (queue->head > 0 && !queue->in_flight) {
+        memmove(queue->segments, queue->segments + queue->head,
+                (queue->tail - queue->head) * sizeof(*queue->segments));
+        queue->tail -= queue->head;
+        queue->head = 0;
+        return true;
+    }
+
+    size_t capacity = queue->capacity ? queue->capacity * 2 : 4;
+    struct output_segment *segments;
+    if (queue->in_flight && !queue->retired) {
+        // The array in flight is kept until the message completed
+        segments = malloc(capacity * sizeof(*segments));
+        if (segments) {
+            memcpy(segments, queue->segments,
+                   queue->tail * sizeof(*queue->segments));
+            queue->retired = queue->segments;
+        }
+    } else {
+        segments = realloc(queue->segments, capacity * sizeof(*segments));
+    }
+    if (!segments) {
+        perror("realloc");
+        return false;
+    }
+    queue->segments = segments;
+    queue->capacity = capacity;
+    return true;
+}
+
+/**
+ * Append the bytes of `part` after its first `offset` ones
+ */
+static void push(struct output_queue *queue, const struct output_part *part,
+                 size_t offset) {
+    size_t length = part->length - offset;
+    if (queue->failed || length == 0) {
+        if (part->ownership == OUTPUT_VALUE) release(part->data);
+        return;
+    }
+
+    // Small parts, like the headers of consecutive responses, share a segment
+    if (part->ownership == OUTPUT_BORROWED && queue->tail > queue->head) {
+        struct output_segment *last = &queue->segments[queue->tail - 1];
+        if (last->ownership == OUTPUT_INLINE &&
+            last->length + length <= OUTPUT_INLINE_SIZE) {
+            memcpy(last->inline_data + last->length, part->data + offset,
+                   length);
+            last->length += length;
+            queue->pending_bytes += length;
+            return;
+        }
+    }
+
+    if (!reserve(queue)) {
+        if (part->ownership == OUTPUT_VALUE) release(part->data);
+        fail(queue);
+        return;
+    }
+
+    struct output_segment *segment = &queue->segments[queue->tail];
+    segment->ownership = part->ownership;
+    if (part->ownership == OUTPUT_BORROWED) {
+        const char *data = part->data + offset;
+        if (length <= OUTPUT_INLINE_SIZE) {
+            segment->ownership = OUTPUT_INLINE;
+            memcpy(segment->inline_data, data, length);
+        } else {
+            char *copy = malloc(length);
+            if (!copy) {
+                perror("malloc");
+                fail(queue);
+                return;
+            }
+            memcpy(copy, data, length);
+            segment->ownership = OUTPUT_HEAP;
+            segment->data = copy;
+        }
+        segment->length = length;
+    } else {
+        // Kept whole, a value has to be released through its start. Only the
+        // first part of an empty queue can be partially sent.
+        segment->data = part->data;
+        segment->length = part->length;
+        if (offset > 0) queue->sent = offset;
+    }
+
+    queue->pending_bytes += length;
+    queue->tail += 1;
+}
+
+void output_queue_init(struct output_queue *queue) {
+    *queue = (struct output_queue){0};
+}
+
+void output_queue_init_submitted(struct output_queue *queue,
+                                 void (*submit)(struct output_queue *queue,
+                                                const struct msghdr *message)) {
+    *queue = (struct output_queue){.submit = submit};
+}
+
+/**
+ * Point `iov` at the pending data, returning the number of entries used
+ */
+static size_t gather(const struct output_queue *queue, struct iovec *iov) {
+    size_t count = 0;
+    for (size_t i = queue->head; i < queue->tail && count < OUTPUT_IOV_MAX;
+         i++, count++) {
+        const struct output_segment *segment = &queue->segments[i];
+        size_t skip = i == queue->head ? queue->sent : 0;
+        iov[count] = (struct iovec){(void *)(segment_data(segment) + skip),
+                                    segment->length - skip};
+    }
+    return count;
+}
+
+/**
+ * Drop the first `written` pending bytes, which were sent
+ */
+static void consume(struct output_queue *queue, size_t written) {
+    queue->pending_bytes -= written;
+    while (written > 0) {
+        struct output_segment *segment = &queue->segments[queue->head];
+        size_t left = segment->length - queue->sent;
+        if (written < left) {
+            queue->sent += written;
+            break;
+        }
+        written -= left;
+        segment_free(segment);
+        queue->head += 1;
+        queue->sent = 0;
+    }
+}
+
+/**
+ * Hand the pending data to `queue->submit`, unless some is in flight
+ */
+static void submit(struct output_queue *queue) {
+    if (queue->in_flight || queue->failed || !output_queue_pending(queue)) {
+        return;
+    }
+    if (!queue->iov &&
+        !(queue->iov = malloc(OUTPUT_IOV_MAX * sizeof(*queue->iov)))) {
+        perror("malloc");
+        fail(queue);
+        return;
+    }
+    queue->message = (struct msghdr){
+        .msg_iov = queue->iov,
+        .msg_iovlen = gather(queue, queue->iov),
+    };
+    queue->in_flight = true;
+    queue->submit(queue, &queue->message);
+}
+
+bool output_queue_pending(const struct output_queue *queue) {
+    return queue->head != queue->tail;
+}
+
+void output_queue_send(struct output_queue *queue, int sock,
+                       const struct output_part *parts, size_t count) {
+    size_t done = 0;
+    size_t offset = 0;
+
+    // Common case: nothing is queued, so the parts go out straight from where
+    // they are
+    if (!output_queue_pending(queue) && !queue->failed && !queue->corked &&
+        !queue->submit) {
+        struct iovec iov[OUTPUT_IOV_MAX];
+        size_t iov_count = count < OUTPUT_IOV_MAX ? count : OUTPUT_IOV_MAX;
+        for (size_t i = 0; i < iov_count; i++) {
+            iov[i] = (struct iovec){(void *)parts[i].data, parts[i].length};
+        }
+
+        ssize_t written = write_vector(sock, iov, iov_count);
+        if (written == -1) {
+            queue->failed = true;
+            written = 0;
+        }
+        size_t remaining = written;
+        while (done < count && remaining >= parts[done].length) {
+            remaining -= parts[done].length;
+            if (parts[done].ownership == OUTPUT_VALUE) release(parts[done].data);
+            done += 1;
+        }
+        offset = remaining;
+    }
+
+    for (; done < count; done++, offset = 0) {
+        push(queue, &parts[done], offset);
+    }
+    if (queue->submit && !queue->corked) submit(queue);
+}
+
+int output_queue_flush(struct output_queue *queue, int sock) {
+    if (queue->submit) {
+        submit(queue);
+        if (queue->failed) return -1;
+        if (output_queue_pending(queue)) return 0;
+        queue->head = queue->tail = 0;
+        return 1;
+    }
+
+    while (!queue->failed && output_queue_pending(queue)) {
+        struct iovec iov[OUTPUT_IOV_MAX];
+        size_t count = gather(queue, iov);
+
+        ssize_t written = write_vector(sock, iov, count);
+        if (written == -1) {
+            fail(queue);
+            break;
+        }
+        if (written == 0) return 0;
+        consume(queue, written);
+    }
+
+    if (queue->failed) return -1;
+    queue->head = queue->tail = 0;
+    return 1;
+}
+
+int output_queue_complete(struct output_queue *queue, ssize_t written) {
+    queue->in_flight = false;
+    free(queue->retired);
+    queue->retired = NULL;
+
+    if (written < 0) {
+        if (written != -EPIPE && written != -ECONNRESET &&
+            written != -ECANCELED) {
+            fprintf(stderr, "sendmsg: %s\n", strerror(-written));
+        }
+        fail(queue);
+    } else if (!queue->failed) {
+        consume(queue, written);
+    }
+    if (queue->failed) {
+        fail(queue); // now that nothing points into the segments
+        return -1;
+    }
+
+    if (!output_queue_pending(queue)) {
+        queue->head = queue->tail = 0;
+        return 1;
+    }
+    if (!queue->corked) submit(queue);
+    return queue->failed ? -1 : 0;
+}
+
+void output_queue_cork(struct output_queue *queue) { queue->corked = true; }
+
+int output_queue_uncork(struct output_queue *queue, int sock) {
+    queue->corked = false;
+    return output_queue_flush(queue, sock);
+}
+
+void output_queue_clear(struct output_queue *queue) {
+    for (size_t i = queue->head; i < queue->tail; i++) {
+        segment_free(&queue->segments[i]);
+    }
+    free(queue->segments);
+    free(queue->iov);
+    free(queue->retired);
+    *queue = (struct output_queue){.submit = queue->submit};
+}
@@ -0,0 +1,160 @@
+/**
+ * Durability of the store: snapshot plus write-ahead log
+ *
+ * Snapshots are fuzzy: the log is switched to a new segment first, then the
+ * store is written out while it keeps changing. Replaying that segment and
+ * the later ones over the snapshot applies every change made since, in
+ * order; changes the snapshot already contains are simply applied again.
+ */
+
+#include "persist.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "snapshot.h"
+#include "util.h"
+#include "wal.h"
+
+struct persist {
+    struct store *store;
+    const char *directory;
+    unsigned snapshot_interval_s;
+};
+
+static int compare_segments(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * List the log segments in `directory`, sorted. Returns their number, the
+ * array is to be freed by the caller.
+ */
+static size_t list_segments(const char *directory, uint64_t **segments) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        perror("opendir");
+        exit(EXIT_FAILURE);
+    }
+    size_t count = 0, capacity = 16;
+    *segments = malloc(capacity * sizeof(**segments));
+    struct dirent *entry;
+    while (*segments && (entry = readdir(dir))) {
+        uint64_t segment;
+        if (!wal_segment_number(entry->d_name, &segment)) continue;
+        if (count == capacity) {
+            capacity *= 2;
+            uint64_t *grown = realloc(*segments, capacity * sizeof(**segments));
+            if (!grown) free(*segments);
+            *segments = grown;
+            if (!grown) break;
+        }
+        (*segments)[count++] = segment;
+    }
+    closedir(dir);
+    if (!*segments) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    qsort(*segments, count, sizeof(**segments), compare_segments);
+    return count;
+}
+
+static void take_snapshot(struct persist *persist) {
+    uint64_t start = monotonic_ms();
+    uint64_t segment = wal_rotate();
+    size_t keys = snapshot_write(persist->store, persist->directory, segment);
+
+    // Older segments are contained in the snapshot now
+    uint64_t *segments;
+    size_t count = list_segments(persist->directory, &segments);
+    for (size_t i = 0; i < count && segments[i] < segment; i++) {
+        char path[4096];
+        wal_segment_path(path, sizeof(path), persist->directory, segments[i]);
+        unlink(path);
+    }
+    free(segments);
+
+    log_info("Wrote snapshot of %zu keys in %" PRIu64 " ms\n", keys,
+             monotonic_ms() - start);
+}
+
+static void *snapshot_thread(void *arg) {
+    struct persist *persist = arg;
+    uint64_t snapshot_at = wal_appended();
+    const struct timespec interval = {.tv_sec = persist->snapshot_interval_s};
+
+    while (true) {
+        nanosleep(&interval, NULL);
+        uint64_t appended = wal_appended();
+        if (appended == snapshot_at) continue; // nothing changed
+        take_snapshot(persist);
+        snapshot_at = appended;
+    }
+    return NULL;
+}
+
+void persist_open(struct store *store, const char *directory,
+                  unsigned snapshot_interval_s) {
+    if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t start = monotonic_ms();
+    size_t keys = 0;
+    uint64_t first_segment = 0;
+    if (snapshot_load(store, directory, &keys, &first_segment)) {
+        log_info("Loaded snapshot of %zu keys in %" PRIu64 " ms\n", keys,
+                 monotonic_ms() - start);
+    }
+
+    uint64_t *segments;
+    size_t count = list_segments(directory, &segments);
+    uint64_t next_segment = first_segment;
+    long records = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (segments[i] < first_segment) continue; // left over, covered
+        char path[4096];
+        wal_segment_path(path, sizeof(path), directory, segments[i]);
+        long applied = wal_replay(path, store);
+        if (applied == -1) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        records += applied;
+        next_segment = segments[i] + 1;
+    }
+    free(segments);
+    log_info("Recovered from %s in %" PRIu64 " ms: %zu keys from the "
+             "snapshot, %ld records from the log\n",
+             directory, monotonic_ms() - start, keys, records);
+
+    wal_open(directory, next_segment);
+    store->journal = wal_append;
+
+    if (snapshot_interval_s == 0) return;
+    struct persist *persist = malloc(sizeof(*persist));
+    if (!persist) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    *persist = (struct persist){store, directory, snapshot_interval_s};
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, snapshot_thread, persist);
+    if (error) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(error));
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
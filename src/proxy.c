@@ -0,0 +1,512 @@
+/**
+ * Proxy mode: requests for other nodes' keys are forwarded to them instead
+ * of being redirected
+ *
+ * Each event loop keeps a small pool of connections to other nodes, keyed
+ * by their address. Requests are pipelined on them, and the responses come
+ * back in the same order, so every connection has a queue of the clients
+ * waiting for them. A response is passed on as it arrives: the header once
+ * it is complete, then the payload piece by piece.
+ *
+ * The other node is one of ours, so its responses are simple: every one
+ * has a Content-Length header, or no payload at all.
+ */
+
+#define _GNU_SOURCE // memmem
+
+#include "proxy.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "data.h"
+#include "event_loop.h"
+#include "http_response.h"
+#include "log.h"
+#include "metrics.h"
+#include "options.h"
+#include "socket_handler.h"
+
+extern struct options options;
+
+/**
+ * A client waiting for a response. `client` is NULL if it went away, the
+ * response is dropped then. `started` tells whether its header was passed
+ * on already; until then, `request` is kept to be sent again, unless it was
+ * `retried` already.
+ */
+struct proxy_slot {
+    struct connection_state *client;
+    bool started;
+    bool retried;
+    struct proxy_request *request;
+};
+
+/**
+ * A pooled connection to another node
+ *
+ * `slots[head..head + count)`, modulo the capacity, are the clients waiting
+ * for responses, in order. `buffer` up to `end` holds data received but not
+ * passed on yet; `body_left` payload bytes of the first response are still
+ * to come, which has status `status`. `dirty` is set while forwarded
+ * requests wait for `proxy_flush()`. `used_at` is when a request was last
+ * forwarded or answered.
+ */
+struct proxy_upstream {
+    bool used;
+    int sock;
+    struct event_loop *loop;
+    char ip[INET_ADDRSTRLEN];
+    uint16_t port;
+    bool connected;
+    bool dirty;
+    uint64_t used_at;
+    struct output_queue output;
+
+    struct proxy_slot slots[PROXY_MAX_PIPELINE];
+    size_t head;
+    size_t count;
+
+    char *buffer;
+    char *end;
+    size_t body_left;
+    int status;
+};
+
+// Every event loop runs on its own thread, so each one has its own pool
+static __thread struct proxy_upstream upstreams[PROXY_MAX_UPSTREAMS];
+
+/**
+ * A client whose response is complete, or failed
+ */
+struct proxy_done {
+    struct connection_state *client;
+    int status;
+};
+
+bool proxy_wanted(const struct request *request) {
+    return options.proxy && !get_header(request, "Via");
+}
+
+static void upstream_close(struct proxy_upstream *upstream) {
+    event_loop_unwatch(upstream->loop, upstream->sock, upstream);
+    close(upstream->sock);
+    output_queue_clear(&upstream->output);
+    free(upstream->buffer);
+    upstream->used = false;
+}
+
+/**
+ * Open a connection to `ip`:`port` in `upstream`. Returns false on failure.
+ */
+static bool upstream_open(struct proxy_upstream *upstream,
+                          struct event_loop *loop, const char *ip,
+                          uint16_t port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) return false;
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("socket");
+        return false;
+    }
+    // Requests are batched by `proxy_flush()` already
+    const int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    char *buffer = malloc(HTTP_MAX_SIZE);
+    if (!buffer ||
+        (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+         errno != EINPROGRESS) ||
+        event_loop_watch(loop, sock, EPOLLIN | EPOLLOUT | EPOLLET, upstream) ==
+            -1) {
+        perror("proxy");
+        free(buffer);
+        close(sock);
+        return false;
+    }
+
+    *upstream = (struct proxy_upstream){
+        .used = true,
+        .sock = sock,
+        .loop = loop,
+        .port = port,
+        .buffer = buffer,
+        .end = buffer,
+    };
+    snprintf(upstream->ip, sizeof(upstream->ip), "%s", ip);
+    output_queue_init(&upstream->output);
+    // Requests wait until the connection is established
+    output_queue_cork(&upstream->output);
+    log_debug("Opened proxy connection to %s:%d\n", ip, port);
+    return true;
+}
+
+/**
+ * Whether `upstream` was idle for so long that the other node may be about
+ * to close it. Nodes share the idle timeout; retiring connections at half of
+ * it keeps requests from being sent just as the other node closes.
+ */
+static bool upstream_stale(const struct proxy_upstream *upstream) {
+    return options.idle_timeout_s > 0 && upstream->count == 0 &&
+           !upstream->dirty &&
+           monotonic_ms() - upstream->used_at >
+               options.idle_timeout_s * 1000ull / 2;
+}
+
+/**
+ * The pooled connection to `ip`:`port`, opened if need be. Returns NULL if
+ * the pool is full of busy connections.
+ */
+static struct proxy_upstream *upstream_get(struct event_loop *loop,
+                                           const char *ip, uint16_t port) {
+    struct proxy_upstream *free_slot = NULL, *idle = NULL;
+    for (size_t i = 0; i < PROXY_MAX_UPSTREAMS; i++) {
+        struct proxy_upstream *upstream = &upstreams[i];
+        if (!upstream->used) {
+            if (!free_slot) free_slot = upstream;
+        } else if (upstream->port == port && strcmp(upstream->ip, ip) == 0) {
+            if (!upstream_stale(upstream)) return upstream;
+            log_debug("Retiring idle proxy connection to %s:%d\n", ip, port);
+            upstream_close(upstream);
+            free_slot = upstream;
+            break;
+        } else if (upstream->count == 0 && !upstream->dirty &&
+                   (!idle || upstream->used_at < idle->used_at)) {
+            idle = upstream;
+        }
+    }
+
+    if (!free_slot && idle) {
+        // Make room by closing the connection unused for the longest time
+        upstream_close(idle);
+        free_slot = idle;
+    }
+    if (!free_slot || !upstream_open(free_slot, loop, ip, port)) return NULL;
+    return free_slot;
+}
+
+/**
+ * Queue `request` from `client` on the connection to `ip`:`port`, taking it
+ * over. Returns false if no connection is available.
+ */
+static bool upstream_enqueue(struct connection_state *client,
+                             struct proxy_request *request, const char *ip,
+                             uint16_t port, bool retried) {
+    struct proxy_upstream *upstream = upstream_get(client->loop, ip, port);
+    if (!upstream || upstream->count == PROXY_MAX_PIPELINE) return false;
+
+    // Only what the other node looks at is passed on
+    char head[HTTP_MAX_SIZE];
+    int head_length = snprintf(head, sizeof(head),
+                               "%s %s HTTP/1.1\r\n"
+                               "Via: " PROXY_VIA "\r\n"
+                               "Content-Length: %zu\r\n\r\n",
+                               request->method, request->uri,
+                               request->payload_length);
+    if (head_length < 0 || (size_t)head_length >= sizeof(head)) return false;
+
+    // The payload is queued by reference, the request keeps its own
+    struct output_part parts[] = {
+        {head, head_length, OUTPUT_BORROWED},
+        {request->payload, request->payload_length, OUTPUT_VALUE},
+    };
+    if (request->payload) value_retain(request->payload);
+    output_queue_cork(&upstream->output);
+    output_queue_send(&upstream->output, upstream->sock, parts,
+                      request->payload ? 2 : 1);
+    upstream->dirty = true;
+    upstream->used_at = monotonic_ms();
+
+    size_t index = (upstream->head + upstream->count) % PROXY_MAX_PIPELINE;
+    upstream->slots[index] =
+        (struct proxy_slot){client, false, retried, request};
+    upstream->count += 1;
+    client->proxied = true;
+    client->upstream = upstream;
+    client->proxy_slot = index;
+    return true;
+}
+
+bool proxy_forward(struct connection_state *client,
+                   struct proxy_request *request, const char *ip,
+                   uint16_t port) {
+    return upstream_enqueue(client, request, ip, port, false);
+}
+
+struct proxy_request *proxy_copy_request(const struct connection_state *client,
+                                         const struct request *request) {
+    size_t method_length = strlen(request->method) + 1;
+    size_t uri_length = strlen(request->uri) + 1;
+    size_t payload_length =
+        request->payload_length > 0 ? request->payload_length : 0;
+
+    struct proxy_request *copy =
+        malloc(sizeof(*copy) + method_length + uri_length);
+    if (!copy) return NULL;
+    char *data = (char *)(copy + 1);
+    *copy = (struct proxy_request){
+        .method = memcpy(data, request->method, method_length),
+        .uri = memcpy(data + method_length, request->uri, uri_length),
+        .payload_length = payload_length,
+    };
+    if (payload_length == 0) return copy;
+
+    if (client->body && request->payload == client->body) {
+        value_retain(client->body);
+        copy->payload = client->body;
+        return copy;
+    }
+    char *payload = value_alloc(payload_length);
+    if (!payload) {
+        free(copy);
+        return NULL;
+    }
+    copy->payload = memcpy(payload, request->payload, payload_length);
+    return copy;
+}
+
+void proxy_free_request(struct proxy_request *request) {
+    if (!request) return;
+    if (request->payload) release(request->payload);
+    free(request);
+}
+
+void proxy_detach(struct connection_state *client) {
+    client->upstream->slots[client->proxy_slot].client = NULL;
+    client->proxied = false;
+    client->upstream = NULL;
+}
+
+/**
+ * Drop the connection to `upstream`. Requests whose responses did not start
+ * yet are sent once more on a new connection, a pooled one may have been
+ * closed by the other node just as they were sent. Clients that received
+ * part of their response are closed, the others are answered with 502.
+ */
+static void upstream_fail(struct proxy_upstream *upstream) {
+    if (upstream->count == 0) {
+        log_debug("Proxy connection to %s:%d closed\n", upstream->ip,
+                  upstream->port);
+    } else {
+        log_warn("Lost proxy connection to %s:%d\n", upstream->ip,
+                 upstream->port);
+    }
+
+    // Taken off the connection first, the clients may forward again
+    struct proxy_slot waiting[PROXY_MAX_PIPELINE];
+    size_t count = upstream->count;
+    for (size_t i = 0; i < count; i++) {
+        waiting[i] = upstream->slots[(upstream->head + i) % PROXY_MAX_PIPELINE];
+    }
+    char ip[INET_ADDRSTRLEN];
+    memcpy(ip, upstream->ip, sizeof(ip));
+    uint16_t port = upstream->port;
+    upstream_close(upstream);
+
+    for (size_t i = 0; i < count; i++) {
+        struct connection_state *client = waiting[i].client;
+        struct proxy_request *request = waiting[i].request;
+        if (!client) {
+            proxy_free_request(request);
+            continue;
+        }
+        client->proxied = false;
+        client->upstream = NULL;
+        if (waiting[i].started) {
+            connection_close(client);
+            continue;
+        }
+        if (!waiting[i].retried &&
+            upstream_enqueue(client, request, ip, port, true)) {
+            log_debug("Sending %s %s to %s:%d again\n", request->method,
+                      request->uri, ip, port);
+            continue;
+        }
+        proxy_free_request(request);
+        const char *bad_gateway =
+            "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+        send_http_response(client, bad_gateway, strlen(bad_gateway));
+        connection_proxied(client, 502);
+    }
+}
+
+void proxy_flush(void) {
+    for (size_t i = 0; i < PROXY_MAX_UPSTREAMS; i++) {
+        struct proxy_upstream *upstream = &upstreams[i];
+        if (!upstream->used || !upstream->dirty || !upstream->connected) {
+            continue;
+        }
+        upstream->dirty = false;
+        if (output_queue_uncork(&upstream->output, upstream->sock) == -1) {
+            upstream_fail(upstream);
+        }
+    }
+}
+
+struct proxy_upstream *proxy_upstream_of(void *source) {
+    if ((char *)source < (char *)upstreams ||
+        (char *)source >= (char *)(upstreams + PROXY_MAX_UPSTREAMS)) {
+        return NULL;
+    }
+    return source;
+}
+
+/**
+ * Status code and Content-Length of the response header `head`
+ */
+static void parse_head(const char *head, size_t length, int *status,
+                       size_t *content_length) {
+    *status = 0;
+    *content_length = 0;
+    if (length > 12) *status = atoi(head + 9); // after "HTTP/1.1 "
+
+    static const char name[] = "\r\nContent-Length:";
+    const char *end = head + length;
+    for (const char *line = memmem(head, length, "\r\n", 2); line;
+         line = memmem(line + 2, end - line - 2, "\r\n", 2)) {
+        if ((size_t)(end - line) > sizeof(name) - 1 &&
+            strncasecmp(line, name, sizeof(name) - 1) == 0) {
+            *content_length = strtoull(line + sizeof(name) - 1, NULL, 10);
+            break;
+        }
+    }
+}
+
+/**
+ * Pass `length` bytes of a response on to `client`, with `head_length` of
+ * them a header. Header and payload go out in one write, so that the client
+ * socket does not hold back the payload waiting for an acknowledgement.
+ */
+static void pass_on(struct connection_state *client, const char *data,
+                    size_t head_length, size_t length) {
+    if (!client || length == 0) return;
+    struct output_part parts[] = {
+        {data, head_length, OUTPUT_BORROWED},
+        {data + head_length, length - head_length, OUTPUT_BORROWED},
+    };
+    if (head_length == 0) {
+        output_queue_send(&client->output, client->sock, &parts[1], 1);
+    } else {
+        output_queue_send(&client->output, client->sock, parts,
+                          head_length < length ? 2 : 1);
+    }
+}
+
+/**
+ * Pass the received data on to the waiting clients, noting the ones whose
+ * responses are complete in `done`. Returns false if the data does not
+ * make sense.
+ */
+static bool upstream_receive(struct proxy_upstream *upstream,
+                             struct proxy_done *done, size_t *done_count) {
+    char *start = upstream->buffer;
+    while (start < upstream->end) {
+        if (upstream->count == 0) return false; // nobody asked for it
+
+        struct proxy_slot *slot = &upstream->slots[upstream->head];
+        size_t head_length = 0;
+        if (!slot->started) {
+            char *head_end = memmem(start, upstream->end - start, "\r\n\r\n", 4);
+            if (!head_end) break;
+            head_length = head_end + 4 - start;
+            parse_head(start, head_length, &upstream->status,
+                       &upstream->body_left);
+            slot->started = true;
+            // Never sent again once the client saw part of the response
+            proxy_free_request(slot->request);
+            slot->request = NULL;
+        }
+        size_t available = upstream->end - start - head_length;
+        size_t length =
+            available < upstream->body_left ? available : upstream->body_left;
+        pass_on(slot->client, start, head_length, head_length + length);
+        start += head_length + length;
+        upstream->body_left -= length;
+
+        if (upstream->body_left == 0) {
+            if (slot->client) {
+                slot->client->proxied = false;
+                slot->client->upstream = NULL;
+                done[(*done_count)++] = (struct proxy_done){slot->client,
+                                                            upstream->status};
+            }
+            upstream->head = (upstream->head + 1) % PROXY_MAX_PIPELINE;
+            upstream->count -= 1;
+            upstream->used_at = monotonic_ms();
+        }
+    }
+
+    // A header that does not fit the buffer is no response of ours
+    if (start == upstream->buffer &&
+        upstream->end == upstream->buffer + HTTP_MAX_SIZE) {
+        return false;
+    }
+    upstream->end = buffer_discard(upstream->buffer, start - upstream->buffer,
+                                   upstream->end - start);
+    return true;
+}
+
+void proxy_handle(struct proxy_upstream *upstream) {
+    if (!upstream->connected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        struct sockaddr_in peer;
+        socklen_t peer_length = sizeof(peer);
+        if (getsockopt(upstream->sock, SOL_SOCKET, SO_ERROR, &error, &length) ==
+                -1 ||
+            error) {
+            upstream_fail(upstream);
+            return;
+        }
+        if (getpeername(upstream->sock, (struct sockaddr *)&peer,
+                        &peer_length) == -1) {
+            return; // still connecting
+        }
+        upstream->connected = true;
+        upstream->dirty = false;
+        if (output_queue_uncork(&upstream->output, upstream->sock) == -1) {
+            upstream_fail(upstream);
+            return;
+        }
+    } else if (output_queue_flush(&upstream->output, upstream->sock) == -1) {
+        upstream_fail(upstream);
+        return;
+    }
+
+    // Clients continue once the connection is consistent again, they may
+    // forward more requests
+    struct proxy_done done[PROXY_MAX_PIPELINE];
+    size_t done_count = 0;
+    bool failed = false;
+    while (true) {
+        ssize_t received =
+            recv(upstream->sock, upstream->end,
+                 upstream->buffer + HTTP_MAX_SIZE - upstream->end, MSG_DONTWAIT);
+        metrics_count(METRICS_IO_SYSCALLS);
+        if (received == -1 && errno == EINTR) continue;
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (received <= 0) {
+            failed = true;
+            break;
+        }
+        upstream->end += received;
+        if (!upstream_receive(upstream, done, &done_count)) {
+            failed = true;
+            break;
+        }
+    }
+
+    if (failed) upstream_fail(upstream);
+    for (size_t i = 0; i < done_count; i++) {
+        connection_proxied(done[i].client, done[i].status);
+    }
+}
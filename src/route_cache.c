@@ -0,0 +1,119 @@
+/**
+ * A cache of the hash ranges other nodes are responsible for, learned from
+ * DHT replies. Each reply names the responsible node and its predecessor,
+ * which exactly delimits the node's range.
+ *
+ * Ranges of a consistent ring are disjoint, so each is identified by its upper
+ * end. Entries are kept sorted by it: the range that may contain a hash is
+ * the first one ending at or after it, wrapping around to the first entry.
+ */
+
+#include "route_cache.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "dht.h"
+#include "options.h"
+#include "util.h"
+
+extern struct options options;
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct route routes[ROUTE_CACHE_CAPACITY];
+static size_t route_count = 0;
+
+static atomic_uint_fast64_t hits = 0;
+static atomic_uint_fast64_t misses = 0;
+
+static bool overlaps(const struct route *a, uint16_t pred_id, uint16_t id) {
+    // Two ranges on the ring overlap iff one contains the other's upper end
+    return is_responsible(a->id, id, pred_id) ||
+           is_responsible(id, a->id, a->pred_id);
+}
+
+static void remove_at(size_t i) {
+    memmove(&routes[i], &routes[i + 1],
+            (route_count - i - 1) * sizeof(routes[0]));
+    route_count -= 1;
+}
+
+void route_cache_insert(uint16_t pred_id, uint16_t id, const char *ip,
+                        uint16_t port) {
+    uint64_t now = monotonic_ms();
+
+    pthread_rwlock_wrlock(&lock);
+    for (size_t i = route_count; i-- > 0;) {
+        if (routes[i].expires_at <= now ||
+            overlaps(&routes[i], pred_id, id)) {
+            remove_at(i);
+        }
+    }
+
+    if (route_count == ROUTE_CACHE_CAPACITY) {
+        // Evict the entry that expires first
+        size_t oldest = 0;
+        for (size_t i = 1; i < route_count; i++) {
+            if (routes[i].expires_at < routes[oldest].expires_at) oldest = i;
+        }
+        remove_at(oldest);
+    }
+
+    size_t position = 0;
+    while (position < route_count && routes[position].id < id) position++;
+    memmove(&routes[position + 1], &routes[position],
+            (route_count - position) * sizeof(routes[0]));
+    route_count += 1;
+
+    struct route *route = &routes[position];
+    route->pred_id = pred_id;
+    route->id = id;
+    strncpy(route->ip, ip, sizeof(route->ip) - 1);
+    route->ip[sizeof(route->ip) - 1] = '\0';
+    route->port = port;
+    route->expires_at = now + (uint64_t)options.route_ttl_s * 1000;
+    pthread_rwlock_unlock(&lock);
+}
+
+bool route_cache_lookup(uint16_t hash, struct route *route) {
+    bool found = false;
+
+    pthread_rwlock_rdlock(&lock);
+    if (route_count > 0) {
+        // First range ending at or after `hash`
+        size_t low = 0, high = route_count;
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (routes[mid].id < hash) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        const struct route *candidate = &routes[low % route_count];
+        if (is_responsible(hash, candidate->id, candidate->pred_id) &&
+            candidate->expires_at > monotonic_ms()) {
+            *route = *candidate;
+            found = true;
+        }
+    }
+    pthread_rwlock_unlock(&lock);
+
+    atomic_fetch_add_explicit(found ? &hits : &misses, 1,
+                              memory_order_relaxed);
+    return found;
+}
+
+void route_cache_forget(uint16_t pred_id, uint16_t id) {
+    pthread_rwlock_wrlock(&lock);
+    for (size_t i = route_count; i-- > 0;) {
+        if (overlaps(&routes[i], pred_id, id)) remove_at(i);
+    }
+    pthread_rwlock_unlock(&lock);
+}
+
+void route_cache_stats(uint64_t *hit_count, uint64_t *miss_count) {
+    *hit_count = atomic_load_explicit(&hits, memory_order_relaxed);
+    *miss_count = atomic_load_explicit(&misses, memory_order_relaxed);
+}
@@ -0,0 +1,287 @@
+/**
+ * Size-classed slab allocator for the keys and values of the store
+ *
+ * Each size class keeps a list of pages that have free objects. Freed
+ * objects go onto their page's free list, so churn reuses memory of the
+ * same size instead of fragmenting the heap. Pages are mapped from the
+ * system in batches; a page that becomes empty goes to a shared pool for any
+ * class to reuse, and is returned to the system as a whole once the pool is
+ * full.
+ *
+ * Building with -DSLAB_MALLOC sends every allocation to malloc(), for
+ * comparison.
+ */
+
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/**
+ * Header at the start of every page
+ *
+ * `free_list` links freed objects, `bump` points to the part of the page
+ * never handed out yet. `prev` and `next` link the pages of a class that
+ * have free objects.
+ */
+struct slab_page {
+    struct slab_page *prev;
+    struct slab_page *next;
+    void *free_list;
+    char *bump;
+    uint32_t used;
+    uint32_t capacity;
+    uint32_t class;
+    bool listed;
+};
+
+#define PAGE_HEADER_SIZE ((sizeof(struct slab_page) + 63) & ~(size_t)63)
+
+struct slab_class {
+    pthread_mutex_t lock;
+    struct slab_page *partial;
+    size_t pages;
+    size_t objects;
+};
+
+static struct slab_class classes[SLAB_CLASSES];
+static pthread_once_t classes_once = PTHREAD_ONCE_INIT;
+
+// Empty pages, linked through `next`
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slab_page *pool = NULL;
+static size_t pool_pages = 0;
+
+static atomic_size_t large_objects = 0;
+static atomic_size_t large_bytes = 0;
+static atomic_uint_fast64_t system_allocations = 0;
+static atomic_uint_fast64_t system_frees = 0;
+
+static void classes_init(void) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_init(&classes[i].lock, NULL);
+    }
+}
+
+static bool large(size_t size) {
+#ifdef SLAB_MALLOC
+    (void)size;
+    return true;
+#else
+    return size > SLAB_MAX_OBJECT;
+#endif
+}
+
+static size_t class_of(size_t size) {
+    if (size <= 128) return size == 0 ? 0 : (size - 1) / 16;
+    unsigned log = 63 - __builtin_clzll(size - 1);
+    size_t step = (size_t)1 << (log - 2);
+    return 8 + (log - 7) * 4 + ((size - 1) - ((size_t)1 << log)) / step;
+}
+
+static size_t class_size(size_t class) {
+    if (class < 8) return (class + 1) * 16;
+    unsigned log = (class - 8) / 4 + 7;
+    return ((size_t)1 << log) + ((class - 8) % 4 + 1) * ((size_t)1 << (log - 2));
+}
+
+size_t slab_capacity(size_t size) {
+    return large(size) ? size : class_size(class_of(size));
+}
+
+static void count(atomic_uint_fast64_t *counter) {
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static void list_push(struct slab_class *class, struct slab_page *page) {
+    page->prev = NULL;
+    page->next = class->partial;
+    if (class->partial) class->partial->prev = page;
+    class->partial = page;
+    page->listed = true;
+}
+
+static void list_remove(struct slab_class *class, struct slab_page *page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        class->partial = page->next;
+    }
+    if (page->next) page->next->prev = page->prev;
+    page->listed = false;
+}
+
+/**
+ * Map `SLAB_BATCH_PAGES` aligned pages, keep the first and pool the others.
+ * Called with `pool_lock` held.
+ */
+static struct slab_page *pages_map(void) {
+    size_t length = (SLAB_BATCH_PAGES + 1) * SLAB_PAGE_SIZE;
+    char *region = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) return NULL;
+    count(&system_allocations);
+
+    // Unmap the unaligned head and tail
+    char *start = (char *)(((uintptr_t)region + SLAB_PAGE_SIZE - 1) &
+                           ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    char *end = start + SLAB_BATCH_PAGES * SLAB_PAGE_SIZE;
+    if (start > region) munmap(region, start - region);
+    if (region + length > end) munmap(end, region + length - end);
+
+    for (size_t i = 1; i < SLAB_BATCH_PAGES; i++) {
+        struct slab_page *page = (struct slab_page *)(start + i * SLAB_PAGE_SIZE);
+        page->next = pool;
+        pool = page;
+        pool_pages += 1;
+    }
+    return (struct slab_page *)start;
+}
+
+static struct slab_page *page_new(size_t class) {
+    pthread_mutex_lock(&pool_lock);
+    struct slab_page *page = pool;
+    if (page) {
+        pool = page->next;
+        pool_pages -= 1;
+    } else {
+        page = pages_map();
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (!page) return NULL;
+
+    size_t size = class_size(class);
+    page->free_list = NULL;
+    page->bump = (char *)page + PAGE_HEADER_SIZE;
+    page->capacity = (SLAB_PAGE_SIZE - PAGE_HEADER_SIZE) / size;
+    page->used = 0;
+    page->class = class;
+    return page;
+}
+
+void *slab_alloc(size_t size) {
+    if (large(size)) {
+        void *object = malloc(size);
+        if (!object) return NULL;
+        count(&system_allocations);
+        atomic_fetch_add_explicit(&large_objects, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&large_bytes, size, memory_order_relaxed);
+        return object;
+    }
+
+    pthread_once(&classes_once, classes_init);
+    size_t index = class_of(size);
+    struct slab_class *class = &classes[index];
+    pthread_mutex_lock(&class->lock);
+
+    struct slab_page *page = class->partial;
+    if (!page) {
+        if (!(page = page_new(index))) {
+            pthread_mutex_unlock(&class->lock);
+            return NULL;
+        }
+        list_push(class, page);
+        class->pages += 1;
+    }
+
+    void *object;
+    if (page->free_list) {
+        object = page->free_list;
+        page->free_list = *(void **)object;
+    } else {
+        object = page->bump;
+        page->bump += class_size(index);
+    }
+    page->used += 1;
+    if (page->used == page->capacity) list_remove(class, page);
+    class->objects += 1;
+
+    pthread_mutex_unlock(&class->lock);
+    return object;
+}
+
+void slab_free(void *object, size_t size) {
+    if (!object) return;
+    if (large(size)) {
+        free(object);
+        count(&system_frees);
+        atomic_fetch_sub_explicit(&large_objects, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&large_bytes, size, memory_order_relaxed);
+        return;
+    }
+
+    struct slab_page *page =
+        (struct slab_page *)((uintptr_t)object & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    struct slab_class *class = &classes[page->class];
+    struct slab_page *release = NULL;
+    pthread_mutex_lock(&class->lock);
+
+    *(void **)object = page->free_list;
+    page->free_list = object;
+    page->used -= 1;
+    class->objects -= 1;
+    if (!page->listed) list_push(class, page);
+
+    if (page->used == 0) {
+        list_remove(class, page);
+        class->pages -= 1;
+        release = page;
+    }
+    pthread_mutex_unlock(&class->lock);
+
+    if (release) {
+        pthread_mutex_lock(&pool_lock);
+        if (pool_pages < SLAB_POOL_PAGES) {
+            release->next = pool;
+            pool = release;
+            pool_pages += 1;
+            release = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    if (release) {
+        munmap(release, SLAB_PAGE_SIZE);
+        count(&system_frees);
+    }
+}
+
+void slab_trim(void) {
+    pthread_mutex_lock(&pool_lock);
+    struct slab_page *pages = pool;
+    pool = NULL;
+    pool_pages = 0;
+    pthread_mutex_unlock(&pool_lock);
+
+    while (pages) {
+        struct slab_page *next = pages->next;
+        munmap(pages, SLAB_PAGE_SIZE);
+        count(&system_frees);
+        pages = next;
+    }
+}
+
+void slab_stats(struct slab_stats *stats) {
+    pthread_once(&classes_once, classes_init);
+    *stats = (struct slab_stats){0};
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        struct slab_class *class = &classes[i];
+        pthread_mutex_lock(&class->lock);
+        stats->pages += class->pages;
+        stats->objects += class->objects;
+        stats->object_bytes += class->objects * class_size(i);
+        pthread_mutex_unlock(&class->lock);
+    }
+    pthread_mutex_lock(&pool_lock);
+    stats->pool_pages = pool_pages;
+    pthread_mutex_unlock(&pool_lock);
+    stats->large_objects =
+        atomic_load_explicit(&large_objects, memory_order_relaxed);
+    stats->large_bytes = atomic_load_explicit(&large_bytes, memory_order_relaxed);
+    stats->system_allocations =
+        atomic_load_explicit(&system_allocations, memory_order_relaxed);
+    stats->system_frees =
+        atomic_load_explicit(&system_frees, memory_order_relaxed);
+}
@@ -0,0 +1,237 @@
+/**
+ * Compacted snapshots of the store
+ *
+ * Layout, in native byte order:
+ *
+ *     header | values | index | keys
+ *
+ * Every value is preceded by `VALUE_HEADER_SIZE` bytes and aligned to 16,
+ * so that the mapped file can be handed to the store without copying. The
+ * index holds one `snapshot_entry` per key. The header's checksum covers the
+ * index and the keys; the file as a whole is only renamed into place once it
+ * is synced, so it is either complete or absent.
+ */
+
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define SNAPSHOT_MAGIC "RNSNAP01"
+#define SNAPSHOT_ALIGN 16
+#define SNAPSHOT_WRITE_BUFFER (1 << 20)
+
+struct snapshot_header {
+    char magic[8];
+    uint64_t segment;
+    uint64_t count;
+    uint64_t index_offset;
+    uint64_t keys_offset;
+    uint64_t size;
+    uint32_t checksum;
+    uint32_t reserved;
+    char padding[8];
+};
+
+struct snapshot_entry {
+    uint64_t value_offset;
+    uint64_t value_length;
+    uint64_t key_offset;
+    uint64_t key_length;
+};
+
+/**
+ * A buffer that grows as needed
+ */
+struct growing {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+static void growing_append(struct growing *buffer, const void *data,
+                           size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (buffer->length + length > capacity) capacity *= 2;
+        char *grown = realloc(buffer->data, capacity);
+        if (!grown) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+struct snapshot_writer {
+    int fd;
+    uint64_t offset; // of the end of the values written so far
+    struct growing output;
+    struct growing index;
+    struct growing keys;
+};
+
+static void write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+static void flush_output(struct snapshot_writer *writer) {
+    write_all(writer->fd, writer->output.data, writer->output.length);
+    writer->output.length = 0;
+}
+
+static void write_entry(void *context, const char *key, size_t key_length,
+                        const char *value, size_t value_length) {
+    struct snapshot_writer *writer = context;
+
+    // The header a mapped value needs, see `value_wrap()`
+    char header[VALUE_HEADER_SIZE] = {0};
+    value_wrap(header);
+    static const char padding[SNAPSHOT_ALIGN] = {0};
+    size_t pad = (SNAPSHOT_ALIGN - value_length % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+
+    struct snapshot_entry entry = {
+        .value_offset = writer->offset + VALUE_HEADER_SIZE,
+        .value_length = value_length,
+        .key_offset = writer->keys.length,
+        .key_length = key_length,
+    };
+    growing_append(&writer->index, &entry, sizeof(entry));
+    growing_append(&writer->keys, key, key_length + 1);
+
+    growing_append(&writer->output, header, sizeof(header));
+    if (value_length >= SNAPSHOT_WRITE_BUFFER) {
+        flush_output(writer);
+        write_all(writer->fd, value, value_length);
+    } else {
+        growing_append(&writer->output, value, value_length);
+    }
+    growing_append(&writer->output, padding, pad);
+    writer->offset += VALUE_HEADER_SIZE + value_length + pad;
+    if (writer->output.length >= SNAPSHOT_WRITE_BUFFER) flush_output(writer);
+}
+
+size_t snapshot_write(struct store *store, const char *directory,
+                      uint64_t segment) {
+    char path[4096], temporary[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, SNAPSHOT_FILE);
+    snprintf(temporary, sizeof(temporary), "%s/%s.tmp", directory,
+             SNAPSHOT_FILE);
+
+    struct snapshot_writer writer = {
+        .fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644),
+        .offset = sizeof(struct snapshot_header),
+    };
+    if (writer.fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    struct snapshot_header header = {.magic = SNAPSHOT_MAGIC};
+    growing_append(&writer.output, &header, sizeof(header));
+
+    store_for_each(store, write_entry, &writer);
+    flush_output(&writer);
+
+    // Key offsets become relative to the file
+    header.count = writer.index.length / sizeof(struct snapshot_entry);
+    header.segment = segment;
+    header.index_offset = writer.offset;
+    header.keys_offset = writer.offset + writer.index.length;
+    header.size = header.keys_offset + writer.keys.length;
+    struct snapshot_entry *entries = (struct snapshot_entry *)writer.index.data;
+    for (size_t i = 0; i < header.count; i++) {
+        entries[i].key_offset += header.keys_offset;
+    }
+    header.checksum = crc32c(0, writer.index.data, writer.index.length);
+    header.checksum = crc32c(header.checksum, writer.keys.data, writer.keys.length);
+
+    write_all(writer.fd, writer.index.data, writer.index.length);
+    write_all(writer.fd, writer.keys.data, writer.keys.length);
+    if (pwrite(writer.fd, &header, sizeof(header), 0) != sizeof(header) ||
+        fsync(writer.fd) == -1 || close(writer.fd) == -1 ||
+        rename(temporary, path) == -1) {
+        perror("snapshot");
+        exit(EXIT_FAILURE);
+    }
+    int directory_fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (directory_fd == -1 || fsync(directory_fd) == -1) {
+        perror("fsync");
+        exit(EXIT_FAILURE);
+    }
+    close(directory_fd);
+
+    free(writer.output.data);
+    free(writer.index.data);
+    free(writer.keys.data);
+    return header.count;
+}
+
+bool snapshot_load(struct store *store, const char *directory, size_t *keys,
+                   uint64_t *segment) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, SNAPSHOT_FILE);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) == -1 ||
+        (size_t)info.st_size < sizeof(struct snapshot_header)) {
+        close(fd);
+        return false;
+    }
+    // Private and writable: reference counts are kept in the values' headers
+    size_t size = info.st_size;
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    struct snapshot_header *header = (struct snapshot_header *)data;
+    struct snapshot_entry *entries =
+        (struct snapshot_entry *)(data + header->index_offset);
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->size != size || header->index_offset > header->keys_offset ||
+        header->keys_offset > size ||
+        header->count != (header->keys_offset - header->index_offset) /
+                             sizeof(struct snapshot_entry) ||
+        crc32c(0, entries, size - header->index_offset) != header->checksum) {
+        munmap(data, size);
+        return false;
+    }
+
+    for (size_t i = 0; i < header->count; i++) {
+        struct snapshot_entry *entry = &entries[i];
+        if (entry->key_offset + entry->key_length >= size ||
+            data[entry->key_offset + entry->key_length] != '\0' ||
+            entry->value_offset < VALUE_HEADER_SIZE ||
+            entry->value_offset + entry->value_length > header->index_offset) {
+            continue; // cannot happen with a valid checksum
+        }
+        char *value = value_wrap(data + entry->value_offset - VALUE_HEADER_SIZE);
+        set_value(store, data + entry->key_offset, value, entry->value_length);
+    }
+
+    // The values stay mapped for as long as the store refers to them
+    *keys = header->count;
+    *segment = header->segment;
+    return true;
+}
@@ -1,142 +1,226 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "socket_handler.h"
 #include "http.h"
 #include "dht_handler.h"
 #include "http_response.h"
+#include "log.h"
+#include "metrics.h"
+#include "migrate.h"
+#include "options.h"
+#include "proxy.h"
+#include "wal.h"
+#include "route_cache.h"
 #include "dht.h"
 #include "util.h"
 
 extern struct dht_state dht;
+extern struct options options;
+
+static bool process_buffer(struct connection_state *state);
+static void connection_expired(struct timer *timer);
+static void connection_submit(struct output_queue *output,
+                              const struct msghdr *message);
+static void connection_release(struct connection_state *state);
 
 static bool should_close_connection(struct request *request) {
     const string connection_header = get_header(request, "Connection");
     return connection_header && strcmp(connection_header, "close") == 0;
 }
 
-void send_reply(int conn, struct request *request, int udp_socket) {
-    char buffer[HTTP_MAX_SIZE];
-    char *reply = buffer;
-    size_t offset = 0;
+static void send_redirect_to(struct connection_state *conn, const char *ip,
+                             uint16_t port, const char *uri) {
+    char port_str[6];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    send_redirect(conn, ip, port_str, uri);
+}
+
+/**
+ * Whether the connection waits for the response to a parked or forwarded
+ * request; later requests are only processed afterwards
+ */
+static bool connection_waiting(const struct connection_state *state) {
+    return state->parked || state->proxied;
+}
+
+/**
+ * Forward `request` to the node at `ip`:`port` in proxy mode. Returns false if
+ * it is to be redirected instead.
+ */
+static bool forward(struct connection_state *state,
+                    const struct request *request, const char *ip,
+                    uint16_t port) {
+    if (!proxy_wanted(request)) return false;
+    struct proxy_request *copy = proxy_copy_request(state, request);
+    if (copy && proxy_forward(state, copy, ip, port)) return true;
+    proxy_free_request(copy);
+    return false;
+}
+
+/**
+ * Answer `request`, unless it is parked or forwarded. Returns the status code
+ * sent, or zero if the response is still to come.
+ */
+static int answer(struct connection_state *state, struct request *request) {
+    struct connection_state *conn = state;
+
+    log_debug("Handling %s request for %s (%zd byte payload)\n",
+              request->method, request->uri, request->payload_length);
 
-    fprintf(stderr, "(%s:%d) Handling %s request for %s (%lu byte payload)\n",
-            dht.self_ip, dht.self_port, request->method, request->uri, request->payload_length);
+    // Every node answers for its own metrics
+    if (strcmp(request->uri, METRICS_PATH) == 0 &&
+        strcmp(request->method, "GET") == 0) {
+        return send_metrics(conn);
+    }
+    // Keys moved here are accepted even before joining has finished. Without
+    // the header naming the sender, the path is an ordinary key.
+    if (strcmp(request->uri, MIGRATE_PATH) == 0 &&
+        strcmp(request->method, "PUT") == 0 &&
+        get_header(request, MIGRATE_FROM_HEADER)) {
+        return handle_migration(conn, request);
+    }
 
     uint16_t uri_hash =
-        pseudo_hash((unsigned char *)request->uri, strlen(request->uri));
+        ring_hash((unsigned char *)request->uri, strlen(request->uri));
+
+    // Not responsible for anything while joining the ring
+    struct dht_node node;
+    uint16_t pred_id;
+    enum dht_route route = dht_route(&dht, uri_hash, &node, &pred_id);
+    if (route == DHT_ROUTE_JOINING) {
+        send_service_unavailable(conn);
+        return 503;
+    }
 
     // DHT PART
     // check if we are responsible
-    if (is_responsible(uri_hash, dht.self_id, dht.pred_id)) {
-        fprintf(stderr, "(%s:%d) Responsible for hash 0x%04x\n", dht.self_ip, dht.self_port, uri_hash);
+    if (route == DHT_ROUTE_SELF) {
+        log_debug("Responsible for hash 0x%04x as 0x%04x\n", uri_hash, node.id);
 
-        // If it's a GET or DELETE request and the resource doesn't exist, return 404
-        if (strcmp(request->method, "GET") == 0 || strcmp(request->method, "DELETE") == 0) {
+        // If it's a GET request and the resource doesn't exist, return 404.
+        // A DELETE of a missing key still goes on, it may be on its way here
+        // from the previous owner, see `migrate_delete()`.
+        if (strcmp(request->method, "GET") == 0) {
             size_t resource_length;
-            const char *resource = get(request->uri, resources, MAX_RESOURCES, &resource_length);
-            if (!resource) {
+            const char *resource = get(&resources, request->uri, &resource_length);
+            if (resource) {
+                release(resource);
+            } else {
                 const char *not_found = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
                 send_http_response(conn, not_found, strlen(not_found));
-                return;
+                return 404;
             }
         }
     
     // check if our successor is responsible
-    } else if (is_responsible(uri_hash, dht.succ_id, dht.self_id)) {
+    } else if (route == DHT_ROUTE_SUCCESSOR) {
+        if (forward(state, request, node.ip, ntohs(node.addr.sin_port))) {
+            log_debug("Successor is responsible for hash 0x%04x, forwarding "
+                      "to: %s:%s\n",
+                      uri_hash, node.ip, node.port);
+            return 0;
+        }
         // Our successor is responsible, redirect to it
-        fprintf(stderr, "(%s:%d) Successor is responsible for hash 0x%04x, redirecting to: %s:%s\n", 
-                dht.self_ip, dht.self_port, uri_hash, dht.succ_ip, dht.succ_port);
-        send_redirect(conn, dht.succ_ip, dht.succ_port, request->uri);
-        return;
+        log_debug("Successor is responsible for hash 0x%04x, redirecting to: "
+                  "%s:%s\n",
+                  uri_hash, node.ip, node.port);
+        send_redirect(conn, node.ip, node.port, request->uri);
+        return 303;
     } else {
-        // Check if we have received a DHT reply
-        uint16_t responsible_id;
-        const char *responsible_ip;
-        uint16_t responsible_port;
-        
-        // First check if we already have a reply
-        if (get_last_dht_reply(&responsible_id, &responsible_ip, &responsible_port)) {
-            // We have a reply, redirect to the responsible node
-            fprintf(stderr, "(%s:%d) Have reply for hash 0x%04x, redirecting to: %s:%d\n", 
-                    dht.self_ip, dht.self_port, uri_hash, responsible_ip, responsible_port);
-            char port_str[6];
-            snprintf(port_str, sizeof(port_str), "%d", responsible_port);
-            send_redirect(conn, responsible_ip, port_str, request->uri);
-            return;
-        }
-        
-        // No reply yet, send lookup
-        fprintf(stderr, "(%s:%d) No reply yet for hash 0x%04x, sending lookup to successor: %s:%s\n", 
-                dht.self_ip, dht.self_port, uri_hash, dht.succ_ip, dht.succ_port);
-        send_dht_lookup(udp_socket, &dht, uri_hash);
-        
-        // Check again for reply after sending lookup
-        if (get_last_dht_reply(&responsible_id, &responsible_ip, &responsible_port)) {
-            // Got a reply after lookup, redirect
-            fprintf(stderr, "(%s:%d) Got reply after lookup for hash 0x%04x, redirecting to: %s:%d\n", 
-                    dht.self_ip, dht.self_port, uri_hash, responsible_ip, responsible_port);
-            char port_str[6];
-            snprintf(port_str, sizeof(port_str), "%d", responsible_port);
-            send_redirect(conn, responsible_ip, port_str, request->uri);
-            return;
+        // A previous reply may already cover this hash
+        struct route cached;
+        if (route_cache_lookup(uri_hash, &cached)) {
+            if (forward(state, request, cached.ip, cached.port)) {
+                log_debug("Cached route for hash 0x%04x, forwarding to: "
+                          "%s:%d\n",
+                          uri_hash, cached.ip, cached.port);
+                return 0;
+            }
+            log_debug("Cached route for hash 0x%04x, redirecting to: %s:%d\n",
+                      uri_hash, cached.ip, cached.port);
+            send_redirect_to(conn, cached.ip, cached.port, request->uri);
+            return 303;
         }
-        
-        // Still no reply, send 503
-        fprintf(stderr, "(%s:%d) No reply after lookup for hash 0x%04x, sending 503\n", 
-                dht.self_ip, dht.self_port, uri_hash);
-        send_service_unavailable(conn);
-        return;
+
+        // No reply yet: park the request until the lookup resolves or times
+        // out, see `connection_resume_all()`
+        log_debug("No reply yet for hash 0x%04x, parking request until lookup "
+                  "resolves\n",
+                  uri_hash);
+        connection_park(state, uri_hash, request);
+        dht_lookup_start(state->loop, uri_hash);
+        return 0;
     }
 
     // WEBSERVER PART
-    fprintf(stderr, "(%s:%d) Handling request locally\n", dht.self_ip, dht.self_port);
+    log_debug("Handling request locally\n");
 
+    int status = 501;
     if (strcmp(request->method, "GET") == 0) {
-        handle_get_request(conn, request->uri, &offset, reply);
+        status = handle_get_request(conn, request->uri);
     } else if (strcmp(request->method, "PUT") == 0) {
-        handle_put_request(conn, request->uri, request->payload,
-                          request->payload_length, &offset, reply);
+        status = handle_put_request(conn, request->uri, request->payload,
+                                    request->payload_length);
     } else if (strcmp(request->method, "DELETE") == 0) {
-        handle_delete_request(conn, request->uri, &offset, reply);
+        status = handle_delete_request(conn, request->uri);
     } else {
-        reply = "HTTP/1.1 501 Method Not Supported\r\n\r\n";
-        offset = strlen(reply);
+        const char *reply = "HTTP/1.1 501 Method Not Supported\r\n\r\n";
+        send_http_response(conn, reply, strlen(reply));
     }
 
-    send_http_response(conn, reply, offset);
+    log_debug("URI hash: 0x%04x, self_id: 0x%04x, pred_id: 0x%04x\n", uri_hash,
+              node.id, pred_id);
+    return status;
+}
+
+void send_reply(struct connection_state *state, struct request *request) {
+    uint64_t start = metrics_now();
+    enum metrics_method method = metrics_method(request->method);
 
-    fprintf(stderr, "(%s:%d) URI hash: 0x%04x, self_id: 0x%04x, pred_id: 0x%04x\n",
-            dht.self_ip, dht.self_port, uri_hash, dht.self_id, dht.pred_id);
-    fprintf(stderr, "(%s:%d) Is responsible: %d\n",
-            dht.self_ip, dht.self_port, is_responsible(uri_hash, dht.self_id, dht.pred_id));
+    int status = answer(state, request);
+    if (connection_waiting(state)) {
+        // Counted once the response is known
+        state->parked_method = method;
+        state->parked_since = start;
+    } else {
+        metrics_request(method, status, start);
+    }
 }
 
-size_t process_packet(int conn, char *buffer, size_t n, int udp_socket) {
-    struct request request = {0};
-    ssize_t bytes_processed = parse_request(buffer, n, &request);
+ssize_t process_packet(struct connection_state *state, char *buffer, size_t n) {
+    struct request request;
+    ssize_t bytes_processed =
+        parse_request(&state->parser, buffer, n, &request);
 
     if (bytes_processed > 0) {
-        send_reply(conn, &request, udp_socket);
+        send_reply(state, &request);
+        if (connection_waiting(state)) {
+            // Answered later, the request's bytes are no longer needed
+            state->close_after_parked = should_close_connection(&request);
+            return bytes_processed;
+        }
         return should_close_connection(&request) ? -1 : bytes_processed;
     }
 
     if (bytes_processed == -1) {
         const string bad_request = "HTTP/1.1 400 Bad Request\r\n\r\n";
-        send_http_response(conn, bad_request, strlen(bad_request));
-        printf("Received malformed request, terminating connection.\n");
-        close(conn);
+        send_http_response(state, bad_request, strlen(bad_request));
+        metrics_request(METRICS_OTHER_METHOD, 400, metrics_now());
+        log_info("Received malformed request, terminating connection.\n");
         return -1;
     }
 
     return bytes_processed;
 }
 
-int setup_socket_common(int sock) {
+int setup_socket_common(int sock, bool reuse_port) {
     if (sock == -1) {
         perror("socket");
         exit(EXIT_FAILURE);
@@ -148,6 +232,14 @@ int setup_socket_common(int sock) {
         exit(EXIT_FAILURE);
     }
 
+    // Lets every worker bind its own socket to the same address, the kernel
+    // then spreads connections and datagrams between them.
+    if (reuse_port &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
     return sock;
 }
 
@@ -159,12 +251,12 @@ static void bind_socket(int sock, struct sockaddr_in addr) {
     }
 }
 
-int setup_server_socket(struct sockaddr_in addr) {
-    int sock = setup_socket_common(socket(AF_INET, SOCK_STREAM, 0));
+int setup_server_socket(struct sockaddr_in addr, bool reuse_port) {
+    int sock = setup_socket_common(socket(AF_INET, SOCK_STREAM, 0), reuse_port);
 
     bind_socket(sock, addr);
 
-    if (listen(sock, 1) == -1) {
+    if (listen(sock, SOMAXCONN) == -1) {
         perror("listen");
         close(sock);
         exit(EXIT_FAILURE);
@@ -176,12 +268,12 @@ int setup_server_socket(struct sockaddr_in addr) {
         exit(EXIT_FAILURE);
     }
 
-    fprintf(stderr, "Setting up TCP socket on port %d\n", ntohs(addr.sin_port));
+    log_info("Setting up TCP socket on port %d\n", ntohs(addr.sin_port));
     return sock;
 }
 
-int setup_udp_socket(struct sockaddr_in addr) {
-    int sock = setup_socket_common(socket(AF_INET, SOCK_DGRAM, 0));
+int setup_udp_socket(struct sockaddr_in addr, bool reuse_port) {
+    int sock = setup_socket_common(socket(AF_INET, SOCK_DGRAM, 0), reuse_port);
 
     if (fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
         perror("fcntl");
@@ -195,14 +287,328 @@ int setup_udp_socket(struct sockaddr_in addr) {
         return -1;
     }
 
-    fprintf(stderr, "Setting up UDP socket on port %d\n", ntohs(addr.sin_port));
+    log_info("Setting up UDP socket on port %d\n", ntohs(addr.sin_port));
     return sock;
 }
 
-void connection_setup(struct connection_state *state, int sock) {
+void connection_setup(struct connection_state *state, int sock,
+                      struct event_loop *loop) {
     state->sock = sock;
     state->end = state->buffer;
     memset(state->buffer, 0, HTTP_MAX_SIZE);
+    http_parser_init(&state->parser);
+    state->loop = loop;
+    state->body = NULL;
+    state->body_received = 0;
+    if (loop->uring) {
+        // Responses go out with the loop's next submission
+        output_queue_init_submitted(&state->output, connection_submit);
+    } else {
+        output_queue_init(&state->output);
+    }
+    state->closing = false;
+    state->parked = false;
+    state->parked_uri = NULL;
+    state->close_after_parked = false;
+    state->prev_parked = state->next_parked = NULL;
+    state->parked_request = NULL;
+    state->proxied = false;
+    state->upstream = NULL;
+    state->syncing = false;
+    state->sync_position = 0;
+    state->prev_syncing = state->next_syncing = NULL;
+    state->reported_bytes = 0;
+    state->peak_bytes = 0;
+    timer_init(&state->timer, connection_expired);
+    state->request_started = 0;
+    state->inbox = NULL;
+    state->inbox_length = state->inbox_capacity = 0;
+    state->receiving = state->receive_paused = false;
+    state->received_end = false;
+    state->receive_error = 0;
+    state->closed = false;
+}
+
+/**
+ * Arm the connection's timer for what it waits for now: the rest of a payload
+ * or of a request header, which are to arrive within the header timeout, or
+ * else the next request, within the idle timeout
+ */
+static void connection_schedule(struct connection_state *state) {
+    uint64_t now = monotonic_ms();
+    unsigned timeout_s = options.idle_timeout_s;
+    uint64_t since = now;
+    if (state->body) {
+        // Only a payload that stops arriving is cut off, not a long one
+        timeout_s = options.header_timeout_s;
+    } else if (state->end > state->buffer && !connection_waiting(state) &&
+               !state->syncing) {
+        if (!state->request_started) state->request_started = now;
+        timeout_s = options.header_timeout_s;
+        since = state->request_started;
+    } else {
+        state->request_started = 0;
+    }
+
+    if (timeout_s == 0) {
+        timer_cancel(&state->loop->timers, &state->timer);
+    } else {
+        timer_arm(&state->loop->timers, &state->timer,
+                  since + (uint64_t)timeout_s * 1000);
+    }
+}
+
+/**
+ * Update the connection buffer gauge with the bytes `state` holds now, and
+ * its timer with what it waits for
+ */
+static void connection_account(struct connection_state *state) {
+    connection_schedule(state);
+    size_t bytes = (state->end - state->buffer) + state->body_received +
+                   state->output.pending_bytes + state->inbox_length;
+    if (bytes != state->reported_bytes) {
+        metrics_gauge_add(METRICS_CONNECTION_BYTES,
+                          (int64_t)bytes - (int64_t)state->reported_bytes);
+        state->reported_bytes = bytes;
+    }
+    if (bytes > state->peak_bytes) state->peak_bytes = bytes;
+}
+
+static void connection_unpark(struct connection_state *state) {
+    struct event_loop *loop = state->loop;
+    if (state->prev_parked) {
+        state->prev_parked->next_parked = state->next_parked;
+    } else {
+        loop->parked = state->next_parked;
+    }
+    if (state->next_parked) {
+        state->next_parked->prev_parked = state->prev_parked;
+    }
+    state->prev_parked = state->next_parked = NULL;
+
+    free(state->parked_uri);
+    proxy_free_request(state->parked_request);
+    state->parked_uri = NULL;
+    state->parked_request = NULL;
+    state->parked = false;
+}
+
+static void connection_unsync(struct connection_state *state) {
+    struct event_loop *loop = state->loop;
+    if (state->prev_syncing) {
+        state->prev_syncing->next_syncing = state->next_syncing;
+    } else {
+        loop->syncing = state->next_syncing;
+    }
+    if (state->next_syncing) {
+        state->next_syncing->prev_syncing = state->prev_syncing;
+    }
+    state->prev_syncing = state->next_syncing = NULL;
+    state->syncing = false;
+}
+
+/**
+ * Send the responses corked in `state`'s output once the changes they
+ * acknowledge are durable
+ *
+ * `position` is the thread's log position from before the requests were
+ * answered. If they changed the store, the output stays corked and the
+ * connection waits in the loop's `syncing` list, so that the loop serves
+ * other connections meanwhile and their changes share the next sync.
+ * Returns -1 if the output failed.
+ */
+static int connection_acknowledge(struct connection_state *state,
+                                  uint64_t position) {
+    uint64_t appended = wal_position();
+    if (appended != position) state->sync_position = appended;
+    if (appended != position || state->syncing) {
+        struct event_loop *loop = state->loop;
+        if (wal_notify(state->sync_position, event_loop_wake, loop->id)) {
+            if (!state->syncing) {
+                state->syncing = true;
+                state->prev_syncing = NULL;
+                state->next_syncing = loop->syncing;
+                if (loop->syncing) loop->syncing->prev_syncing = state;
+                loop->syncing = state;
+            }
+            return 0;
+        }
+        if (state->syncing) connection_unsync(state);
+    }
+    return output_queue_uncork(&state->output, state->sock);
+}
+
+void connection_release_synced(struct event_loop *loop) {
+    struct connection_state *next;
+    for (struct connection_state *state = loop->syncing; state; state = next) {
+        next = state->next_syncing;
+        if (!wal_durable(state->sync_position)) {
+            // Synced meanwhile, or notified again by the next sync
+            if (wal_notify(state->sync_position, event_loop_wake, loop->id)) {
+                continue;
+            }
+        }
+        connection_unsync(state);
+
+        // Requests that arrived meanwhile are still to be read
+        if (output_queue_uncork(&state->output, state->sock) == -1 ||
+            (!connection_waiting(state) && !handle_incoming_data(state))) {
+            connection_finish(state);
+        } else {
+            connection_account(state);
+        }
+    }
+}
+
+void connection_close(struct connection_state *state) {
+    timer_cancel(&state->loop->timers, &state->timer);
+    if (state->parked) connection_unpark(state);
+    if (state->proxied) proxy_detach(state);
+    if (state->syncing) connection_unsync(state);
+    if (state->body) release(state->body);
+    metrics_gauge_add(METRICS_CONNECTION_BYTES, -(int64_t)state->reported_bytes);
+    metrics_gauge_add(METRICS_CONNECTIONS_OPEN, -1);
+    metrics_connection_peak(state->peak_bytes);
+
+    state->closed = true;
+    if (state->receiving || state->output.in_flight) {
+        // The kernel still uses the connection's memory and socket, which are
+        // released once the cancelled requests completed. Until then, the
+        // socket's number cannot be reused for a connection that requests
+        // prepared for this one would go to. Nothing more is sent.
+        if (state->receiving) event_loop_cancel_receive(state->loop, state);
+        if (state->output.in_flight) event_loop_cancel_send(state->loop, state);
+        output_queue_cork(&state->output);
+        return;
+    }
+    connection_release(state);
+}
+
+/**
+ * Free a closed connection once nothing is in flight for it anymore
+ */
+static void connection_release(struct connection_state *state) {
+    if (state->receiving || state->output.in_flight) return;
+    // Closing the socket also removes it from the epoll set
+    close(state->sock);
+    output_queue_clear(&state->output);
+    free(state->inbox);
+    free(state);
+}
+
+void connection_finish(struct connection_state *state) {
+    // Rare enough to wait for the log in place
+    if (state->syncing) {
+        wal_sync();
+        connection_unsync(state);
+        if (output_queue_uncork(&state->output, state->sock) == -1) {
+            connection_close(state);
+            return;
+        }
+    }
+    // Responses still queued are sent before the connection goes away
+    if (output_queue_pending(&state->output) && !state->output.failed) {
+        state->closing = true;
+        connection_account(state);
+        return;
+    }
+    connection_close(state);
+}
+
+/**
+ * Close a connection whose timer ran out. A client that was still sending a
+ * request is told so, as far as the socket takes it right away.
+ */
+static void connection_expired(struct timer *timer) {
+    struct connection_state *state =
+        container_of(timer, struct connection_state, timer);
+    bool slow = state->request_started || state->body;
+    if (slow && !state->output.failed) {
+        const string timeout =
+            "HTTP/1.1 408 Request Timeout\r\nConnection: close\r\n\r\n";
+        send_http_response(state, timeout, strlen(timeout));
+    }
+    metrics_count(METRICS_CONNECTIONS_TIMED_OUT);
+    log_debug("Closing connection %d, %s\n", state->sock,
+              slow ? "request incomplete" : "idle");
+    connection_close(state);
+}
+
+/**
+ * Carry on with a connection whose parked or forwarded request was answered
+ */
+static void connection_continue(struct connection_state *state) {
+    if (state->proxied) {
+        // Forwarded once the lookup resolved, the response is still to come
+        if (connection_acknowledge(state, wal_position()) == -1) {
+            connection_finish(state);
+        } else {
+            connection_account(state);
+        }
+    } else if (state->close_after_parked) {
+        connection_acknowledge(state, wal_position());
+        connection_finish(state);
+    } else if (!process_buffer(state) || !handle_incoming_data(state)) {
+        // Continue with the requests that queued up behind the answered one
+        connection_finish(state);
+    } else {
+        connection_account(state);
+    }
+}
+
+void connection_park(struct connection_state *state, uint16_t hash,
+                     const struct request *request) {
+    struct event_loop *loop = state->loop;
+
+    state->parked = true;
+    state->parked_hash = hash;
+    state->parked_uri = strdup(request->uri);
+    // Kept if it is to be forwarded once the lookup resolves, a streamed
+    // payload by reference
+    if (proxy_wanted(request)) {
+        state->parked_request = proxy_copy_request(state, request);
+    }
+    state->prev_parked = NULL;
+    state->next_parked = loop->parked;
+    if (loop->parked) loop->parked->prev_parked = state;
+    loop->parked = state;
+}
+
+void connection_resume_all(struct event_loop *loop,
+                           const struct dht_resolution *resolution) {
+    struct connection_state *next;
+    for (struct connection_state *state = loop->parked; state; state = next) {
+        next = state->next_parked;
+        if (state->parked_hash != resolution->hash) continue;
+
+        // Sent along with the responses to the requests queued up behind it
+        output_queue_cork(&state->output);
+        if (resolution->found && state->parked_request &&
+            proxy_forward(state, state->parked_request, resolution->ip,
+                          resolution->port)) {
+            state->parked_request = NULL;
+            log_debug("Lookup for hash 0x%04x resolved, forwarding to: %s:%d\n",
+                      resolution->hash, resolution->ip, resolution->port);
+        } else if (resolution->found && state->parked_uri) {
+            log_debug("Lookup for hash 0x%04x resolved, redirecting to: %s:%d\n",
+                      resolution->hash, resolution->ip, resolution->port);
+            send_redirect_to(state, resolution->ip, resolution->port,
+                             state->parked_uri);
+            metrics_request(state->parked_method, 303, state->parked_since);
+        } else {
+            log_debug("Lookup for hash 0x%04x failed, sending 503\n",
+                      resolution->hash);
+            send_service_unavailable(state);
+            metrics_request(state->parked_method, 503, state->parked_since);
+        }
+        connection_unpark(state);
+        connection_continue(state);
+    }
+}
+
+void connection_proxied(struct connection_state *state, int status) {
+    metrics_request(state->parked_method, status, state->parked_since);
+    connection_continue(state);
 }
 
 char *buffer_discard(char *buffer, size_t discard, size_t keep) {
@@ -211,57 +617,326 @@ char *buffer_discard(char *buffer, size_t discard, size_t keep) {
     return buffer + keep;
 }
 
-void handle_server_socket(int server_socket, struct pollfd *sockets,
-                         struct connection_state *state) {
-    int connection = accept(server_socket, NULL, NULL);
-    if (connection == -1) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("accept");
-            close(server_socket);
-            exit(EXIT_FAILURE);
+void connection_open(struct event_loop *loop, int sock) {
+    // Responses are batched by corking already; Nagle's algorithm would only
+    // hold back those answered later, e.g. forwarded ones, until the client
+    // acknowledges the earlier ones
+    const int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    struct connection_state *state = malloc(sizeof(*state));
+    if (!state) {
+        perror("malloc");
+        close(sock);
+        return;
+    }
+    connection_setup(state, sock, loop);
+
+    if (loop->uring) {
+        event_loop_receive(loop, state);
+        state->receiving = true;
+    } else if (event_loop_watch(loop, sock, EPOLLIN | EPOLLOUT | EPOLLET,
+                                state) == -1) {
+        // EPOLLOUT edges resume sending queued output
+        perror("epoll_ctl");
+        close(sock);
+        free(state);
+        return;
+    }
+    metrics_count(METRICS_CONNECTIONS_ACCEPTED);
+    metrics_gauge_add(METRICS_CONNECTIONS_OPEN, 1);
+    connection_schedule(state);
+}
+
+void handle_server_socket(struct event_loop *loop) {
+    // Bounded, so a connection storm cannot starve established clients. The
+    // listener is level-triggered, leftovers are picked up on the next wakeup.
+    for (int i = 0; i < EVENT_LOOP_ACCEPT_BATCH; i++) {
+        int connection = accept(loop->server_socket, NULL, NULL);
+        metrics_count(METRICS_IO_SYSCALLS);
+        if (connection == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                event_loop_accept_failed(loop, errno); // keep serving the others
+            }
+            return;
         }
+        connection_open(loop, connection);
+    }
+}
+
+void handle_client_socket(struct event_loop *loop,
+                          struct connection_state *state) {
+    (void)loop;
+    // Neither sent nor read from until its changes are durable
+    if (state->syncing) return;
+    int flushed = output_queue_flush(&state->output, state->sock);
+    if (flushed == -1 || (flushed == 1 && state->closing)) {
+        connection_close(state);
+    } else if (flushed == 1 && !handle_incoming_data(state)) {
+        connection_finish(state);
+    } else {
+        connection_account(state);
+    }
+}
+
+/**
+ * Hand the pending output of a connection to the io_uring backend
+ */
+static void connection_submit(struct output_queue *output,
+                              const struct msghdr *message) {
+    struct connection_state *state =
+        container_of(output, struct connection_state, output);
+    event_loop_send(state->loop, state, message);
+}
+
+void connection_sent(struct connection_state *state, int result) {
+    int flushed = output_queue_complete(&state->output, result);
+    if (state->closed) {
+        connection_release(state);
+    } else if (flushed == -1 || (flushed == 1 && state->closing)) {
+        connection_close(state);
+    } else if (!state->syncing && !handle_incoming_data(state)) {
+        // Requests held back by the backlog are read now
+        connection_finish(state);
+    } else {
+        connection_account(state);
+    }
+}
+
+void connection_received(struct connection_state *state, const char *data,
+                         int result, bool more) {
+    if (!more) state->receiving = state->receive_paused = false;
+    if (state->closed) {
+        connection_release(state);
         return;
     }
 
-    connection_setup(state, connection);
-    sockets[0].events = POLLIN;
-    sockets[1].fd = connection;
-    sockets[1].events = POLLIN;
+    if (result > 0) {
+        if (state->inbox_length + result > state->inbox_capacity) {
+            size_t capacity = state->inbox_capacity ? state->inbox_capacity : 4096;
+            while (capacity < state->inbox_length + result) capacity *= 2;
+            char *inbox = realloc(state->inbox, capacity);
+            if (!inbox) {
+                perror("realloc");
+                connection_close(state);
+                return;
+            }
+            state->inbox = inbox;
+            state->inbox_capacity = capacity;
+        }
+        memcpy(state->inbox + state->inbox_length, data, result);
+        state->inbox_length += result;
+
+        // A connection not reading, e.g. while its request is parked, holds
+        // about as much as a socket buffer before receiving is stopped
+        if (state->inbox_length >= HTTP_MAX_SIZE && state->receiving &&
+            !state->receive_paused) {
+            event_loop_cancel_receive(state->loop, state);
+            state->receive_paused = true;
+        }
+    } else if (result == 0) {
+        state->received_end = true;
+    } else if (result != -ENOBUFS && result != -ECANCELED) {
+        state->receive_error = -result;
+    }
+    // Out of buffers or cancelled, receiving is resumed once the inbox is
+    // empty
+
+    // Neither sent nor read from until its changes are durable, nor read from
+    // once it is closed after the queued responses, e.g. an error
+    if (state->syncing || state->closing) return;
+    if (!handle_incoming_data(state)) {
+        connection_finish(state);
+    } else {
+        connection_account(state);
+    }
+}
+
+/**
+ * Whether too many responses are queued to read further requests. Submitted
+ * output is in flight for a moment after every batch of responses, so only
+ * a backlog beyond what fits into the request buffer counts then.
+ */
+static bool connection_backlogged(const struct connection_state *state) {
+    if (state->output.submit) return state->output.pending_bytes >= HTTP_MAX_SIZE;
+    return output_queue_pending(&state->output);
 }
 
-void handle_client_socket(struct connection_state *state,
-                         struct pollfd *sockets, int udp_socket) {
-    bool cont = handle_incoming_data(state, udp_socket);
+/**
+ * Receive up to `space` bytes into `target`, like `recv()`: from the socket,
+ * or from the inbox with io_uring, rearming the receive once it is empty
+ */
+static ssize_t connection_receive(struct connection_state *state,
+                                  char *target, size_t space) {
+    if (!state->loop->uring) {
+        metrics_count(METRICS_IO_SYSCALLS);
+        return recv(state->sock, target, space, MSG_DONTWAIT);
+    }
 
-    if (!cont) {
-        sockets[0].events = POLLIN;
-        sockets[1].fd = -1;
-        sockets[1].events = 0;
+    if (state->inbox_length == 0) {
+        if (state->receive_error) {
+            errno = state->receive_error;
+            return -1;
+        }
+        if (state->received_end) return 0;
+        if (!state->receiving) {
+            event_loop_receive(state->loop, state);
+            state->receiving = true;
+        }
+        errno = EAGAIN;
+        return -1;
     }
+
+    size_t length = space < state->inbox_length ? space : state->inbox_length;
+    memcpy(target, state->inbox, length);
+    state->inbox_length -= length;
+    memmove(state->inbox, state->inbox + length, state->inbox_length);
+    return length;
 }
 
-bool handle_incoming_data(struct connection_state *state, int udp_socket) {
-    const char *buffer_end = state->buffer + HTTP_MAX_SIZE;
-    ssize_t bytes_read = recv(state->sock, state->end, buffer_end - state->end, 0);
+/**
+ * Switch to receiving the payload of the request at the start of the buffer
+ * into its own allocation, once its header is complete. Returns false if the
+ * connection is to be closed.
+ */
+static bool body_start(struct connection_state *state) {
+    struct request request;
+    ssize_t head_length =
+        parse_request_head(&state->parser, state->buffer, &request);
+    if (head_length == 0) return true;
+
+    if ((size_t)request.payload_length > HTTP_MAX_PAYLOAD) {
+        const string too_large = "HTTP/1.1 413 Content Too Large\r\n\r\n";
+        send_http_response(state, too_large, strlen(too_large));
+        metrics_request(metrics_method(request.method), 413, metrics_now());
+        return false;
+    }
+    if (!(state->body = value_alloc(request.payload_length))) {
+        log_warn("Out of memory receiving %zu bytes\n",
+                 (size_t)request.payload_length);
+        const string no_memory =
+            "HTTP/1.1 507 Insufficient Storage\r\nContent-Length: 0\r\n\r\n";
+        send_http_response(state, no_memory, strlen(no_memory));
+        metrics_request(metrics_method(request.method), 507, metrics_now());
+        return false;
+    }
 
-    if (bytes_read == -1) {
-        perror("recv");
-        close(state->sock);
-        exit(EXIT_FAILURE);
+    // Less than the whole payload is buffered, or the request would have
+    // been answered already
+    char *payload = state->buffer + head_length;
+    state->body_received = state->end - payload;
+    memcpy(state->body, payload, state->body_received);
+    state->end = payload;
+    state->body_request = request;
+    return true;
+}
+
+/**
+ * Answer the request whose payload was received into `body`. Returns false
+ * if the connection is to be closed.
+ */
+static bool body_finish(struct connection_state *state) {
+    struct request *request = &state->body_request;
+    request->payload = state->body;
+    uint64_t position = wal_position();
+    output_queue_cork(&state->output);
+    send_reply(state, request);
+    if (connection_acknowledge(state, position) == -1) return false;
+
+    // Dropped unless a PUT handed it to the store
+    if (state->body) release(state->body);
+    state->body = NULL;
+    state->body_received = 0;
+
+    bool close = should_close_connection(request);
+    state->end = buffer_discard(state->buffer, state->end - state->buffer, 0);
+    if (connection_waiting(state)) {
+        state->close_after_parked = close;
+        return true;
     }
-    if (bytes_read == 0) return false;
+    return !close;
+}
 
+/**
+ * Answer the complete requests in the connection's buffer, stopping early at
+ * a parked one, and send the responses together. Returns false if the
+ * connection is to be closed.
+ */
+static bool process_buffer(struct connection_state *state) {
     char *window_start = state->buffer;
-    char *window_end = state->end + bytes_read;
 
-    ssize_t bytes_processed;
-    while ((bytes_processed = process_packet(state->sock, window_start,
-                               window_end - window_start, udp_socket)) > 0) {
+    // The responses to all pipelined requests at hand go out in one write,
+    // in order, also when the last one asks to close the connection
+    uint64_t position = wal_position();
+    output_queue_cork(&state->output);
+    ssize_t bytes_processed = 0;
+    while (!connection_waiting(state) &&
+           (bytes_processed = process_packet(state, window_start,
+                                             state->end - window_start)) > 0) {
         window_start += bytes_processed;
     }
-    if (bytes_processed == -1) return false;
+    // Changes are acknowledged once durable
+    if (connection_acknowledge(state, position) == -1 ||
+        bytes_processed == -1) {
+        return false;
+    }
 
+    // What is left is the start of the next request
+    if (window_start > state->buffer) state->request_started = 0;
     state->end = buffer_discard(state->buffer, window_start - state->buffer,
-                               window_end - window_start);
+                                state->end - window_start);
+    return connection_waiting(state) || body_start(state);
+}
+
+bool handle_incoming_data(struct connection_state *state) {
+    const char *buffer_end = state->buffer + HTTP_MAX_SIZE;
+
+    // Edge-triggered: drain the socket until it would block. A parked or
+    // proxied connection is left alone until its response is known, it is
+    // drained again when resumed. Neither are requests read while responses are
+    // still queued, so a client that does not read cannot make the queue
+    // grow without bounds.
+    while (!connection_waiting(state) && !connection_backlogged(state)) {
+        char *target = state->end;
+        size_t space = buffer_end - state->end;
+        if (state->body) {
+            target = state->body + state->body_received;
+            space = state->body_request.payload_length - state->body_received;
+        } else if (space == 0) {
+            // The buffer is full, yet the header is still incomplete
+            const string too_large =
+                "HTTP/1.1 431 Request Header Fields Too Large\r\n\r\n";
+            send_http_response(state, too_large, strlen(too_large));
+            char method[8] = "";
+            const char *method_end = memchr(state->buffer, ' ', sizeof(method));
+            if (method_end) {
+                memcpy(method, state->buffer, method_end - state->buffer);
+            }
+            metrics_request(metrics_method(method), 431, metrics_now());
+            return false;
+        }
+
+        ssize_t bytes_read = connection_receive(state, target, space);
+
+        if (bytes_read == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            if (errno == EINTR) continue;
+            perror("recv");
+            return false;
+        }
+        if (bytes_read == 0) return false;
+
+        if (state->body) {
+            state->body_received += bytes_read;
+            if (state->body_received < (size_t)state->body_request.payload_length) {
+                continue;
+            }
+            if (!body_finish(state)) return false;
+        } else {
+            state->end += bytes_read;
+        }
+        if (!process_buffer(state) || state->output.failed) return false;
+    }
     return true;
-} 
+}
@@ -0,0 +1,193 @@
+/**
+ * Hierarchical timer wheel
+ *
+ * A timer due in `delta` ms goes to the lowest level whose slots together
+ * span more than `delta`, into the slot its expiry falls into. Slot `s` of
+ * level `l` is reached when the time, counted in units of 64^l ms, next
+ * ends in `s`. Only level 0 slots hold timers that are due then; reaching a
+ * higher slot re-inserts its timers, which then land further down.
+ */
+
+#include "timer.h"
+
+#include <limits.h>
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_BITS)
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static void list_init(struct timer *head) { head->next = head->prev = head; }
+
+static void list_push(struct timer *head, struct timer *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(struct timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+/**
+ * Move all timers of `from` to the empty list `to`
+ */
+static void list_take(struct timer *from, struct timer *to) {
+    if (from->next == from) {
+        list_init(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to->prev->next = to;
+    list_init(from);
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now) {
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        wheel->occupied[level] = 0;
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+void timer_init(struct timer *timer, void (*callback)(struct timer *timer)) {
+    *timer = (struct timer){.callback = callback};
+}
+
+/**
+ * Link `timer` into the slot for its expiry, relative to the wheel's time
+ */
+static void insert(struct timer_wheel *wheel, struct timer *timer) {
+    // Due ones are run at the next millisecond
+    uint64_t expires =
+        timer->expires > wheel->now ? timer->expires : wheel->now + 1;
+    uint64_t delta = expires - wheel->now;
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >> LEVEL_SHIFT(level + 1) != 0) {
+        level++;
+    }
+    unsigned slot = (expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    list_push(&wheel->slots[level][slot], timer);
+    wheel->occupied[level] |= UINT64_C(1) << slot;
+}
+
+static void remove_from(struct timer_wheel *wheel, struct timer *timer) {
+    struct timer *head = timer->next == timer->prev ? timer->next : NULL;
+    list_unlink(timer);
+    if (!head) return;
+
+    // The timer was the only one in its slot, which is recognized by its
+    // head being both neighbours. Find which slot that was.
+    uintptr_t offset = (uintptr_t)head - (uintptr_t)&wheel->slots[0][0];
+    size_t index = offset / sizeof(struct timer);
+    if (index < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS) {
+        wheel->occupied[index / TIMER_WHEEL_SLOTS] &=
+            ~(UINT64_C(1) << (index % TIMER_WHEEL_SLOTS));
+    }
+}
+
+void timer_arm(struct timer_wheel *wheel, struct timer *timer,
+               uint64_t expires) {
+    if (timer_armed(timer)) {
+        remove_from(wheel, timer);
+    } else {
+        wheel->count++;
+    }
+    timer->expires = expires;
+    insert(wheel, timer);
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer) {
+    if (!timer_armed(timer)) return;
+    remove_from(wheel, timer);
+    wheel->count--;
+}
+
+/**
+ * The time at which slot `slot` of `level` is reached next, after `now`
+ */
+static uint64_t slot_time(uint64_t now, int level, unsigned slot) {
+    int shift = LEVEL_SHIFT(level);
+    uint64_t time = (((now >> shift) & ~(uint64_t)SLOT_MASK) | slot) << shift;
+    if (time <= now) time += (uint64_t)TIMER_WHEEL_SLOTS << shift;
+    return time;
+}
+
+/**
+ * The earliest time at which an occupied slot is reached, UINT64_MAX if
+ * there is none
+ */
+static uint64_t next_event(const struct timer_wheel *wheel) {
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t occupied = wheel->occupied[level];
+        if (!occupied) continue;
+
+        // The first occupied slot after the current one, wrapping around
+        unsigned current = (wheel->now >> LEVEL_SHIFT(level)) & SLOT_MASK;
+        unsigned start = (current + 1) & SLOT_MASK;
+        uint64_t rotated =
+            start ? (occupied >> start) | (occupied << (64 - start)) : occupied;
+        unsigned slot = (start + __builtin_ctzll(rotated)) & SLOT_MASK;
+
+        uint64_t time = slot_time(wheel->now, level, slot);
+        if (time < next) next = time;
+    }
+    return next;
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now) {
+    while (wheel->count > 0) {
+        uint64_t next = next_event(wheel);
+        if (next > now) break;
+        wheel->now = next;
+
+        // Timers reaching the end of their slot's span are due now, the
+        // others of higher levels move down
+        struct timer due;
+        list_init(&due);
+        for (int level = TIMER_WHEEL_LEVELS - 1; level >= 0; level--) {
+            int shift = LEVEL_SHIFT(level);
+            if (next & (((uint64_t)1 << shift) - 1)) continue; // not aligned
+            unsigned slot = (next >> shift) & SLOT_MASK;
+            if (!(wheel->occupied[level] & (UINT64_C(1) << slot))) continue;
+
+            struct timer moving;
+            list_take(&wheel->slots[level][slot], &moving);
+            wheel->occupied[level] &= ~(UINT64_C(1) << slot);
+            while (moving.next != &moving) {
+                struct timer *timer = moving.next;
+                list_unlink(timer);
+                if (timer->expires <= next) {
+                    list_push(&due, timer);
+                } else {
+                    insert(wheel, timer);
+                }
+            }
+        }
+
+        // Disarmed before their callbacks run, which may arm them again or
+        // cancel others that are due
+        while (due.next != &due) {
+            struct timer *timer = due.next;
+            list_unlink(timer);
+            wheel->count--;
+            timer->callback(timer);
+        }
+    }
+    if (now > wheel->now) wheel->now = now;
+}
+
+int timer_wheel_timeout(const struct timer_wheel *wheel, uint64_t now) {
+    if (wheel->count == 0) return -1;
+    uint64_t next = next_event(wheel);
+    if (next <= now) return 0;
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
@@ -0,0 +1,270 @@
+/**
+ * Minimal io_uring setup and submission helpers, without liburing
+ */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, void *arg, size_t size) {
+    metrics_count(METRICS_IO_SYSCALLS);
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, arg, size);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+    *ring = (struct uring){.fd = -1};
+
+    // Completions outnumber submissions with multishot requests. Linux 6.0
+    // brought single issuer rings, and with them multishot receives; where
+    // available, completions are only processed when the loop asks for them.
+    const unsigned base = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                          IORING_SETUP_SINGLE_ISSUER;
+    const unsigned attempts[] = {
+        base | IORING_SETUP_DEFER_TASKRUN,
+        base | IORING_SETUP_COOP_TASKRUN,
+    };
+    struct io_uring_params params;
+    for (size_t i = 0; i < sizeof(attempts) / sizeof(*attempts); i++) {
+        params = (struct io_uring_params){
+            .flags = attempts[i],
+            .cq_entries = entries * 4,
+        };
+        ring->fd = sys_setup(entries, &params);
+        if (ring->fd != -1 || errno != EINVAL) break;
+    }
+    if (ring->fd == -1) return -1;
+
+    const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                              IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_EXT_ARG;
+    if ((params.features & required) != required) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    ring->features = params.features;
+
+    // Both rings share one mapping
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        int error = errno;
+        close(ring->fd);
+        errno = error;
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        int error = errno;
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        errno = error;
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Entries are used in ring order
+    for (unsigned i = 0; i < ring->sq_entries; i++) ring->sq_array[i] = i;
+    return 0;
+}
+
+void uring_destroy(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/**
+ * Make the prepared entries visible to the kernel, returning their number
+ */
+static unsigned publish(struct uring *ring) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    while (ring->sq_local_tail -
+               __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+           ring->sq_entries) {
+        if (sys_enter(ring->fd, publish(ring), 0, 0, NULL, 0) == -1 &&
+            errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail += 1;
+    return sqe;
+}
+
+int uring_wait(struct uring *ring, int timeout_ms) {
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg = {
+        .sigmask_sz = _NSIG / 8,
+        .ts = timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0,
+    };
+    unsigned to_submit = publish(ring);
+    if (sys_enter(ring->fd, to_submit, 1,
+                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                  sizeof(arg)) == -1 &&
+        errno != ETIME && errno != EINTR && errno != EBUSY) {
+        return -1;
+    }
+    return 0;
+}
+
+int uring_buffers_init(struct uring *ring, struct uring_buffers *buffers,
+                       uint16_t group, unsigned count, size_t size) {
+    *buffers = (struct uring_buffers){
+        .ring_size = count * sizeof(struct io_uring_buf),
+        .size = size,
+        .count = count,
+        .group = group,
+    };
+    buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers->ring == MAP_FAILED) return -1;
+    buffers->memory = malloc(count * size);
+    if (!buffers->memory) {
+        munmap(buffers->ring, buffers->ring_size);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)buffers->ring,
+        .ring_entries = count,
+        .bgid = group,
+    };
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        int error = errno;
+        free(buffers->memory);
+        munmap(buffers->ring, buffers->ring_size);
+        errno = error;
+        return -1;
+    }
+
+    for (unsigned id = 0; id < count; id++) uring_buffer_return(buffers, id);
+    return 0;
+}
+
+void uring_buffer_return(struct uring_buffers *buffers, uint16_t id) {
+    struct io_uring_buf *buf =
+        &buffers->ring->bufs[buffers->tail & (buffers->count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(buffers, id);
+    buf->len = buffers->size;
+    buf->bid = id;
+    buffers->tail += 1;
+    __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept_multishot(struct uring *ring, int fd,
+                                 uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_recv_multishot(struct uring *ring, int fd,
+                               const struct uring_buffers *buffers,
+                               uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers->group;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_recvmsg_multishot(struct uring *ring, int fd,
+                                  struct msghdr *header,
+                                  const struct uring_buffers *buffers,
+                                  uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)header;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers->group;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_sendmsg(struct uring *ring, int fd,
+                        const struct msghdr *message, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_poll_multishot(struct uring *ring, int fd, unsigned poll_mask,
+                               uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = poll_mask;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_cancel(struct uring *ring, uint64_t target,
+                       uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
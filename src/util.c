@@ -1,22 +1,20 @@
 #include "util.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-char *memstr(char *haystack, size_t n, string needle) {
-    char *end = haystack + n;
-
-    // Iterate through the memory (haystack)
-    while ((haystack = memchr(haystack, needle[0], end - haystack)) != NULL) {
-        if (strncmp(haystack, needle, strlen(needle)) == 0) {
-            return haystack;
-        }
-    }
-
-    return NULL;
-}
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 uint16_t safe_strtoul(const char *restrict nptr, char **restrict endptr,
                       int base, const string message) {
@@ -33,23 +31,189 @@ uint16_t safe_strtoul(const char *restrict nptr, char **restrict endptr,
 
 
 uint16_t pseudo_hash(const unsigned char *buffer, size_t buf_len) {
-    // we use tcp crc16 check here
-    uint32_t hash = 0;
-    // add zero padding to the end if buf_len not even
-    size_t pad_length = buf_len % 2 ? buf_len + 1 : buf_len;
-    uint8_t *int_buffer =  calloc(pad_length, sizeof *buffer);
-    memcpy(int_buffer, buffer, buf_len);
-
-    for (size_t i = 0; i < pad_length; i+=2) {
-        hash += int_buffer[i] << 8 | int_buffer[i+1];
+    // The TCP checksum of the buffer, padded with a zero byte to an even
+    // length: the sum of its big-endian 16-bit words, with the carries
+    // folded back in once. Bytes at even offsets are the high halves of the
+    // words, those at odd offsets the low ones; both are summed on their own.
+    uint64_t high = 0, low = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i low_bytes = _mm256_set1_epi16(0x00FF);
+    __m256i high_sums = _mm256_setzero_si256(), low_sums = high_sums;
+    for (; i + 32 <= buf_len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        high_sums = _mm256_add_epi64(
+            high_sums, _mm256_sad_epu8(_mm256_and_si256(block, low_bytes),
+                                       _mm256_setzero_si256()));
+        low_sums = _mm256_add_epi64(
+            low_sums, _mm256_sad_epu8(_mm256_srli_epi16(block, 8),
+                                      _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, high_sums);
+    high = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i *)lanes, low_sums);
+    low = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+    const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+    __m128i high_sums = _mm_setzero_si128(), low_sums = high_sums;
+    for (; i + 16 <= buf_len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buffer + i));
+        high_sums = _mm_add_epi64(
+            high_sums,
+            _mm_sad_epu8(_mm_and_si128(block, low_bytes), _mm_setzero_si128()));
+        low_sums = _mm_add_epi64(
+            low_sums, _mm_sad_epu8(_mm_srli_epi16(block, 8), _mm_setzero_si128()));
     }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, high_sums);
+    high = lanes[0] + lanes[1];
+    _mm_storeu_si128((__m128i *)lanes, low_sums);
+    low = lanes[0] + lanes[1];
+#endif
+    for (; i + 1 < buf_len; i += 2) {
+        high += buffer[i];
+        low += buffer[i + 1];
+    }
+    if (i < buf_len) high += buffer[i]; // padded with zero
 
+    // Summed in 32 bits, as always: beyond 128 KiB the sum wraps around
+    uint32_t hash = (uint32_t)((high << 8) + low);
     hash = (hash & 0xFFFF) + (hash >> 16);
+    return (uint16_t)~hash;
+}
 
-    free(int_buffer);
+/**
+ * The high and low halves of the 128 bit product, xor-ed
+ */
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    __extension__ unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
 
-    return (uint16_t) ~hash;
+static inline uint64_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
 }
 
+uint16_t wyhash16(const unsigned char *buffer, size_t buf_len) {
+    static const uint64_t secret[4] = {
+        0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+        0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+    };
+    const unsigned char *p = buffer;
+    uint64_t seed = wymix(secret[0], secret[1]);
+    uint64_t a, b;
 
+    if (buf_len <= 16) {
+        if (buf_len >= 4) {
+            // Two overlapping pairs of 32-bit words cover 4 to 16 bytes
+            size_t offset = (buf_len >> 3) << 2;
+            a = read32(p) << 32 | read32(p + offset);
+            b = read32(p + buf_len - 4) << 32 | read32(p + buf_len - 4 - offset);
+        } else if (buf_len > 0) {
+            a = (uint64_t)p[0] << 16 | (uint64_t)p[buf_len >> 1] << 8 |
+                p[buf_len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t remaining = buf_len;
+        if (remaining > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = wymix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                seed1 = wymix(read64(p + 16) ^ secret[2], read64(p + 24) ^ seed1);
+                seed2 = wymix(read64(p + 32) ^ secret[3], read64(p + 40) ^ seed2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        for (; remaining > 16; p += 16, remaining -= 16) {
+            seed = wymix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+        }
+        // The last 16 bytes, overlapping those already mixed in
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+
+    a ^= secret[1];
+    b ^= seed;
+    __extension__ unsigned __int128 product = (unsigned __int128)a * b;
+    a = (uint64_t)product;
+    b = (uint64_t)(product >> 64);
+    uint64_t hash = wymix(a ^ secret[0] ^ buf_len, b ^ secret[1]);
+    return (uint16_t)(hash ^ hash >> 16 ^ hash >> 32 ^ hash >> 48);
+}
 
+// Set once at startup, before any worker runs
+static enum key_hash_function selected_key_hash = KEY_HASH_CHECKSUM;
+
+void key_hash_select(enum key_hash_function function) {
+    selected_key_hash = function;
+}
+
+uint16_t ring_hash(const unsigned char *buffer, size_t buf_len) {
+    if (selected_key_hash == KEY_HASH_WYHASH) return wyhash16(buffer, buf_len);
+    return pseudo_hash(buffer, buf_len);
+}
+
+uint16_t virtual_id(uint16_t first_id, uint32_t index) {
+    if (index == 0) return first_id;
+    uint32_t x = (uint32_t)first_id << 16 | index;
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return (uint16_t)x;
+}
+
+uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+#ifndef __SSE4_2__
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    crc = ~crc;
+#ifdef __SSE4_2__
+    for (; length >= 8; bytes += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        crc = (uint32_t)_mm_crc32_u64(crc, word);
+    }
+    for (; length > 0; bytes++, length--) crc = _mm_crc32_u8(crc, *bytes);
+#else
+    pthread_once(&crc32c_once, crc32c_init);
+    for (; length > 0; bytes++, length--) {
+        crc = crc32c_table[(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+    }
+#endif
+    return ~crc;
+}
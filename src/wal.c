@@ -0,0 +1,342 @@
+/**
+ * Write-ahead log of the store's changes
+ *
+ * Records are appended to an in-memory buffer by the workers. The log thread
+ * swaps it for an empty one, writes it out and syncs it, then wakes up the
+ * workers waiting for their records, or notifies the event loops that asked
+ * for it. Whatever was appended during a sync
+ * goes out with the next one.
+ *
+ * The log is split into numbered segment files. A snapshot records the
+ * first segment that is not contained in it, older ones can be deleted.
+ */
+
+#define _GNU_SOURCE // fdatasync
+
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "util.h"
+
+/**
+ * Header of a record, followed by the key, a NUL byte and the value
+ *
+ * `checksum` is the CRC-32C of everything after it, up to the end of the
+ * value.
+ */
+struct wal_record {
+    uint32_t checksum;
+    uint32_t operation;
+    uint32_t key_length;
+    uint32_t reserved;
+    uint64_t value_length;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t appended_cond;
+    pthread_cond_t synced_cond;
+
+    char *buffer;
+    size_t length;
+    size_t capacity;
+
+    // Log positions: bytes appended, and bytes on disk
+    uint64_t appended;
+    uint64_t durable;
+
+    // Event loops to notify after the next sync, one bit each
+    uint64_t waiters;
+    void (*wake)(unsigned waiter);
+
+    bool open;
+    bool rotate;
+    const char *directory;
+    uint64_t segment;
+    int fd;
+} wal = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .appended_cond = PTHREAD_COND_INITIALIZER,
+    .synced_cond = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+};
+
+// Log position after the last record appended by this thread
+static __thread uint64_t thread_appended = 0;
+
+void wal_segment_path(char *path, size_t size, const char *directory,
+                      uint64_t segment) {
+    snprintf(path, size, "%s/wal-%016" PRIx64 ".log", directory, segment);
+}
+
+bool wal_segment_number(const char *name, uint64_t *segment) {
+    char suffix[8];
+    return sscanf(name, "wal-%16" SCNx64 "%7s", segment, suffix) == 2 &&
+           strcmp(suffix, ".log") == 0;
+}
+
+static void sync_directory(const char *directory) {
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || fsync(fd) == -1) {
+        perror("fsync");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+static int segment_create(const char *directory, uint64_t segment) {
+    char path[4096];
+    wal_segment_path(path, sizeof(path), directory, segment);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    sync_directory(directory);
+    return fd;
+}
+
+static void write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            // Acknowledged writes could not be kept, stop accepting more
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+static void *wal_thread(void *arg) {
+    (void)arg;
+    char *batch = NULL;
+    size_t batch_capacity = 0;
+
+    pthread_mutex_lock(&wal.lock);
+    while (true) {
+        while (wal.length == 0 && !wal.rotate) {
+            pthread_cond_wait(&wal.appended_cond, &wal.lock);
+        }
+
+        // Take the appended records, workers continue with the empty buffer
+        char *records = wal.buffer;
+        size_t length = wal.length;
+        size_t capacity = wal.capacity;
+        wal.buffer = batch;
+        wal.capacity = batch_capacity;
+        wal.length = 0;
+        batch = records;
+        batch_capacity = capacity;
+        uint64_t position = wal.appended;
+        bool rotate = wal.rotate;
+        pthread_mutex_unlock(&wal.lock);
+
+        if (length > 0) {
+            write_all(wal.fd, batch, length);
+            if (fdatasync(wal.fd) == -1) {
+                perror("fdatasync");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (rotate) {
+            close(wal.fd);
+            wal.fd = segment_create(wal.directory, wal.segment + 1);
+        }
+
+        pthread_mutex_lock(&wal.lock);
+        wal.durable = position;
+        if (rotate) {
+            wal.segment += 1;
+            wal.rotate = false;
+        }
+        pthread_cond_broadcast(&wal.synced_cond);
+
+        uint64_t waiters = wal.waiters;
+        wal.waiters = 0;
+        if (waiters) {
+            pthread_mutex_unlock(&wal.lock);
+            for (unsigned i = 0; i < 64; i++) {
+                if (waiters >> i & 1) wal.wake(i);
+            }
+            pthread_mutex_lock(&wal.lock);
+        }
+    }
+    return NULL;
+}
+
+void wal_open(const char *directory, uint64_t segment) {
+    wal.directory = directory;
+    wal.segment = segment;
+    wal.fd = segment_create(directory, segment);
+    wal.buffer = malloc(WAL_BUFFER_SIZE);
+    if (!wal.buffer) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    wal.capacity = WAL_BUFFER_SIZE;
+    wal.open = true;
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, wal_thread, NULL);
+    if (error) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(error));
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+void wal_append(enum store_operation operation, const char *key,
+                size_t key_length, const char *value, size_t value_length) {
+    struct wal_record record = {
+        .operation = operation,
+        .key_length = key_length,
+        .value_length = value_length,
+    };
+    uint32_t checksum = crc32c(0, (char *)&record + sizeof(record.checksum),
+                               sizeof(record) - sizeof(record.checksum));
+    checksum = crc32c(checksum, key, key_length + 1);
+    record.checksum = crc32c(checksum, value, value_length);
+    size_t size = sizeof(record) + key_length + 1 + value_length;
+
+    pthread_mutex_lock(&wal.lock);
+    if (wal.length + size > wal.capacity) {
+        size_t capacity = wal.capacity ? wal.capacity : WAL_BUFFER_SIZE;
+        while (wal.length + size > capacity) capacity *= 2;
+        char *buffer = realloc(wal.buffer, capacity);
+        if (!buffer) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        wal.buffer = buffer;
+        wal.capacity = capacity;
+    }
+    char *end = wal.buffer + wal.length;
+    memcpy(end, &record, sizeof(record));
+    memcpy(end + sizeof(record), key, key_length + 1);
+    if (value_length > 0) {
+        memcpy(end + sizeof(record) + key_length + 1, value, value_length);
+    }
+    wal.length += size;
+    wal.appended += size;
+    thread_appended = wal.appended;
+    pthread_cond_signal(&wal.appended_cond);
+    pthread_mutex_unlock(&wal.lock);
+}
+
+void wal_sync(void) {
+    if (thread_appended == 0) return;
+
+    pthread_mutex_lock(&wal.lock);
+    while (wal.durable < thread_appended) {
+        pthread_cond_wait(&wal.synced_cond, &wal.lock);
+    }
+    pthread_mutex_unlock(&wal.lock);
+}
+
+uint64_t wal_position(void) { return thread_appended; }
+
+bool wal_durable(uint64_t position) {
+    pthread_mutex_lock(&wal.lock);
+    bool durable = wal.durable >= position;
+    pthread_mutex_unlock(&wal.lock);
+    return durable;
+}
+
+bool wal_notify(uint64_t position, void (*wake)(unsigned waiter),
+                unsigned waiter) {
+    pthread_mutex_lock(&wal.lock);
+    bool pending = wal.durable < position;
+    if (pending) {
+        wal.wake = wake;
+        wal.waiters |= (uint64_t)1 << waiter;
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return pending;
+}
+
+uint64_t wal_rotate(void) {
+    pthread_mutex_lock(&wal.lock);
+    wal.rotate = true;
+    pthread_cond_signal(&wal.appended_cond);
+    while (wal.rotate) pthread_cond_wait(&wal.synced_cond, &wal.lock);
+    uint64_t segment = wal.segment;
+    pthread_mutex_unlock(&wal.lock);
+    return segment;
+}
+
+uint64_t wal_appended(void) {
+    pthread_mutex_lock(&wal.lock);
+    uint64_t appended = wal.appended;
+    pthread_mutex_unlock(&wal.lock);
+    return appended;
+}
+
+long wal_replay(const char *path, struct store *store) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return -1;
+    }
+    size_t size = info.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    long applied = 0;
+    size_t offset = 0;
+    while (size - offset >= sizeof(struct wal_record)) {
+        struct wal_record record;
+        memcpy(&record, data + offset, sizeof(record));
+        size_t available = size - offset - sizeof(record);
+        if (record.key_length >= available ||
+            record.value_length > available - record.key_length - 1) {
+            break; // torn write
+        }
+        const char *key = data + offset + sizeof(record);
+        const char *value = key + record.key_length + 1;
+        uint32_t checksum =
+            crc32c(0, (char *)&record + sizeof(record.checksum),
+                   sizeof(record) - sizeof(record.checksum));
+        checksum = crc32c(checksum, key, record.key_length + 1);
+        checksum = crc32c(checksum, value, record.value_length);
+        if (checksum != record.checksum || key[record.key_length] != '\0') {
+            break;
+        }
+
+        if (record.operation == STORE_PUT) {
+            set(store, (string)key, value, record.value_length);
+        } else {
+            remove_tuple(store, (string)key);
+        }
+        applied += 1;
+        offset += sizeof(record) + record.key_length + 1 + record.value_length;
+    }
+    if (offset < size) {
+        log_warn("Ignoring %zu bytes of incomplete records at the end of %s\n",
+                 size - offset, path);
+    }
+
+    munmap(data, size);
+    return applied;
+}
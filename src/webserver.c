@@ -3,7 +3,7 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,66 +13,76 @@
 
 #include "data.h"
 #include "dht.h"
+#include "event_loop.h"
 #include "http.h"
+#include "log.h"
+#include "migrate.h"
+#include "options.h"
+#include "persist.h"
 #include "util.h"
 #include "http_response.h"
 #include "socket_handler.h"
 #include "dht_handler.h"
 
 struct dht_state dht = {0};
-struct tuple resources[MAX_RESOURCES] = {
-    {"/static/foo", "Foo", sizeof "Foo" - 1},
-    {"/static/bar", "Bar", sizeof "Bar" - 1},
-    {"/static/baz", "Baz", sizeof "Baz" - 1}
-};
+struct store resources;
+struct options options;
+
+static void *run_worker(void *loop) {
+    event_loop_run(loop);
+    return NULL;
+}
 
 int main(int argc, char **argv) {
+    int first_argument = parse_options(&options, argc, argv);
+    // Shift the positional arguments, so that argv[1] is the IP again
+    argc -= first_argument - 1;
+    argv += first_argument - 1;
+
     if (argc < 3) return EXIT_FAILURE;
 
-    init_dht_state(&dht, argc, argv);
+    log_init(options.log_level);
+    key_hash_select(options.key_hash);
+    init_dht_state(&dht, argc, argv, options.vnodes);
+    log_set_prefix("(%s:%d) ", dht.self_ip, dht.self_port);
+
+    store_init(&resources);
+    set(&resources, "/static/foo", "Foo", sizeof "Foo" - 1);
+    set(&resources, "/static/bar", "Bar", sizeof "Bar" - 1);
+    set(&resources, "/static/baz", "Baz", sizeof "Baz" - 1);
+    if (options.data_dir) {
+        persist_open(&resources, options.data_dir, options.snapshot_interval_s);
+    }
+    migrate_init(&resources, &dht.self_addr, options.migration_rate_mb_s);
 
     struct sockaddr_in addr = derive_sockaddr(argv[1], argv[2]);
+    bool reuse_port = options.workers > 1;
 
-    int server_socket = setup_server_socket(addr);
-    int udp_socket = setup_udp_socket(addr);
+    // Every worker owns a listener and a DHT socket bound to the same
+    // address and runs its own event loop. The first one runs on this thread.
+    struct event_loop *loops = calloc(options.workers, sizeof(*loops));
+    if (!loops) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < options.workers; i++) {
+        int server_socket = setup_server_socket(addr, reuse_port);
+        int udp_socket = setup_udp_socket(addr, reuse_port);
+        event_loop_init(&loops[i], server_socket, udp_socket, options.backend);
+    }
 
     print_dht_info(&dht);
 
-    struct pollfd sockets[3] = {
-        {.fd = server_socket, .events = POLLIN},  // index 0: tcp server socket
-        {.fd = -1, .events = 0},              // index 1: future client socket
-        {.fd = udp_socket, .events = POLLIN}  // index 2: udp socket for DHT
-    };
-
-    struct connection_state state = {0};
-
-    while (true) {
-        int ready = poll(sockets, sizeof(sockets) / sizeof(sockets[0]), -1);
-        if (ready == -1) {
-            perror("poll");
+    for (unsigned i = 1; i < options.workers; i++) {
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, run_worker, &loops[i]);
+        if (error) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(error));
             exit(EXIT_FAILURE);
         }
-
-        for (size_t i = 0; i < sizeof(sockets) / sizeof(sockets[0]); i++) {
-            if (sockets[i].revents != POLLIN) continue;
-
-            int s = sockets[i].fd;
-            if (s == server_socket) {
-                handle_server_socket(server_socket, sockets, &state);
-            } else if (s == state.sock) {
-                handle_client_socket(&state, sockets, udp_socket);
-            } else if (s == udp_socket) {
-                struct sockaddr_in sender;
-                socklen_t sender_len = sizeof(sender);
-                struct dht_message msg;
-                ssize_t bytes_read = recvfrom(udp_socket, &msg, sizeof(msg), 0,
-                                          (struct sockaddr *)&sender, &sender_len);
-                if (bytes_read > 0) {
-                    handle_dht_message(udp_socket, &msg, &sender, &dht);
-                }
-            }
-        }
+        pthread_detach(thread);
     }
+    event_loop_run(&loops[0]);
 
     return EXIT_SUCCESS;
 }
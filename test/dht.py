@@ -11,7 +11,7 @@ import util
 
 Peer = collections.namedtuple('Peer', ['id', 'ip', 'port'])
 Message = collections.namedtuple('Message', ['flags', 'id', 'peer'])
-Flags = enum.Enum('Flags', ['lookup', 'reply', 'stabilize', 'notify', 'join'], start=0)
+Flags = enum.Enum('Flags', ['lookup', 'reply', 'stabilize', 'notify', 'join', 'lookup_batch'], start=0)
 message_format = "!BHH4sH"
 
 
@@ -36,6 +36,26 @@ def hash(data):
     return hash_val
 
 
+def serialize_batch(hashes, peer):
+    """Serialize a LOOKUP_BATCH: a lookup header with the number of hashes in place of the hash, followed by them"""
+    header = serialize(Message(Flags.lookup_batch, len(hashes), peer))
+    return header + struct.pack(f'!{len(hashes)}H', *hashes)
+
+
+def deserialize_batch(data):
+    """Return the requester and hashes of a LOOKUP_BATCH"""
+    header = deserialize(data[:struct.calcsize(message_format)])
+    hashes = struct.unpack(f'!{header.id}H', data[struct.calcsize(message_format):])
+    return header.peer, list(hashes)
+
+
+def deserialize_all(data):
+    """Split a datagram of several messages back to back, e.g. a combined reply"""
+    size = struct.calcsize(message_format)
+    assert len(data) % size == 0, "Received datagram is no sequence of DHT messages"
+    return [deserialize(data[i:i + size]) for i in range(0, len(data), size)]
+
+
 def expect_msg(sock, expectation):
     assert util.bytes_available(sock) > 0, "No data received on socket"
     data = sock.recv(1024)
@@ -3,7 +3,9 @@ Tests for RN Praxis 1
 """
 
 import contextlib
+import os
 import re
+import resource
 import socket
 import time
 from http.client import HTTPConnection
@@ -32,6 +34,42 @@ def webserver(request):
     return runner
 
 
+def _limit_memory(mib):
+    """Return a `preexec_fn` capping the address space of the webserver at `mib` MiB"""
+    def limit():
+        resource.setrlimit(resource.RLIMIT_AS, (mib << 20, mib << 20))
+    return limit
+
+
+def _limit_files(count):
+    """Return a `preexec_fn` limiting the webserver to `count` file descriptors"""
+    def limit():
+        resource.setrlimit(resource.RLIMIT_NOFILE, (count, count))
+    return limit
+
+
+def _cpu_seconds(pid):
+    """Return the CPU time process `pid` used so far"""
+    with open(f'/proc/{pid}/stat') as stat:
+        fields = stat.read().rpartition(')')[2].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def _receive_response(reader):
+    """Read one response from `reader`, a socket's binary file, return its status and payload"""
+    status = reader.readline()
+    assert status, "Connection closed before the response"
+    length = 0
+    for line in iter(reader.readline, b'\r\n'):
+        assert line, "Connection closed before the response was complete"
+        name, _, value = line.partition(b':')
+        if name.strip().lower() == b'content-length':
+            length = int(value)
+    payload = reader.read(length)
+    assert len(payload) == length, "Connection closed before the response was complete"
+    return int(status.split(b' ')[1]), payload
+
+
 def test_execute(webserver, port):
     """
     Test server is executable
@@ -210,3 +248,339 @@ def test_dynamic_content(webserver, port):
         response = conn.getresponse()
         response.read()
         assert response.status == 404, f"'{path}' should be missing"
+
+
+@pytest.mark.timeout(10)
+def test_many_keys(webserver, port):
+    """
+    Test the store keeps thousands of keys, far more than its tables start with
+    """
+
+    keys = [f'/many/{i}' for i in range(3000)] + [f'/many/{i}/{"x" * 40}' for i in range(3000)]
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), contextlib.closing(
+        HTTPConnection('localhost', port)
+    ) as conn:
+        conn.connect()
+
+        for key in keys:
+            conn.request('PUT', key, key.encode())
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 201, f"Creation of '{key}' did not yield '201'"
+
+        for key in keys:
+            conn.request('GET', key)
+            response = conn.getresponse()
+            payload = response.read()
+            assert response.status == 200, f"'{key}' went missing"
+            assert payload == key.encode(), f"Content of '{key}' does not match what was passed"
+
+
+@pytest.mark.timeout(1)
+def test_overwrite(webserver, port):
+    """
+    Test overwriting a value, with one of the same size and with smaller and larger ones
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), contextlib.closing(
+        HTTPConnection('localhost', port)
+    ) as conn:
+        conn.connect()
+
+        conn.request('PUT', '/overwritten', b'first')
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 201, "Creation did not yield '201'"
+
+        for content in [b'other', b'x' * 5000, b'y' * 7000, b'small']:
+            conn.request('PUT', '/overwritten', content)
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 204, "Overwriting an existing value did not yield '204'"
+
+            conn.request('GET', '/overwritten')
+            response = conn.getresponse()
+            payload = response.read()
+            assert response.status == 200
+            assert payload == content, "Content does not match what was passed last"
+
+
+@pytest.mark.timeout(5)
+def test_store_no_memory(webserver, port):
+    """
+    Test a value the server has no memory left for is refused with 507, and the others are kept
+    """
+
+    content = b'x' * 7000
+
+    with webserver(
+        '127.0.0.1', f'{port}', preexec_fn=_limit_memory(64)
+    ), contextlib.closing(
+        HTTPConnection('localhost', port)
+    ) as conn:
+        conn.connect()
+
+        for i in range(100000):
+            conn.request('PUT', f'/full/{i}', content)
+            response = conn.getresponse()
+            response.read()
+            if response.status != 201:
+                break
+        assert response.status == 507, "Value that does not fit into memory should be answered with '507'"
+        assert i > 0
+
+        conn.close()
+        conn.request('GET', '/full/0')
+        response = conn.getresponse()
+        payload = response.read()
+        assert response.status == 200, "Values stored before should be kept"
+        assert payload == content
+
+        conn.request('GET', f'/full/{i}')
+        response = conn.getresponse()
+        response.length = 0  # Convince `http.client` to handle no-content 404s properly
+        response.read()
+        assert response.status == 404, "Value refused with '507' should not be stored"
+
+
+@pytest.mark.timeout(2)
+def test_payload_no_memory(webserver, port):
+    """
+    Test a payload the server has no memory for is refused with 507, not 413
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}', preexec_fn=_limit_memory(64)
+    ):
+        with socket.create_connection(('localhost', port)) as conn:
+            conn.sendall(b'PUT /large HTTP/1.1\r\nContent-Length: 100000000\r\n\r\n')
+            reply = conn.recv(1024)
+            assert reply.startswith(b'HTTP/1.1 507'), "Payload that does not fit into memory should be answered with '507'"
+
+        with contextlib.closing(HTTPConnection('localhost', port)) as conn:
+            conn.request('GET', '/static/foo')
+            reply = conn.getresponse()
+            assert reply.status == 200 and reply.read() == b'Foo', "Server should keep serving"
+
+
+@pytest.mark.timeout(2)
+def test_split_request(webserver, port):
+    """
+    Test requests arriving in pieces, split inside the request line, header fields, line ends and payload
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), socket.create_connection(
+        ('localhost', port)
+    ) as conn:
+        reader = conn.makefile('rb')
+        for piece in [b'PU', b'T /spl', b'it HTTP/1.1\r', b'\nCont', b'ent-Len', b'gth: 1', b'1\r\n', b'\r', b'\nhello', b' world']:
+            conn.sendall(piece)
+            time.sleep(.05)
+        assert _receive_response(reader)[0] == 201, "Creation from a split request did not yield '201'"
+
+        for piece in [b'GET /split HTTP/1.1\r\n', b'\r', b'\n']:
+            conn.sendall(piece)
+            time.sleep(.05)
+        assert _receive_response(reader) == (200, b'hello world')
+
+
+@pytest.mark.timeout(1)
+def test_header_case(webserver, port):
+    """
+    Test header field names are matched regardless of case
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), socket.create_connection(
+        ('localhost', port)
+    ) as conn:
+        reader = conn.makefile('rb')
+        for name in [b'content-length', b'CONTENT-LENGTH', b'cOnTeNt-LeNgTh']:
+            conn.sendall(b'PUT /case HTTP/1.1\r\n' + name + b': 4\r\n\r\n' + name[:4])
+            assert _receive_response(reader)[0] in {201, 204}, f"'{name.decode()}' was not taken for the payload length"
+
+            conn.sendall(b'GET /case HTTP/1.1\r\n\r\n')
+            assert _receive_response(reader) == (200, name[:4])
+
+
+@pytest.mark.timeout(1)
+def test_header_too_large(webserver, port):
+    """
+    Test a header that does not fit into the request buffer is answered with 431
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), socket.create_connection(
+        ('localhost', port)
+    ) as conn:
+        reader = conn.makefile('rb')
+        # Exactly the 8 KiB of the buffer, so the server does not reset the connection over unread bytes
+        head = b'GET /static/foo HTTP/1.1\r\nX-Filler: '
+        conn.sendall(head + b'a' * (8192 - len(head)))
+        assert _receive_response(reader)[0] == 431, "Oversized header was not answered with '431'"
+        assert reader.read(1) == b'', "Connection should be closed after '431'"
+
+
+@pytest.mark.timeout(1)
+def test_pipelining(webserver, port):
+    """
+    Test pipelined requests are answered in order, up to and including one asking to close the connection
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}'
+    ), socket.create_connection(
+        ('localhost', port)
+    ) as conn:
+        reader = conn.makefile('rb')
+        conn.sendall(
+            b'PUT /pipelined HTTP/1.1\r\nContent-Length: 3\r\n\r\none'
+            b'GET /pipelined HTTP/1.1\r\n\r\n'
+            b'GET /static/foo HTTP/1.1\r\n\r\n'
+            b'PUT /pipelined HTTP/1.1\r\nContent-Length: 3\r\n\r\ntwo'
+            b'GET /missing HTTP/1.1\r\n\r\n'
+            b'GET /pipelined HTTP/1.1\r\nConnection: close\r\n\r\n'
+        )
+
+        assert _receive_response(reader)[0] == 201
+        assert _receive_response(reader) == (200, b'one')
+        assert _receive_response(reader) == (200, b'Foo')
+        assert _receive_response(reader)[0] == 204
+        assert _receive_response(reader)[0] == 404
+        assert _receive_response(reader) == (200, b'two'), "Response to the request closing the connection is missing"
+        assert reader.read(1) == b'', "Connection should be closed after 'Connection: close'"
+
+
+@pytest.mark.timeout(5)
+def test_header_timeout(webserver, port):
+    """
+    Test a request header still incomplete after the header timeout is answered with 408, even if it trickles in
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}', '--header-timeout', '1'
+    ), socket.create_connection(
+        ('localhost', port)
+    ) as conn:
+        reader = conn.makefile('rb')
+        start = time.monotonic()
+        conn.sendall(b'GET /static/foo HTTP/1.1\r\n')
+        for _ in range(4):
+            time.sleep(.3)
+            conn.sendall(b'X')
+
+        assert _receive_response(reader)[0] == 408, "Incomplete header was not answered with '408'"
+        assert reader.read(1) == b'', "Connection should be closed after '408'"
+        assert 1 <= time.monotonic() - start < 2, "Header timeout should count from the start of the request"
+
+
+@pytest.mark.timeout(5)
+def test_payload_timeout(webserver, port):
+    """
+    Test a payload that stops arriving is answered with 408
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}', '--header-timeout', '1'
+    ), socket.create_connection(
+        ('localhost', port)
+    ) as conn:
+        reader = conn.makefile('rb')
+        conn.sendall(b'PUT /stalled HTTP/1.1\r\nContent-Length: 10\r\n\r\nabc')
+
+        assert _receive_response(reader)[0] == 408, "Stalled payload was not answered with '408'"
+        assert reader.read(1) == b'', "Connection should be closed after '408'"
+
+
+@pytest.mark.timeout(5)
+def test_idle_timeout(webserver, port):
+    """
+    Test a connection without a request for longer than the idle timeout is closed without a response
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}', '--idle-timeout', '1'
+    ), socket.create_connection(
+        ('localhost', port)
+    ) as conn:
+        reader = conn.makefile('rb')
+        conn.sendall(b'GET /static/foo HTTP/1.1\r\n\r\n')
+        assert _receive_response(reader) == (200, b'Foo')
+
+        start = time.monotonic()
+        assert reader.read(1) == b'', "Idle connection should be closed without a response"
+        assert 1 <= time.monotonic() - start < 2.5
+
+
+@pytest.mark.timeout(5)
+def test_recovery(webserver, port, tmp_path):
+    """
+    Test the values stored with --data-dir survive the server being killed, both from a snapshot and from the log
+    """
+
+    args = ['127.0.0.1', f'{port}', '--data-dir', f'{tmp_path}', '--snapshot-interval', '1']
+
+    with webserver(*args), contextlib.closing(HTTPConnection('localhost', port)) as conn:
+        for path, content in [('/kept', b'kept'), ('/replaced', b'old'), ('/deleted', b'deleted')]:
+            conn.request('PUT', path, content)
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 201
+
+        time.sleep(1.5)  # Into a snapshot
+
+        conn.request('PUT', '/replaced', b'new')
+        conn.getresponse().read()
+        conn.request('DELETE', '/deleted')
+        conn.getresponse().read()
+        conn.request('PUT', '/logged', b'logged')
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 201
+        # Killed once the context exits, without a chance to clean up
+
+    with webserver(*args), contextlib.closing(HTTPConnection('localhost', port)) as conn:
+        for path, content in [('/kept', b'kept'), ('/replaced', b'new'), ('/logged', b'logged')]:
+            conn.request('GET', path)
+            response = conn.getresponse()
+            payload = response.read()
+            assert response.status == 200, f"'{path}' was lost"
+            assert payload == content, f"Content of '{path}' does not match what was last passed"
+
+        conn.request('GET', '/deleted')
+        response = conn.getresponse()
+        response.length = 0  # Convince `http.client` to handle no-content 404s properly
+        response.read()
+        assert response.status == 404, "Deleted value came back"
+
+
+@pytest.mark.timeout(3)
+def test_out_of_descriptors(webserver, port):
+    """
+    Test a server out of file descriptors waits for connections to close instead of spinning, then serves again
+    """
+
+    with webserver(
+        '127.0.0.1', f'{port}', preexec_fn=_limit_files(32)
+    ) as server, contextlib.ExitStack() as stack:
+        conns = [stack.enter_context(socket.create_connection(('localhost', port))) for _ in range(40)]
+
+        start = _cpu_seconds(server.pid)
+        time.sleep(1)
+        assert _cpu_seconds(server.pid) - start < .2, "Server should not spin while it cannot accept connections"
+
+        for conn in conns[:20]:
+            conn.close()
+        conn = conns[-1]
+        reader = conn.makefile('rb')
+        conn.sendall(b'GET /static/foo HTTP/1.1\r\n\r\n')
+        assert _receive_response(reader) == (200, b'Foo'), "Pending connection should be served once descriptors are free"
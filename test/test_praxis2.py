@@ -4,6 +4,7 @@ Tests for RN Praxis 2
 
 import contextlib
 import errno
+import socket
 import struct
 import time
 import urllib.request as req
@@ -35,13 +36,14 @@ def _iter_with_neighbors(xs):
 def static_peer(request):
     """Return a function for spawning DHT peers
     """
-    def runner(peer, predecessor=None, successor=None):
+    def runner(peer, predecessor=None, successor=None, options=()):
         """Spawn a static DHT peer
 
-        The peer is passed its local neighborhood via environment variables.
+        The peer is passed its local neighborhood via environment variables,
+        and `options` on the command line.
         """
         return util.KillOnExit(
-            [request.config.getoption('executable'), peer.ip, f'{peer.port}'] + ([f'{peer.id}'] if peer.id is not None else []),
+            [request.config.getoption('executable'), peer.ip, f'{peer.port}'] + ([f'{peer.id}'] if peer.id is not None else []) + list(options),
             env={
                 **({'PRED_ID': f'{predecessor.id}', 'PRED_IP': predecessor.ip, 'PRED_PORT': f'{predecessor.port}'} if predecessor is not None else {}),
                 **({'SUCC_ID': f'{successor.id}', 'SUCC_IP': successor.ip, 'SUCC_PORT': f'{successor.port}'} if successor is not None else {}),
@@ -59,6 +61,57 @@ def static_peer(request):
     return runner
 
 
+@pytest.fixture
+def dynamic_peer(request):
+    """Return a function for spawning DHT peers that join a ring and stabilize
+    """
+    def runner(peer, anchor=None, options=()):
+        """Spawn a DHT peer, on its own or joining the ring through `anchor`
+        """
+        return util.KillOnExit(
+            [request.config.getoption('executable'), peer.ip, f'{peer.port}', f'{peer.id}']
+            + ([anchor.ip, f'{anchor.port}'] if anchor is not None else [])
+            + list(options),
+        )
+
+    return runner
+
+
+def _request(peer, method, uri, body=None, headers={}):
+    """Send a single request to `peer` without following redirects
+
+    Returns the response, with its payload read into `body`.
+    """
+    with contextlib.closing(HTTPConnection(peer.ip, peer.port)) as conn:
+        conn.request(method, uri, body=body, headers=headers)
+        response = conn.getresponse()
+        response.body = response.read()
+        return response
+
+
+def _uris_in_range(pred_id, id_, count, prefix='/key'):
+    """Return `count` URIs whose hashes lie in (`pred_id`, `id_`]"""
+    uris = []
+    i = 0
+    while len(uris) < count:
+        uri = f'{prefix}{i}'
+        uri_hash = dht.hash(uri.encode('latin1'))
+        if (pred_id < uri_hash <= id_) if pred_id < id_ else (uri_hash > pred_id or uri_hash <= id_):
+            uris.append(uri)
+        i += 1
+    return uris
+
+
+def _eventually(check, timeout=5, interval=.1):
+    """Call `check` until it returns true, at most for `timeout` seconds"""
+    deadline = time.monotonic() + timeout
+    while not check():
+        if time.monotonic() > deadline:
+            return False
+        time.sleep(interval)
+    return True
+
+
 @pytest.mark.timeout(1)
 def test_listen(static_peer):
     """
@@ -341,3 +394,256 @@ def test_dht(static_peer):
             util.urlopen(f'http://{contact.ip}:{contact.port}/dynamic/{datum}')
 
         assert exception_info.value.status == 404, f"'/dynamic/{datum}' should be missing, but GET was not answered with '404'"
+
+
+@pytest.mark.timeout(2)
+def test_lookup_parked(static_peer):
+    """Test that a request waits for its lookup instead of failing right away
+
+    The request is answered once the reply arrives, as long as it arrives within the lookup timeout.
+    """
+
+    predecessor = dht.Peer(0xffff, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x0001, '127.0.0.1', 4712)
+
+    with dht.peer_socket(
+        predecessor
+    ) as pred_mock, static_peer(
+        self, predecessor, successor, options=['--lookup-timeout', '1000']
+    ), dht.peer_socket(
+        successor
+    ) as succ_mock, contextlib.closing(
+        HTTPConnection(self.ip, self.port)
+    ) as conn:
+        conn.connect()
+        conn.request('GET', '/a')
+        time.sleep(.1)
+
+        assert util.bytes_available(conn.sock) == 0, "Server should wait for the lookup before answering"
+        assert util.bytes_available(succ_mock) > 0, "No data received on successor socket"
+        msg = dht.deserialize(succ_mock.recv(1024))
+        assert msg.flags == dht.Flags.lookup, "Received message should be a lookup"
+        assert msg.id == dht.hash(b'/a'), "Received lookup should query the requested datum's hash"
+
+        reply = dht.Message(dht.Flags.reply, successor.id, predecessor)
+        pred_mock.sendto(dht.serialize(reply), (self.ip, self.port))
+
+        response = conn.getresponse()
+        _ = response.read()
+        assert response.status == 303, "Parked request should be delegated once the lookup resolves"
+        assert response.headers['Location'] == f'http://{predecessor.ip}:{predecessor.port}/a', "Server should've delegated to the responsible peer"
+
+
+@pytest.mark.timeout(5)
+def test_streamed_put(static_peer):
+    """Test that payloads larger than the request buffer are stored whole, and too large ones are refused"""
+
+    self = dht.Peer(None, '127.0.0.1', 4711)
+    content = util.randbytes(8 * 1024 * 1024)
+
+    with static_peer(self):
+        reply = _request(self, 'PUT', '/large', content)
+        assert reply.status == 201, "Creation of a large datum did not yield '201'"
+
+        reply = _request(self, 'GET', '/large')
+        assert reply.status == 200
+        assert reply.body == content, "Content of a large datum does not match what was passed"
+
+        with contextlib.closing(socket.create_connection((self.ip, self.port))) as sock:
+            sock.sendall(b'PUT /huge HTTP/1.1\r\nContent-Length: 2147483648\r\n\r\n')
+            response = sock.recv(1024)
+            assert response.startswith(b'HTTP/1.1 413'), "Server should refuse a payload too large to store"
+
+
+@pytest.mark.timeout(5)
+def test_proxy(static_peer):
+    """Test proxy mode: requests for another peer's data are forwarded to it instead of redirected"""
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+    uri, = _uris_in_range(first.id, second.id, 1)
+    content = b'forwarded'
+
+    with static_peer(
+        first, second, second, options=['--proxy']
+    ), static_peer(
+        second, first, first, options=['--proxy']
+    ):
+        reply = _request(first, 'PUT', uri, content)
+        assert reply.status == 201, "Forwarded creation did not yield '201'"
+
+        reply = _request(first, 'GET', uri)
+        assert reply.status == 200, "Forwarded request should be answered by the responsible peer"
+        assert reply.body == content
+
+        reply = _request(second, 'GET', uri)
+        assert reply.status == 200, "Datum should be stored on the responsible peer"
+        assert reply.body == content
+
+        reply = _request(first, 'DELETE', uri)
+        assert reply.status in {200, 202, 204}, "Forwarded deletion did not succeed"
+        assert _request(second, 'GET', uri).status == 404, "Datum should be deleted on the responsible peer"
+
+
+@pytest.mark.timeout(2)
+def test_join_sent(dynamic_peer):
+    """Test that a peer started with an anchor asks it to join the ring"""
+
+    anchor = dht.Peer(0x4000, '127.0.0.1', 4710)
+    self = dht.Peer(0xc000, '127.0.0.1', 4711)
+
+    with dht.peer_socket(anchor) as anchor_mock, dynamic_peer(self, anchor):
+        time.sleep(.2)
+        dht.expect_msg(anchor_mock, dht.Message(dht.Flags.join, None, self))
+
+
+@pytest.mark.timeout(10)
+def test_join(dynamic_peer):
+    """Test that a peer joins a running ring, after which both split the namespace"""
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+    first_uri, = _uris_in_range(second.id, first.id, 1)
+    second_uri, = _uris_in_range(first.id, second.id, 1)
+
+    with dynamic_peer(first), dynamic_peer(second, first):
+        # Responsible for its range once the first peer stabilized with it
+        assert _eventually(lambda: _request(second, 'GET', second_uri).status == 404), "Joined peer did not become responsible for its range"
+
+        reply = _request(first, 'GET', second_uri)
+        assert reply.status == 303, "Anchor should delegate the joined peer's range"
+        assert reply.headers['Location'] == f'http://{second.ip}:{second.port}{second_uri}'
+
+        assert _request(first, 'GET', first_uri).status == 404, "Anchor should stay responsible for the rest"
+        reply = _request(second, 'GET', first_uri)
+        assert reply.status == 303, "Joined peer should delegate the anchor's range"
+        assert reply.headers['Location'] == f'http://{first.ip}:{first.port}{first_uri}'
+
+
+@pytest.mark.timeout(10)
+def test_migration(dynamic_peer):
+    """Test that data moves to a peer that joined and took over its range"""
+
+    first = dht.Peer(0x4000, '127.0.0.1', 4711)
+    second = dht.Peer(0xc000, '127.0.0.1', 4712)
+    moved = _uris_in_range(first.id, second.id, 5)
+    kept = _uris_in_range(second.id, first.id, 5)
+
+    with dynamic_peer(first):
+        for uri in moved + kept:
+            assert _request(first, 'PUT', uri, uri.encode()).status == 201
+
+        with dynamic_peer(second, first):
+            for uri in moved:
+                assert _eventually(lambda: _request(second, 'GET', uri).status == 200), f"'{uri}' was not moved to the joined peer"
+                assert _request(second, 'GET', uri).body == uri.encode()
+                assert _request(first, 'GET', uri).status == 303, f"'{uri}' should be delegated by its previous peer"
+
+            for uri in kept:
+                reply = _request(first, 'GET', uri)
+                assert reply.status == 200, f"'{uri}' should stay with the anchor"
+                assert reply.body == uri.encode()
+
+
+@pytest.mark.timeout(2)
+def test_migration_refused(static_peer):
+    """Test that only neighbours can move data to a peer, and the path is an ordinary key to anybody else"""
+
+    self = dht.Peer(None, '127.0.0.1', 4711)
+
+    with static_peer(self):
+        record = struct.pack('!II', 2, 5) + b'/xvalue'
+        reply = _request(self, 'PUT', '/_migrate', record, {'Migrate-From': '4712', 'Migrate-Range': '0 65535'})
+        assert reply.status == 403, "Batch from a peer that is no neighbour should be refused"
+        assert _request(self, 'GET', '/x').status == 404, "Refused batch should not be stored"
+        metrics = _request(self, 'GET', '/_metrics').body.decode()
+        assert 'http_requests_total{method="PUT",status="403"} 1\n' in metrics, "Refused batch should be counted as '403'"
+
+        reply = _request(self, 'PUT', '/_migrate', b'content')
+        assert reply.status == 201, "Path without the batch headers should be an ordinary key"
+        assert _request(self, 'GET', '/_migrate').body == b'content'
+
+
+@pytest.mark.timeout(1)
+def test_lookup_batch(static_peer):
+    """Test that a peer answers a batch of lookups with a combined reply and, if asked to, forwards the rest batched"""
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x1000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x2000, '127.0.0.1', 4712)
+
+    with dht.peer_socket(
+        predecessor
+    ) as pred_mock, static_peer(
+        self, predecessor, successor, options=['--lookup-batch']
+    ), dht.peer_socket(
+        successor
+    ) as succ_mock:
+        batch = dht.serialize_batch([0x0800, 0x1800, 0x0900, 0x2800, 0x3000], predecessor)
+        pred_mock.sendto(batch, (self.ip, self.port))
+
+        time.sleep(.1)
+
+        assert util.bytes_available(pred_mock) > 0, "No data received on predecessor socket"
+        replies = dht.deserialize_all(pred_mock.recv(1024))
+        assert replies == [
+            dht.Message(dht.Flags.reply, predecessor.id, self),
+            dht.Message(dht.Flags.reply, self.id, successor),
+        ], "Combined reply should name each responsible peer once, in order"
+
+        assert util.bytes_available(succ_mock) > 0, "No data received on successor socket"
+        requester, hashes = dht.deserialize_batch(succ_mock.recv(1024))
+        assert requester == predecessor, "Forwarded batch should indicate the originator"
+        assert hashes == [0x2800, 0x3000], "Forwarded batch should hold the unanswered hashes"
+
+
+@pytest.mark.timeout(1)
+def test_lookup_unbatched(static_peer):
+    """Test that lookups are forwarded one per datagram unless batching is enabled
+
+    Peers that predate LOOKUP_BATCH would drop it.
+    """
+
+    predecessor = dht.Peer(0x0000, '127.0.0.1', 4710)
+    self = dht.Peer(0x1000, '127.0.0.1', 4711)
+    successor = dht.Peer(0x2000, '127.0.0.1', 4712)
+
+    with dht.peer_socket(
+        predecessor
+    ) as pred_mock, static_peer(
+        self, predecessor, successor
+    ), dht.peer_socket(
+        successor
+    ) as succ_mock:
+        for hash_ in [0x2800, 0x3000]:
+            lookup = dht.Message(dht.Flags.lookup, hash_, predecessor)
+            pred_mock.sendto(dht.serialize(lookup), (self.ip, self.port))
+        pred_mock.sendto(dht.serialize_batch([0x3800, 0x4000], predecessor), (self.ip, self.port))
+
+        time.sleep(.1)
+
+        for hash_ in [0x2800, 0x3000, 0x3800, 0x4000]:
+            dht.expect_msg(succ_mock, dht.Message(dht.Flags.lookup, hash_, predecessor))
+        assert util.bytes_available(succ_mock) == 0, "Successor should receive nothing but the single lookups"
+
+
+@pytest.mark.timeout(2)
+def test_lookup_no_next_hop(static_peer):
+    """Test that a lookup is dropped, not sent to an unset address, when no other peer is known to forward it to"""
+
+    predecessor = dht.Peer(0xffff, '127.0.0.1', 4710)
+    self = dht.Peer(0x0000, '127.0.0.1', 4711)
+
+    with dht.peer_socket(
+        predecessor
+    ) as pred_mock, static_peer(
+        self, predecessor
+    ):
+        reply = _request(self, 'GET', '/a')
+        assert reply.status == 503, "Request should fail once its lookup expires"
+        assert util.bytes_available(pred_mock) == 0, "Predecessor should not be asked"
+
+        metrics = _request(self, 'GET', '/_metrics').body.decode()
+        assert '\ndht_lookups_sent_total 0\n' in metrics, "No lookup should be sent"
+        assert '\ndht_lookups_dropped_total 0\n' not in metrics, "Lookups without a next hop should be counted as dropped"